@@ -0,0 +1,237 @@
+﻿
+#include "stdafx.h"
+
+#include "animation.h"
+#include "pmx_loader.h"
+#include "profiler.h"
+
+
+animation_stage::animation_stage()
+  : busy_(0), ik_busy_(0), spring_busy_(0), stats_()
+{
+}
+
+animation_stage::~animation_stage()
+{
+  // ワーカーがインスタンスを触り終わるまで待つ.
+  if (running_.valid()) {
+    running_.wait();
+  }
+}
+
+bone_palette_buffer::ptr_t animation_stage::add(skeleton_pose::ptr_t pose, motion_sampler::ptr_t sampler, float frame,
+                                                spring_bone_set::ptr_t spring)
+{
+  if (running_.valid()) {
+    finish();
+  }
+  auto inst = std::make_unique<instance>();
+  inst->pose = pose;
+  inst->sampler = sampler;
+  inst->palette = bone_palette_buffer::make(pose->bone_count());
+  inst->spring = spring;
+  inst->frame = frame;
+  inst->delta = 0.f;
+  // トラックの無いモーフは今のモデルの重みのままにする.
+  if (auto morph = sampler->get_morph()) {
+    inst->morph_weight.resize(morph->morph_count());
+    for (size_t i=0; i<morph->morph_count(); ++i) {
+      inst->morph_weight[i] = morph->weight(i);
+    }
+    inst->morph_track.reserve(sampler->morph_track_count());
+    for (size_t i=0; i<sampler->morph_track_count(); ++i) {
+      inst->morph_track.push_back(sampler->morph_track_target(i));
+    }
+  }
+  auto palette = inst->palette;
+  instance_array_.push_back(std::move(inst));
+  return palette;
+}
+
+void animation_stage::clear()
+{
+  if (running_.valid()) {
+    finish();
+  }
+  instance_array_.clear();
+}
+
+void animation_stage::start(job_system *jobs, float delta)
+{
+  if (running_.valid()) {
+    finish();
+  }
+  advance(delta);
+  if (!jobs) {
+    run(0);
+    return;
+  }
+  // 呼び出したスレッドは描画に戻るので, 分けるのもワーカーに任せる.
+  auto task = std::make_shared<std::packaged_task<void()>>([this, jobs]() { run(jobs); });
+  running_ = task->get_future();
+  jobs->push([task]() { (*task)(); });
+}
+
+void animation_stage::finish()
+{
+  if (running_.valid()) {
+    running_.get();
+  }
+  publish();
+}
+
+void animation_stage::update(job_system *jobs, float delta)
+{
+  if (running_.valid()) {
+    finish();
+  }
+  advance(delta);
+  // 待つ間は呼び出したスレッドも回す.
+  run(jobs);
+  publish();
+}
+
+void animation_stage::advance(float delta)
+{
+  for (auto& inst : instance_array_) {
+    float length = std::max(inst->sampler->get_motion()->frame_count(), 1.f);
+    inst->frame = std::fmod(inst->frame + delta, length);
+    // VMD は 30fps.
+    inst->delta = delta / 30.f;
+    if (inst->frame < 0.f) {
+      inst->frame += length;
+    }
+  }
+}
+
+void animation_stage::run(job_system *jobs)
+{
+  busy_ = 0;
+  ik_busy_ = 0;
+  spring_busy_ = 0;
+  // 一体でも数十 us かかるので, 一体ずつ取り合う方が偏らない.
+  parallel_for(jobs, instance_array_.size(), 1, [this](size_t begin, size_t end) {
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration ik(0), spring(0);
+    for (size_t i=begin; i<end; ++i) {
+      instance *inst = instance_array_[i].get();
+      evaluate(inst);
+      ik += inst->pose->take_ik_time();
+      if (inst->spring) {
+        spring += inst->spring->last_update_time();
+      }
+    }
+    busy_ += (std::chrono::steady_clock::now() - start).count();
+    ik_busy_ += ik.count();
+    spring_busy_ += spring.count();
+  });
+}
+
+void animation_stage::publish()
+{
+  stats_.instance_count = instance_array_.size();
+  stats_.total = std::chrono::steady_clock::duration(busy_.load());
+  stats_.ik = std::chrono::steady_clock::duration(ik_busy_.load());
+  stats_.spring = std::chrono::steady_clock::duration(spring_busy_.load());
+  profiler::instance().add("animation", stats_.total);
+  if (stats_.ik.count() > 0) {
+    profiler::instance().add("ik", stats_.ik);
+  }
+  if (stats_.spring.count() > 0) {
+    profiler::instance().add("spring_bone", stats_.spring);
+  }
+
+  for (auto& inst : instance_array_) {
+    inst->palette->swap();
+    if (auto morph = inst->sampler->get_morph()) {
+      // トラックのあるモーフだけ入れる. 重みが同じなら set_weight() は何もしない.
+      for (uint32_t m : inst->morph_track) {
+        morph->set_weight(m, inst->morph_weight[m]);
+      }
+      // トラックの無いモーフは, UI などが後から変えた重みを次のボーンモーフに使う.
+      for (size_t i=0; i<inst->morph_weight.size(); ++i) {
+        inst->morph_weight[i] = morph->weight(i);
+      }
+    }
+  }
+}
+
+void animation_stage::evaluate(instance *inst)
+{
+  skeleton_pose *pose = inst->pose.get();
+  inst->sampler->apply_pose(inst->frame, pose);
+  if (auto morph = inst->sampler->get_morph()) {
+    inst->sampler->sample_morph(inst->frame, inst->morph_weight.data());
+    morph->evaluate_bone_offset(inst->morph_weight.data(), &inst->bone_offset);
+    pose->clear_morph();
+    for (const auto& ofs : inst->bone_offset) {
+      if (ofs.bone < pose->bone_count()) {
+        pose->set_morph(ofs.bone, ofs.translate, ofs.rotate);
+      }
+    }
+  }
+  if (inst->spring) {
+    inst->spring->update(pose, inst->delta);
+  } else {
+    pose->evaluate();
+  }
+  const matrix *m = pose->skinning_matrix_array();
+  std::copy(m, m + pose->bone_count(), inst->palette->back());
+}
+
+
+bool bench_animation_stage(const char *pmx_filename, const char *vmd_filename, int instances, int frames)
+{
+  typedef std::chrono::steady_clock clock;
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, pmx_filename)) {
+    std::cerr << "cannot load " << pmx_filename << std::endl;
+    return false;
+  }
+  vmd_motion_data vmd;
+  if (!load_vmd(&vmd, vmd_filename)) {
+    std::cerr << "cannot load " << vmd_filename << std::endl;
+    return false;
+  }
+  auto mot = motion::make(vmd);
+  auto skel = make_pmx_skeleton(data);
+  auto morph = make_pmx_morph(data);
+
+  animation_stage stage;
+  for (int i=0; i<instances; ++i) {
+    stage.add(skeleton_pose::make(skel), motion_sampler::make(mot, skel, morph), i * 7.f);
+  }
+
+  printf("animation stage: %zu bones, %zu ik chains, %d instances, %d frames\n",
+         skel->bone_count(), skel->ik_chain_count(), instances, frames);
+
+  // 60fps で進める.
+  auto measure = [&](job_system *jobs) {
+    clock::duration busy = clock::duration::zero();
+    auto start = clock::now();
+    for (int f=0; f<frames; ++f) {
+      stage.update(jobs, 0.5f);
+      busy += stage.last_stats().total;
+    }
+    double us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / frames;
+    double busy_us = std::chrono::duration<double, std::micro>(busy).count() / frames;
+    return std::make_pair(us, busy_us);
+  };
+
+  auto [serial_us, serial_busy_us] = measure(0);
+  printf("  %-10s: %9.1f us/frame, %7.2f us/instance\n",
+         "serial", serial_us, serial_busy_us / std::max(instances, 1));
+  // ワーカーの数 + 呼び出したスレッドで回す.
+  int hardware = std::max((int)std::thread::hardware_concurrency(), 2);
+  for (int threads=1; threads<hardware; threads*=2) {
+    job_system jobs(threads);
+    auto [us, busy_us] = measure(&jobs);
+    char label[32];
+    snprintf(label, sizeof(label), "%d+1 thr", threads);
+    printf("  %-10s: %9.1f us/frame, %7.2f us/instance, %5.2fx\n",
+           label, us, busy_us / std::max(instances, 1), serial_us / us);
+  }
+
+  return true;
+}
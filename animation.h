@@ -0,0 +1,104 @@
+﻿
+#pragma once
+
+#include "motion.h"
+#include "bone_palette.h"
+#include "spring_bone.h"
+#include "job_system.h"
+
+
+// 多数のインスタンスのアニメーションをまとめて進める段.
+// インスタンスごとの モーションを引く → ボーンモーフ → IK と行列 → 揺れ物 → ボーン行列 を一つのジョブにして
+// ワーカーで並べて回し, 結果は bone_palette_buffer の back() へ書く.
+// 全部終わったら finish() がメインスレッドで swap() するので, 描く側は front() をロックせずに読める.
+//
+// モーフの重みはインスタンスごとに持つ. 頂点と材質のモーフはモデルで共有なので,
+// finish() で後に足したインスタンスの重みをモデルの morph_set へ入れる.
+class animation_stage
+{
+public:
+  typedef std::shared_ptr<animation_stage> ptr_t;
+
+  struct stats
+  {
+    // 一つ前の start() から finish() までに回したインスタンスの数と, ワーカーでかかった時間の合計.
+    size_t instance_count;
+    std::chrono::steady_clock::duration total;
+    // total のうち IK と揺れ物の分.
+    std::chrono::steady_clock::duration ik;
+    std::chrono::steady_clock::duration spring;
+  };
+
+public:
+  animation_stage();
+  ~animation_stage();
+
+  animation_stage(const animation_stage&) = delete;
+  animation_stage& operator=(const animation_stage&) = delete;
+
+  // インスタンスを足して, その姿勢のボーン行列を返す. model_node::set_palette_buffer() へ渡す.
+  // pose は以後この段が書き換えるので, 他から触らないこと. frame は再生を始める位置.
+  // spring があれば, 進めた時間だけ揺らしてからボーン行列を作る.
+  bone_palette_buffer::ptr_t add(skeleton_pose::ptr_t pose, motion_sampler::ptr_t sampler, float frame = 0.f,
+                                 spring_bone_set::ptr_t spring = spring_bone_set::ptr_t());
+  size_t instance_count() const { return instance_array_.size(); }
+  void clear();
+
+  float frame(size_t i) const { return instance_array_[i]->frame; }
+  void set_frame(size_t i, float frame) { instance_array_[i]->frame = frame; }
+
+  // 全インスタンスの再生位置を delta フレーム進め, jobs のワーカーで計算を始める. すぐ戻る.
+  // 最後のキーを越えたら頭へ戻る. jobs が 0 ならここで全部計算する.
+  void start(job_system *jobs, float delta);
+  // start() の計算が終わるのを待ち, ボーン行列を入れ替えてモーフの重みをモデルへ入れる.
+  // かかった時間は profiler に "animation" として, そのうち IK と揺れ物の分を "ik" と "spring_bone" として足す.
+  void finish();
+  // start() と finish() を続けて呼ぶ.
+  void update(job_system *jobs, float delta);
+
+  const stats& last_stats() const { return stats_; }
+
+private:
+  struct instance
+  {
+    skeleton_pose::ptr_t pose;
+    motion_sampler::ptr_t sampler;
+    bone_palette_buffer::ptr_t palette;
+    spring_bone_set::ptr_t spring;
+    float frame;
+    // 前の計算から進めた秒数.
+    float delta;
+    // モデルのモーフの数だけ.
+    std::vector<float> morph_weight;
+    // モーションにトラックのあるモーフの番号. finish() でモデルへ入れるのはこれだけ.
+    std::vector<uint32_t> morph_track;
+    morph_set::bone_offset_array_t bone_offset;
+  };
+
+  // 再生位置を進める.
+  void advance(float delta);
+  // 全インスタンスを計算して back() へ書く. ワーカーからも呼ぶ.
+  void run(job_system *jobs);
+  // 書き終わった back() を表にし, モーフの重みをモデルへ入れる.
+  void publish();
+  static void evaluate(instance*);
+
+private:
+  // ワーカーが書き換えている間も場所が変わらないよう, ポインタで持つ.
+  std::vector<std::unique_ptr<instance>> instance_array_;
+  std::future<void> running_;
+  std::atomic<int64_t> busy_;
+  std::atomic<int64_t> ik_busy_;
+  std::atomic<int64_t> spring_busy_;
+  stats stats_;
+
+public:
+  static auto make()
+  {
+    return std::make_shared<animation_stage>();
+  }
+};
+
+// 同じモデルの instances 体に位置をずらしてモーションを流し, ワーカースレッドの数を変えて
+// 一フレームの計算にかかる時間を比べる.
+bool bench_animation_stage(const char *pmx_filename, const char *vmd_filename, int instances, int frames);
@@ -0,0 +1,308 @@
+﻿
+#include "stdafx.h"
+
+#include "bench.h"
+
+#include "util.h"
+#include "pmx_loader.h"
+#include "utf.h"
+#include "render_queue.h"
+#include "gl_state.h"
+#include "cpu_skinning.h"
+#include "morph.h"
+#include "motion.h"
+#include "animation.h"
+#include "vertex_animation.h"
+#include "spring_bone.h"
+
+
+namespace {
+
+int bench_pmx(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench pmx <file.pmx> [iterations]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 10;
+  return bench_pmx_parse(argv[0], iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_pmxcache(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench pmxcache <file.pmx> [iterations]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 10;
+  return bench_pmx_cache(argv[0], iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_meshopt(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench meshopt <file.pmx>" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return bench_pmx_mesh(argv[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// 見えないウィンドウで PMX を読み込んで func(model, shader) を呼ぶ.
+template<class FuncT>
+int run_with_pmx_model(const char *filename, FuncT func)
+{
+  // 描画には GL のコンテキストが要るので, 見えないウィンドウを作る.
+  if (!glfwInit()) {
+    return EXIT_FAILURE;
+  }
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  GLFWwindow *window = glfwCreateWindow(960, 720, "Cut bench", NULL, NULL);
+  if (!window) {
+    glfwTerminate();
+    return EXIT_FAILURE;
+  }
+  glfwMakeContextCurrent(window);
+  gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+
+  bool result = false;
+  {
+    auto rm = std::make_shared<resource_repository>();
+    uint8_t black[] = { 0x00 }, white[] = { 0xff };
+    for (auto [name, pixel] : { std::make_pair("tex_black", black), std::make_pair("tex_white", white) }) {
+      auto tex = texture::make();
+      gl_state::instance().bind_texture(GL_TEXTURE_2D, tex->texture_globj());
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 1, 1, 0, GL_RED, GL_UNSIGNED_BYTE, pixel);
+      rm->add(name, tex);
+    }
+    auto pmx_shader = std::make_shared<shader>();
+    auto mdl = std::make_shared<model>();
+    if (!pmx_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh")) {
+      std::cerr << "cannot compile pmx shader." << std::endl;
+    } else if (!load_pmx(mdl.get(), filename, rm.get())) {
+      std::cerr << "cannot load " << filename << std::endl;
+    } else {
+      result = func(mdl, pmx_shader);
+    }
+  }
+
+  glfwDestroyWindow(window);
+  glfwTerminate();
+  return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_draw(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench draw <file.pmx> [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int frames = (argc > 1) ? std::max(1, atoi(argv[1])) : 100;
+  return run_with_pmx_model(argv[0], [=](model::ptr_t mdl, shader::ptr_t shdr) {
+    return bench_model_draw(mdl, shdr, frames);
+  });
+}
+
+int bench_scene(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench scene <file.pmx> [models] [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int models = (argc > 1) ? std::max(1, atoi(argv[1])) : 16;
+  int frames = (argc > 2) ? std::max(1, atoi(argv[2])) : 100;
+  return run_with_pmx_model(argv[0], [=](model::ptr_t mdl, shader::ptr_t shdr) {
+    return bench_render_queue(mdl, shdr, models, frames);
+  });
+}
+
+int bench_instancing(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench instancing <file.pmx> [instances] [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int instances = (argc > 1) ? std::max(1, atoi(argv[1])) : 200;
+  int frames = (argc > 2) ? std::max(1, atoi(argv[2])) : 100;
+  return run_with_pmx_model(argv[0], [=](model::ptr_t mdl, shader::ptr_t shdr) {
+    auto instanced_shader = std::make_shared<shader>();
+    if (!instanced_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh",
+                                                    { "INSTANCING" })) {
+      std::cerr << "cannot compile instanced pmx shader." << std::endl;
+      return false;
+    }
+    return bench_model_instancing(mdl, shdr, instanced_shader, instances, frames);
+  });
+}
+
+int bench_skinning(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench skinning <file.pmx> [iterations]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 100;
+  return bench_cpu_skinning(argv[0], iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_pose(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench pose <file.pmx> [iterations]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 10000;
+  return bench_skeleton_pose(argv[0], iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_ik(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench ik <file.pmx> [instances] [iterations]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int instances = (argc > 1) ? std::max(1, atoi(argv[1])) : 100;
+  int iterations = (argc > 2) ? std::max(1, atoi(argv[2])) : 100;
+  return bench_skeleton_ik(argv[0], instances, iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_spring(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench spring <file.pmx> [iterations]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 1000;
+  return bench_spring_bone(argv[0], iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_morph(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench morph <file.pmx> [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int frames = (argc > 1) ? std::max(1, atoi(argv[1])) : 100;
+  return run_with_pmx_model(argv[0], [=](model::ptr_t mdl, shader::ptr_t shdr) {
+    auto morph_shader = std::make_shared<shader>();
+    if (!morph_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh", { "MORPH" })) {
+      std::cerr << "cannot compile morph pmx shader." << std::endl;
+      return false;
+    }
+    return bench_morph_update(mdl, shdr, morph_shader, frames);
+  });
+}
+
+int bench_motion(int argc, char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: -bench motion <file.pmx> <file.vmd> [instances] [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int instances = (argc > 2) ? std::max(1, atoi(argv[2])) : 100;
+  int frames = (argc > 3) ? std::max(1, atoi(argv[3])) : 1000;
+  return bench_motion_sample(argv[0], argv[1], instances, frames) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_motioncompress(int argc, char **argv)
+{
+  if (argc < 1) {
+    std::cerr << "usage: -bench motioncompress <file.vmd> [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int frames = (argc > 1) ? std::max(1, atoi(argv[1])) : 1000;
+  return bench_motion_compress(argv[0], frames) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_animation(int argc, char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: -bench animation <file.pmx> <file.vmd> [instances] [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int instances = (argc > 2) ? std::max(1, atoi(argv[2])) : 64;
+  int frames = (argc > 3) ? std::max(1, atoi(argv[3])) : 200;
+  return bench_animation_stage(argv[0], argv[1], instances, frames) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_vat(int argc, char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: -bench vat <file.pmx> <file.vmd> [instances] [frames]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int instances = (argc > 2) ? std::max(1, atoi(argv[2])) : 200;
+  int frames = (argc > 3) ? std::max(1, atoi(argv[3])) : 100;
+  pmx_model_data data;
+  if (!load_pmx_data(&data, argv[0])) {
+    std::cerr << "cannot load " << argv[0] << std::endl;
+    return EXIT_FAILURE;
+  }
+  vmd_motion_data vmd;
+  if (!load_vmd(&vmd, argv[1])) {
+    std::cerr << "cannot load " << argv[1] << std::endl;
+    return EXIT_FAILURE;
+  }
+  auto mot = motion::make(vmd);
+  return run_with_pmx_model(argv[0], [&](model::ptr_t mdl, shader::ptr_t) {
+    auto skinning_shader = std::make_shared<shader>();
+    auto vat_shader = std::make_shared<shader>();
+    if (!skinning_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh",
+                                                   { "SKINNING" }) ||
+        !vat_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh",
+                                              { "VERTEX_ANIMATION", "INSTANCING" })) {
+      std::cerr << "cannot compile pmx shader variants." << std::endl;
+      return false;
+    }
+    return bench_vertex_animation(mdl, data, mot, skinning_shader, vat_shader, instances, frames);
+  });
+}
+
+int bench_utf(int argc, char **argv)
+{
+  int iterations = (argc > 0) ? std::max(1, atoi(argv[0])) : 20;
+  return bench_utf_transcode(iterations) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct bench_entry
+{
+  const char *name;
+  int (*func)(int, char**);
+};
+const bench_entry bench_table[] = {
+  { "pmx", bench_pmx },
+  { "pmxcache", bench_pmxcache },
+  { "meshopt", bench_meshopt },
+  { "draw", bench_draw },
+  { "scene", bench_scene },
+  { "instancing", bench_instancing },
+  { "skinning", bench_skinning },
+  { "pose", bench_pose },
+  { "ik", bench_ik },
+  { "spring", bench_spring },
+  { "morph", bench_morph },
+  { "motion", bench_motion },
+  { "motioncompress", bench_motioncompress },
+  { "animation", bench_animation },
+  { "vat", bench_vat },
+  { "utf", bench_utf },
+};
+
+} // end of anonymus namespace
+
+
+int run_bench(int argc, char **argv)
+{
+  if (argc >= 1) {
+    for (const auto& b : bench_table) {
+      if (std::string_view(argv[0]) == b.name) {
+        return b.func(argc - 1, argv + 1);
+      }
+    }
+  }
+
+  std::cerr << "usage: -bench <name> [args...]" << std::endl;
+  for (const auto& b : bench_table) {
+    std::cerr << "  " << b.name << std::endl;
+  }
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,7 @@
+﻿
+#pragma once
+
+
+// コマンドラインからベンチマークを走らせる.
+// Cut -bench <name> [args...]
+int run_bench(int argc, char **argv);
@@ -35,7 +35,7 @@ struct bitmapfileinfo
 
 } // end of namespace
 
-bool load_bmp(texture *tex, const char *filename)
+bool decode_bmp(texture_image *img, const char *filename)
 {
   // BMP 読み込み.
   std::ifstream f;
@@ -71,14 +71,12 @@ bool load_bmp(texture *tex, const char *filename)
   f.read((char*)data.get(), size);
   f.close();
 
-  // テクスチャへロード.
-  GLint internalformat = (fi.bit_count == 24) ? GL_RGB : GL_RGBA;
-  GLenum format = (fi.bit_count == 24) ? GL_RGB : GL_RGBA;
-  glBindTexture(GL_TEXTURE_2D, tex->texture_globj());
-  glTexImage2D(GL_TEXTURE_2D, 0, internalformat, fi.width, fi.height, 0, format, GL_UNSIGNED_BYTE, data.get());
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-  glGenerateMipmap(GL_TEXTURE_2D);
+  img->width = fi.width;
+  img->height = fi.height;
+  img->internalformat = (fi.bit_count == 24) ? GL_RGB : GL_RGBA;
+  img->format = (fi.bit_count == 24) ? GL_RGB : GL_RGBA;
+  img->type = GL_UNSIGNED_BYTE;
+  img->data = std::move(data);
 
   return true;
 }
@@ -3,4 +3,4 @@
 
 #include "texture.h"
 
-bool load_bmp(texture*, const char *filename);
+bool decode_bmp(texture_image*, const char *filename);
@@ -0,0 +1,68 @@
+﻿
+#include "stdafx.h"
+
+#include "bone_palette.h"
+#include "gl_state.h"
+
+
+bone_palette::bone_palette(size_t bone_count)
+  : matrix_array_(std::max<size_t>(bone_count, 1), matrix::identity()), buffer_(0), texture_(0), dirty_(true)
+{
+  // 列優先でそのまま並べれば, texelFetch の 4 つがそのまま mat4 の列になる.
+  static_assert(sizeof(matrix) == sizeof(float) * 16);
+  auto& gl = gl_state::instance();
+  glGenBuffers(1, &buffer_);
+  gl.bind_buffer(GL_TEXTURE_BUFFER, buffer_);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(matrix) * matrix_array_.size(), 0, GL_DYNAMIC_DRAW);
+  glGenTextures(1, &texture_);
+  gl.bind_texture(GL_TEXTURE_BUFFER, texture_);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer_);
+}
+
+bone_palette::~bone_palette()
+{
+  auto& gl = gl_state::instance();
+  if (texture_) {
+    gl.delete_texture(texture_);
+  }
+  if (buffer_) {
+    gl.delete_buffer(buffer_);
+  }
+}
+
+void bone_palette::set_bone_matrix(size_t i, const matrix& m)
+{
+  matrix_array_[i] = m;
+  dirty_ = true;
+}
+
+void bone_palette::set_bone_matrix_array(const matrix *m, size_t count)
+{
+  assert(count <= matrix_array_.size());
+  std::copy(m, m + count, matrix_array_.begin());
+  dirty_ = true;
+}
+
+void bone_palette::update()
+{
+  if (!dirty_) {
+    return;
+  }
+  gl_state::instance().bind_buffer(GL_TEXTURE_BUFFER, buffer_);
+  glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(matrix) * matrix_array_.size(), &matrix_array_[0]);
+  dirty_ = false;
+}
+
+
+bone_palette_buffer::bone_palette_buffer(size_t bone_count)
+  : front_(0), revision_(0)
+{
+  buffer_[0].assign(bone_count, matrix::identity());
+  buffer_[1].assign(bone_count, matrix::identity());
+}
+
+void bone_palette_buffer::swap()
+{
+  front_ ^= 1;
+  ++revision_;
+}
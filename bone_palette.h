@@ -0,0 +1,79 @@
+﻿
+#pragma once
+
+
+// スキニングに使うボーン行列の並び.
+// テクスチャバッファに行列を列ごとの RGBA32F 四つで並べ, 頂点シェーダの
+// bone_palette (samplerBuffer) から引く. 変わった時だけ一度にまとめて転送する.
+class bone_palette
+{
+public:
+  typedef std::shared_ptr<bone_palette> ptr_t;
+
+public:
+  // 全て単位行列で始める.
+  bone_palette(size_t bone_count);
+  ~bone_palette();
+
+  bone_palette(const bone_palette&) = delete;
+  bone_palette& operator=(const bone_palette&) = delete;
+
+  size_t bone_count() const { return matrix_array_.size(); }
+
+  // 初期姿勢のモデル空間から今の姿勢のモデル空間への行列.
+  const matrix& bone_matrix(size_t i) const { return matrix_array_[i]; }
+  void set_bone_matrix(size_t i, const matrix& m);
+  // 前から count 個をまとめて入れ替える. count は bone_count() 以下.
+  void set_bone_matrix_array(const matrix *m, size_t count);
+
+  // 変わっていたら転送する.
+  void update();
+
+  GLuint globj_texture() { return texture_; }
+
+private:
+  std::vector<matrix> matrix_array_;
+  GLuint buffer_;
+  GLuint texture_;
+  bool dirty_;
+
+public:
+  static auto make(size_t bone_count)
+  {
+    return std::make_shared<bone_palette>(bone_count);
+  }
+};
+
+
+// ボーン行列の二重バッファ. 姿勢をワーカーで計算する時に使う.
+// 計算する側は back() へ書き, 書き終わったらメインスレッドで swap() する.
+// 描く側は front() を読むだけなので, 次のフレームを計算している間もロックせずに描ける.
+class bone_palette_buffer
+{
+public:
+  typedef std::shared_ptr<bone_palette_buffer> ptr_t;
+
+public:
+  // 全て単位行列で始める.
+  bone_palette_buffer(size_t bone_count);
+
+  size_t bone_count() const { return buffer_[0].size(); }
+
+  const matrix *front() const { return buffer_[front_].data(); }
+  matrix *back() { return buffer_[front_ ^ 1].data(); }
+  // back() を front() にする. back() へ書くのが全部終わってから呼ぶこと.
+  void swap();
+  // swap() の度に増える. 描く側は変わった時だけ bone_palette へ移す.
+  uint32_t revision() const { return revision_; }
+
+private:
+  std::vector<matrix> buffer_[2];
+  uint32_t front_;
+  uint32_t revision_;
+
+public:
+  static auto make(size_t bone_count)
+  {
+    return std::make_shared<bone_palette_buffer>(bone_count);
+  }
+};
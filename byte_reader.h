@@ -0,0 +1,81 @@
+﻿
+#pragma once
+
+
+// メモリ上のバイト列を先頭から読む.
+// 範囲外を読もうとした時点で fail() になり, 以降の読み込みはすべて失敗する.
+class byte_reader
+{
+public:
+  byte_reader(const void *p, size_t size)
+    : begin_((const uint8_t*)p), cur_((const uint8_t*)p), end_((const uint8_t*)p + size), fail_(false)
+  {}
+
+  // size バイト進めて, 進める前の位置を返す.
+  const uint8_t *advance(size_t size)
+  {
+    if (fail_ || (size > remain())) {
+      fail_ = true;
+      cur_ = end_;
+      return 0;
+    }
+    const uint8_t *p = cur_;
+    cur_ += size;
+    return p;
+  }
+
+  bool skip(size_t size) { return advance(size) != 0; }
+
+  // 先頭から pos バイトの位置へ移る.
+  bool seek(size_t pos)
+  {
+    if (fail_ || (pos > size())) {
+      fail_ = true;
+      cur_ = end_;
+      return false;
+    }
+    cur_ = begin_ + pos;
+    return true;
+  }
+
+  bool read_bytes(void *dst, size_t size)
+  {
+    const uint8_t *p = advance(size);
+    if (!p) {
+      return false;
+    }
+    std::memcpy(dst, p, size);
+    return true;
+  }
+
+  template<class T>
+  bool read(T *p, int n = 1)
+  {
+    return read_bytes(p, sizeof(T) * n);
+  }
+
+  bool fail() const { return fail_; }
+  size_t tell() const { return cur_ - begin_; }
+  size_t size() const { return end_ - begin_; }
+  size_t remain() const { return end_ - cur_; }
+  const uint8_t *current() const { return cur_; }
+
+private:
+  const uint8_t *begin_;
+  const uint8_t *cur_;
+  const uint8_t *end_;
+  bool fail_;
+};
+
+
+// util.h の std::istream 版と同じ形で呼べるようにしておく.
+inline void read_uint8(byte_reader& r, uint8_t *p, int n = 1) { r.read(p, n); }
+inline void read_int8(byte_reader& r, int8_t *p, int n = 1) { r.read(p, n); }
+inline void read_uint16(byte_reader& r, uint16_t *p, int n = 1) { r.read(p, n); }
+inline void read_int16(byte_reader& r, int16_t *p, int n = 1) { r.read(p, n); }
+inline void read_uint32(byte_reader& r, uint32_t *p, int n = 1) { r.read(p, n); }
+inline void read_int32(byte_reader& r, int32_t *p, int n = 1) { r.read(p, n); }
+inline void read_uint64(byte_reader& r, uint64_t *p, int n = 1) { r.read(p, n); }
+inline void read_int64(byte_reader& r, int64_t *p, int n = 1) { r.read(p, n); }
+inline void read_float(byte_reader& r, float *p, int n = 1) { r.read(p, n); }
+inline void skip_bytes(byte_reader& r, size_t size) { r.skip(size); }
@@ -0,0 +1,342 @@
+﻿
+#include "stdafx.h"
+
+#include "cpu_skinning.h"
+#include "pmx_loader.h"
+
+
+namespace {
+
+// 一回のジョブで変形する頂点の数. 8 の倍数.
+const size_t skin_grain = 4096;
+
+// 行列の上 3 行を列ごとに並べた 12 要素の, matrix::m での位置.
+const int bone_element[12] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14 };
+
+// 変形の入力と出力. 全て頂点番号で引く.
+struct skin_stream
+{
+  const float *src_pos[3];
+  const float *src_nml[3];
+  const int32_t *bone[4];
+  const float *weight[4];
+  const uint8_t *block_influence;
+  float *pos[3];
+  float *nml[3];
+};
+
+void skin_range_scalar(const skin_stream& s, size_t begin, size_t end, const float *bone_array)
+{
+  for (size_t i=begin; i<end; ++i) {
+    float m[12] = {};
+    for (int k=0; k<4; ++k) {
+      float w = s.weight[k][i];
+      if (w == 0.f) {
+        continue;
+      }
+      const float *b = bone_array + s.bone[k][i] * 16;
+      for (int e=0; e<12; ++e) {
+        m[e] += w * b[bone_element[e]];
+      }
+    }
+    float x = s.src_pos[0][i], y = s.src_pos[1][i], z = s.src_pos[2][i];
+    s.pos[0][i] = m[0] * x + m[3] * y + m[6] * z + m[9];
+    s.pos[1][i] = m[1] * x + m[4] * y + m[7] * z + m[10];
+    s.pos[2][i] = m[2] * x + m[5] * y + m[8] * z + m[11];
+    float nx = s.src_nml[0][i], ny = s.src_nml[1][i], nz = s.src_nml[2][i];
+    s.nml[0][i] = m[0] * nx + m[3] * ny + m[6] * nz;
+    s.nml[1][i] = m[1] * nx + m[4] * ny + m[7] * nz;
+    s.nml[2][i] = m[2] * nx + m[5] * ny + m[8] * nz;
+  }
+}
+
+#if defined(CUT_SIMD_X86)
+
+// 頂点ごとに, 行列の列を 4 要素のまま混ぜる.
+void skin_range_sse2(const skin_stream& s, size_t begin, size_t end, const float *bone_array)
+{
+  for (size_t i=begin; i<end; ++i) {
+    __m128 c0 = _mm_setzero_ps(), c1 = _mm_setzero_ps(), c2 = _mm_setzero_ps(), c3 = _mm_setzero_ps();
+    for (int k=0; k<4; ++k) {
+      float w = s.weight[k][i];
+      if (w == 0.f) {
+        continue;
+      }
+      const float *b = bone_array + s.bone[k][i] * 16;
+      __m128 vw = _mm_set1_ps(w);
+      c0 = _mm_add_ps(c0, _mm_mul_ps(vw, _mm_loadu_ps(b)));
+      c1 = _mm_add_ps(c1, _mm_mul_ps(vw, _mm_loadu_ps(b + 4)));
+      c2 = _mm_add_ps(c2, _mm_mul_ps(vw, _mm_loadu_ps(b + 8)));
+      c3 = _mm_add_ps(c3, _mm_mul_ps(vw, _mm_loadu_ps(b + 12)));
+    }
+    __m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(s.src_pos[0][i])),
+                                     _mm_mul_ps(c1, _mm_set1_ps(s.src_pos[1][i]))),
+                          _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(s.src_pos[2][i])), c3));
+    __m128 n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(s.src_nml[0][i])),
+                                     _mm_mul_ps(c1, _mm_set1_ps(s.src_nml[1][i]))),
+                          _mm_mul_ps(c2, _mm_set1_ps(s.src_nml[2][i])));
+    alignas(16) float tp[4], tn[4];
+    _mm_store_ps(tp, p);
+    _mm_store_ps(tn, n);
+    for (int j=0; j<3; ++j) {
+      s.pos[j][i] = tp[j];
+      s.nml[j][i] = tn[j];
+    }
+  }
+}
+
+// 頂点 8 個をまとめて, 行列の要素ごとに集めて混ぜる.
+SIMD_TARGET_AVX2
+void skin_range_avx2(const skin_stream& s, size_t begin, size_t end, const float *bone_array)
+{
+  for (size_t i=begin; i<end; i+=8) {
+    __m256 m[12];
+    for (int e=0; e<12; ++e) {
+      m[e] = _mm256_setzero_ps();
+    }
+    // BDEF1 ばかりの区間なら 1 本で済む.
+    int n = s.block_influence[i / 8];
+    for (int k=0; k<n; ++k) {
+      __m256i base = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i*)(s.bone[k] + i)), 4);
+      __m256 w = _mm256_loadu_ps(s.weight[k] + i);
+      for (int e=0; e<12; ++e) {
+        __m256 g = _mm256_i32gather_ps(bone_array, _mm256_add_epi32(base, _mm256_set1_epi32(bone_element[e])), 4);
+        m[e] = _mm256_add_ps(m[e], _mm256_mul_ps(w, g));
+      }
+    }
+    __m256 x = _mm256_loadu_ps(s.src_pos[0] + i);
+    __m256 y = _mm256_loadu_ps(s.src_pos[1] + i);
+    __m256 z = _mm256_loadu_ps(s.src_pos[2] + i);
+    __m256 nx = _mm256_loadu_ps(s.src_nml[0] + i);
+    __m256 ny = _mm256_loadu_ps(s.src_nml[1] + i);
+    __m256 nz = _mm256_loadu_ps(s.src_nml[2] + i);
+    for (int j=0; j<3; ++j) {
+      __m256 p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[j], x), _mm256_mul_ps(m[3 + j], y)),
+                               _mm256_add_ps(_mm256_mul_ps(m[6 + j], z), m[9 + j]));
+      __m256 q = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[j], nx), _mm256_mul_ps(m[3 + j], ny)),
+                               _mm256_mul_ps(m[6 + j], nz));
+      _mm256_storeu_ps(s.pos[j] + i, p);
+      _mm256_storeu_ps(s.nml[j] + i, q);
+    }
+  }
+}
+
+#endif
+
+} // end of anonymus namespace
+
+
+cpu_skinning::cpu_skinning(const pmx_model_data& data)
+  : vertex_count_(data.vertex_count), padded_count_((data.vertex_count + 7) & ~(size_t)7), bone_count_(0)
+{
+  for (int j=0; j<3; ++j) {
+    src_pos_[j].assign(padded_count_, 0.f);
+    src_nml_[j].assign(padded_count_, 0.f);
+  }
+  for (int k=0; k<4; ++k) {
+    bone_[k].assign(padded_count_, 0);
+    weight_[k].assign(padded_count_, 0.f);
+  }
+  block_influence_.assign(padded_count_ / 8, 0);
+  const size_t bone_limit = data.bone_array.size();
+  for (size_t i=0; i<vertex_count_; ++i) {
+    const auto& vtx = data.vertex_array[i];
+    for (int j=0; j<3; ++j) {
+      src_pos_[j][i] = vtx.pos[j];
+      src_nml_[j][i] = vtx.nml[j];
+    }
+    for (int k=0; k<4; ++k) {
+      // 使わない枠と範囲外の枠は 0 番・重み 0 にしておけば, 集める時にはみ出さない.
+      if ((vtx.weight[k] == 0.f) || ((size_t)vtx.bone[k] >= bone_limit)) {
+        continue;
+      }
+      bone_[k][i] = (int32_t)vtx.bone[k];
+      weight_[k][i] = vtx.weight[k];
+      bone_count_ = std::max<size_t>(bone_count_, (size_t)vtx.bone[k] + 1);
+      uint8_t& influence = block_influence_[i / 8];
+      influence = std::max<uint8_t>(influence, (uint8_t)(k + 1));
+    }
+  }
+
+  sdef_array_.reserve(data.sdef_array.size());
+  for (const auto& sdef : data.sdef_array) {
+    const auto& vtx = data.vertex_array[sdef.vertex];
+    // 一つ目のボーンが使えなければ, 線形のブレンドの結果のままにする.
+    if ((vtx.weight[0] == 0.f) || ((size_t)vtx.bone[0] >= bone_limit)) {
+      continue;
+    }
+    sdef_vertex s;
+    s.vertex = sdef.vertex;
+    s.bone[0] = vtx.bone[0];
+    s.weight[0] = vtx.weight[0];
+    // 二つ目が使われていなければ一つ目で埋め, 回転を読む時にはみ出さないようにする.
+    if ((vtx.weight[1] == 0.f) || ((size_t)vtx.bone[1] >= bone_limit)) {
+      s.bone[1] = s.bone[0];
+      s.weight[1] = 0.f;
+    } else {
+      s.bone[1] = vtx.bone[1];
+      s.weight[1] = vtx.weight[1];
+    }
+    // 重みで混ぜた R が C に来るよう R0, R1 をずらし, C との中点を使う.
+    vec3 rw = sdef.r0 * s.weight[0] + sdef.r1 * s.weight[1];
+    s.c = sdef.c;
+    s.cr0 = (sdef.c + (sdef.c + sdef.r0 - rw)) * 0.5f;
+    s.cr1 = (sdef.c + (sdef.c + sdef.r1 - rw)) * 0.5f;
+    sdef_array_.push_back(s);
+  }
+
+  // skin() するまでは初期姿勢.
+  pos_x_ = src_pos_[0];
+  pos_y_ = src_pos_[1];
+  pos_z_ = src_pos_[2];
+  nml_x_ = src_nml_[0];
+  nml_y_ = src_nml_[1];
+  nml_z_ = src_nml_[2];
+}
+
+bool cpu_skinning::skin(const matrix *bone_array, size_t bone_count, job_system *jobs)
+{
+  return skin(bone_array, bone_count, jobs, simd_support());
+}
+
+bool cpu_skinning::skin(const matrix *bone_array, size_t bone_count, job_system *jobs, simd_level level)
+{
+  if (bone_count < bone_count_) {
+    return false;
+  }
+  if (!sdef_array_.empty()) {
+    bone_rotation_.resize(bone_count);
+    for (size_t i=0; i<bone_count; ++i) {
+      bone_rotation_[i] = quarternion::from_matrix(bone_array[i]);
+    }
+  }
+  parallel_for(jobs, padded_count_, skin_grain, [&](size_t begin, size_t end) {
+    skin_range(begin, end, bone_array, level);
+  });
+  return true;
+}
+
+void cpu_skinning::skin_range(size_t begin, size_t end, const matrix *bone_array, simd_level level)
+{
+  skin_stream s;
+  for (int j=0; j<3; ++j) {
+    s.src_pos[j] = src_pos_[j].data();
+    s.src_nml[j] = src_nml_[j].data();
+  }
+  for (int k=0; k<4; ++k) {
+    s.bone[k] = bone_[k].data();
+    s.weight[k] = weight_[k].data();
+  }
+  s.block_influence = block_influence_.data();
+  s.pos[0] = pos_x_.data();
+  s.pos[1] = pos_y_.data();
+  s.pos[2] = pos_z_.data();
+  s.nml[0] = nml_x_.data();
+  s.nml[1] = nml_y_.data();
+  s.nml[2] = nml_z_.data();
+
+  const float *bones = bone_array->m;
+  switch (level) {
+#if defined(CUT_SIMD_X86)
+  case SIMD_AVX2:
+    skin_range_avx2(s, begin, end, bones);
+    break;
+  case SIMD_SSE2:
+    skin_range_sse2(s, begin, end, bones);
+    break;
+#endif
+  default:
+    skin_range_scalar(s, begin, end, bones);
+    break;
+  }
+  skin_sdef(begin, std::min(end, vertex_count_), bone_array);
+}
+
+// SDEF は二つのボーンの回転を球面補間して, 中心 C の周りに回す.
+void cpu_skinning::skin_sdef(size_t begin, size_t end, const matrix *bone_array)
+{
+  auto it = std::lower_bound(sdef_array_.begin(), sdef_array_.end(), begin,
+                             [](const sdef_vertex& s, size_t v) { return s.vertex < v; });
+  for (; (it != sdef_array_.end()) && (it->vertex < end); ++it) {
+    const sdef_vertex& s = *it;
+    size_t i = s.vertex;
+    quarternion q = slerp(bone_rotation_[s.bone[0]], bone_rotation_[s.bone[1]], s.weight[1]);
+    vec3 p = rotate(q, vec3(src_pos_[0][i], src_pos_[1][i], src_pos_[2][i]) - s.c) +
+      transform_point(bone_array[s.bone[0]], s.cr0) * s.weight[0] +
+      transform_point(bone_array[s.bone[1]], s.cr1) * s.weight[1];
+    vec3 n = rotate(q, vec3(src_nml_[0][i], src_nml_[1][i], src_nml_[2][i]));
+    pos_x_[i] = p.x;
+    pos_y_[i] = p.y;
+    pos_z_[i] = p.z;
+    nml_x_[i] = n.x;
+    nml_y_[i] = n.y;
+    nml_z_[i] = n.z;
+  }
+}
+
+void cpu_skinning::bounds(vec3 *lo, vec3 *hi) const
+{
+  if (vertex_count_ == 0) {
+    *lo = *hi = vec3(0.f, 0.f, 0.f);
+    return;
+  }
+  *lo = *hi = position(0);
+  for (size_t i=1; i<vertex_count_; ++i) {
+    vec3 p = position(i);
+    *lo = vec3(std::min(lo->x, p.x), std::min(lo->y, p.y), std::min(lo->z, p.z));
+    *hi = vec3(std::max(hi->x, p.x), std::max(hi->y, p.y), std::max(hi->z, p.z));
+  }
+}
+
+
+bool bench_cpu_skinning(const char *filename, int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, filename)) {
+    return false;
+  }
+  cpu_skinning skinning(data);
+
+  // ボーンごとに少しずつ違う回転と移動.
+  std::vector<matrix> bone_array(std::max<size_t>(skinning.bone_count(), 1));
+  for (size_t i=0; i<bone_array.size(); ++i) {
+    matrix m = matrix::rotate_axis(normalize(vec3(1.f, (float)(i % 7), 0.5f)), 0.05f * (float)i);
+    m._03 = 0.1f * (float)(i % 5);
+    m._13 = 0.2f;
+    m._23 = -0.1f * (float)(i % 3);
+    bone_array[i] = m;
+  }
+
+  // スカラー版を正解にする.
+  skinning.skin(bone_array.data(), bone_array.size(), 0, SIMD_None);
+  std::vector<vec3> reference(skinning.vertex_count());
+  for (size_t i=0; i<reference.size(); ++i) {
+    reference[i] = skinning.position(i);
+  }
+
+  job_system jobs;
+  printf("cpu skinning: %zu vertices (%zu sdef), %zu bones, %d iterations, %d workers\n",
+         skinning.vertex_count(), data.sdef_array.size(), bone_array.size(), iterations, jobs.thread_count());
+  for (int level=SIMD_None; level<=simd_support(); ++level) {
+    for (job_system *js : { (job_system*)0, &jobs }) {
+      skinning.skin(bone_array.data(), bone_array.size(), js, (simd_level)level);
+      auto start = clock::now();
+      for (int i=0; i<iterations; ++i) {
+        skinning.skin(bone_array.data(), bone_array.size(), js, (simd_level)level);
+      }
+      double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count() / iterations;
+      float error = 0.f;
+      for (size_t i=0; i<reference.size(); ++i) {
+        vec3 d = skinning.position(i) - reference[i];
+        error = std::max(error, std::max(std::abs(d.x), std::max(std::abs(d.y), std::abs(d.z))));
+      }
+      printf("  %-6s %-8s : %9.3f ms, %9.2f Mvertices/s, max error %g\n",
+             simd_level_name((simd_level)level), js ? "threaded" : "single",
+             ms, skinning.vertex_count() / (ms * 1000.0), error);
+    }
+  }
+
+  return true;
+}
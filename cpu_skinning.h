@@ -0,0 +1,70 @@
+﻿
+#pragma once
+
+#include "pmx_model.h"
+#include "job_system.h"
+#include "simd.h"
+
+
+// CPU でのスキニング.
+// 位置と法線, ボーン番号と重みを成分ごとの配列 (SoA) に持ち, 頂点 8 個ずつ 4 本の重みを混ぜる.
+// SDEF の頂点は混ぜた後で補正する. GL を使わないので, 描画しないプロセスでも使える.
+class cpu_skinning
+{
+public:
+  cpu_skinning(const pmx_model_data&);
+
+  size_t vertex_count() const { return vertex_count_; }
+  // 頂点が参照するボーンの数. skin() にはこれ以上の数の行列を渡すこと.
+  size_t bone_count() const { return bone_count_; }
+
+  // bone_array は bone_palette と同じく, 初期姿勢のモデル空間から今の姿勢のモデル空間への行列.
+  // jobs があれば頂点を分けてワーカーでも回す. 行列が足りなければ false.
+  bool skin(const matrix *bone_array, size_t bone_count, job_system *jobs = 0);
+  bool skin(const matrix *bone_array, size_t bone_count, job_system *jobs, simd_level);
+
+  vec3 position(size_t i) const { return vec3(pos_x_[i], pos_y_[i], pos_z_[i]); }
+  vec3 normal(size_t i) const { return vec3(nml_x_[i], nml_y_[i], nml_z_[i]); }
+  const float *position_x() const { return pos_x_.data(); }
+  const float *position_y() const { return pos_y_.data(); }
+  const float *position_z() const { return pos_z_.data(); }
+  // 変形後の位置を囲む箱.
+  void bounds(vec3 *lo, vec3 *hi) const;
+
+private:
+  // 変形前. SDEF は混ぜた後の補正に使う値を先に計算しておく.
+  struct sdef_vertex
+  {
+    uint32_t vertex;
+    uint32_t bone[2];
+    float weight[2];
+    vec3 c;
+    vec3 cr0;
+    vec3 cr1;
+  };
+
+  // [begin, end) を変形する. begin は 8 の倍数.
+  void skin_range(size_t begin, size_t end, const matrix *bone_array, simd_level);
+  void skin_sdef(size_t begin, size_t end, const matrix *bone_array);
+
+private:
+  size_t vertex_count_;
+  // 頂点 8 個の区切りまで伸ばした数. 伸ばした分は重み 0.
+  size_t padded_count_;
+  size_t bone_count_;
+  std::vector<float> src_pos_[3];
+  std::vector<float> src_nml_[3];
+  std::vector<int32_t> bone_[4];
+  std::vector<float> weight_[4];
+  // 頂点 8 個ごとの, 重みが入っている枠の数.
+  std::vector<uint8_t> block_influence_;
+  std::vector<sdef_vertex> sdef_array_;
+  // skin() ごとに作る, SDEF のボーンの回転.
+  std::vector<quarternion> bone_rotation_;
+
+  std::vector<float> pos_x_, pos_y_, pos_z_;
+  std::vector<float> nml_x_, nml_y_, nml_z_;
+};
+
+// 頂点数 / 秒 を SIMD の種類とスレッドの有無で比べる.
+bool bench_cpu_skinning(const char *filename, int iterations);
@@ -5,6 +5,7 @@
 
 #include "figure.h"
 #include "util.h"
+#include "gl_state.h"
 
 
 
@@ -47,12 +48,13 @@ void coordinator::draw(scene *scn, draw_context *ctx, manager *m)
 manager::manager()
 {
   shader_.compile_from_source_file("assets/shader/simple.vsh", "assets/shader/simple.fsh");
+  mvp_location_ = shader_.uniform_location("MVP");
   glGenBuffers(1, &vertex_buffer_);
 }
 
 manager::~manager()
 {
-  glDeleteBuffers(1, &vertex_buffer_);
+  gl_state::instance().delete_buffer(vertex_buffer_);
 }
 
 void manager::draw(scene *scn, draw_context *ctx, const matrix& mtx, GLenum mode, const vertex_t *vertices, GLsizei count)
@@ -63,11 +65,14 @@ void manager::draw(scene *scn, draw_context *ctx, const matrix& mtx, GLenum mode
   matrix mv = concat(scn->root_camera().view_matrix(), m);
   matrix mvp = concat(scn->root_camera().projection_matrix(), mv);
 
-  shader_.set_uniform("MVP", mvp);
+  shader_.set_uniform(mvp_location_, mvp);
 
-  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  auto& gl = gl_state::instance();
+  gl.bind_buffer(GL_ARRAY_BUFFER, vertex_buffer_);
   glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_t) * count, vertices, GL_STATIC_DRAW);
-  
+
+  // 属性は既定の頂点配列に設定する.
+  gl.bind_vertex_array(0);
   for (const auto& decl : FIGURE_VERTEX_DECL) {
     shader_.set_attrib(decl);
   }
@@ -84,6 +84,7 @@ public:
 
 private:
   shader shader_;
+  GLint mvp_location_;
   GLuint vertex_buffer_;
 };
 
@@ -2,6 +2,7 @@
 #include "stdafx.h"
 
 #include "font.h"
+#include "gl_state.h"
 
 
 namespace font {
@@ -40,7 +41,7 @@ texture_atlas::texture_atlas(int w, int h)
   : packer_(w, h)
 {
   tex_ = texture::make();
-  glBindTexture(GL_TEXTURE_2D, tex_->texture_globj());
+  gl_state::instance().bind_texture(GL_TEXTURE_2D, tex_->texture_globj());
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
   glSamplerParameteri(tex_->sampler_globj(), GL_TEXTURE_MAG_FILTER, GL_NEAREST);
   glSamplerParameteri(tex_->sampler_globj(), GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -69,7 +70,7 @@ rect texture_atlas::register_char(FT_GlyphSlot glyph)
   int pixel_store = 0;
   glGetIntegerv(GL_UNPACK_ALIGNMENT, &pixel_store);
   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-  glBindTexture(GL_TEXTURE_2D, tex_->texture_globj());
+  gl_state::instance().bind_texture(GL_TEXTURE_2D, tex_->texture_globj());
   glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h, GL_RED, GL_UNSIGNED_BYTE, buf);
   glPixelStorei(GL_UNPACK_ALIGNMENT, pixel_store);
 
@@ -85,12 +86,13 @@ void texture_atlas::clear()
 renderer::renderer(face::ptr_t f, shader::ptr_t s)
   : face_(f), glyph_tex_(TEXTURE_SIZE, TEXTURE_SIZE), shader_(s)
 {
+  glyph_sampler_location_ = shader_->uniform_location("glyph_sampler");
   glGenBuffers(1, &vertex_buffer_);
 }
 
 renderer::~renderer()
 {
-  glDeleteBuffers(1, &vertex_buffer_);
+  gl_state::instance().delete_buffer(vertex_buffer_);
 }
 
 size_t renderer::render(vec2 pos, const ivec2& size, const color& col, std::u16string_view str, vec2 *end)
@@ -142,10 +144,13 @@ size_t renderer::render(vec2 pos, const ivec2& size, const color& col, std::u16s
     *end = screen_from_vertex(pos);
   }
 
-  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  auto& gl = gl_state::instance();
+  gl.bind_buffer(GL_ARRAY_BUFFER, vertex_buffer_);
   glBufferData(GL_ARRAY_BUFFER, vertex_array.size() * sizeof(vertex), vertex_array.data(), GL_STATIC_DRAW);
 
   shader_->use();
+  // 属性は既定の頂点配列に設定する.
+  gl.bind_vertex_array(0);
   static const vertex_decl vertex_decl[] = {
     { Semantics_Position, GL_FLOAT, 2, offsetof(vertex, pos), sizeof(vertex) },
     { Semantics_Color, GL_FLOAT, 4, offsetof(vertex, col), sizeof(vertex) },
@@ -154,10 +159,9 @@ size_t renderer::render(vec2 pos, const ivec2& size, const color& col, std::u16s
   for (auto& decl : vertex_decl) {
     shader_->set_attrib(decl);
   }
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, glyph_tex_.texture()->texture_globj());
-  glBindSampler(0, glyph_tex_.texture()->sampler_globj());
-  shader_->set_uniform("glyph_sampler", 0);
+  gl.bind_texture(0, GL_TEXTURE_2D, glyph_tex_.texture()->texture_globj());
+  gl.bind_sampler(0, glyph_tex_.texture()->sampler_globj());
+  shader_->set_uniform(glyph_sampler_location_, 0);
 
   glDrawArrays(GL_TRIANGLES, 0, (GLsizei)vertex_array.size());
 
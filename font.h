@@ -117,6 +117,7 @@ private:
   texture_atlas glyph_tex_;
   GLuint vertex_buffer_;
   shader::ptr_t shader_;
+  GLint glyph_sampler_location_;
 
   vec2 screen_size_;
 };
@@ -0,0 +1,231 @@
+﻿
+#include "stdafx.h"
+
+#include "gl_state.h"
+
+
+namespace {
+
+// まだ分からない状態.
+const GLuint unknown = ~0u;
+
+} // end of anonymus namespace
+
+
+gl_state_impl::gl_state_impl()
+  : frame_stats_(), last_frame_stats_()
+{
+  invalidate();
+}
+
+void gl_state_impl::invalidate()
+{
+  program_ = unknown;
+  vertex_array_ = unknown;
+  buffer_array_.clear();
+  indexed_buffer_map_.clear();
+  active_texture_ = unknown;
+  texture_unit_array_.clear();
+  capability_array_.clear();
+  blend_equation_ = { unknown, unknown };
+  blend_func_ = { unknown, unknown, unknown, unknown };
+  depth_func_ = unknown;
+}
+
+GLuint& gl_state_impl::buffer_binding(GLenum target)
+{
+  for (auto& [t, buffer] : buffer_array_) {
+    if (t == target) {
+      return buffer;
+    }
+  }
+  buffer_array_.emplace_back(target, unknown);
+  return buffer_array_.back().second;
+}
+
+gl_state_impl::texture_unit& gl_state_impl::unit(GLuint u)
+{
+  if (u >= texture_unit_array_.size()) {
+    texture_unit_array_.resize(u + 1, texture_unit{ {}, unknown });
+  }
+  return texture_unit_array_[u];
+}
+
+GLuint& gl_state_impl::texture_binding(GLuint u, GLenum target)
+{
+  auto& texture_array = unit(u).texture_array;
+  for (auto& [t, texture] : texture_array) {
+    if (t == target) {
+      return texture;
+    }
+  }
+  texture_array.emplace_back(target, unknown);
+  return texture_array.back().second;
+}
+
+void gl_state_impl::use_program(GLuint program)
+{
+  if (update(program_, program)) {
+    glUseProgram(program);
+  }
+}
+
+void gl_state_impl::bind_vertex_array(GLuint vertex_array)
+{
+  if (update(vertex_array_, vertex_array)) {
+    glBindVertexArray(vertex_array);
+    buffer_binding(GL_ELEMENT_ARRAY_BUFFER) = unknown;
+  }
+}
+
+void gl_state_impl::bind_buffer(GLenum target, GLuint buffer)
+{
+  if (update(buffer_binding(target), buffer)) {
+    glBindBuffer(target, buffer);
+  }
+}
+
+void gl_state_impl::bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+  auto it = indexed_buffer_map_.try_emplace({target, index}, unknown, 0, 0).first;
+  if (update(it->second, buffer_range_t(buffer, offset, size))) {
+    glBindBufferRange(target, index, buffer, offset, size);
+    // 番号の無い方の束縛も変わる.
+    buffer_binding(target) = buffer;
+  }
+}
+
+void gl_state_impl::active_texture(GLuint u)
+{
+  if (active_texture_ != u) {
+    glActiveTexture(GL_TEXTURE0 + u);
+    active_texture_ = u;
+    ++frame_stats_.issued;
+  }
+}
+
+void gl_state_impl::bind_texture(GLuint u, GLenum target, GLuint texture)
+{
+  GLuint& current = texture_binding(u, target);
+  if (current == texture) {
+    ++frame_stats_.skipped;
+    return;
+  }
+  active_texture(u);
+  glBindTexture(target, texture);
+  current = texture;
+  ++frame_stats_.issued;
+}
+
+void gl_state_impl::bind_texture(GLenum target, GLuint texture)
+{
+  if (active_texture_ == unknown) {
+    active_texture(0);
+  }
+  bind_texture(active_texture_, target, texture);
+}
+
+void gl_state_impl::bind_sampler(GLuint u, GLuint sampler)
+{
+  if (update(unit(u).sampler, sampler)) {
+    glBindSampler(u, sampler);
+  }
+}
+
+void gl_state_impl::enable(GLenum cap, bool b)
+{
+  int state = b ? 1 : 0;
+  for (auto& [c, current] : capability_array_) {
+    if (c == cap) {
+      if (!update(current, state)) {
+        return;
+      }
+      b ? glEnable(cap) : glDisable(cap);
+      return;
+    }
+  }
+  capability_array_.emplace_back(cap, state);
+  ++frame_stats_.issued;
+  b ? glEnable(cap) : glDisable(cap);
+}
+
+void gl_state_impl::blend_equation_separate(GLenum rgb, GLenum alpha)
+{
+  if (update(blend_equation_, std::make_pair(rgb, alpha))) {
+    glBlendEquationSeparate(rgb, alpha);
+  }
+}
+
+void gl_state_impl::blend_func_separate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha)
+{
+  if (update(blend_func_, std::make_tuple(src_rgb, dst_rgb, src_alpha, dst_alpha))) {
+    glBlendFuncSeparate(src_rgb, dst_rgb, src_alpha, dst_alpha);
+  }
+}
+
+void gl_state_impl::depth_func(GLenum func)
+{
+  if (update(depth_func_, func)) {
+    glDepthFunc(func);
+  }
+}
+
+void gl_state_impl::delete_program(GLuint program)
+{
+  glDeleteProgram(program);
+  if (program_ == program) {
+    program_ = unknown;
+  }
+}
+
+void gl_state_impl::delete_vertex_array(GLuint vertex_array)
+{
+  glDeleteVertexArrays(1, &vertex_array);
+  if (vertex_array_ == vertex_array) {
+    vertex_array_ = unknown;
+    buffer_binding(GL_ELEMENT_ARRAY_BUFFER) = unknown;
+  }
+}
+
+void gl_state_impl::delete_buffer(GLuint buffer)
+{
+  glDeleteBuffers(1, &buffer);
+  for (auto& [target, current] : buffer_array_) {
+    if (current == buffer) {
+      current = unknown;
+    }
+  }
+  for (auto& [key, range] : indexed_buffer_map_) {
+    if (std::get<0>(range) == buffer) {
+      range = buffer_range_t(unknown, 0, 0);
+    }
+  }
+}
+
+void gl_state_impl::delete_texture(GLuint texture)
+{
+  glDeleteTextures(1, &texture);
+  for (auto& u : texture_unit_array_) {
+    for (auto& [target, current] : u.texture_array) {
+      if (current == texture) {
+        current = unknown;
+      }
+    }
+  }
+}
+
+void gl_state_impl::delete_sampler(GLuint sampler)
+{
+  glDeleteSamplers(1, &sampler);
+  for (auto& u : texture_unit_array_) {
+    if (u.sampler == sampler) {
+      u.sampler = unknown;
+    }
+  }
+}
+
+void gl_state_impl::begin_frame()
+{
+  last_frame_stats_ = frame_stats_;
+  frame_stats_ = stats();
+}
@@ -0,0 +1,95 @@
+﻿
+#pragma once
+
+#include "singleton.h"
+
+
+// GL の状態の写し.
+// 束縛やブレンドなどの設定はここを通して, 今と同じ設定なら GL を呼ばずに済ませる.
+// ここを通さずに状態を変えたら invalidate() すること.
+class gl_state_impl
+{
+public:
+  // 呼んだ数と省いた数.
+  struct stats
+  {
+    size_t issued;
+    size_t skipped;
+  };
+
+public:
+  gl_state_impl();
+
+  // 覚えている状態を全て分からないことにする.
+  void invalidate();
+
+  void use_program(GLuint);
+  // 頂点配列を変えるとインデックスバッファの束縛も変わる.
+  void bind_vertex_array(GLuint);
+  void bind_buffer(GLenum target, GLuint);
+  void bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+  // unit のテクスチャを束縛する. 必要な時だけ glActiveTexture も呼ぶ.
+  void bind_texture(GLuint unit, GLenum target, GLuint);
+  // 今のユニットに束縛する. 転送などユニットを気にしない時に.
+  void bind_texture(GLenum target, GLuint);
+  void bind_sampler(GLuint unit, GLuint);
+
+  void enable(GLenum cap, bool);
+  void blend_equation_separate(GLenum rgb, GLenum alpha);
+  void blend_func_separate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha);
+  void depth_func(GLenum);
+
+  // 消したものは GL が束縛を外すので, 写しからも外す.
+  void delete_program(GLuint);
+  void delete_vertex_array(GLuint);
+  void delete_buffer(GLuint);
+  void delete_texture(GLuint);
+  void delete_sampler(GLuint);
+
+  // フレームの始めに呼ぶ. 数え直す.
+  void begin_frame();
+  const stats& frame_stats() const { return frame_stats_; }
+  const stats& last_frame_stats() const { return last_frame_stats_; }
+
+private:
+  typedef std::tuple<GLuint, GLintptr, GLsizeiptr> buffer_range_t;
+  struct texture_unit
+  {
+    // 種類ごとに束縛できる.
+    std::vector<std::pair<GLenum, GLuint>> texture_array;
+    GLuint sampler;
+  };
+
+  // 変わっていれば新しい値を覚えて true.
+  template<class T>
+  bool update(T& current, const T& v)
+  {
+    if (current == v) {
+      ++frame_stats_.skipped;
+      return false;
+    }
+    current = v;
+    ++frame_stats_.issued;
+    return true;
+  }
+  GLuint& buffer_binding(GLenum target);
+  GLuint& texture_binding(GLuint unit, GLenum target);
+  texture_unit& unit(GLuint);
+  void active_texture(GLuint unit);
+
+private:
+  GLuint program_;
+  GLuint vertex_array_;
+  std::vector<std::pair<GLenum, GLuint>> buffer_array_;
+  std::map<std::pair<GLenum, GLuint>, buffer_range_t> indexed_buffer_map_;
+  GLuint active_texture_;
+  std::vector<texture_unit> texture_unit_array_;
+  std::vector<std::pair<GLenum, int>> capability_array_;
+  std::pair<GLenum, GLenum> blend_equation_;
+  std::tuple<GLenum, GLenum, GLenum, GLenum> blend_func_;
+  GLenum depth_func_;
+
+  stats frame_stats_;
+  stats last_frame_stats_;
+};
+typedef singleton<gl_state_impl> gl_state;
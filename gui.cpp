@@ -3,6 +3,7 @@
 
 #include "gui.h"
 #include "util.h"
+#include "gl_state.h"
 
 namespace gui
 {
@@ -56,24 +57,26 @@ void draw_context::draw(const vertex* vertex_array, int vertex_cnt,
                         const uint32_t *index_array, int index_cnt,
                         const color& c0, const color& c1)
 {
+  auto& gl = gl_state::instance();
   gui_shader->use();
 
-  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+  gl.bind_buffer(GL_ARRAY_BUFFER, vertex_buffer);
   glBufferData(GL_ARRAY_BUFFER, vertex_cnt * sizeof(vertex), vertex_array, GL_STATIC_DRAW);
 
+  // 属性は既定の頂点配列に設定する. インデックスはクライアント側の配列から.
+  gl.bind_vertex_array(0);
+  gl.bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
   for (const auto& decl: gui_vertex_decl) {
     gui_shader->set_attrib(decl);
   }
-  gui_shader->set_uniform("screen_size", screen_size);
-  gui_shader->set_uniform("color0", c0);
-  gui_shader->set_uniform("color1", c1);
-
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, gui_tex->texture_globj());
-  glBindSampler(0, gui_tex->sampler_globj());
-  gui_shader->set_uniform("gui_sampler", 0);
+  gui_shader->set_uniform(gui_shader_location.screen_size, screen_size);
+  gui_shader->set_uniform(gui_shader_location.color0, c0);
+  gui_shader->set_uniform(gui_shader_location.color1, c1);
 
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  gl.bind_texture(0, GL_TEXTURE_2D, gui_tex->texture_globj());
+  gl.bind_sampler(0, gui_tex->sampler_globj());
+  gui_shader->set_uniform(gui_shader_location.gui_sampler, 0);
 
   glDrawElements(GL_TRIANGLES,
                  index_cnt,
@@ -255,6 +258,11 @@ system::system(shader::ptr_t s, texture::ptr_t t, font::renderer::ptr_t f)
 {
   glGenBuffers(1, &vertex_buffer_);
 
+  shader_location_.screen_size = shader_->uniform_location("screen_size");
+  shader_location_.color0 = shader_->uniform_location("color0");
+  shader_location_.color1 = shader_->uniform_location("color1");
+  shader_location_.gui_sampler = shader_->uniform_location("gui_sampler");
+
   // デフォルトプロパティ.
   property_.font_color = color(0.f, 0.f, 0.f, 1.f);
   property_.font_size = 12;
@@ -268,7 +276,7 @@ system::system(shader::ptr_t s, texture::ptr_t t, font::renderer::ptr_t f)
 
 system::~system()
 {
-  glDeleteBuffers(1, &vertex_buffer_);
+  gl_state::instance().delete_buffer(vertex_buffer_);
 }
 
 void system::update()
@@ -278,12 +286,12 @@ void system::update()
 
 void system::draw()
 {
-  glDisable(GL_DEPTH_TEST);
+  gl_state::instance().enable(GL_DEPTH_TEST, false);
 
   font_renderer_->set_screen_size((int)screen_size_.x, (int)screen_size_.y);
 
   draw_context cxt = {
-    shader_, texture_, vertex_buffer_, font_renderer_, screen_size_, property_, focused_.lock() };
+    shader_, shader_location_, texture_, vertex_buffer_, font_renderer_, screen_size_, property_, focused_.lock() };
 
   component_set::draw(cxt);
 }
@@ -1082,6 +1090,100 @@ event_result radio_button::on_cursor_leave(const vec2&)
 
 
 
+slider::slider(const string& name, float *value, float min_value, float max_value)
+  : component(name), in_press_(false), in_over_(false),
+    notice_variable_(value), min_value_(min_value), max_value_(max_value)
+{
+}
+
+void slider::draw(draw_context& cxt) const
+{
+  const system_property& prop = cxt.property;
+  const color& border = (in_over_ || in_press_) ? prop.active_color : prop.frame_color0;
+  cxt.draw_rect(bar_pos_, bar_size_, border, in_over_ ? prop.semiactive_color : prop.frame_color1);
+  float rate = (max_value_ > min_value_) ? (*notice_variable_ - min_value_) / (max_value_ - min_value_) : 0.f;
+  rate = std::min(std::max(rate, 0.f), 1.f);
+  if (rate > 0.f) {
+    cxt.draw_rect(bar_pos_, vec2(bar_size_.x * rate, bar_size_.y), border, prop.active_color);
+  }
+  cxt.draw_font(name_pos_, prop.font_color, name());
+}
+
+vec2 slider::calc_layout(calc_layout_context& cxt)
+{
+  const system_property& prop = cxt.property;
+  bar_pos_ = local_pos();
+  bar_size_ = vec2((float)prop.font_size * 8.f, (float)prop.font_size);
+  rect name_area = cxt.font_renderer->get_area(prop.font_size, name());
+  name_pos_ = local_pos() + vec2(bar_size_.x + prop.mergin, (float)-name_area.y);
+  set_size(bar_pos_ + bar_size_ - local_pos());
+
+  return name_pos_ + vec2(prop.mergin + name_area.w, prop.mergin) - local_pos();
+}
+
+void slider::set_value_from(const vec2& p)
+{
+  float rate = (bar_size_.x > 0.f) ? (p.x - bar_pos_.x) / bar_size_.x : 0.f;
+  rate = std::min(std::max(rate, 0.f), 1.f);
+  *notice_variable_ = min_value_ + (max_value_ - min_value_) * rate;
+}
+
+event_result slider::on_mouse_button(const vec2& p, MouseButton button, MouseAction action, ModKey)
+{
+  if (button == MouseButton_Left) {
+    if (action == MouseAction_Press) {
+      if (is_in_area(p, bar_pos_, bar_size_)) {
+        in_press_ = true;
+        set_value_from(p);
+        return { true, false };
+      }
+    } else {
+      if (in_press_) {
+        in_press_ = false;
+        set_value_from(p);
+        return { true, false };
+      }
+    }
+  }
+  return { false, false };
+}
+
+event_result slider::on_cursor_move(const vec2& p)
+{
+  // つまんでいる間は棒の外へ出ても追いかける.
+  if (in_press_) {
+    set_value_from(p);
+    return { true, false };
+  }
+  return { false, false };
+}
+
+event_result slider::on_cursor_enter(const vec2& p)
+{
+  if (is_in_area(p, bar_pos_, bar_size_)) {
+    in_over_ = true;
+    return { true, false };
+  }
+
+  return { false, false };
+}
+
+event_result slider::on_cursor_leave(const vec2&)
+{
+  in_over_ = false;
+
+  return { true, false };
+}
+
+event_result slider::on_lost_focus()
+{
+  in_press_ = false;
+
+  return { true, false };
+}
+
+
+
 label::label(const string& name)
   : component(name), name_pos_(0.f)
 {
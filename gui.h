@@ -15,6 +15,15 @@ struct vertex
   vec2 pos, uv;
 };
 
+// gui シェーダの uniform の位置.
+struct shader_location
+{
+  GLint screen_size;
+  GLint color0;
+  GLint color1;
+  GLint gui_sampler;
+};
+
 
 struct system_property
 {
@@ -189,6 +198,7 @@ protected:
 
 private:
   shader::ptr_t shader_;
+  shader_location shader_location_;
   texture::ptr_t texture_;
   font::renderer::ptr_t font_renderer_;
   GLuint vertex_buffer_;
@@ -203,6 +213,7 @@ private:
 struct draw_context
 {
   const shader::ptr_t gui_shader;
+  const shader_location& gui_shader_location;
   const texture::ptr_t gui_tex;
   const GLuint vertex_buffer;
   const font::renderer::ptr_t font_renderer;
@@ -424,6 +435,41 @@ private:
 };
 
 
+// 棒をつまんで min_value から max_value の間の値を選ぶ.
+class slider : public component, public shared_ptr_creator<slider>
+{
+public:
+  typedef std::shared_ptr<slider> ptr_t;
+
+public:
+  slider(const string& name, float *value, float min_value = 0.f, float max_value = 1.f);
+
+  void draw(draw_context&) const override;
+  vec2 calc_layout(calc_layout_context&) override;
+
+  event_result on_mouse_button(const vec2&, MouseButton, MouseAction, ModKey) override;
+  event_result on_cursor_move(const vec2&) override;
+  event_result on_cursor_enter(const vec2&) override;
+  event_result on_cursor_leave(const vec2&) override;
+  event_result on_lost_focus() override;
+
+protected:
+  // カーソルの位置から値を決める.
+  void set_value_from(const vec2&);
+
+private:
+  vec2 name_pos_;
+  vec2 bar_pos_;
+  vec2 bar_size_;
+
+  bool in_press_;
+  bool in_over_;
+  float *notice_variable_;
+  float min_value_;
+  float max_value_;
+};
+
+
 class label : public component, public shared_ptr_creator<label>
 {
 public:
@@ -0,0 +1,111 @@
+﻿
+#include "stdafx.h"
+
+#include "job_system.h"
+
+
+job_system::job_system(int thread_count)
+  : stop_(false)
+{
+  if (thread_count <= 0) {
+    thread_count = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+  }
+  thread_array_.reserve(thread_count);
+  for (int i=0; i<thread_count; ++i) {
+    thread_array_.emplace_back([this]() { worker(); });
+  }
+}
+
+job_system::~job_system()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    // まだ始まっていないジョブは捨てる.
+    job_queue_.clear();
+  }
+  cond_.notify_all();
+  for (auto& th : thread_array_) {
+    th.join();
+  }
+}
+
+void job_system::push(job_t job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_queue_.push_back(std::move(job));
+  }
+  cond_.notify_one();
+}
+
+void job_system::worker()
+{
+  for (;;) {
+    job_t job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return stop_ || !job_queue_.empty(); });
+      if (stop_) {
+        return;
+      }
+      job = std::move(job_queue_.front());
+      job_queue_.pop_front();
+    }
+    job();
+  }
+}
+
+
+void parallel_for(job_system *jobs, size_t count, size_t grain,
+                  const std::function<void(size_t, size_t)>& fn)
+{
+  grain = std::max<size_t>(grain, 1);
+  const size_t chunk_count = (count + grain - 1) / grain;
+  if (!jobs || (chunk_count <= 1)) {
+    for (size_t begin=0; begin<count; begin+=grain) {
+      fn(begin, std::min(begin + grain, count));
+    }
+    return;
+  }
+
+  // 遅れて始まったワーカーが触っても良いよう, 状態は共有で持つ.
+  // fn は取った区間がある間しか呼ばないので, 全部終わるまで待てば参照のままで良い.
+  struct state
+  {
+    std::atomic<size_t> next;
+    size_t done;
+    std::mutex mutex;
+    std::condition_variable cond;
+  };
+  auto st = std::make_shared<state>();
+  st->next = 0;
+  st->done = 0;
+  const auto *f = &fn;
+  auto run = [st, f, count, grain, chunk_count]() {
+    size_t finished = 0;
+    for (;;) {
+      size_t chunk = st->next.fetch_add(1);
+      if (chunk >= chunk_count) {
+        break;
+      }
+      size_t begin = chunk * grain;
+      (*f)(begin, std::min(begin + grain, count));
+      ++finished;
+    }
+    if (finished) {
+      std::lock_guard<std::mutex> lock(st->mutex);
+      st->done += finished;
+      if (st->done == chunk_count) {
+        st->cond.notify_all();
+      }
+    }
+  };
+  int worker_count = (int)std::min<size_t>(jobs->thread_count(), chunk_count - 1);
+  for (int i=0; i<worker_count; ++i) {
+    jobs->push(run);
+  }
+  run();
+  std::unique_lock<std::mutex> lock(st->mutex);
+  st->cond.wait(lock, [&]() { return st->done == chunk_count; });
+}
@@ -0,0 +1,45 @@
+﻿
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+
+// ワーカースレッドでジョブを実行する.
+// GL はメインスレッドでしか使えないので, ジョブの中で GL を呼んではいけない.
+class job_system
+{
+public:
+  typedef std::shared_ptr<job_system> ptr_t;
+  typedef std::function<void()> job_t;
+
+public:
+  // thread_count が 0 ならハードウェアスレッド数 - 1 (最低 1).
+  job_system(int thread_count = 0);
+  ~job_system();
+
+  job_system(const job_system&) = delete;
+  job_system& operator=(const job_system&) = delete;
+
+  void push(job_t);
+
+  int thread_count() const { return (int)thread_array_.size(); }
+
+private:
+  void worker();
+
+private:
+  std::vector<std::thread> thread_array_;
+  std::deque<job_t> job_queue_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_;
+};
+
+// [0, count) を grain 個ずつに分け, jobs のワーカーと呼び出したスレッドとで fn(begin, end) を呼ぶ.
+// 全部終わるまで戻らない. jobs が 0 なら呼び出したスレッドだけで回す.
+void parallel_for(job_system *jobs, size_t count, size_t grain,
+                  const std::function<void(size_t, size_t)>& fn);
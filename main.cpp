@@ -6,11 +6,18 @@
 #include "figure.h"
 
 #include "pmx_loader.h"
+#include "motion.h"
+#include "animation.h"
+#include "render_queue.h"
+#include "gl_state.h"
+#include "profiler.h"
 #include "resource_repository.h"
+#include "utf.h"
 
 #include "font.h"
 #include "gui.h"
 #include "glfw_util.h"
+#include "bench.h"
 
 
 namespace
@@ -78,6 +85,10 @@ entity_world *world() {
 
 int main(int argc, char **argv)
 {
+  if ((argc > 1) && (std::string_view(argv[1]) == "-bench")) {
+    return run_bench(argc - 2, argv + 2);
+  }
+
   GLFWwindow* window;
 
   glfwSetErrorCallback(error_callback);
@@ -110,19 +121,19 @@ int main(int argc, char **argv)
   {
     // ダミーテクスチャを作る.
     auto blacktex = texture::make();
-    glBindTexture(GL_TEXTURE_2D, blacktex->texture_globj());
+    gl_state::instance().bind_texture(GL_TEXTURE_2D, blacktex->texture_globj());
     uint8_t black[] = { 0x00 };
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 1, 1, 0, GL_RED, GL_UNSIGNED_BYTE, black);
     rm->add("tex_black", blacktex);
     auto whitetex = texture::make();
-    glBindTexture(GL_TEXTURE_2D, whitetex->texture_globj());
+    gl_state::instance().bind_texture(GL_TEXTURE_2D, whitetex->texture_globj());
     uint8_t white[] = { 0xff };
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 1, 1, 0, GL_RED, GL_UNSIGNED_BYTE, white);
     rm->add("tex_white", whitetex);
   }
 
   auto pmx_shader = std::make_shared<shader>();
-  assert(pmx_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh"));
+  assert(pmx_shader->compile_from_source_file("assets/shader/pmx.vsh", "assets/shader/pmx.fsh", { "SKINNING" }));
   rm->add("pmx_shader", pmx_shader);
 
   std::string modelname;
@@ -135,10 +146,12 @@ int main(int argc, char **argv)
     }
     modelname = "assets/" + modelname;
   }
-  auto pmx_model = std::make_shared<model>();
-  load_pmx(pmx_model.get(),
-           modelname.c_str(),
-           rm.get());
+  world()->add("job_system", std::make_shared<job_system>());
+  auto jobs = world()->get<job_system::ptr_t>("job_system");
+  world()->add("upload_queue", std::make_shared<upload_queue>());
+  auto uploader = world()->get<upload_queue::ptr_t>("upload_queue");
+
+  auto pmx_model = load_pmx_async(modelname.c_str(), rm.get(), jobs.get(), uploader);
   rm->add("main_pmx", pmx_model);
 
   world()->add("main_scene", std::make_shared<scene>());
@@ -149,12 +162,39 @@ int main(int argc, char **argv)
            vec3(0.f, 1.f, 0.f),
            deg2rad(45.f), 1.f, 0.1f, 100.f);
 
-  scn->add_node(scene_node::make<model_node>(pmx_model, pmx_shader));
-
   world()->add("figure_manager", std::make_shared<figure::manager>());
   auto fm = world()->get<figure::manager::ptr_t>("figure_manager");
   fm->append_to(scn, figure::coordinator(matrix::identity() * 10.0f));
 
+  // 読み込みが終わるまでは, モデルの辺りに小さな座標軸を代わりに出しておく.
+  auto placeholder = scene_node::make<figure::node<figure::coordinator>>(
+    fm.get(), figure::coordinator(matrix(3.f, 0.f, 0.f, 0.f,
+                                         0.f, 3.f, 0.f, 10.f,
+                                         0.f, 0.f, 3.f, 0.f,
+                                         0.f, 0.f, 0.f, 1.f)));
+  auto model_root = std::make_shared<async_model_node>(pmx_model, pmx_shader, placeholder);
+  scn->add_node(model_root);
+
+  // 二つ目の引数はモーション (VMD). モデルを読み終わったら流す.
+  motion::ptr_t motion_data;
+  if (argc > 2) {
+    vmd_motion_data vmd;
+    if (load_vmd(&vmd, argv[2])) {
+      // 毎フレームのキーが並ぶモーションは大きいので, 許容誤差の中で詰めたまま再生する.
+      motion_compress_stats st;
+      motion_data = motion::make(vmd)->compress(motion_compress_option(), &st);
+      printf("%s: %zu -> %zu keys, %.1f -> %.1f KB (%.2fx), error %.5f / %.5f rad / %.5f\n",
+             argv[2], st.key_count, st.compressed_key_count, st.size / 1024.0, st.compressed_size / 1024.0,
+             st.ratio(), st.translate_error, st.rotate_error, st.morph_error);
+    } else {
+      std::cerr << "cannot load " << argv[2] << std::endl;
+    }
+  }
+  // 姿勢はワーカーで計算し, 描く間に次のフレームを進める.
+  auto anim_stage = animation_stage::make();
+  bool motion_attached = false;
+  double motion_time = 0.0;
+
   world()->add("camera_control", std::make_shared<camera_control>(scn->root_camera()));
   auto cc = world()->get<camera_control::ptr_t>("camera_control");
 
@@ -171,17 +211,14 @@ int main(int argc, char **argv)
   auto gui_system = gui::system::create(gui_shader, gui_tex, font_renderer);
   world()->add("gui", gui_system);
   bool visible_mouse_point = false;
-  int morph = 0;
+  bool visible_render_stats = false;
   int mode = 0;
   {
     auto win = gui_system->add_child<gui::window>(u"てすとウィンドウ");
     win->add_child<gui::check_box>(u"マウス座標", &visible_mouse_point);
+    win->add_child<gui::check_box>(u"描画統計", &visible_render_stats);
     win->add_child<gui::button>(u"ボタン", [=](){ std::cout << "click!" << std::endl; });
     auto grp = win->add_child<gui::group>(u"グループ");
-    auto cmb = grp->add_child<gui::combo_box>(u"コンボボックス", &morph);
-    cmb->add_item(u"一つ目のアイテム");
-    cmb->add_item(u"2nd item");
-    cmb->add_item(u"第三のもの");
     grp->add_child<gui::radio_button>(u"ラジオボタン０", &mode, 0)->set_layout_way(gui::LayoutWay_Horizon);
     grp->add_child<gui::radio_button>(u"ラジオボタン１", &mode, 1)->set_layout_way(gui::LayoutWay_Horizon);
     grp->add_child<gui::radio_button>(u"ラジオボタン２", &mode, 2);
@@ -192,18 +229,30 @@ int main(int argc, char **argv)
     win->add_child<gui::check_box>(u"mouse position", &visible_mouse_point);
     win->add_child<gui::button>(u"button", [=](){ std::cout << "click!" << std::endl; });
     auto grp = win->add_child<gui::group>(u"group");
-    auto cmb = grp->add_child<gui::combo_box>(u"combo_box", &morph);
-    cmb->add_item(u"1st item");
-    cmb->add_item(u"２つめのアイテム");
-    cmb->add_item(u"3rd item");
     grp->add_child<gui::radio_button>(u"radio_button0", &mode, 0)->set_layout_way(gui::LayoutWay_Horizon);
     grp->add_child<gui::radio_button>(u"radio_button1", &mode, 1)->set_layout_way(gui::LayoutWay_Horizon);
     grp->add_child<gui::radio_button>(u"radio_button2", &mode, 2);
     win->add_child<gui::label>(u"label");
   }
+  // モデルのモーフを選んで重みを変える. 名前は読み込みが終わってから入れる.
+  int morph_index = 0;
+  float morph_weight = 0.f;
+  int shown_morph_index = -1;
+  bool morph_listed = false;
+  morph_set::ptr_t morph_target;
+  gui::combo_box::ptr_t morph_combo;
+  {
+    auto win = gui_system->add_child<gui::window>(u"モーフ");
+    morph_combo = win->add_child<gui::combo_box>(u"名前", &morph_index);
+    // 空だと描けないので, 名前を入れるまでの代わり.
+    morph_combo->add_item(u"(読み込み中)");
+    win->add_child<gui::slider>(u"重み", &morph_weight);
+  }
   gui_system->calc_layout();
   
   while (!glfwWindowShouldClose(window)) {
+    gl_state::instance().begin_frame();
+    profiler::instance().begin_frame();
 
     int width, height;
     glfwGetFramebufferSize(window, &width, &height);
@@ -215,6 +264,38 @@ int main(int argc, char **argv)
 
     glfwPollEvents();
 
+    // 非同期読み込みの GL オブジェクト作成. 一フレームで使う時間を抑える.
+    uploader->drain(std::chrono::milliseconds(4));
+
+    if (!morph_listed) {
+      if (auto node = model_root->get_model_node()) {
+        morph_listed = true;
+        morph_combo->clear_item();
+        auto mrp = node->get_model()->get_morph();
+        if (mrp && (mrp->morph_count() > 0)) {
+          morph_target = mrp;
+          std::u16string name;
+          for (size_t i=0; i<mrp->morph_count(); ++i) {
+            utf16_from_utf8(&name, mrp->name(i).data(), mrp->name(i).size());
+            morph_combo->add_item(name);
+          }
+        } else {
+          morph_combo->add_item(u"(なし)");
+        }
+        morph_index = 0;
+        gui_system->calc_layout();
+      }
+    }
+    if (morph_target) {
+      // 選び直したらスライダーをそのモーフの重みに合わせ, それ以外はスライダーの値を入れる.
+      if (morph_index != shown_morph_index) {
+        morph_weight = morph_target->weight((size_t)morph_index);
+        shown_morph_index = morph_index;
+      } else {
+        morph_target->set_weight((size_t)morph_index, morph_weight);
+      }
+    }
+
     float aspect = width / (float)height;
 
     glViewport(0, 0, width, height);
@@ -222,17 +303,48 @@ int main(int argc, char **argv)
     glClearDepth(1.0f);
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
-    glEnablei(GL_BLEND, 0);
-    glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
-    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
+    auto& gl = gl_state::instance();
+    gl.enable(GL_BLEND, true);
+    gl.blend_equation_separate(GL_FUNC_ADD, GL_FUNC_ADD);
+    gl.blend_func_separate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
 
     scn->root_camera().set_aspect(aspect);
     cc->apply_to(&scn->root_camera());
 
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
+    gl.enable(GL_DEPTH_TEST, true);
+    gl.depth_func(GL_LESS);
+
+    // VMD は 30fps のフレームで数える. 最後まで行ったら頭へ戻る.
+    if (motion_data && !motion_attached) {
+      auto node = model_root->get_model_node();
+      if (node && node->pose()) {
+        auto sampler = motion_sampler::make(motion_data, node->pose()->get_skeleton(), node->get_model()->get_morph());
+        // 物理後のボーンの鎖は揺れ物として揺らす.
+        auto spring = spring_bone_set::make(node->pose()->get_skeleton());
+        spring->add_body_colliders();
+        if (spring->chain_count() == 0) {
+          spring.reset();
+        }
+        node->set_palette_buffer(anim_stage->add(node->pose(), sampler, 0.f, spring));
+        motion_attached = true;
+        motion_time = glfwGetTime();
+      }
+    }
+    if (motion_attached) {
+      double now = glfwGetTime();
+      anim_stage->start(jobs.get(), (float)((now - motion_time) * 30.0));
+      motion_time = now;
+    }
 
-    scn->draw();
+    {
+      profile_scope scope("draw");
+      scn->draw();
+    }
+
+    // 描いたのは前のフレームの姿勢. 次に描く分をここで入れ替える.
+    if (motion_attached) {
+      anim_stage->finish();
+    }
 
     gui_system->draw();
 
@@ -243,6 +355,42 @@ int main(int argc, char **argv)
       ss << x << ", " << y;
       font_renderer->render({(float)x, (float)y}, {16, 16}, {0.f, 0.f, 0.f, 1.f}, ss.str());
     }
+    if (visible_render_stats) {
+      // 待ち行列で省けた GL の状態設定の数. 設定した数 / 素直に設定した場合の数.
+      const auto& st = scn->queue()->last_stats();
+      std::pair<const char16_t*, const render_queue::state_count*> count_array[] = {
+        { u"program", &st.program },
+        { u"vao", &st.vertex_array },
+        { u"material", &st.material },
+        { u"texture", &st.texture },
+        { u"matrix", &st.matrix },
+      };
+      // 前のフレームで profiler に足された時間.
+      auto profile = profiler::instance().last_frame();
+      float y = (float)height - 16.f * (countof(count_array) + profile.size() + 2);
+      for (const auto& e : profile) {
+        std::basic_stringstream<char16_t> line;
+        line << std::u16string(e.name, e.name + std::strlen(e.name)) << u" "
+             << std::chrono::duration<float, std::milli>(e.total).count() << u" ms (" << e.count << u")";
+        font_renderer->render({8.f, y}, {16, 16}, {0.f, 0.f, 0.f, 1.f}, line.str());
+        y += 16.f;
+      }
+      // 前のフレームで gl_state が呼んだ数と省いた数.
+      const auto& gl_stats = gl_state::instance().last_frame_stats();
+      std::basic_stringstream<char16_t> ss;
+      ss << u"gl " << gl_stats.issued << u" issued, " << gl_stats.skipped << u" skipped";
+      font_renderer->render({8.f, y}, {16, 16}, {0.f, 0.f, 0.f, 1.f}, ss.str());
+      y += 16.f;
+      ss.str(u"");
+      ss << u"items " << st.item_count;
+      font_renderer->render({8.f, y}, {16, 16}, {0.f, 0.f, 0.f, 1.f}, ss.str());
+      for (const auto& [name, count] : count_array) {
+        y += 16.f;
+        std::basic_stringstream<char16_t> line;
+        line << name << u" " << count->issued << u" / " << count->requested;
+        font_renderer->render({8.f, y}, {16, 16}, {0.f, 0.f, 0.f, 1.f}, line.str());
+      }
+    }
 
 
     glfwSwapBuffers(window);
@@ -0,0 +1,126 @@
+﻿
+#include "stdafx.h"
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+#ifdef _WIN32
+
+mapped_file::mapped_file()
+  : data_(0), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(0)
+{
+}
+
+bool mapped_file::open(const char *filename)
+{
+  close();
+
+  file_ = ::CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0,
+                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file_, &size) || (size.QuadPart == 0)) {
+    close();
+    return false;
+  }
+  mapping_ = ::CreateFileMappingA(file_, 0, PAGE_READONLY, 0, 0, 0);
+  if (!mapping_) {
+    close();
+    return false;
+  }
+  data_ = (const uint8_t*)::MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+  if (!data_) {
+    close();
+    return false;
+  }
+  size_ = (size_t)size.QuadPart;
+
+  return true;
+}
+
+void mapped_file::close()
+{
+  if (data_) {
+    ::UnmapViewOfFile(data_);
+  }
+  if (mapping_) {
+    ::CloseHandle(mapping_);
+  }
+  if (file_ != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(file_);
+  }
+  data_ = 0;
+  size_ = 0;
+  file_ = INVALID_HANDLE_VALUE;
+  mapping_ = 0;
+}
+
+#else
+
+mapped_file::mapped_file()
+  : data_(0), size_(0), fd_(-1)
+{
+}
+
+bool mapped_file::open(const char *filename)
+{
+  close();
+
+  fd_ = ::open(filename, O_RDONLY);
+  if (fd_ < 0) {
+    return false;
+  }
+  struct stat st;
+  if ((::fstat(fd_, &st) != 0) || (st.st_size == 0)) {
+    close();
+    return false;
+  }
+  void *p = ::mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (p == MAP_FAILED) {
+    close();
+    return false;
+  }
+  // 先頭から順に読むだけなので先読みさせる.
+  ::madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+  data_ = (const uint8_t*)p;
+  size_ = (size_t)st.st_size;
+
+  return true;
+}
+
+void mapped_file::close()
+{
+  if (data_) {
+    ::munmap((void*)data_, size_);
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  data_ = 0;
+  size_ = 0;
+  fd_ = -1;
+}
+
+#endif
+
+mapped_file::mapped_file(const char *filename)
+  : mapped_file()
+{
+  open(filename);
+}
+
+mapped_file::~mapped_file()
+{
+  close();
+}
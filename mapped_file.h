@@ -0,0 +1,32 @@
+﻿
+#pragma once
+
+
+// 読み込み専用のメモリマップドファイル.
+class mapped_file
+{
+public:
+  mapped_file();
+  mapped_file(const char *filename);
+  ~mapped_file();
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  bool open(const char *filename);
+  void close();
+
+  bool is_open() const { return data_ != 0; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t *data_;
+  size_t size_;
+#ifdef _WIN32
+  void *file_;
+  void *mapping_;
+#else
+  int fd_;
+#endif
+};
@@ -0,0 +1,222 @@
+﻿
+#include "stdafx.h"
+
+#include "mesh_optimizer.h"
+
+
+namespace {
+
+// Forsyth の方法のパラメータ.
+const int forsyth_cache_size = 32;
+const float forsyth_cache_decay_power = 1.5f;
+const float forsyth_last_tri_score = 0.75f;
+const float forsyth_valence_boost_scale = 2.f;
+const float forsyth_valence_boost_power = 0.5f;
+
+float forsyth_vertex_score(int cache_pos, uint32_t remain)
+{
+  if (remain == 0) {
+    // もう使わない頂点.
+    return -1.f;
+  }
+  float score = 0.f;
+  if (cache_pos >= 0) {
+    if (cache_pos < 3) {
+      // 直前の三角形の頂点は少し下げる. 同じ帯ばかり続けないように.
+      score = forsyth_last_tri_score;
+    } else {
+      float scale = 1.f / (forsyth_cache_size - 3);
+      score = std::pow(1.f - (cache_pos - 3) * scale, forsyth_cache_decay_power);
+    }
+  }
+  // 残りが少ない頂点を先に片付ける.
+  score += forsyth_valence_boost_scale * std::pow((float)remain, -forsyth_valence_boost_power);
+  return score;
+}
+
+} // end of anonymus namespace
+
+
+vertex_cache_stats analyze_vertex_cache(const uint32_t *index_array, size_t index_count,
+                                        size_t vertex_count, int cache_size)
+{
+  // FIFO は入った時刻だけ覚えておけば良い.
+  std::vector<size_t> cache_time(vertex_count, 0);
+  std::vector<bool> used(vertex_count, false);
+  size_t time = (size_t)cache_size + 1;
+  size_t miss = 0;
+  size_t used_count = 0;
+  for (size_t i=0; i<index_count; ++i) {
+    uint32_t v = index_array[i];
+    if (v >= vertex_count) {
+      continue;
+    }
+    if (!used[v]) {
+      used[v] = true;
+      ++used_count;
+    }
+    if (time - cache_time[v] > (size_t)cache_size) {
+      cache_time[v] = time++;
+      ++miss;
+    }
+  }
+  vertex_cache_stats stats;
+  stats.acmr = (index_count >= 3) ? miss / (float)(index_count / 3) : 0.f;
+  stats.atvr = used_count ? miss / (float)used_count : 0.f;
+  return stats;
+}
+
+
+bool optimize_vertex_cache(uint32_t *index_array, size_t index_count, size_t vertex_count)
+{
+  const size_t tri_count = index_count / 3;
+  const size_t npos = (size_t)-1;
+
+  // 頂点ごとに, まだ出していない三角形の一覧.
+  std::vector<uint32_t> remain(vertex_count, 0);
+  for (size_t i=0; i<tri_count*3; ++i) {
+    if (index_array[i] >= vertex_count) {
+      return false;
+    }
+    ++remain[index_array[i]];
+  }
+  std::vector<uint32_t> offset(vertex_count + 1, 0);
+  for (size_t v=0; v<vertex_count; ++v) {
+    offset[v + 1] = offset[v] + remain[v];
+  }
+  std::vector<uint32_t> tri_list(tri_count * 3);
+  {
+    std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+    for (size_t i=0; i<tri_count*3; ++i) {
+      tri_list[fill[index_array[i]]++] = (uint32_t)(i / 3);
+    }
+  }
+
+  std::vector<int> cache_pos(vertex_count, -1);
+  std::vector<float> vertex_score(vertex_count);
+  for (size_t v=0; v<vertex_count; ++v) {
+    vertex_score[v] = forsyth_vertex_score(-1, remain[v]);
+  }
+  std::vector<float> tri_score(tri_count);
+  std::vector<bool> added(tri_count, false);
+  size_t best = npos;
+  float best_score = -1.f;
+  for (size_t t=0; t<tri_count; ++t) {
+    const uint32_t *tri = &index_array[t * 3];
+    tri_score[t] = vertex_score[tri[0]] + vertex_score[tri[1]] + vertex_score[tri[2]];
+    if (tri_score[t] > best_score) {
+      best_score = tri_score[t];
+      best = t;
+    }
+  }
+
+  auto update_vertex_score = [&](uint32_t v) {
+    float score = forsyth_vertex_score(cache_pos[v], remain[v]);
+    float delta = score - vertex_score[v];
+    vertex_score[v] = score;
+    for (uint32_t i=offset[v]; i<offset[v]+remain[v]; ++i) {
+      tri_score[tri_list[i]] += delta;
+    }
+  };
+
+  std::vector<uint32_t> out;
+  out.reserve(tri_count * 3);
+  uint32_t cache[forsyth_cache_size + 3];
+  int cache_count = 0;
+  size_t scan = 0;
+  for (size_t n=0; n<tri_count; ++n) {
+    if (best == npos) {
+      // キャッシュ内に候補が無い時は, 先頭から残っているものを拾う.
+      while (added[scan]) {
+        ++scan;
+      }
+      best = scan;
+    }
+    added[best] = true;
+    const uint32_t tri[3] = { index_array[best * 3], index_array[best * 3 + 1], index_array[best * 3 + 2] };
+    out.insert(out.end(), tri, tri + 3);
+
+    // 出した三角形を頂点の一覧から外す.
+    for (auto v : tri) {
+      uint32_t *list = &tri_list[offset[v]];
+      for (uint32_t i=0; i<remain[v]; ++i) {
+        if (list[i] == best) {
+          std::swap(list[i], list[remain[v] - 1]);
+          --remain[v];
+          break;
+        }
+      }
+    }
+
+    // キャッシュの先頭へ入れる (LRU).
+    uint32_t new_cache[forsyth_cache_size + 3];
+    int new_count = 0;
+    for (auto v : tri) {
+      if (std::find(new_cache, new_cache + new_count, v) == new_cache + new_count) {
+        new_cache[new_count++] = v;
+      }
+    }
+    for (int i=0; i<cache_count; ++i) {
+      uint32_t v = cache[i];
+      if ((v != tri[0]) && (v != tri[1]) && (v != tri[2])) {
+        new_cache[new_count++] = v;
+      }
+    }
+    for (int i=forsyth_cache_size; i<new_count; ++i) {
+      cache_pos[new_cache[i]] = -1;
+      update_vertex_score(new_cache[i]);
+    }
+    cache_count = std::min(new_count, forsyth_cache_size);
+    std::copy(new_cache, new_cache + cache_count, cache);
+    for (int i=0; i<cache_count; ++i) {
+      cache_pos[cache[i]] = i;
+      update_vertex_score(cache[i]);
+    }
+
+    // 次はキャッシュ内の頂点を使う三角形から選ぶ.
+    best = npos;
+    best_score = -1.f;
+    for (int i=0; i<cache_count; ++i) {
+      uint32_t v = cache[i];
+      for (uint32_t j=offset[v]; j<offset[v]+remain[v]; ++j) {
+        uint32_t t = tri_list[j];
+        if (tri_score[t] > best_score) {
+          best_score = tri_score[t];
+          best = t;
+        }
+      }
+    }
+  }
+
+  std::copy(out.begin(), out.end(), index_array);
+  return true;
+}
+
+
+void make_vertex_fetch_remap(std::vector<uint32_t> *remap,
+                             const uint32_t *index_array, size_t index_count, size_t vertex_count)
+{
+  const uint32_t unused = (uint32_t)-1;
+  remap->assign(vertex_count, unused);
+  uint32_t next = 0;
+  for (size_t i=0; i<index_count; ++i) {
+    uint32_t v = index_array[i];
+    if ((v < vertex_count) && ((*remap)[v] == unused)) {
+      (*remap)[v] = next++;
+    }
+  }
+  for (auto& r : *remap) {
+    if (r == unused) {
+      r = next++;
+    }
+  }
+}
+
+void remap_index_array(uint32_t *index_array, size_t index_count, const std::vector<uint32_t>& remap)
+{
+  for (size_t i=0; i<index_count; ++i) {
+    if (index_array[i] < remap.size()) {
+      index_array[i] = remap[index_array[i]];
+    }
+  }
+}
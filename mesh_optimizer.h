@@ -0,0 +1,35 @@
+﻿
+#pragma once
+
+
+// 頂点キャッシュの効き具合.
+struct vertex_cache_stats
+{
+  float acmr;  // 三角形あたりのキャッシュミス数 (0.5 - 3).
+  float atvr;  // 参照された頂点あたりのキャッシュミス数 (1 が最良).
+};
+
+// cache_size 個の FIFO キャッシュで描いた時の値を数える.
+vertex_cache_stats analyze_vertex_cache(const uint32_t *index_array, size_t index_count,
+                                        size_t vertex_count, int cache_size = 16);
+
+// 頂点キャッシュに載りやすい順に三角形を並べ替える (Tom Forsyth の方法).
+// 頂点数を超えるインデックスがあれば何もせず false.
+bool optimize_vertex_cache(uint32_t *index_array, size_t index_count, size_t vertex_count);
+
+// 頂点を初めて使われる順に並べ替える表を作る. remap[旧番号] = 新番号.
+// 使われない頂点は元の順のまま後ろへ置く.
+void make_vertex_fetch_remap(std::vector<uint32_t> *remap,
+                             const uint32_t *index_array, size_t index_count, size_t vertex_count);
+
+void remap_index_array(uint32_t *index_array, size_t index_count, const std::vector<uint32_t>& remap);
+
+template<class VertexT>
+void remap_vertex_array(std::vector<VertexT> *vertex_array, const std::vector<uint32_t>& remap)
+{
+  std::vector<VertexT> r(vertex_array->size());
+  for (size_t i=0; i<remap.size(); ++i) {
+    r[remap[i]] = (*vertex_array)[i];
+  }
+  vertex_array->swap(r);
+}
@@ -4,6 +4,11 @@
 #include "shader.h"
 #include "texture.h"
 #include "scene.h"
+#include "bone_palette.h"
+#include "skeleton.h"
+
+class morph_set;
+class vertex_animation;
 
 
 // 頂点ストリーム.
@@ -25,8 +30,13 @@ public:
 
   GLuint globj_vertex_buffer() { return vertex_buffer_; }
 
+  // vertex_array() の [offset, offset + size) バイトをバッファへ転送する.
+  void upload_range(size_t offset, size_t size);
+
 protected:
   void setup_buffer();
+  // 領域だけ確保する. 中身は upload_range() で転送する.
+  void allocate_buffer();
 
 private:
   vertex_decl_array_t vertex_decl_array_;
@@ -34,7 +44,11 @@ private:
 
 public:
   template<class VertexArrayT>
-  static auto make(const vertex_decl_array_t&, const VertexArrayT&);
+  static auto make(const vertex_decl_array_t&, VertexArrayT&&);
+  template<class VertexT>
+  static auto make_view(const vertex_decl_array_t& vertex_decl_array,
+                        const VertexT *vertex_array, size_t vertex_count,
+                        std::shared_ptr<const void> holder, bool upload = true);
 };
 
 template<class VertexT>
@@ -51,6 +65,12 @@ public:
   {
     base_t::setup_buffer();
   }
+  // 頂点配列を引き取る. コピーはしない.
+  vertex_stream(const vertex_decl_array_t& vertex_decl_arary, vertex_array_t&& vertex_array)
+    : vertex_stream_base(vertex_decl_arary), vertex_array_(std::move(vertex_array))
+  {
+    base_t::setup_buffer();
+  }
 
   virtual void *vertex_array() { return vertex_array_.empty() ? 0 : &vertex_array_[0]; }
   virtual size_t vertex_count() { return vertex_array_.size(); }
@@ -60,16 +80,104 @@ private:
   vertex_array_t vertex_array_;
 };
 
+// 外部のメモリを参照する頂点ストリーム.
+// holder は参照先のメモリの持ち主で, ストリームと同じだけ生かしておく.
+template<class VertexT>
+class vertex_stream_view : public vertex_stream_base
+{
+public:
+  typedef vertex_stream_base base_t;
+  typedef VertexT vertex_t;
+
+public:
+  // upload が false なら領域だけ確保する. 大きい時に何回かに分けて転送するため.
+  vertex_stream_view(const vertex_decl_array_t& vertex_decl_arary,
+                     const vertex_t *vertex_array, size_t vertex_count,
+                     std::shared_ptr<const void> holder, bool upload = true)
+    : vertex_stream_base(vertex_decl_arary),
+      vertex_array_(vertex_array), vertex_count_(vertex_count), holder_(holder)
+  {
+    if (upload) {
+      base_t::setup_buffer();
+    } else {
+      base_t::allocate_buffer();
+    }
+  }
+
+  virtual void *vertex_array() { return (void*)vertex_array_; }
+  virtual size_t vertex_count() { return vertex_count_; }
+  virtual size_t vertex_buffer_size() { return vertex_count_ * sizeof(vertex_t); }
+
+private:
+  const vertex_t *vertex_array_;
+  size_t vertex_count_;
+  std::shared_ptr<const void> holder_;
+};
+
 template<class VertexArrayT>
-static inline auto vertex_stream_base::make(
-  const vertex_decl_array_t& vertex_decl_array, const VertexArrayT& vertex_array)
+inline auto vertex_stream_base::make(
+  const vertex_decl_array_t& vertex_decl_array, VertexArrayT&& vertex_array)
 {
-  typedef VertexArrayT::value_type vertex_t;
-  return std::make_shared<vertex_stream<vertex_t>>(vertex_decl_array, vertex_array);
+  typedef typename std::decay_t<VertexArrayT>::value_type vertex_t;
+  return std::make_shared<vertex_stream<vertex_t>>(
+    vertex_decl_array, std::forward<VertexArrayT>(vertex_array));
+}
+
+template<class VertexT>
+inline auto vertex_stream_base::make_view(
+  const vertex_decl_array_t& vertex_decl_array,
+  const VertexT *vertex_array, size_t vertex_count,
+  std::shared_ptr<const void> holder, bool upload)
+{
+  return std::make_shared<vertex_stream_view<VertexT>>(
+    vertex_decl_array, vertex_array, vertex_count, holder, upload);
 }
 
 
 // ジオメトリ.
+// インデックス一つのバイト数.
+size_t index_type_size(GLenum index_type);
+// vertex_count 個の頂点を指すのに足りるインデックスの型.
+// GL_UNSIGNED_BYTE は遅い環境が多いので, 16bit より狭くはしない.
+GLenum index_type_for(size_t vertex_count);
+// 幅の違うインデックス配列へ写す. 収まらない値は切り詰められる.
+void convert_index_array(void *dst, GLenum dst_type, const void *src, GLenum src_type, size_t count);
+
+
+// インデックスバッファ.
+// 転送したら CPU 側には持たない. 複数の geometry で区間を分けて使える.
+class index_stream
+{
+public:
+  typedef std::shared_ptr<index_stream> ptr_t;
+
+public:
+  // index_type は GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, GL_UNSIGNED_INT のどれか.
+  index_stream(GLenum index_type, const void *index_array, size_t index_count);
+  ~index_stream();
+
+  index_stream(const index_stream&) = delete;
+  index_stream& operator=(const index_stream&) = delete;
+
+  GLenum index_type() const { return index_type_; }
+  size_t index_count() const { return index_count_; }
+  size_t index_buffer_size() const { return index_count_ * index_type_size(index_type_); }
+
+  GLuint globj_index_buffer() { return index_buffer_; }
+
+private:
+  GLenum index_type_;
+  size_t index_count_;
+  GLuint index_buffer_;
+
+public:
+  static auto make(GLenum index_type, const void *index_array, size_t index_count)
+  {
+    return std::make_shared<index_stream>(index_type, index_array, index_count);
+  }
+};
+
+
 class geometry
 {
 public:
@@ -77,28 +185,82 @@ public:
   typedef std::shared_ptr<geometry> ptr_t;
 
 public:
+  // 自分だけのインデックスバッファを作る. 最大のインデックスが収まる幅に狭めて持つ.
   geometry(vertex_stream_base::ptr_t, const index_array_t&);
+  geometry(vertex_stream_base::ptr_t, GLenum index_type, const void *index_array, size_t index_count);
+  // 共有のインデックスバッファの [index_offset, index_offset + index_count) を使う.
+  geometry(vertex_stream_base::ptr_t, index_stream::ptr_t, size_t index_offset, size_t index_count);
   ~geometry();
 
-  void *index_array() { return &index_array_[0]; }
-  size_t index_count() { return index_array_.size(); }
-  size_t index_buffer_size() { return index_count() * 4; }
+  size_t index_offset() { return index_offset_; }
+  size_t index_count() { return index_count_; }
+  GLenum index_type() { return indices_->index_type(); }
+  // glDrawElements に渡すバッファ先頭からのバイト数.
+  size_t index_byte_offset() { return index_offset_ * index_type_size(index_type()); }
 
   vertex_stream_base::ptr_t vertex_stream() { return vertex_stream_; }
+  index_stream::ptr_t indices() { return indices_; }
 
-  GLuint globj_index_buffer() { return index_buffer_; }
+  GLuint globj_index_buffer() { return indices_->globj_index_buffer(); }
 
 private:
   vertex_stream_base::ptr_t vertex_stream_;
-  index_array_t index_array_;
-  GLuint index_buffer_;
+  index_stream::ptr_t indices_;
+  size_t index_offset_;
+  size_t index_count_;
 
 public:
   static auto make(vertex_stream_base::ptr_t vertex_stream, const index_array_t& index_array)
   {
     return std::make_shared<geometry>(vertex_stream, index_array);
   }
+  static auto make(vertex_stream_base::ptr_t vertex_stream,
+                   GLenum index_type, const void *index_array, size_t index_count)
+  {
+    return std::make_shared<geometry>(vertex_stream, index_type, index_array, index_count);
+  }
+  static auto make(vertex_stream_base::ptr_t vertex_stream,
+                   index_stream::ptr_t indices, size_t index_offset, size_t index_count)
+  {
+    return std::make_shared<geometry>(vertex_stream, indices, index_offset, index_count);
+  }
+
+};
 
+
+// 頂点配列オブジェクト.
+// 頂点属性の設定とインデックスバッファの束縛をまとめて覚えておく.
+// 属性の位置はシェーダで変わるので, シェーダごとに作る.
+// instance_buffer を渡すと, シェーダの vInstanceWorld にインスタンスごとの行列を流す.
+class vertex_array
+{
+public:
+  typedef std::shared_ptr<vertex_array> ptr_t;
+
+public:
+  // instance_buffer はインスタンスごとに instance_stride バイト (0 なら matrix 一つ) ずつ並べたもの.
+  // 頭のワールド行列を vInstanceWorld へ, 後ろに float があれば vInstanceTime へ流す.
+  vertex_array(vertex_stream_base::ptr_t, index_stream::ptr_t, shader*,
+               GLuint instance_buffer = 0, GLsizei instance_stride = 0);
+  ~vertex_array();
+
+  vertex_array(const vertex_array&) = delete;
+  vertex_array& operator=(const vertex_array&) = delete;
+
+  GLuint globj() { return vertex_array_; }
+
+private:
+  // 使っている間は消えないよう持っておく.
+  vertex_stream_base::ptr_t vertex_stream_;
+  index_stream::ptr_t indices_;
+  GLuint vertex_array_;
+
+public:
+  static auto make(vertex_stream_base::ptr_t vertex_stream, index_stream::ptr_t indices, shader *shdr,
+                   GLuint instance_buffer = 0, GLsizei instance_stride = 0)
+  {
+    return std::make_shared<vertex_array>(vertex_stream, indices, shdr, instance_buffer, instance_stride);
+  }
 };
 
 
@@ -123,10 +285,10 @@ public:
 
   public:
 #define DECL_PARAMETER_T_CTOR_TYPE(type, dim, Type) \
-    parameter_t(const type& v) : parameter_t(Type, 1, dim, sizeof(type), &v) {} \
-    parameter_t(size_t num, const type *v) : parameter_t(Type, num, dim, sizeof(type), v) {} \
+    parameter_t(const type& v) : parameter_t(Type, 1, dim, sizeof(type) / dim, &v) {} \
+    parameter_t(size_t num, const type *v) : parameter_t(Type, num, dim, sizeof(type) / dim, v) {} \
     parameter_t(std::initializer_list<type> init) \
-      : parameter_t(Type, init.size(), dim, sizeof(type), init.begin()) {}
+      : parameter_t(Type, init.size(), dim, sizeof(type) / dim, init.begin()) {}
 
 #define DECL_PARAMETER_T_CTOR(type, vectype, Type) \
     DECL_PARAMETER_T_CTOR_TYPE(type, 1, Type) \
@@ -138,7 +300,7 @@ public:
     parameter_t(type v0, type v1, type v2, type v3) : parameter_t(1, {v0, v1, v2, v3}) {} \
     parameter_t(size_t num, int dim, const type *v) : parameter_t(Type, num, dim, sizeof(type), v) {} \
     parameter_t(int dim, std::initializer_list<type> init) \
-      : parameter_t(Type, init.size(), dim, sizeof(type), init.begin()) {}
+      : parameter_t(Type, init.size() / dim, dim, sizeof(type), init.begin()) {}
 
     DECL_PARAMETER_T_CTOR(float, vec, Type_Float)
     DECL_PARAMETER_T_CTOR(int, ivec, Type_Int)
@@ -164,6 +326,8 @@ public:
     }
 
     void set_to(const char *name, shader*) const;
+    // std140 などのブロックの中へ書く. block_size を越える分は書かない.
+    void write_to(uint8_t *block, size_t block_size, const shader_program::uniform_block_member&) const;
 
   private:
     Type type_;
@@ -188,19 +352,25 @@ public:
     } else {
       parameter_map_.try_emplace(name, args...);
     }
+    ++revision_;
   }
 
   void set_texture(const char *name, texture::ptr_t tex)
   {
     texture_map_[name] = tex;
+    ++revision_;
   }
 
   const parameter_map_t& parameter_map() const { return parameter_map_; }
   const texture_map_t& texture_map() const { return texture_map_; }
 
+  // パラメータやテクスチャを変える度に増える.
+  uint32_t revision() const { return revision_; }
+
 private:
   parameter_map_t parameter_map_;
   texture_map_t texture_map_;
+  uint32_t revision_;
 
   
 public:
@@ -210,11 +380,71 @@ public:
 };
 
 
+// マテリアルのパラメータを並べた uniform バッファ.
+// シェーダの uniform ブロックの配置に合わせて, マテリアル一つにつき一区画を書いておく.
+// パラメータが変わったマテリアルは update() でまとめて一回で転送する.
+class material_buffer
+{
+public:
+  typedef std::shared_ptr<material_buffer> ptr_t;
+  typedef std::vector<material::ptr_t> material_array_t;
+  // ブロックに無いパラメータは今まで通り名前で設定する.
+  typedef std::vector<std::pair<const std::string*, const material::parameter_t*>> loose_parameter_array_t;
+  // テクスチャはサンプラの位置の順に並べて, その順番をユニットにする.
+  struct texture_binding
+  {
+    GLint location;
+    GLuint texture;
+    GLuint sampler;
+  };
+  typedef std::vector<texture_binding> texture_binding_array_t;
+
+public:
+  material_buffer(const material_array_t&, const shader_program*, GLint block_index);
+  ~material_buffer();
+
+  material_buffer(const material_buffer&) = delete;
+  material_buffer& operator=(const material_buffer&) = delete;
+
+  void update();
+
+  size_t material_count() const { return material_array_.size(); }
+  GLintptr block_offset(size_t i) const { return (GLintptr)(i * block_stride_); }
+  GLsizeiptr block_size() const { return (GLsizeiptr)block_size_; }
+  const loose_parameter_array_t& loose_parameter_array(size_t i) const { return loose_parameter_array_[i]; }
+  const texture_binding_array_t& texture_binding_array(size_t i) const { return texture_binding_array_[i]; }
+
+  GLuint globj_uniform_buffer() { return uniform_buffer_; }
+
+private:
+  void write_block(size_t i);
+
+private:
+  material_array_t material_array_;
+  const shader_program *program_;
+  size_t block_size_;
+  size_t block_stride_;
+  std::vector<uint8_t> storage_;
+  std::vector<uint32_t> revision_array_;
+  std::vector<loose_parameter_array_t> loose_parameter_array_;
+  std::vector<texture_binding_array_t> texture_binding_array_;
+  GLuint uniform_buffer_;
+
+public:
+  static auto make(const material_array_t& material_array, const shader_program *program, GLint block_index)
+  {
+    return std::make_shared<material_buffer>(material_array, program, block_index);
+  }
+};
+
+
 // モデル.
 class model
 {
 public:
+  typedef std::shared_ptr<model> ptr_t;
   typedef std::vector<vertex_stream_base::ptr_t> vertex_stream_array_t;
+  typedef std::vector<index_stream::ptr_t> index_stream_array_t;
   typedef std::vector<geometry::ptr_t> geometry_array_t;
   typedef std::vector<material::ptr_t> material_array_t;
   typedef std::vector<texture::ptr_t> texture_array_t;
@@ -230,16 +460,49 @@ public:
   model();
   ~model();
 
+  // 作った順に振る番号. 描画の並べ替えでモデルをまとめるのに使う. 16 ビットを越えたら回る.
+  uint32_t id() const { return id_; }
+
   void push(geometry::ptr_t, material::ptr_t);
 
   const section_array_t& section_array() { return section_array_; }
 
+  // 頂点が参照するボーンの数. スキニングのボーン行列はこの数だけ要る.
+  size_t bone_count() const { return bone_count_; }
+  void set_bone_count(size_t n) { bone_count_ = n; }
+
+  // ボーンの階層. 無ければ 0.
+  skeleton::ptr_t get_skeleton() { return skeleton_; }
+  void set_skeleton(skeleton::ptr_t skel) { skeleton_ = skel; }
+
+  // モーフ. 無ければ 0. 頂点と材質はモデルで共有なので, 重みもモデルに一つ.
+  std::shared_ptr<morph_set> get_morph() { return morph_; }
+  void set_morph(std::shared_ptr<morph_set> m) { morph_ = m; }
+
+  // geom をこのシェーダで描く時の頂点配列オブジェクト. 初めて使う時に作る.
+  vertex_array::ptr_t get_vertex_array(geometry*, shader*);
+  // セクションのマテリアルを並べた uniform バッファ. 区画はセクションと同じ順.
+  // シェーダに "material" ブロックが無ければ 0.
+  material_buffer::ptr_t get_material_buffer(shader*);
+
+private:
+  typedef std::tuple<vertex_stream_base*, index_stream*, GLuint> vertex_array_key_t;
+  typedef std::map<vertex_array_key_t, vertex_array::ptr_t> vertex_array_map_t;
+  typedef std::map<GLuint, material_buffer::ptr_t> material_buffer_map_t;
+
 private:
   vertex_stream_array_t vertex_stream_array_;
+  index_stream_array_t index_stream_array_;
   geometry_array_t geometry_array_;
   material_array_t material_array_;
   texture_array_t texture_array_;
   section_array_t section_array_;
+  vertex_array_map_t vertex_array_map_;
+  material_buffer_map_t material_buffer_map_;
+  uint32_t id_;
+  size_t bone_count_;
+  skeleton::ptr_t skeleton_;
+  std::shared_ptr<morph_set> morph_;
 };
 
 
@@ -248,12 +511,205 @@ class model_node : public scene_node
 public:
   model_node(std::shared_ptr<model> model, std::shared_ptr<shader> shader);
   virtual void draw(scene*, draw_context*);
+  virtual void enqueue(scene*, draw_context*, render_queue*);
+
+  std::shared_ptr<model> get_model() { return model_; }
 
   const matrix& world_matrix() const { return mtx_; }
   void set_world_matrix(const matrix& m) { mtx_ = m; }
 
+  // false にすると頂点配列オブジェクトを使わず, 毎回属性を設定し直す. 比較用.
+  void set_use_vertex_array(bool b) { use_vertex_array_ = b; }
+
+  // ボーン行列. シェーダが SKINNING 付きでコンパイルされていなければ 0.
+  // 行列を書き換えると, 次に描く時に一度だけ転送する.
+  bone_palette::ptr_t palette() { return palette_; }
+  // シェーダが MORPH 付きなら, モデルのモーフが MorphMode_GPU の時に頂点モーフをシェーダで足す.
+  bool use_morph_table() const { return use_morph_table_; }
+  // このノードの姿勢. モデルにスケルトンが無ければ 0.
+  // 変えると, 次に描く時に計算し直してボーン行列へ入れる.
+  skeleton_pose::ptr_t pose() { return pose_; }
+  // 姿勢を animation_stage で計算する時のボーン行列. 渡すと pose() には触らず,
+  // 描く時に front() が変わっていればボーン行列へ移す. 0 に戻すと pose() から計算する.
+  void set_palette_buffer(bone_palette_buffer::ptr_t);
+  bone_palette_buffer::ptr_t palette_buffer() { return palette_buffer_; }
+
+private:
+  // モデルのモーフを反映してから, 姿勢を計算し直す.
+  void update_pose();
+
+private:
+  std::shared_ptr<model> model_;
+  std::shared_ptr<shader> shader_;
+  GLint mvp_location_;
+  matrix mtx_;
+  bool use_vertex_array_;
+  bone_palette::ptr_t palette_;
+  bool use_morph_table_;
+  skeleton_pose::ptr_t pose_;
+  // 姿勢へ入れたボーンモーフの版.
+  uint32_t bone_morph_revision_;
+  bone_palette_buffer::ptr_t palette_buffer_;
+  // ボーン行列へ移した palette_buffer_ の版.
+  uint32_t palette_buffer_revision_;
+};
+
+// 頂点配列オブジェクトを使った時と使わない時の描画の CPU 時間を比べる.
+bool bench_model_draw(model::ptr_t, shader::ptr_t, int frames);
+
+
+// 同じモデルをたくさん並べるノードの共通部分.
+// インスタンスごとの InstanceT をバッファに並べ, セクションごとに一度の glDrawElementsInstanced で全部描く.
+// InstanceT は頭にワールド行列を置き, 後ろに float があれば vInstanceTime へ流す (vertex_array を参照).
+// シェーダは INSTANCING を定義してコンパイルしたもの.
+template<class InstanceT>
+class instanced_node_base : public scene_node
+{
+public:
+  size_t instance_count() const { return instance_array_.size(); }
+  const InstanceT& instance(size_t i) const { return instance_array_[i]; }
+  void clear_instances()
+  {
+    instance_array_.clear();
+    instance_dirty_ = true;
+  }
+
+protected:
+  instanced_node_base(std::shared_ptr<model> model, std::shared_ptr<shader> shader);
+  ~instanced_node_base();
+
+  // インスタンスを足して, その番号を返す.
+  size_t push_instance(const InstanceT& inst)
+  {
+    instance_array_.push_back(inst);
+    instance_dirty_ = true;
+    return instance_array_.size() - 1;
+  }
+  void set_instance(size_t i, const InstanceT& inst)
+  {
+    instance_array_[i] = inst;
+    instance_dirty_ = true;
+  }
+
+  // インスタンスが変わっていたらバッファへ転送する.
+  void update_instance_buffer();
+  vertex_array::ptr_t get_vertex_array(geometry*);
+  // シェーダと uniform を設定した後に呼ぶ. 全セクションを全インスタンス分描く.
+  void draw_sections(material_buffer*);
+
 private:
+  typedef std::pair<vertex_stream_base*, index_stream*> vertex_array_key_t;
+  typedef std::map<vertex_array_key_t, vertex_array::ptr_t> vertex_array_map_t;
+
+protected:
   std::shared_ptr<model> model_;
   std::shared_ptr<shader> shader_;
+  GLint mvp_location_;
+  std::vector<InstanceT> instance_array_;
+
+private:
+  GLuint instance_buffer_;
+  size_t instance_buffer_capacity_;
+  bool instance_dirty_;
+  vertex_array_map_t vertex_array_map_;
+};
+
+
+// 同じモデルをたくさん並べるノード. インスタンスごとにワールド行列を持つ.
+class instanced_model_node : public instanced_node_base<matrix>
+{
+public:
+  instanced_model_node(std::shared_ptr<model> model, std::shared_ptr<shader> shader);
+  virtual void draw(scene*, draw_context*);
+  virtual void enqueue(scene*, draw_context*, render_queue*);
+
+  // インスタンスを足して, その番号を返す.
+  size_t add_instance(const matrix& world) { return push_instance(world); }
+  void set_instance_matrix(size_t i, const matrix& world) { set_instance(i, world); }
+  const matrix& instance_matrix(size_t i) const { return instance(i); }
+
+  // 全インスタンスで共有するボーン行列. シェーダが SKINNING 付きでなければ 0.
+  bone_palette::ptr_t palette() { return palette_; }
+
+private:
+  bone_palette::ptr_t palette_;
+  bool use_morph_table_;
+};
+
+// instanced_model_node と vertex_animation_node の bench で共通の, 格子状に並べたモデルを見下ろすカメラを置き,
+// instances 個のワールド行列を返す.
+std::vector<matrix> setup_instancing_bench(scene*, int instances);
+
+// 同じモデルを instances 個, model_node を並べた時と instanced_model_node で描いた時とで比べる.
+// instanced_shdr は shdr と同じシェーダを INSTANCING 付きでコンパイルしたもの.
+bool bench_model_instancing(model::ptr_t, shader::ptr_t shdr, shader::ptr_t instanced_shdr,
+                            int instances, int frames);
+
+
+// vertex_animation_node のインスタンス. 再生位置のずれは秒.
+struct vertex_animation_instance
+{
+  matrix world;
+  float time_offset;
+};
+
+// 焼いた頂点アニメーションで動く同じモデルをたくさん並べるノード.
+// インスタンスごとにワールド行列と再生位置のずれをバッファに並べる.
+// 姿勢もスキニングも計算しないので, 描く時の CPU の仕事は数に依らない.
+// シェーダは VERTEX_ANIMATION と INSTANCING を定義してコンパイルしたもの.
+// 時刻を uniform で渡すので, 待ち行列には積まずに draw() で描く.
+class vertex_animation_node : public instanced_node_base<vertex_animation_instance>
+{
+public:
+  vertex_animation_node(std::shared_ptr<model> model, std::shared_ptr<vertex_animation>, std::shared_ptr<shader> shader);
+  virtual void draw(scene*, draw_context*);
+
+  size_t add_instance(const matrix& world, float time_offset) { return push_instance({ world, time_offset }); }
+  void set_instance(size_t i, const matrix& world, float time_offset)
+  {
+    instanced_node_base::set_instance(i, { world, time_offset });
+  }
+
+  // 全インスタンスに共通の再生時刻 (秒).
+  float time() const { return time_; }
+  void set_time(float t) { time_ = t; }
+
+private:
+  std::shared_ptr<vertex_animation> animation_;
+  GLint vertex_count_location_;
+  GLint frame_count_location_;
+  GLint frame_rate_location_;
+  GLint time_location_;
+  float time_;
+};
+
+// 非同期に読み込むモデルのノード.
+// 読み込みが終わるまでは placeholder を代わりに描く. 失敗した時も placeholder のまま.
+class async_model_node : public scene_node
+{
+public:
+  typedef std::shared_future<model::ptr_t> future_t;
+
+public:
+  async_model_node(future_t model, std::shared_ptr<shader> shader, scene_node::ptr_t placeholder);
+  virtual void draw(scene*, draw_context*);
+  virtual void enqueue(scene*, draw_context*, render_queue*);
+
+  bool is_ready() const { return model_node_ != 0; }
+  // 読み込みが終わっていなければ 0.
+  std::shared_ptr<model_node> get_model_node();
+
+  const matrix& world_matrix() const { return mtx_; }
+  void set_world_matrix(const matrix& m);
+
+private:
+  // 読み込みが終わっていたら model_node を作る.
+  void poll();
+
+private:
+  future_t model_;
+  std::shared_ptr<shader> shader_;
+  scene_node::ptr_t placeholder_;
+  std::shared_ptr<model_node> model_node_;
   matrix mtx_;
 };
@@ -0,0 +1,619 @@
+﻿
+#include "stdafx.h"
+
+#include "morph.h"
+#include "gl_state.h"
+
+
+namespace {
+
+// この数より近い区間は一つにまとめて転送する. 転送の呼び出しを減らす方が速い.
+const uint32_t range_merge_gap = 32;
+
+// 差分の表の番号は浮動小数で持つので, これ未満でないと正しく表せない.
+// 重みの位置は 4 つずつ詰めた何番目かなので, 表のテクセル数の 4 倍までを使う.
+const size_t max_gpu_table_index = (size_t)1 << 24;
+
+// 並んだ頂点番号を区間にまとめて足す.
+void append_runs(morph_set::range_array_t *out, std::vector<uint32_t> index_array)
+{
+  std::sort(index_array.begin(), index_array.end());
+  // 前に足してある区間とはまとめない.
+  const size_t first = out->size();
+  for (uint32_t i : index_array) {
+    if ((out->size() > first) && (i <= out->back().second + range_merge_gap)) {
+      out->back().second = std::max(out->back().second, i + 1);
+    } else {
+      out->push_back({ i, i + 1 });
+    }
+  }
+}
+
+// 区間を並べて, 重なるものや近いものをまとめる.
+void merge_ranges(morph_set::range_array_t *ranges)
+{
+  if (ranges->empty()) {
+    return;
+  }
+  std::sort(ranges->begin(), ranges->end());
+  size_t n = 0;
+  for (size_t i=1; i<ranges->size(); ++i) {
+    auto& last = (*ranges)[n];
+    const auto& r = (*ranges)[i];
+    if (r.first <= last.second + range_merge_gap) {
+      last.second = std::max(last.second, r.second);
+    } else {
+      (*ranges)[++n] = r;
+    }
+  }
+  ranges->resize(n + 1);
+}
+
+} // end of anonymus namespace
+
+
+morph_set::morph_set(const std::vector<pmx_model_morph>& morph_array,
+                     const std::vector<pmx_section>& section_array, size_t vertex_count)
+  : base_captured_(false), active_vertex_morph_(0), vertex_count_(vertex_count),
+    mode_(MorphMode_CPU), vertex_mode_(MorphMode_CPU), buffer_(0), texture_(0), weight_texel_(0),
+    gpu_weight_dirty_(false), material_dirty_(false), bone_revision_(0), bone_dirty_(false), stats_()
+{
+  const size_t count = morph_array.size();
+  name_array_.reserve(count);
+  for (const auto& morph : morph_array) {
+    name_array_.push_back(morph.name);
+    panel_array_.push_back(morph.panel);
+    type_array_.push_back(morph.type);
+  }
+  name_index_.resize(count);
+  std::iota(name_index_.begin(), name_index_.end(), 0);
+  std::stable_sort(name_index_.begin(), name_index_.end(),
+                   [this](uint32_t a, uint32_t b) { return name_array_[a] < name_array_[b]; });
+
+  // グループモーフを末端まで展開する. 自分を含むグループは辿らない.
+  std::vector<uint8_t> visiting(count, 0);
+  std::function<void(uint32_t, float)> expand = [&](uint32_t m, float rate) {
+    const auto& morph = morph_array[m];
+    if (morph.type != PMXMorph_Group) {
+      leaf_morph_.push_back(m);
+      leaf_rate_.push_back(rate);
+      return;
+    }
+    visiting[m] = 1;
+    for (const auto& ofs : morph.group_array) {
+      if ((ofs.morph >= 0) && ((size_t)ofs.morph < count) && !visiting[ofs.morph]) {
+        expand((uint32_t)ofs.morph, rate * ofs.rate);
+      }
+    }
+    visiting[m] = 0;
+  };
+  leaf_offset_.push_back(0);
+  for (uint32_t m=0; m<count; ++m) {
+    expand(m, 1.f);
+    leaf_offset_.push_back((uint32_t)leaf_morph_.size());
+  }
+  std::vector<std::vector<std::pair<uint32_t, float>>> source(count);
+  for (uint32_t m=0; m<count; ++m) {
+    for (uint32_t k=leaf_offset_[m]; k<leaf_offset_[m + 1]; ++k) {
+      source[leaf_morph_[k]].push_back({ m, leaf_rate_[k] });
+    }
+  }
+  source_offset_.push_back(0);
+  for (const auto& s : source) {
+    for (const auto& [m, rate] : s) {
+      source_morph_.push_back(m);
+      source_rate_.push_back(rate);
+    }
+    source_offset_.push_back((uint32_t)source_morph_.size());
+  }
+
+  // 種類ごとの差分を並べる.
+  vertex_offset_.push_back(0);
+  uv_offset_.push_back(0);
+  run_offset_.push_back(0);
+  bone_offset_.push_back(0);
+  material_offset_.push_back(0);
+  std::vector<uint32_t> touched;
+  for (const auto& morph : morph_array) {
+    std::vector<uint32_t> index_array;
+    if (morph.type == PMXMorph_Vertex) {
+      for (const auto& ofs : morph.vertex_array) {
+        if (ofs.vertex < vertex_count) {
+          vertex_index_.push_back(ofs.vertex);
+          delta_x_.push_back(ofs.translate.x);
+          delta_y_.push_back(ofs.translate.y);
+          delta_z_.push_back(ofs.translate.z);
+          index_array.push_back(ofs.vertex);
+        }
+      }
+    } else if (morph.type == PMXMorph_UV) {
+      for (const auto& ofs : morph.uv_array) {
+        if (ofs.vertex < vertex_count) {
+          uv_index_.push_back(ofs.vertex);
+          delta_u_.push_back(ofs.translate.x);
+          delta_v_.push_back(ofs.translate.y);
+          index_array.push_back(ofs.vertex);
+        }
+      }
+    } else if (morph.type == PMXMorph_Bone) {
+      for (const auto& ofs : morph.bone_array) {
+        if (ofs.bone >= 0) {
+          bone_index_.push_back((uint32_t)ofs.bone);
+          bone_translate_.push_back(ofs.translate);
+          bone_rotate_.push_back(normalize(ofs.rotate));
+        }
+      }
+    } else if (morph.type == PMXMorph_Material) {
+      material_array_.insert(material_array_.end(), morph.material_array.begin(), morph.material_array.end());
+    }
+    touched.insert(touched.end(), index_array.begin(), index_array.end());
+    append_runs(&run_array_, std::move(index_array));
+    vertex_offset_.push_back((uint32_t)vertex_index_.size());
+    uv_offset_.push_back((uint32_t)uv_index_.size());
+    run_offset_.push_back((uint32_t)run_array_.size());
+    bone_offset_.push_back((uint32_t)bone_index_.size());
+    material_offset_.push_back((uint32_t)material_array_.size());
+  }
+  std::sort(touched.begin(), touched.end());
+  touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+  base_index_ = touched;
+  append_runs(&base_run_array_, std::move(touched));
+
+  for (const auto& sec : section_array) {
+    base_diffuse_.push_back(sec.diffuse);
+    base_specular_.push_back(sec.specular);
+    base_ambient_.push_back(sec.ambient);
+  }
+
+  weight_.resize(count, 0.f);
+  applied_.resize(count, 0.f);
+  changed_.resize(count, 0);
+  leaf_mark_.resize(count, 0);
+}
+
+morph_set::~morph_set()
+{
+  auto& gl = gl_state::instance();
+  if (texture_) {
+    gl.delete_texture(texture_);
+  }
+  if (buffer_) {
+    gl.delete_buffer(buffer_);
+  }
+}
+
+int32_t morph_set::find_morph(std::string_view name) const
+{
+  auto it = std::lower_bound(name_index_.begin(), name_index_.end(), name,
+                             [this](uint32_t m, std::string_view n) { return name_array_[m] < n; });
+  if ((it != name_index_.end()) && (name_array_[*it] == name)) {
+    return (int32_t)*it;
+  }
+  return -1;
+}
+
+void morph_set::set_weight(size_t i, float w)
+{
+  if (weight_[i] == w) {
+    return;
+  }
+  weight_[i] = w;
+  if (!changed_[i]) {
+    changed_[i] = 1;
+    changed_morph_.push_back((uint32_t)i);
+  }
+}
+
+void morph_set::reset()
+{
+  for (size_t i=0; i<weight_.size(); ++i) {
+    set_weight(i, 0.f);
+  }
+}
+
+bool morph_set::set_mode(MorphMode mode)
+{
+  if (mode == MorphMode_GPU) {
+    // 頂点ごとの区切り (4 つずつ), 差分, 重み (4 つずつ) のテクセル数.
+    size_t texel = (vertex_count_ + 1 + 3) / 4 + vertex_index_.size() + (applied_.size() + 3) / 4;
+    if (texel * 4 >= max_gpu_table_index) {
+      return false;
+    }
+  }
+  mode_ = mode;
+  return true;
+}
+
+void morph_set::attach(vertex_stream_base::ptr_t stream, const std::vector<material::ptr_t>& material_array)
+{
+  vertex_stream_ = stream;
+  material_ptr_array_ = material_array;
+}
+
+void morph_set::apply(pmx_model_vertex *vertex_array, range_array_t *dirty)
+{
+  stats_ = stats();
+  if (changed_morph_.empty()) {
+    return;
+  }
+  if (vertex_array && !base_captured_) {
+    base_pos_.resize(base_index_.size());
+    base_uv_.resize(base_index_.size());
+    for (size_t k=0; k<base_index_.size(); ++k) {
+      base_pos_[k] = vertex_array[base_index_[k]].pos;
+      base_uv_[k] = vertex_array[base_index_[k]].uv;
+    }
+    base_captured_ = true;
+  }
+
+  // 重みの変わったモーフが動かす末端のモーフを集める.
+  touched_leaf_.clear();
+  for (uint32_t m : changed_morph_) {
+    changed_[m] = 0;
+    for (uint32_t k=leaf_offset_[m]; k<leaf_offset_[m + 1]; ++k) {
+      uint32_t leaf = leaf_morph_[k];
+      if (!leaf_mark_[leaf]) {
+        leaf_mark_[leaf] = 1;
+        touched_leaf_.push_back(leaf);
+      }
+    }
+  }
+  changed_morph_.clear();
+
+  size_t dirty_begin = dirty->size();
+  for (uint32_t leaf : touched_leaf_) {
+    leaf_mark_[leaf] = 0;
+    float w = 0.f;
+    for (uint32_t k=source_offset_[leaf]; k<source_offset_[leaf + 1]; ++k) {
+      w += weight_[source_morph_[k]] * source_rate_[k];
+    }
+    float d = w - applied_[leaf];
+    if (d == 0.f) {
+      continue;
+    }
+    ++stats_.morph_count;
+    bone_dirty_ |= (bone_offset_[leaf] != bone_offset_[leaf + 1]);
+    material_dirty_ |= (material_offset_[leaf] != material_offset_[leaf + 1]);
+    bool has_vertex = (run_offset_[leaf] != run_offset_[leaf + 1]);
+    bool has_position = (vertex_offset_[leaf] != vertex_offset_[leaf + 1]);
+    if (has_position && (vertex_mode_ == MorphMode_GPU)) {
+      // 頂点はそのままで, 重みだけをシェーダへ渡す.
+      gpu_weight_dirty_ = true;
+      stats_.vertex_count += vertex_offset_[leaf + 1] - vertex_offset_[leaf];
+    } else if (has_vertex && vertex_array) {
+      active_vertex_morph_ += (w != 0.f) - (applied_[leaf] != 0.f);
+      for (uint32_t k=vertex_offset_[leaf]; k<vertex_offset_[leaf + 1]; ++k) {
+        vec3& pos = vertex_array[vertex_index_[k]].pos;
+        pos.x += delta_x_[k] * d;
+        pos.y += delta_y_[k] * d;
+        pos.z += delta_z_[k] * d;
+      }
+      for (uint32_t k=uv_offset_[leaf]; k<uv_offset_[leaf + 1]; ++k) {
+        vec2& uv = vertex_array[uv_index_[k]].uv;
+        uv.x += delta_u_[k] * d;
+        uv.y += delta_v_[k] * d;
+      }
+      stats_.vertex_count += (vertex_offset_[leaf + 1] - vertex_offset_[leaf]) + (uv_offset_[leaf + 1] - uv_offset_[leaf]);
+      dirty->insert(dirty->end(), run_array_.begin() + run_offset_[leaf], run_array_.begin() + run_offset_[leaf + 1]);
+    }
+    applied_[leaf] = w;
+  }
+
+  // 差分を足し引きし続けた誤差が残らないよう, 全部 0 に戻ったら元の値にする.
+  if ((active_vertex_morph_ == 0) && (dirty->size() != dirty_begin)) {
+    dirty->resize(dirty_begin);
+    restore_base(vertex_array, dirty);
+  }
+}
+
+void morph_set::restore_base(pmx_model_vertex *vertex_array, range_array_t *dirty)
+{
+  for (size_t k=0; k<base_index_.size(); ++k) {
+    vertex_array[base_index_[k]].pos = base_pos_[k];
+    vertex_array[base_index_[k]].uv = base_uv_[k];
+  }
+  dirty->insert(dirty->end(), base_run_array_.begin(), base_run_array_.end());
+}
+
+void morph_set::update()
+{
+  if (changed_morph_.empty() && (mode_ == vertex_mode_)) {
+    stats_ = stats();
+    return;
+  }
+  range_array_t dirty;
+  auto *vertex_array = vertex_stream_ ? (pmx_model_vertex*)vertex_stream_->vertex_array() : nullptr;
+  if (mode_ != vertex_mode_) {
+    switch_vertex_mode(vertex_array, &dirty);
+  }
+  apply(vertex_array, &dirty);
+  merge_ranges(&dirty);
+  for (const auto& r : dirty) {
+    size_t offset = r.first * sizeof(pmx_model_vertex);
+    size_t size = (r.second - r.first) * sizeof(pmx_model_vertex);
+    vertex_stream_->upload_range(offset, size);
+    ++stats_.upload_count;
+    stats_.upload_size += size;
+  }
+  if (gpu_weight_dirty_) {
+    update_gpu_weight();
+  }
+  if (material_dirty_) {
+    update_material();
+  }
+  if (bone_dirty_) {
+    update_bone_offset();
+  }
+}
+
+void morph_set::switch_vertex_mode(pmx_model_vertex *vertex_array, range_array_t *dirty)
+{
+  // GPU へ移すなら頂点へ足してある分を引き, CPU へ戻すなら足す.
+  float sign = (mode_ == MorphMode_GPU) ? -1.f : 1.f;
+  for (size_t leaf=0; leaf<applied_.size(); ++leaf) {
+    float w = applied_[leaf];
+    if ((w == 0.f) || (vertex_offset_[leaf] == vertex_offset_[leaf + 1])) {
+      continue;
+    }
+    active_vertex_morph_ += (mode_ == MorphMode_GPU) ? -1 : 1;
+    if (!vertex_array) {
+      continue;
+    }
+    for (uint32_t k=vertex_offset_[leaf]; k<vertex_offset_[leaf + 1]; ++k) {
+      vec3& pos = vertex_array[vertex_index_[k]].pos;
+      pos.x += delta_x_[k] * w * sign;
+      pos.y += delta_y_[k] * w * sign;
+      pos.z += delta_z_[k] * w * sign;
+    }
+    dirty->insert(dirty->end(), run_array_.begin() + run_offset_[leaf], run_array_.begin() + run_offset_[leaf + 1]);
+  }
+  if (vertex_array && base_captured_ && (active_vertex_morph_ == 0)) {
+    restore_base(vertex_array, dirty);
+  }
+  vertex_mode_ = mode_;
+  gpu_weight_dirty_ = (mode_ == MorphMode_GPU);
+}
+
+void morph_set::setup_gpu_table()
+{
+  // 頂点ごとに差分を並べ直す. 区切りは表の頭からのテクセル位置.
+  const uint32_t offset_texel = (uint32_t)((vertex_count_ + 1 + 3) / 4);
+  std::vector<uint32_t> count(vertex_count_ + 1, 0);
+  for (uint32_t v : vertex_index_) {
+    ++count[v];
+  }
+  // count を頂点ごとの書き始めのテクセル位置に置き換える.
+  uint32_t texel = offset_texel;
+  for (size_t v=0; v<=vertex_count_; ++v) {
+    uint32_t c = count[v];
+    count[v] = texel;
+    texel += c;
+  }
+  weight_texel_ = texel;
+  const size_t weight_count = (applied_.size() + 3) / 4;
+  // 1 テクセルに float を 4 つずつ並べる. 頭の区切りは 1 テクセルに 4 頂点分詰める.
+  std::vector<float> table((weight_texel_ + weight_count) * 4, 0.f);
+  for (size_t v=0; v<=vertex_count_; ++v) {
+    table[v] = (float)count[v];
+  }
+  for (uint32_t leaf=0; leaf+1<vertex_offset_.size(); ++leaf) {
+    // w は重みの位置 (4 つずつ詰めた何番目か).
+    float slot = (float)(weight_texel_ * 4 + leaf);
+    for (uint32_t k=vertex_offset_[leaf]; k<vertex_offset_[leaf + 1]; ++k) {
+      float *dst = &table[(size_t)count[vertex_index_[k]]++ * 4];
+      dst[0] = delta_x_[k];
+      dst[1] = delta_y_[k];
+      dst[2] = delta_z_[k];
+      dst[3] = slot;
+    }
+  }
+
+  auto& gl = gl_state::instance();
+  glGenBuffers(1, &buffer_);
+  gl.bind_buffer(GL_TEXTURE_BUFFER, buffer_);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * table.size(), &table[0], GL_DYNAMIC_DRAW);
+  glGenTextures(1, &texture_);
+  gl.bind_texture(GL_TEXTURE_BUFFER, texture_);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer_);
+}
+
+void morph_set::update_gpu_weight()
+{
+  if (!texture_) {
+    setup_gpu_table();
+  }
+  // 重みは末端のモーフの数しかないので, 毎回全部送る.
+  std::vector<float> weight((applied_.size() + 3) / 4 * 4, 0.f);
+  std::copy(applied_.begin(), applied_.end(), weight.begin());
+  gl_state::instance().bind_buffer(GL_TEXTURE_BUFFER, buffer_);
+  glBufferSubData(GL_TEXTURE_BUFFER, sizeof(vec4) * weight_texel_, sizeof(float) * weight.size(), &weight[0]);
+  stats_.upload_size += sizeof(float) * weight.size();
+  ++stats_.upload_count;
+  gpu_weight_dirty_ = false;
+}
+
+void morph_set::update_bone_offset()
+{
+  bone_offset_map_t offset_map;
+  for (size_t leaf=0; leaf<applied_.size(); ++leaf) {
+    add_bone_offset(&offset_map, leaf, applied_[leaf]);
+  }
+  make_bone_offset_array(offset_map, &bone_offset_array_);
+  ++bone_revision_;
+  bone_dirty_ = false;
+}
+
+void morph_set::evaluate_bone_offset(const float *weight, bone_offset_array_t *out) const
+{
+  bone_offset_map_t offset_map;
+  for (size_t leaf=0; leaf+1<bone_offset_.size(); ++leaf) {
+    if (bone_offset_[leaf] == bone_offset_[leaf + 1]) {
+      continue;
+    }
+    float w = 0.f;
+    for (uint32_t k=source_offset_[leaf]; k<source_offset_[leaf + 1]; ++k) {
+      w += weight[source_morph_[k]] * source_rate_[k];
+    }
+    add_bone_offset(&offset_map, leaf, w);
+  }
+  make_bone_offset_array(offset_map, out);
+}
+
+void morph_set::add_bone_offset(bone_offset_map_t *offset_map, size_t leaf, float w) const
+{
+  if (w == 0.f) {
+    return;
+  }
+  for (uint32_t k=bone_offset_[leaf]; k<bone_offset_[leaf + 1]; ++k) {
+    auto it = offset_map->try_emplace(bone_index_[k], vec3(0.f, 0.f, 0.f), quarternion::identity()).first;
+    it->second.first += bone_translate_[k] * w;
+    it->second.second = slerp(quarternion::identity(), bone_rotate_[k], w) * it->second.second;
+  }
+}
+
+void morph_set::make_bone_offset_array(const bone_offset_map_t& offset_map, bone_offset_array_t *out)
+{
+  out->clear();
+  for (const auto& [bone, offset] : offset_map) {
+    out->push_back({ bone, offset.first, offset.second });
+  }
+}
+
+void morph_set::update_material()
+{
+  // 掛ける方は重みで 1 からの補間, 足す方は重みを掛けて足す.
+  const size_t count = std::min(material_ptr_array_.size(), base_diffuse_.size());
+  const color one(1.f), zero(0.f);
+  // 材質ごとに diffuse, specular, ambient の三つずつ.
+  std::vector<color> mul(count * 3, one), add(count * 3, zero);
+  std::vector<uint8_t> touched(count, 0);
+  for (size_t leaf=0; leaf<applied_.size(); ++leaf) {
+    float w = applied_[leaf];
+    for (uint32_t k=material_offset_[leaf]; k<material_offset_[leaf + 1]; ++k) {
+      const auto& ofs = material_array_[k];
+      size_t begin = (ofs.material < 0) ? 0 : (size_t)ofs.material;
+      size_t end = (ofs.material < 0) ? count : std::min(begin + 1, count);
+      for (size_t i=begin; i<end; ++i) {
+        touched[i] = 1;
+        if (w == 0.f) {
+          continue;
+        }
+        const color *value[] = { &ofs.diffuse, &ofs.specular, &ofs.ambient };
+        for (int j=0; j<3; ++j) {
+          if (ofs.op == 0) {
+            mul[i * 3 + j] *= one + (*value[j] - one) * w;
+          } else {
+            add[i * 3 + j] += *value[j] * w;
+          }
+        }
+      }
+    }
+  }
+  for (size_t i=0; i<count; ++i) {
+    if (!touched[i]) {
+      continue;
+    }
+    auto& mtrl = material_ptr_array_[i];
+    mtrl->set_parameter("diffuse", color(base_diffuse_[i] * mul[i * 3] + add[i * 3]));
+    mtrl->set_parameter("specular", color(base_specular_[i] * mul[i * 3 + 1] + add[i * 3 + 1]));
+    mtrl->set_parameter("ambient", color(base_ambient_[i] * mul[i * 3 + 2] + add[i * 3 + 2]));
+  }
+  material_dirty_ = false;
+}
+
+
+bool bench_morph_update(model::ptr_t mdl, shader::ptr_t shdr, shader::ptr_t morph_shader, int frames)
+{
+  typedef std::chrono::steady_clock clock;
+
+  auto mrp = mdl->get_morph();
+  if (!mrp || !mrp->has_vertex_morph()) {
+    std::cerr << "no vertex morph." << std::endl;
+    return false;
+  }
+  if (!mrp->set_mode(MorphMode_GPU)) {
+    std::cerr << "too large for gpu morph." << std::endl;
+    return false;
+  }
+  mrp->set_mode(MorphMode_CPU);
+  auto stream = mdl->section_array().front().geom->vertex_stream();
+  // 一つだけ動かすなら頂点の多いモーフ. 顔のスライダーを引いている時と同じ.
+  std::vector<size_t> vertex_morph;
+  size_t target = 0, target_vertex = 0, total_vertex = 0;
+  for (size_t i=0; i<mrp->morph_count(); ++i) {
+    if (mrp->type(i) != PMXMorph_Vertex) {
+      continue;
+    }
+    mrp->set_weight(i, 1.f);
+    mrp->update();
+    size_t n = mrp->last_stats().vertex_count;
+    mrp->set_weight(i, 0.f);
+    mrp->update();
+    vertex_morph.push_back(i);
+    total_vertex += n;
+    if (n > target_vertex) {
+      target = i;
+      target_vertex = n;
+    }
+  }
+
+  enum Method { Method_Full, Method_Sparse, Method_GPU };
+  scene scn;
+  model_node cpu_node(mdl, shdr), gpu_node(mdl, morph_shader);
+  auto measure = [&](Method method, const std::vector<size_t>& moving, morph_set::stats *st) {
+    mrp->set_mode((method == Method_GPU) ? MorphMode_GPU : MorphMode_CPU);
+    mrp->reset();
+    mrp->update();
+    model_node& node = (method == Method_GPU) ? gpu_node : cpu_node;
+    glFinish();
+    *st = morph_set::stats();
+    auto start = clock::now();
+    for (int f=0; f<frames; ++f) {
+      for (size_t k=0; k<moving.size(); ++k) {
+        mrp->set_weight(moving[k], 0.5f + 0.5f * std::sin(0.1f * (f + 1) + k));
+      }
+      if (method == Method_Full) {
+        morph_set::range_array_t dirty;
+        mrp->apply((pmx_model_vertex*)stream->vertex_array(), &dirty);
+        stream->upload_range(0, stream->vertex_buffer_size());
+        st->upload_size += stream->vertex_buffer_size();
+        ++st->upload_count;
+      } else {
+        mrp->update();
+        st->upload_size += mrp->last_stats().upload_size;
+        st->upload_count += mrp->last_stats().upload_count;
+      }
+      draw_context ctx;
+      node.draw(&scn, &ctx);
+      glFinish();
+    }
+    return std::chrono::duration<double, std::micro>(clock::now() - start).count() / frames;
+  };
+
+  printf("morph update: %zu morphs, %zu vertices, %d frames (with draw)\n",
+         mrp->morph_count(), stream->vertex_count(), frames);
+  std::pair<const char*, Method> method_array[] = {
+    { "full  ", Method_Full },
+    { "sparse", Method_Sparse },
+    { "gpu   ", Method_GPU },
+  };
+  for (bool all : { false, true }) {
+    std::vector<size_t> moving = all ? vertex_morph : std::vector<size_t>{ target };
+    if (all) {
+      printf("  all %zu vertex morphs (%zu offsets)\n", vertex_morph.size(), total_vertex);
+    } else {
+      printf("  one slider \"%s\" (%zu offsets)\n", mrp->name(target).c_str(), target_vertex);
+    }
+    for (const auto& [name, method] : method_array) {
+      morph_set::stats st;
+      double us = measure(method, moving, &st);
+      printf("    %s : %9.1f us/frame, %8.1f KB/frame in %.1f uploads\n", name, us,
+             st.upload_size / 1024.0 / frames, (double)st.upload_count / frames);
+    }
+  }
+  mrp->set_mode(MorphMode_CPU);
+  mrp->reset();
+  mrp->update();
+
+  return glGetError() == GL_NO_ERROR;
+}
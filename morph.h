@@ -0,0 +1,202 @@
+﻿
+#pragma once
+
+#include "pmx_model.h"
+
+
+// モーフ.
+// 頂点と UV の差分はモーフごとに区切った疎な SoA の配列で持ち,
+// 重みが変わったモーフの分だけを頂点へ足して, 書き換えた頂点の区間だけを転送する.
+// グループモーフは作る時に末端のモーフと割合の組へ展開しておく.
+// UV モーフは一つ目の UV だけ. 追加 UV は頂点に無いので使わない.
+//
+// MorphMode_GPU では頂点モーフを頂点バッファへ足さず, 差分の表と重みをテクスチャバッファ
+// (morph_table) に置いて頂点シェーダ (MORPH) で足す. 頂点バッファは書き換えない.
+// UV モーフはどちらでも CPU で足す.
+enum MorphMode
+{
+  MorphMode_CPU,
+  MorphMode_GPU,
+};
+
+class morph_set
+{
+public:
+  typedef std::shared_ptr<morph_set> ptr_t;
+  // 頂点番号の区間 [first, second).
+  typedef std::vector<std::pair<uint32_t, uint32_t>> range_array_t;
+
+  struct stats
+  {
+    // 足し直したモーフと頂点の数.
+    size_t morph_count;
+    size_t vertex_count;
+    // 転送した区間の数とバイト数.
+    size_t upload_count;
+    size_t upload_size;
+  };
+
+  // ボーンモーフを合わせた移動と回転.
+  struct bone_offset
+  {
+    uint32_t bone;
+    vec3 translate;
+    quarternion rotate;
+  };
+  typedef std::vector<bone_offset> bone_offset_array_t;
+
+public:
+  // section_array は材質モーフの基準の値. PMX の材質の順.
+  morph_set(const std::vector<pmx_model_morph>&, const std::vector<pmx_section>&, size_t vertex_count);
+  ~morph_set();
+
+  morph_set(const morph_set&) = delete;
+  morph_set& operator=(const morph_set&) = delete;
+
+  size_t morph_count() const { return name_array_.size(); }
+  const std::string& name(size_t i) const { return name_array_[i]; }
+  uint8_t panel(size_t i) const { return panel_array_[i]; }
+  uint8_t type(size_t i) const { return type_array_[i]; }
+  // 名前から番号を引く. 無ければ -1.
+  int32_t find_morph(std::string_view name) const;
+
+  float weight(size_t i) const { return weight_[i]; }
+  void set_weight(size_t i, float);
+  // 全ての重みを 0 にする.
+  void reset();
+  bool is_dirty() const { return !changed_morph_.empty(); }
+
+  // 頂点か UV のモーフがあるか. 無ければ頂点を書き換えないので, コピーせずに済む.
+  bool has_vertex_morph() const { return !base_index_.empty(); }
+
+  // 頂点モーフを足す所. 既定は MorphMode_CPU. 切り替えは次の update() で反映する.
+  // 表は浮動小数で番号を持つので, 2^24 テクセルを越えるモデルは GPU にできない (false).
+  bool set_mode(MorphMode);
+  MorphMode mode() const { return mode_; }
+  // MorphMode_GPU の時の差分の表. それ以外は 0.
+  GLuint globj_texture() const { return (vertex_mode_ == MorphMode_GPU) ? texture_ : 0; }
+
+  // 書き換える頂点のストリーム (pmx_model_vertex, 重みが全て 0 の状態) と,
+  // 材質モーフを掛けるマテリアル (PMX の材質の順) を決める.
+  void attach(vertex_stream_base::ptr_t, const std::vector<material::ptr_t>&);
+
+  // 重みが変わっていれば頂点, 材質, ボーンモーフへ反映し, 書き換えた頂点の区間だけを転送する.
+  void update();
+  // update() の GL を使わない部分. 重みの変わったモーフの差分を vertex_array へ足し,
+  // 書き換えた区間を dirty へ足す. vertex_array はいつも同じものを渡すこと.
+  void apply(pmx_model_vertex *vertex_array, range_array_t *dirty);
+
+  // ボーンモーフ. 変わる度に bone_revision() が増える.
+  const bone_offset_array_t& bone_offset_array() const { return bone_offset_array_; }
+  uint32_t bone_revision() const { return bone_revision_; }
+  // 重み (morph_count() 個) をこのモデルの重みの代わりに使った時のボーンモーフ.
+  // 作った時から変わらない所しか読まないので, インスタンスごとにワーカーから呼んで良い.
+  void evaluate_bone_offset(const float *weight, bone_offset_array_t *out) const;
+
+  const stats& last_stats() const { return stats_; }
+
+private:
+  void update_bone_offset();
+  typedef std::map<uint32_t, std::pair<vec3, quarternion>> bone_offset_map_t;
+  // 末端のモーフ leaf を重み w で足す.
+  void add_bone_offset(bone_offset_map_t*, size_t leaf, float w) const;
+  static void make_bone_offset_array(const bone_offset_map_t&, bone_offset_array_t*);
+  void update_material();
+  // 頂点モーフの足し先を mode_ に合わせる. 頂点へ足してある分を足すか引く.
+  void switch_vertex_mode(pmx_model_vertex *vertex_array, range_array_t *dirty);
+  // 書き換える頂点を全て元の値に戻す.
+  void restore_base(pmx_model_vertex *vertex_array, range_array_t *dirty);
+  // 差分の表を作る. 重みは update_gpu_weight() で入れる.
+  void setup_gpu_table();
+  void update_gpu_weight();
+
+private:
+  std::vector<std::string> name_array_;
+  std::vector<uint8_t> panel_array_;
+  std::vector<uint8_t> type_array_;
+  std::vector<uint32_t> name_index_;
+
+  // モーフごとの区切りは [offset[i], offset[i + 1]).
+  // グループを展開した末端のモーフと割合.
+  std::vector<uint32_t> leaf_offset_;
+  std::vector<uint32_t> leaf_morph_;
+  std::vector<float> leaf_rate_;
+  // 末端のモーフから, それを動かすモーフと割合. 自分自身も含む.
+  std::vector<uint32_t> source_offset_;
+  std::vector<uint32_t> source_morph_;
+  std::vector<float> source_rate_;
+
+  // 頂点モーフ.
+  std::vector<uint32_t> vertex_offset_;
+  std::vector<uint32_t> vertex_index_;
+  std::vector<float> delta_x_;
+  std::vector<float> delta_y_;
+  std::vector<float> delta_z_;
+  // UV モーフ.
+  std::vector<uint32_t> uv_offset_;
+  std::vector<uint32_t> uv_index_;
+  std::vector<float> delta_u_;
+  std::vector<float> delta_v_;
+  // 頂点と UV のモーフが書き換える頂点の区間.
+  std::vector<uint32_t> run_offset_;
+  range_array_t run_array_;
+  // ボーンモーフ.
+  std::vector<uint32_t> bone_offset_;
+  std::vector<uint32_t> bone_index_;
+  std::vector<vec3> bone_translate_;
+  std::vector<quarternion> bone_rotate_;
+  // 材質モーフ.
+  std::vector<uint32_t> material_offset_;
+  std::vector<pmx_model_morph::material_offset> material_array_;
+  std::vector<color> base_diffuse_;
+  std::vector<color> base_specular_;
+  std::vector<color> base_ambient_;
+
+  // どれかのモーフが書き換える頂点と, その元の値. 重みが全て 0 に戻ったら元へ戻す.
+  std::vector<uint32_t> base_index_;
+  std::vector<vec3> base_pos_;
+  std::vector<vec2> base_uv_;
+  range_array_t base_run_array_;
+  bool base_captured_;
+
+  std::vector<float> weight_;
+  // 頂点などへ足してある末端のモーフの重み.
+  std::vector<float> applied_;
+  std::vector<uint8_t> changed_;
+  std::vector<uint32_t> changed_morph_;
+  std::vector<uint32_t> touched_leaf_;
+  std::vector<uint8_t> leaf_mark_;
+  // 重みが 0 でない頂点, UV のモーフの数.
+  size_t active_vertex_morph_;
+
+  size_t vertex_count_;
+  MorphMode mode_;
+  // 頂点の位置へ今足してある所.
+  MorphMode vertex_mode_;
+  // 差分の表. 頂点ごとの区切り, 差分, 重みの順に並ぶ.
+  GLuint buffer_;
+  GLuint texture_;
+  // 重みの始まり (テクセル).
+  uint32_t weight_texel_;
+  bool gpu_weight_dirty_;
+
+  vertex_stream_base::ptr_t vertex_stream_;
+  std::vector<material::ptr_t> material_ptr_array_;
+  bool material_dirty_;
+  bone_offset_array_t bone_offset_array_;
+  uint32_t bone_revision_;
+  bool bone_dirty_;
+  stats stats_;
+
+public:
+  static auto make(const std::vector<pmx_model_morph>& morph_array,
+                   const std::vector<pmx_section>& section_array, size_t vertex_count)
+  {
+    return std::make_shared<morph_set>(morph_array, section_array, vertex_count);
+  }
+};
+
+// モーフの重みを動かして描いた時に, 全部転送する場合, 差分の区間だけ転送する場合,
+// シェーダで足す場合 (morph_shader は MORPH 付き) とを比べる.
+// 一つのスライダーを動かす時と, 全ての頂点モーフを動かす時の二通り.
+bool bench_morph_update(model::ptr_t, shader::ptr_t shdr, shader::ptr_t morph_shader, int frames);
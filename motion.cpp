@@ -0,0 +1,625 @@
+﻿
+#include "stdafx.h"
+
+#include "motion.h"
+#include "pmx_loader.h"
+
+
+namespace {
+
+// packed_quarternion の残りの成分の範囲は ±1/√2.
+const float packed_range = 0.70710678f;
+
+// 制御点 p1, p2 の三次ベジェ (端は 0 と 1) の t での値.
+inline float bezier(float p1, float p2, float t)
+{
+  float s = 1.f - t;
+  return 3.f * s * s * t * p1 + 3.f * s * t * t * p2 + t * t * t;
+}
+
+// 回転の差の角度. 近い回転では acos の精度が足りないので, 四元数の差の長さから求める.
+inline float rotation_error(const quarternion& a, const quarternion& b)
+{
+  float s = (dot(a, b) < 0.f) ? -1.f : 1.f;
+  vec3 dv = a.v - b.v * s;
+  float dw = a.w - b.w * s;
+  float chord = std::sqrt(dot(dv, dv) + dw * dw);
+  return 4.f * std::asin(std::min(chord * 0.5f, 1.f));
+}
+
+inline float translation_error(const vec3& a, const vec3& b)
+{
+  return std::max({ std::abs(a.x - b.x), std::abs(a.y - b.y), std::abs(a.z - b.z) });
+}
+
+inline vec3 lerp(const vec3& a, const vec3& b, float t)
+{
+  return vec3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+// [0, count) のキーから残すものを選ぶ. 最初と最後は必ず残す.
+// fits(a, e) は a と e の間のキーを全て除いても許容誤差に収まるか.
+// 収まる所は大抵続いているので, 倍々に延ばしてから二分探索で詰める.
+std::vector<uint32_t> reduce_keys(uint32_t count, const std::function<bool(uint32_t, uint32_t)>& fits)
+{
+  std::vector<uint32_t> keep;
+  if (count == 0) {
+    return keep;
+  }
+  keep.push_back(0);
+  uint32_t a = 0;
+  while (a + 1 < count) {
+    uint32_t ok = a + 1, ng = count;
+    for (uint32_t len=2; a + len < count; len*=2) {
+      if (!fits(a, a + len)) {
+        ng = a + len;
+        break;
+      }
+      ok = a + len;
+    }
+    while (ng - ok > 1) {
+      uint32_t mid = ok + (ng - ok) / 2;
+      if (fits(a, mid)) {
+        ok = mid;
+      } else {
+        ng = mid;
+      }
+    }
+    keep.push_back(ok);
+    a = ok;
+  }
+  return keep;
+}
+
+} // end of anonymus namespace
+
+
+packed_quarternion packed_quarternion::pack(const quarternion& q)
+{
+  const float c[4] = { q.v.x, q.v.y, q.v.z, q.w };
+  int largest = 0;
+  for (int i=1; i<4; ++i) {
+    if (std::abs(c[i]) > std::abs(c[largest])) {
+      largest = i;
+    }
+  }
+  // q と -q は同じ回転なので, 除く成分を正にそろえる.
+  float sign = (c[largest] < 0.f) ? -1.f : 1.f;
+  packed_quarternion p;
+  for (int i=0, j=0; i<4; ++i) {
+    if (i == largest) {
+      continue;
+    }
+    float f = (c[i] * sign / packed_range + 1.f) * 0.5f;
+    p.v[j++] = (uint16_t)std::clamp((int)std::lround(f * 32767.f), 0, 32767);
+  }
+  p.v[0] |= (uint16_t)((largest >> 1) << 15);
+  p.v[1] |= (uint16_t)((largest & 1) << 15);
+  return p;
+}
+
+quarternion packed_quarternion::unpack() const
+{
+  int largest = ((v[0] >> 15) << 1) | (v[1] >> 15);
+  float c[4];
+  float sum = 0.f;
+  for (int i=0, j=0; i<4; ++i) {
+    if (i == largest) {
+      continue;
+    }
+    float f = ((v[j++] & 0x7fff) * (2.f / 32767.f) - 1.f) * packed_range;
+    c[i] = f;
+    sum += f * f;
+  }
+  c[largest] = std::sqrt(std::max(1.f - sum, 0.f));
+  return quarternion(c[0], c[1], c[2], c[3]);
+}
+
+
+bezier_table::bezier_table()
+  : value_(resolution + 1)
+{
+  for (int i=0; i<=resolution; ++i) {
+    value_[i] = (float)i / resolution;
+  }
+}
+
+uint16_t bezier_table::add(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2)
+{
+  if ((x1 == y1) && (x2 == y2)) {
+    return 0;
+  }
+  uint32_t key = x1 | (y1 << 8) | (x2 << 16) | ((uint32_t)y2 << 24);
+  auto it = index_map_.find(key);
+  if (it != index_map_.end()) {
+    return it->second;
+  }
+  // 番号が足りなくなったら直線で代える. 普通のモーションでは数百もない.
+  if (curve_count() > 0xffff) {
+    return 0;
+  }
+  uint16_t index = (uint16_t)curve_count();
+  for (int i=0; i<=resolution; ++i) {
+    value_.push_back(solve(x1, y1, x2, y2, (float)i / resolution));
+  }
+  index_map_.emplace(key, index);
+  return index;
+}
+
+float bezier_table::solve(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, float x)
+{
+  // x は t について単調に増えるので, 二分法で t を求める.
+  float px1 = x1 / 127.f, px2 = x2 / 127.f;
+  float lo = 0.f, hi = 1.f;
+  for (int i=0; i<24; ++i) {
+    float mid = (lo + hi) * 0.5f;
+    if (bezier(px1, px2, mid) < x) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return bezier(y1 / 127.f, y2 / 127.f, (lo + hi) * 0.5f);
+}
+
+
+motion::motion(const vmd_motion_data& data)
+  : frame_count_(0.f)
+{
+  // 名前ごとにまとめ, フレーム順に並べる. 同じフレームのキーは後の方を使う.
+  std::map<std::string_view, std::vector<const vmd_bone_key*>> bone_map;
+  for (const auto& key : data.bone_key_array) {
+    bone_map[key.name].push_back(&key);
+  }
+  bone_offset_.push_back(0);
+  for (auto& [name, key_array] : bone_map) {
+    std::stable_sort(key_array.begin(), key_array.end(),
+                     [](const vmd_bone_key *a, const vmd_bone_key *b) { return a->frame < b->frame; });
+    bone_name_array_.emplace_back(name);
+    for (size_t i=0; i<key_array.size(); ++i) {
+      const auto& key = *key_array[i];
+      if ((i + 1 < key_array.size()) && (key_array[i + 1]->frame == key.frame)) {
+        continue;
+      }
+      bone_time_.push_back((float)key.frame);
+      bone_translate_.push_back(key.translate);
+      bone_rotate_.push_back(normalize(key.rotate));
+      for (const auto& c : key.curve) {
+        bone_curve_.push_back(curve_table_.add(c[0], c[1], c[2], c[3]));
+      }
+      frame_count_ = std::max(frame_count_, (float)key.frame);
+    }
+    bone_offset_.push_back((uint32_t)bone_time_.size());
+  }
+
+  std::map<std::string_view, std::vector<const vmd_morph_key*>> morph_map;
+  for (const auto& key : data.morph_key_array) {
+    morph_map[key.name].push_back(&key);
+  }
+  morph_offset_.push_back(0);
+  for (auto& [name, key_array] : morph_map) {
+    std::stable_sort(key_array.begin(), key_array.end(),
+                     [](const vmd_morph_key *a, const vmd_morph_key *b) { return a->frame < b->frame; });
+    morph_name_array_.emplace_back(name);
+    for (size_t i=0; i<key_array.size(); ++i) {
+      const auto& key = *key_array[i];
+      if ((i + 1 < key_array.size()) && (key_array[i + 1]->frame == key.frame)) {
+        continue;
+      }
+      morph_time_.push_back((float)key.frame);
+      morph_weight_.push_back(key.weight);
+      frame_count_ = std::max(frame_count_, (float)key.frame);
+    }
+    morph_offset_.push_back((uint32_t)morph_time_.size());
+  }
+}
+
+void motion::evaluate_bone(size_t track, uint32_t key, float frame, vec3 *translate, quarternion *rotate) const
+{
+  uint32_t k = bone_offset_[track] + key;
+  // 最初のキーより前と最後のキーより後は, 端のキーのまま.
+  if ((k + 1 >= bone_offset_[track + 1]) || (frame <= bone_time_[k])) {
+    *translate = bone_translate_[k];
+    *rotate = bone_rotation(k);
+    return;
+  }
+  uint32_t n = k + 1;
+  float x = (frame - bone_time_[k]) / (bone_time_[n] - bone_time_[k]);
+  const uint16_t *curve = &bone_curve_[n * 4];
+  const vec3& a = bone_translate_[k];
+  const vec3& b = bone_translate_[n];
+  *translate = vec3(a.x + (b.x - a.x) * curve_table_.evaluate(curve[0], x),
+                    a.y + (b.y - a.y) * curve_table_.evaluate(curve[1], x),
+                    a.z + (b.z - a.z) * curve_table_.evaluate(curve[2], x));
+  *rotate = slerp(bone_rotation(k), bone_rotation(n), curve_table_.evaluate(curve[3], x));
+}
+
+float motion::evaluate_morph(size_t track, uint32_t key, float frame) const
+{
+  // モーフは直線で補間する.
+  uint32_t k = morph_offset_[track] + key;
+  if ((k + 1 >= morph_offset_[track + 1]) || (frame <= morph_time_[k])) {
+    return morph_weight_[k];
+  }
+  uint32_t n = k + 1;
+  float x = (frame - morph_time_[k]) / (morph_time_[n] - morph_time_[k]);
+  return morph_weight_[k] + (morph_weight_[n] - morph_weight_[k]) * x;
+}
+
+
+size_t motion::key_size() const
+{
+  return bone_offset_.size() * sizeof(uint32_t) +
+    bone_time_.size() * sizeof(float) +
+    bone_translate_.size() * sizeof(vec3) +
+    bone_rotate_.size() * sizeof(quarternion) +
+    bone_rotate_packed_.size() * sizeof(packed_quarternion) +
+    bone_curve_.size() * sizeof(uint16_t) +
+    morph_offset_.size() * sizeof(uint32_t) +
+    morph_time_.size() * sizeof(float) +
+    morph_weight_.size() * sizeof(float);
+}
+
+motion::ptr_t motion::compress(const motion_compress_option& opt, motion_compress_stats *stats) const
+{
+  // 名前, 補間曲線の表, 長さはそのまま使う.
+  auto out = std::make_shared<motion>(*this);
+  out->bone_offset_.assign(1, 0);
+  out->bone_time_.clear();
+  out->bone_translate_.clear();
+  out->bone_rotate_.clear();
+  out->bone_rotate_packed_.clear();
+  out->bone_curve_.clear();
+  out->morph_offset_.assign(1, 0);
+  out->morph_time_.clear();
+  out->morph_weight_.clear();
+
+  // 詰めた後の回転で比べる.
+  std::vector<quarternion> rotate(bone_time_.size());
+  std::vector<packed_quarternion> packed;
+  for (size_t k=0; k<rotate.size(); ++k) {
+    rotate[k] = bone_rotation((uint32_t)k);
+    if (opt.quantize_rotation) {
+      packed.push_back(packed_quarternion::pack(rotate[k]));
+      rotate[k] = packed.back().unpack();
+    }
+  }
+
+  for (size_t track=0; track<bone_track_count(); ++track) {
+    const uint32_t base = bone_offset_[track];
+    const float *time = &bone_time_[base];
+    // a と e の間の元のキーと, 元のキーの中間を直線の補間と比べる.
+    auto fits = [&](uint32_t a, uint32_t e) {
+      const float span = time[e] - time[a];
+      for (uint32_t i=a; i<e; ++i) {
+        for (int half=0; half<2; ++half) {
+          if ((half == 0) && (i == a)) {
+            continue;
+          }
+          float frame = half ? (time[i] + time[i + 1]) * 0.5f : time[i];
+          vec3 t;
+          quarternion r;
+          if (half) {
+            evaluate_bone(track, i, frame, &t, &r);
+          } else {
+            t = bone_translate_[base + i];
+            r = bone_rotation(base + i);
+          }
+          float x = (frame - time[a]) / span;
+          if ((translation_error(lerp(bone_translate_[base + a], bone_translate_[base + e], x), t) > opt.translate_tolerance) ||
+              (rotation_error(slerp(rotate[base + a], rotate[base + e], x), r) > opt.rotate_tolerance)) {
+            return false;
+          }
+        }
+      }
+      return true;
+    };
+    auto keep = reduce_keys(bone_key_count(track), fits);
+    for (size_t j=0; j<keep.size(); ++j) {
+      uint32_t k = base + keep[j];
+      out->bone_time_.push_back(bone_time_[k]);
+      out->bone_translate_.push_back(bone_translate_[k]);
+      if (opt.quantize_rotation) {
+        out->bone_rotate_packed_.push_back(packed[k]);
+      } else {
+        out->bone_rotate_.push_back(rotate[k]);
+      }
+      // 間を除いた区間は直線で作り直したので, 元の曲線は使えない.
+      bool removed = (j > 0) && (keep[j] != keep[j - 1] + 1);
+      for (int c=0; c<4; ++c) {
+        out->bone_curve_.push_back(removed ? 0 : bone_curve_[k * 4 + c]);
+      }
+    }
+    out->bone_offset_.push_back((uint32_t)out->bone_time_.size());
+  }
+
+  for (size_t track=0; track<morph_track_count(); ++track) {
+    const uint32_t base = morph_offset_[track];
+    const float *time = &morph_time_[base];
+    const float *weight = &morph_weight_[base];
+    // モーフは元も直線なので, 元のキーとだけ比べれば良い.
+    auto fits = [&](uint32_t a, uint32_t e) {
+      for (uint32_t i=a+1; i<e; ++i) {
+        float x = (time[i] - time[a]) / (time[e] - time[a]);
+        if (std::abs(weight[a] + (weight[e] - weight[a]) * x - weight[i]) > opt.morph_tolerance) {
+          return false;
+        }
+      }
+      return true;
+    };
+    for (uint32_t i : reduce_keys(morph_key_count(track), fits)) {
+      out->morph_time_.push_back(time[i]);
+      out->morph_weight_.push_back(weight[i]);
+    }
+    out->morph_offset_.push_back((uint32_t)out->morph_time_.size());
+  }
+
+  if (stats) {
+    *stats = motion_compress_stats();
+    stats->key_count = bone_time_.size() + morph_time_.size();
+    stats->compressed_key_count = out->bone_time_.size() + out->morph_time_.size();
+    stats->size = key_size();
+    stats->compressed_size = out->key_size();
+    // 詰めた方は順に引くので cursor で探す.
+    for (size_t track=0; track<bone_track_count(); ++track) {
+      const float *time = bone_time(track);
+      uint32_t cursor = 0;
+      for (uint32_t i=0; i<bone_key_count(track); ++i) {
+        bool last = (i + 1 == bone_key_count(track));
+        for (int half=0; half<(last ? 1 : 2); ++half) {
+          float frame = half ? (time[i] + time[i + 1]) * 0.5f : time[i];
+          vec3 t0, t1;
+          quarternion r0, r1;
+          evaluate_bone(track, i, frame, &t0, &r0);
+          find_motion_key(out->bone_time(track), out->bone_key_count(track), frame, &cursor);
+          out->evaluate_bone(track, cursor, frame, &t1, &r1);
+          stats->translate_error = std::max(stats->translate_error, translation_error(t0, t1));
+          stats->rotate_error = std::max(stats->rotate_error, rotation_error(r0, r1));
+        }
+      }
+    }
+    for (size_t track=0; track<morph_track_count(); ++track) {
+      const float *time = morph_time(track);
+      uint32_t cursor = 0;
+      for (uint32_t i=0; i<morph_key_count(track); ++i) {
+        find_motion_key(out->morph_time(track), out->morph_key_count(track), time[i], &cursor);
+        float w = out->evaluate_morph(track, cursor, time[i]);
+        stats->morph_error = std::max(stats->morph_error, std::abs(w - morph_weight_[morph_offset_[track] + i]));
+      }
+    }
+  }
+  return out;
+}
+
+
+bool find_motion_key(const float *time, uint32_t count, float frame, uint32_t *cursor)
+{
+  uint32_t c = *cursor;
+  if (c < count) {
+    if (time[c] <= frame) {
+      if ((c + 1 == count) || (frame < time[c + 1])) {
+        return false;
+      }
+      if ((c + 2 == count) || (frame < time[c + 2])) {
+        *cursor = c + 1;
+        return false;
+      }
+    } else if (c == 0) {
+      return false;
+    }
+  }
+  const float *it = std::upper_bound(time, time + count, frame);
+  *cursor = (it == time) ? 0 : (uint32_t)(it - time) - 1;
+  return true;
+}
+
+
+motion_sampler::motion_sampler(motion::ptr_t mot, skeleton::ptr_t skel, morph_set::ptr_t morph)
+  : motion_(mot), morph_(morph), use_cursor_(true), search_count_(0)
+{
+  for (size_t i=0; i<motion_->bone_track_count(); ++i) {
+    int32_t bone = skel->find_bone(motion_->bone_track_name(i));
+    if (bone >= 0) {
+      bone_track_array_.push_back({ (uint32_t)i, (uint32_t)bone });
+    }
+  }
+  if (morph_) {
+    for (size_t i=0; i<motion_->morph_track_count(); ++i) {
+      int32_t m = morph_->find_morph(motion_->morph_track_name(i));
+      if (m >= 0) {
+        morph_track_array_.push_back({ (uint32_t)i, (uint32_t)m });
+      }
+    }
+  }
+  bone_cursor_.resize(bone_track_array_.size(), 0);
+  morph_cursor_.resize(morph_track_array_.size(), 0);
+}
+
+void motion_sampler::apply(float frame, skeleton_pose *pose)
+{
+  apply_pose(frame, pose);
+  for (size_t i=0; i<morph_track_array_.size(); ++i) {
+    morph_->set_weight(morph_track_array_[i].target, sample_morph_track(i, frame));
+  }
+}
+
+void motion_sampler::apply_pose(float frame, skeleton_pose *pose)
+{
+  search_count_ = 0;
+  for (size_t i=0; i<bone_track_array_.size(); ++i) {
+    const auto& tr = bone_track_array_[i];
+    uint32_t& cursor = bone_cursor_[i];
+    if (!use_cursor_) {
+      cursor = (uint32_t)-1;
+    }
+    search_count_ += find_motion_key(motion_->bone_time(tr.track), motion_->bone_key_count(tr.track), frame, &cursor);
+    vec3 t;
+    quarternion r;
+    motion_->evaluate_bone(tr.track, cursor, frame, &t, &r);
+    pose->set_translation(tr.target, t);
+    pose->set_rotation(tr.target, r);
+  }
+}
+
+void motion_sampler::sample_morph(float frame, float *weight)
+{
+  for (size_t i=0; i<morph_track_array_.size(); ++i) {
+    weight[morph_track_array_[i].target] = sample_morph_track(i, frame);
+  }
+}
+
+float motion_sampler::sample_morph_track(size_t i, float frame)
+{
+  const auto& tr = morph_track_array_[i];
+  uint32_t& cursor = morph_cursor_[i];
+  if (!use_cursor_) {
+    cursor = (uint32_t)-1;
+  }
+  search_count_ += find_motion_key(motion_->morph_time(tr.track), motion_->morph_key_count(tr.track), frame, &cursor);
+  return motion_->evaluate_morph(tr.track, cursor, frame);
+}
+
+
+bool bench_motion_compress(const char *vmd_filename, int frames)
+{
+  typedef std::chrono::steady_clock clock;
+
+  vmd_motion_data vmd;
+  if (!load_vmd(&vmd, vmd_filename)) {
+    std::cerr << "cannot load " << vmd_filename << std::endl;
+    return false;
+  }
+  auto mot = motion::make(vmd);
+  printf("motion compress: %zu bone tracks, %zu morph tracks, %.0f frames\n",
+         mot->bone_track_count(), mot->morph_track_count(), mot->frame_count());
+
+  // 全てのトラックを頭から順に引く時間.
+  const float length = std::max(mot->frame_count(), 1.f);
+  auto measure = [&](const motion& m) {
+    std::vector<uint32_t> cursor(m.bone_track_count() + m.morph_track_count(), 0);
+    float sum = 0.f;
+    auto start = clock::now();
+    for (int f=0; f<frames; ++f) {
+      float frame = std::fmod(f * 0.5f, length);
+      for (size_t t=0; t<m.bone_track_count(); ++t) {
+        find_motion_key(m.bone_time(t), m.bone_key_count(t), frame, &cursor[t]);
+        vec3 tr;
+        quarternion r;
+        m.evaluate_bone(t, cursor[t], frame, &tr, &r);
+        sum += tr.x + r.w;
+      }
+      for (size_t t=0; t<m.morph_track_count(); ++t) {
+        uint32_t& c = cursor[m.bone_track_count() + t];
+        find_motion_key(m.morph_time(t), m.morph_key_count(t), frame, &c);
+        sum += m.evaluate_morph(t, c, frame);
+      }
+    }
+    double us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / frames;
+    // 最適化で消されないよう使う.
+    return (sum == 12345.f) ? 0.0 : us;
+  };
+
+  printf("  %-16s: %8zu keys, %9.1f KB, %9.2f us/frame\n",
+         "raw", vmd.bone_key_array.size() + vmd.morph_key_array.size(), mot->key_size() / 1024.0, measure(*mot));
+  const float scale_array[] = { 0.f, 0.5f, 1.f, 2.f, 4.f };
+  for (float scale : scale_array) {
+    for (int quantize=0; quantize<2; ++quantize) {
+      motion_compress_option opt;
+      opt.translate_tolerance *= scale;
+      opt.rotate_tolerance *= scale;
+      opt.morph_tolerance *= scale;
+      opt.quantize_rotation = (quantize != 0);
+      motion_compress_stats st;
+      auto start = clock::now();
+      auto c = mot->compress(opt, &st);
+      double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+      char label[32];
+      snprintf(label, sizeof(label), "x%.1f%s", scale, quantize ? " packed" : "");
+      printf("  %-16s: %8zu keys, %9.1f KB, %9.2f us/frame, %5.2fx, error %.5f / %.5f rad / %.5f, %.1f ms\n",
+             label, st.compressed_key_count, st.compressed_size / 1024.0, measure(*c), st.ratio(),
+             st.translate_error, st.rotate_error, st.morph_error, ms);
+    }
+  }
+
+  return true;
+}
+
+
+bool bench_motion_sample(const char *pmx_filename, const char *vmd_filename, int instances, int frames)
+{
+  typedef std::chrono::steady_clock clock;
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, pmx_filename)) {
+    std::cerr << "cannot load " << pmx_filename << std::endl;
+    return false;
+  }
+  auto start = clock::now();
+  vmd_motion_data vmd;
+  if (!load_vmd(&vmd, vmd_filename)) {
+    std::cerr << "cannot load " << vmd_filename << std::endl;
+    return false;
+  }
+  double load_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+  start = clock::now();
+  auto mot = motion::make(vmd);
+  double build_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+  auto skel = make_pmx_skeleton(data);
+  auto morph = make_pmx_morph(data);
+  std::vector<skeleton_pose::ptr_t> pose_array;
+  std::vector<motion_sampler::ptr_t> sampler_array;
+  for (int i=0; i<instances; ++i) {
+    pose_array.push_back(skeleton_pose::make(skel));
+    sampler_array.push_back(motion_sampler::make(mot, skel, morph));
+  }
+
+  // 60fps で再生する. インスタンスごとに始まりをずらし, 最後まで行ったら頭へ戻る.
+  const float length = std::max(mot->frame_count(), 1.f);
+  auto measure = [&](bool use_cursor, double *search_per_frame) {
+    size_t search = 0;
+    for (auto& s : sampler_array) {
+      s->set_use_cursor(use_cursor);
+    }
+    auto start = clock::now();
+    for (int f=0; f<frames; ++f) {
+      for (int i=0; i<instances; ++i) {
+        float frame = std::fmod(f * 0.5f + i * 7.f, length);
+        sampler_array[i]->apply(frame, pose_array[i].get());
+        search += sampler_array[i]->last_search_count();
+      }
+    }
+    *search_per_frame = (double)search / frames;
+    return std::chrono::duration<double, std::micro>(clock::now() - start).count() / frames;
+  };
+  double cursor_search, binary_search;
+  double cursor_us = measure(true, &cursor_search);
+  double binary_us = measure(false, &binary_search);
+
+  // 表を引いた値と解いた値の差.
+  float max_error = 0.f;
+  bezier_table table;
+  for (const auto& key : vmd.bone_key_array) {
+    for (const auto& c : key.curve) {
+      uint16_t curve = table.add(c[0], c[1], c[2], c[3]);
+      for (int i=0; i<=100; ++i) {
+        float x = i / 100.f;
+        float exact = ((c[0] == c[1]) && (c[2] == c[3])) ? x : bezier_table::solve(c[0], c[1], c[2], c[3], x);
+        max_error = std::max(max_error, std::abs(table.evaluate(curve, x) - exact));
+      }
+    }
+  }
+
+  auto first = sampler_array.empty() ? 0 : sampler_array.front();
+  printf("motion sample: %zu bone keys, %zu morph keys, %.0f frames, %d instances, %d frames\n",
+         vmd.bone_key_array.size(), vmd.morph_key_array.size(), mot->frame_count(), instances, frames);
+  printf("  tracks : %zu bone (%zu in model), %zu morph (%zu in model), %zu curves (max error %.5f)\n",
+         mot->bone_track_count(), first ? first->bone_track_count() : 0,
+         mot->morph_track_count(), first ? first->morph_track_count() : 0,
+         mot->curve_table().curve_count(), max_error);
+  printf("  load   : %9.3f ms, build %.3f ms\n", load_ms, build_ms);
+  printf("  cursor : %9.1f us/frame, %8.1f searches/frame\n", cursor_us, cursor_search);
+  printf("  search : %9.1f us/frame, %8.1f searches/frame\n", binary_us, binary_search);
+
+  return true;
+}
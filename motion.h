@@ -0,0 +1,221 @@
+﻿
+#pragma once
+
+#include "vmd_loader.h"
+#include "skeleton.h"
+#include "morph.h"
+
+
+// VMD の補間曲線 (0..1 の x から y へのベジェ).
+// 制御点ごとに x で等間隔に引いた表を一度だけ作り, 同じ制御点の曲線は表を使い回す.
+class bezier_table
+{
+public:
+  // 表の刻みの数.
+  static const int resolution = 64;
+
+public:
+  // 0 番は直線.
+  bezier_table();
+
+  // 制御点は 0..127. 表の番号を返す. 直線なら 0.
+  uint16_t add(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2);
+  size_t curve_count() const { return value_.size() / (resolution + 1); }
+
+  float evaluate(uint16_t curve, float x) const
+  {
+    if (curve == 0) {
+      return x;
+    }
+    float f = std::clamp(x, 0.f, 1.f) * resolution;
+    int i = std::min((int)f, resolution - 1);
+    const float *v = &value_[curve * (resolution + 1) + i];
+    return v[0] + (v[1] - v[0]) * (f - i);
+  }
+
+  // 表を使わずに解く.
+  static float solve(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, float x);
+
+private:
+  std::vector<float> value_;
+  std::unordered_map<uint32_t, uint16_t> index_map_;
+};
+
+
+// 48 ビットに詰めた回転 (smallest three).
+// 絶対値の一番大きい成分を正にそろえて除き, 残り三つを ±1/√2 の範囲で 15 ビットずつ持つ.
+// 除いた成分の番号は v[0] と v[1] の最上位ビットに入れ, 値は残りから求める.
+struct packed_quarternion
+{
+  uint16_t v[3];
+
+  static packed_quarternion pack(const quarternion&);
+  quarternion unpack() const;
+};
+
+
+struct motion_compress_option
+{
+  // チャンネルごとの許容誤差. 移動はモデルの単位 (軸ごと), 回転はラジアン, モーフは重み.
+  float translate_tolerance = 0.005f;
+  float rotate_tolerance = 0.002f;
+  float morph_tolerance = 0.005f;
+  // 回転を packed_quarternion に詰める.
+  bool quantize_rotation = true;
+};
+
+struct motion_compress_stats
+{
+  // ボーンとモーフのキーの数.
+  size_t key_count;
+  size_t compressed_key_count;
+  // キーの配列のバイト数.
+  size_t size;
+  size_t compressed_size;
+  // 元のキーとキーの中間で比べた一番大きな誤差.
+  float translate_error;
+  float rotate_error;
+  float morph_error;
+
+  float ratio() const { return compressed_size ? (float)size / compressed_size : 0.f; }
+};
+
+
+// モーション. キーはトラック (ボーンやモーフ一つ) ごとにフレーム順に並べ,
+// 時間, 値, 補間曲線を別々の配列 (SoA) で持つ. トラックの区切りは [offset[i], offset[i + 1]).
+class motion
+{
+public:
+  typedef std::shared_ptr<motion> ptr_t;
+
+public:
+  motion(const vmd_motion_data&);
+
+  // 最後のキーのフレーム.
+  float frame_count() const { return frame_count_; }
+
+  size_t bone_track_count() const { return bone_name_array_.size(); }
+  const std::string& bone_track_name(size_t i) const { return bone_name_array_[i]; }
+  uint32_t bone_key_count(size_t track) const { return bone_offset_[track + 1] - bone_offset_[track]; }
+  const float *bone_time(size_t track) const { return &bone_time_[bone_offset_[track]]; }
+  // key 番目と次のキーの間の frame での値. key は frame を挟むキー (find_motion_key の結果).
+  void evaluate_bone(size_t track, uint32_t key, float frame, vec3 *translate, quarternion *rotate) const;
+
+  size_t morph_track_count() const { return morph_name_array_.size(); }
+  const std::string& morph_track_name(size_t i) const { return morph_name_array_[i]; }
+  uint32_t morph_key_count(size_t track) const { return morph_offset_[track + 1] - morph_offset_[track]; }
+  const float *morph_time(size_t track) const { return &morph_time_[morph_offset_[track]]; }
+  float evaluate_morph(size_t track, uint32_t key, float frame) const;
+
+  const bezier_table& curve_table() const { return curve_table_; }
+
+  // 許容誤差の中で前後のキーから直線で作り直せるキーを除き, 回転を詰めたモーションを作る.
+  // 除いた区間の補間は直線になる. 再生は詰めたまま引く.
+  ptr_t compress(const motion_compress_option& = motion_compress_option(), motion_compress_stats* = 0) const;
+  bool is_quantized() const { return !bone_rotate_packed_.empty(); }
+  // キーの配列のバイト数.
+  size_t key_size() const;
+
+private:
+  quarternion bone_rotation(uint32_t k) const
+  {
+    return bone_rotate_packed_.empty() ? bone_rotate_[k] : bone_rotate_packed_[k].unpack();
+  }
+
+private:
+  std::vector<std::string> bone_name_array_;
+  std::vector<uint32_t> bone_offset_;
+  std::vector<float> bone_time_;
+  std::vector<vec3> bone_translate_;
+  std::vector<quarternion> bone_rotate_;
+  // 詰めた時は bone_rotate_ の代わりにこちら.
+  std::vector<packed_quarternion> bone_rotate_packed_;
+  // キーごとに X, Y, Z の移動と回転の 4 つ. 前のキーからこのキーまでの曲線.
+  std::vector<uint16_t> bone_curve_;
+
+  std::vector<std::string> morph_name_array_;
+  std::vector<uint32_t> morph_offset_;
+  std::vector<float> morph_time_;
+  std::vector<float> morph_weight_;
+
+  bezier_table curve_table_;
+  float frame_count_;
+
+public:
+  static auto make(const vmd_motion_data& data)
+  {
+    return std::make_shared<motion>(data);
+  }
+};
+
+// 時間順の time[0, count) から frame を挟むキー (time[i] <= frame < time[i + 1]) を *cursor に入れる.
+// 最初のキーより前なら 0. *cursor が前に呼んだ時の結果なら, 順に再生する間はその位置か次で済む.
+// 二分探索したら true.
+bool find_motion_key(const float *time, uint32_t count, float frame, uint32_t *cursor);
+
+
+// モーションをスケルトンの姿勢とモーフの重みへ流す.
+// トラックとボーン, モーフの対応と, トラックごとに前に引いたキーの位置 (cursor) を持つ.
+// cursor は再生位置ごとなので, インスタンスごとに一つ作る.
+class motion_sampler
+{
+public:
+  typedef std::shared_ptr<motion_sampler> ptr_t;
+
+public:
+  // モデルに無いボーンやモーフのトラックは使わない. morph は無ければ 0.
+  motion_sampler(motion::ptr_t, skeleton::ptr_t, morph_set::ptr_t);
+
+  motion::ptr_t get_motion() { return motion_; }
+  morph_set::ptr_t get_morph() { return morph_; }
+  size_t bone_track_count() const { return bone_track_array_.size(); }
+  size_t morph_track_count() const { return morph_track_array_.size(); }
+  // i 番目のモーフのトラックが動かす morph_set のモーフの番号.
+  uint32_t morph_track_target(size_t i) const { return morph_track_array_[i].target; }
+
+  // frame での回転と移動を pose へ, 重みを morph_set へ入れる.
+  // モーフはモデルで共有なので, 同じモデルの他のインスタンスと取り合う.
+  void apply(float frame, skeleton_pose*);
+  // apply() の回転と移動だけ.
+  void apply_pose(float frame, skeleton_pose*);
+  // apply() の重みを morph_set の代わりに weight (morph_count() 個) へ入れる.
+  // トラックの無いモーフの重みは変えない. morph_set に触らないので, 同じモデルのインスタンスを並べて呼べる.
+  void sample_morph(float frame, float *weight);
+
+  // false にすると cursor を使わず, 毎回二分探索で探す. 比較用.
+  void set_use_cursor(bool b) { use_cursor_ = b; }
+  // 前の apply() で二分探索したトラックの数.
+  size_t last_search_count() const { return search_count_; }
+
+private:
+  struct track
+  {
+    uint32_t track;
+    uint32_t target;
+  };
+
+private:
+  float sample_morph_track(size_t i, float frame);
+
+private:
+  motion::ptr_t motion_;
+  morph_set::ptr_t morph_;
+  std::vector<track> bone_track_array_;
+  std::vector<track> morph_track_array_;
+  std::vector<uint32_t> bone_cursor_;
+  std::vector<uint32_t> morph_cursor_;
+  bool use_cursor_;
+  size_t search_count_;
+
+public:
+  static auto make(motion::ptr_t mot, skeleton::ptr_t skel, morph_set::ptr_t morph)
+  {
+    return std::make_shared<motion_sampler>(mot, skel, morph);
+  }
+};
+
+// 許容誤差を変えて詰めた時の大きさと誤差, 詰めたまま引く時間を比べる.
+bool bench_motion_compress(const char *vmd_filename, int frames);
+
+// インスタンスごとに再生位置をずらして, 順に再生した時の引く時間を cursor の有無で比べる.
+bool bench_motion_sample(const char *pmx_filename, const char *vmd_filename, int instances, int frames);
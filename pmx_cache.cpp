@@ -0,0 +1,573 @@
+﻿
+#include "stdafx.h"
+
+#include "pmx_cache.h"
+
+#include "util.h"
+#include "mapped_file.h"
+#include "byte_reader.h"
+
+
+namespace {
+
+const uint8_t cache_signature[4] = { 'C', 'U', 'T', 'B' };
+const uint32_t cache_version = 8;
+// 頂点ブロックの先頭の揃え.
+const size_t cache_alignment = 16;
+
+// ヘッダ. 各ブロックの位置はファイル先頭からのバイト数.
+struct cache_header
+{
+  uint8_t sig[4];
+  uint32_t version;
+  uint32_t sizeof_vertex;
+  uint32_t sizeof_index;
+  uint32_t flags;
+  pmx_source_key source;
+  uint64_t vertex_offset;
+  uint64_t vertex_count;
+  uint64_t index_offset;
+  uint64_t index_count;
+  uint64_t meta_offset;
+};
+
+bool read_header(byte_reader& r, cache_header *h)
+{
+  read_uint8(r, h->sig, 4);
+  read_uint32(r, &h->version);
+  read_uint32(r, &h->sizeof_vertex);
+  read_uint32(r, &h->sizeof_index);
+  read_uint32(r, &h->flags);
+  read_uint64(r, &h->source.size);
+  read_int64(r, &h->source.mtime);
+  read_uint64(r, &h->source.hash);
+  read_uint64(r, &h->vertex_offset);
+  read_uint64(r, &h->vertex_count);
+  read_uint64(r, &h->index_offset);
+  read_uint64(r, &h->index_count);
+  read_uint64(r, &h->meta_offset);
+  return !r.fail();
+}
+
+void write_header(std::ostream& f, const cache_header& h)
+{
+  write_uint8(f, h.sig, 4);
+  write_uint32(f, &h.version);
+  write_uint32(f, &h.sizeof_vertex);
+  write_uint32(f, &h.sizeof_index);
+  write_uint32(f, &h.flags);
+  write_uint64(f, &h.source.size);
+  write_int64(f, &h.source.mtime);
+  write_uint64(f, &h.source.hash);
+  write_uint64(f, &h.vertex_offset);
+  write_uint64(f, &h.vertex_count);
+  write_uint64(f, &h.index_offset);
+  write_uint64(f, &h.index_count);
+  write_uint64(f, &h.meta_offset);
+}
+
+// ヘッダの直列化後の大きさ.
+const size_t header_size = 4 + 4 * 4 + 8 * 3 + 8 * 5;
+// ヘッダの中の source.mtime の位置.
+const size_t header_mtime_offset = 4 + 4 * 4 + 8;
+
+size_t align_up(size_t v, size_t a)
+{
+  return (v + a - 1) / a * a;
+}
+
+// [offset, offset + count * elem_size) がファイルに収まっているか.
+bool is_in_file(uint64_t offset, uint64_t count, size_t elem_size, size_t file_size)
+{
+  return (offset <= file_size) && (count <= (file_size - offset) / elem_size);
+}
+
+// インデックスがどれも vertex_count より小さいか.
+template<class T>
+bool is_index_in_range(const T *index_array, size_t count, uint64_t vertex_count)
+{
+  T max_index = 0;
+  for (size_t i=0; i<count; ++i) {
+    max_index = std::max(max_index, index_array[i]);
+  }
+  return (count == 0) || (max_index < vertex_count);
+}
+
+// キャッシュを作った時のソースと同じか.
+// 更新日時が変わっていた時だけ中身のハッシュで確かめ, 同じなら *mtime に今の更新日時を入れる.
+bool is_same_source(const pmx_source_key& key, const char *source_filename, int64_t *mtime)
+{
+  std::error_code ec;
+  uint64_t size = std::filesystem::file_size(source_filename, ec);
+  if (ec || (size != key.size)) {
+    return false;
+  }
+  *mtime = pmx_source_mtime(source_filename);
+  if (*mtime == key.mtime) {
+    return true;
+  }
+  mapped_file source;
+  if (!source.open(source_filename)) {
+    return false;
+  }
+  return hash64(source.data(), source.size()) == key.hash;
+}
+
+// ヘッダの source.mtime だけを書き換える. マッピングを閉じてから呼ぶ.
+bool update_source_mtime(const char *cache_filename, int64_t mtime)
+{
+  std::fstream f(cache_filename, std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+  if (f.fail()) {
+    return false;
+  }
+  f.seekp(header_mtime_offset);
+  write_int64(f, &mtime);
+  return !f.fail();
+}
+
+void read_cache_string(byte_reader& r, std::string *str)
+{
+  uint32_t len = 0;
+  read_uint32(r, &len);
+  const uint8_t *p = r.advance(len);
+  if (!p) {
+    str->clear();
+    return;
+  }
+  str->assign((const char*)p, len);
+}
+
+void write_cache_string(std::ostream& f, const std::string& str)
+{
+  uint32_t len = (uint32_t)str.size();
+  write_uint32(f, &len);
+  f.write(str.data(), len);
+}
+
+// 個数を読んで配列を用意する. 残りより多い個数は壊れている.
+template<class T>
+bool read_cache_array_size(byte_reader& r, std::vector<T> *array)
+{
+  uint32_t cnt = 0;
+  read_uint32(r, &cnt);
+  if (r.fail() || (cnt > r.remain())) {
+    return false;
+  }
+  array->resize(cnt);
+  return true;
+}
+
+template<class T>
+void write_cache_array_size(std::ostream& f, const std::vector<T>& array)
+{
+  uint32_t cnt = (uint32_t)array.size();
+  write_uint32(f, &cnt);
+}
+
+bool read_cache_morph(byte_reader& r, pmx_model_morph *morph)
+{
+  read_cache_string(r, &morph->name);
+  read_uint8(r, &morph->panel);
+  read_uint8(r, &morph->type);
+  if (!read_cache_array_size(r, &morph->group_array)) {
+    return false;
+  }
+  for (auto& ofs : morph->group_array) {
+    read_int32(r, &ofs.morph);
+    read_float(r, &ofs.rate);
+  }
+  if (!read_cache_array_size(r, &morph->vertex_array)) {
+    return false;
+  }
+  for (auto& ofs : morph->vertex_array) {
+    read_uint32(r, &ofs.vertex);
+    read_float(r, as_array(ofs.translate), 3);
+  }
+  if (!read_cache_array_size(r, &morph->uv_array)) {
+    return false;
+  }
+  for (auto& ofs : morph->uv_array) {
+    read_uint32(r, &ofs.vertex);
+    read_float(r, as_array(ofs.translate), 4);
+  }
+  if (!read_cache_array_size(r, &morph->bone_array)) {
+    return false;
+  }
+  for (auto& ofs : morph->bone_array) {
+    read_int32(r, &ofs.bone);
+    read_float(r, as_array(ofs.translate), 3);
+    read_float(r, as_array(ofs.rotate.v), 3);
+    read_float(r, &ofs.rotate.w);
+  }
+  if (!read_cache_array_size(r, &morph->material_array)) {
+    return false;
+  }
+  for (auto& ofs : morph->material_array) {
+    read_int32(r, &ofs.material);
+    read_uint8(r, &ofs.op);
+    for (color *c : { &ofs.diffuse, &ofs.specular, &ofs.ambient, &ofs.edge_color,
+                      &ofs.tex_coef, &ofs.sphere_tex_coef, &ofs.toon_tex_coef }) {
+      read_float(r, as_array(*c), 4);
+    }
+    read_float(r, &ofs.edge_size);
+  }
+  return !r.fail();
+}
+
+void write_cache_morph(std::ostream& f, const pmx_model_morph& morph)
+{
+  write_cache_string(f, morph.name);
+  write_uint8(f, &morph.panel);
+  write_uint8(f, &morph.type);
+  write_cache_array_size(f, morph.group_array);
+  for (const auto& ofs : morph.group_array) {
+    write_int32(f, &ofs.morph);
+    write_float(f, &ofs.rate);
+  }
+  write_cache_array_size(f, morph.vertex_array);
+  for (const auto& ofs : morph.vertex_array) {
+    write_uint32(f, &ofs.vertex);
+    write_float(f, as_array(ofs.translate), 3);
+  }
+  write_cache_array_size(f, morph.uv_array);
+  for (const auto& ofs : morph.uv_array) {
+    write_uint32(f, &ofs.vertex);
+    write_float(f, as_array(ofs.translate), 4);
+  }
+  write_cache_array_size(f, morph.bone_array);
+  for (const auto& ofs : morph.bone_array) {
+    write_int32(f, &ofs.bone);
+    write_float(f, as_array(ofs.translate), 3);
+    write_float(f, as_array(ofs.rotate.v), 3);
+    write_float(f, &ofs.rotate.w);
+  }
+  write_cache_array_size(f, morph.material_array);
+  for (const auto& ofs : morph.material_array) {
+    write_int32(f, &ofs.material);
+    write_uint8(f, &ofs.op);
+    for (const color *c : { &ofs.diffuse, &ofs.specular, &ofs.ambient, &ofs.edge_color,
+                            &ofs.tex_coef, &ofs.sphere_tex_coef, &ofs.toon_tex_coef }) {
+      write_float(f, as_array(*c), 4);
+    }
+    write_float(f, &ofs.edge_size);
+  }
+}
+
+} // end of anonymus namespace
+
+
+int64_t pmx_source_mtime(const char *filename)
+{
+  std::error_code ec;
+  auto t = std::filesystem::last_write_time(filename, ec);
+  if (ec) {
+    return 0;
+  }
+  return (int64_t)t.time_since_epoch().count();
+}
+
+pmx_source_key make_pmx_source_key(const char *filename, const void *data, size_t size)
+{
+  pmx_source_key key;
+  key.size = size;
+  key.mtime = pmx_source_mtime(filename);
+  key.hash = hash64(data, size);
+  return key;
+}
+
+std::string pmx_cache_filename(const char *filename)
+{
+  return std::string(filename) + ".cutbin";
+}
+
+
+bool read_pmx_cache(pmx_model_data *out, const char *cache_filename, const char *source_filename,
+                    uint32_t flags)
+{
+  auto file = std::make_shared<mapped_file>();
+  if (!file->open(cache_filename)) {
+    return false;
+  }
+  byte_reader r(file->data(), file->size());
+  cache_header h;
+  if (!read_header(r, &h) ||
+      (std::memcmp(h.sig, cache_signature, 4) != 0) ||
+      (h.version != cache_version) ||
+      (h.flags != flags) ||
+      (h.sizeof_vertex != sizeof(pmx_model_vertex)) ||
+      ((h.sizeof_index != 2) && (h.sizeof_index != 4))) {
+    return false;
+  }
+  GLenum index_type = (h.sizeof_index == 2) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  int64_t source_mtime = 0;
+  if (!is_same_source(h.source, source_filename, &source_mtime)) {
+    return false;
+  }
+  if (source_mtime != h.source.mtime) {
+    // チェックアウトやコピーで日時だけ変わった. 毎回ソース全体をハッシュしないよう,
+    // 次からは日時で済むように書き直して開き直す. 書けなくても今回は使える.
+    file->close();
+    update_source_mtime(cache_filename, source_mtime);
+    if (!file->open(cache_filename)) {
+      return false;
+    }
+    r = byte_reader(file->data(), file->size());
+  }
+  if ((h.vertex_offset % cache_alignment != 0) ||
+      (h.index_offset % h.sizeof_index != 0) ||
+      !is_in_file(h.vertex_offset, h.vertex_count, sizeof(pmx_model_vertex), file->size()) ||
+      !is_in_file(h.index_offset, h.index_count, h.sizeof_index, file->size()) ||
+      (h.meta_offset > file->size())) {
+    return false;
+  }
+
+  // 材質とテクスチャ.
+  r.seek((size_t)h.meta_offset);
+  uint32_t section_cnt = 0;
+  read_uint32(r, &section_cnt);
+  if (r.fail() || (section_cnt > r.remain())) {
+    return false;
+  }
+  std::vector<pmx_section> section_array(section_cnt);
+  for (auto& sec : section_array) {
+    read_uint32(r, &sec.index_offset);
+    read_uint32(r, &sec.index_count);
+    read_float(r, as_array(sec.diffuse), 4);
+    read_float(r, as_array(sec.specular), 4);
+    read_float(r, as_array(sec.ambient), 4);
+    read_float(r, as_array(sec.edge_color), 4);
+    read_float(r, &sec.edge_size);
+    read_uint8(r, &sec.flags);
+    read_uint8(r, &sec.sphere_mode);
+    uint8_t is_common_toon_tex;
+    read_uint8(r, &is_common_toon_tex);
+    sec.is_common_toon_tex = is_common_toon_tex != 0;
+    read_int32(r, &sec.texid);
+    read_int32(r, &sec.sphere_texid);
+    read_int32(r, &sec.toon_texid);
+    if (r.fail() || ((uint64_t)sec.index_offset + sec.index_count > h.index_count)) {
+      return false;
+    }
+  }
+  uint32_t texture_cnt = 0;
+  read_uint32(r, &texture_cnt);
+  if (r.fail() || (texture_cnt > r.remain())) {
+    return false;
+  }
+  std::vector<std::string> texture_path_array(texture_cnt);
+  for (auto& path : texture_path_array) {
+    read_cache_string(r, &path);
+  }
+  if (r.fail()) {
+    return false;
+  }
+  uint32_t sdef_cnt = 0;
+  read_uint32(r, &sdef_cnt);
+  if (r.fail() || (sdef_cnt > h.vertex_count)) {
+    return false;
+  }
+  std::vector<pmx_sdef> sdef_array(sdef_cnt);
+  for (auto& sdef : sdef_array) {
+    read_uint32(r, &sdef.vertex);
+    read_float(r, as_array(sdef.c), 3);
+    read_float(r, as_array(sdef.r0), 3);
+    read_float(r, as_array(sdef.r1), 3);
+    if (r.fail() || (sdef.vertex >= h.vertex_count)) {
+      return false;
+    }
+  }
+  uint32_t bone_cnt = 0;
+  read_uint32(r, &bone_cnt);
+  if (r.fail() || (bone_cnt > r.remain())) {
+    return false;
+  }
+  std::vector<pmx_model_bone> bone_array(bone_cnt);
+  for (auto& bone : bone_array) {
+    read_cache_string(r, &bone.name);
+    read_float(r, as_array(bone.pos), 3);
+    read_int32(r, &bone.parent);
+    read_int32(r, &bone.level);
+    read_uint16(r, &bone.flags);
+    read_int32(r, &bone.assign_bone);
+    read_float(r, &bone.assign_rate);
+    read_int32(r, &bone.ik_target_bone);
+    read_int32(r, &bone.ik_loop_count);
+    read_float(r, &bone.ik_loop_limit);
+    uint32_t link_cnt = 0;
+    read_uint32(r, &link_cnt);
+    if (r.fail() || (link_cnt > r.remain())) {
+      return false;
+    }
+    bone.ik_link_array.resize(link_cnt);
+    for (auto& link : bone.ik_link_array) {
+      read_int32(r, &link.bone);
+      read_uint8(r, &link.angle_limit);
+      read_float(r, as_array(link.min_angle), 3);
+      read_float(r, as_array(link.max_angle), 3);
+    }
+  }
+  std::vector<pmx_model_morph> morph_array;
+  if (!read_cache_array_size(r, &morph_array)) {
+    return false;
+  }
+  for (auto& morph : morph_array) {
+    if (!read_cache_morph(r, &morph)) {
+      return false;
+    }
+    for (const auto& ofs : morph.vertex_array) {
+      if (ofs.vertex >= h.vertex_count) {
+        return false;
+      }
+    }
+    for (const auto& ofs : morph.uv_array) {
+      if (ofs.vertex >= h.vertex_count) {
+        return false;
+      }
+    }
+  }
+  if (r.fail()) {
+    return false;
+  }
+  for (const auto& sec : section_array) {
+    if ((sec.texid >= (int32_t)texture_cnt) ||
+        (sec.sphere_texid >= (int32_t)texture_cnt) ||
+        (!sec.is_common_toon_tex && (sec.toon_texid >= (int32_t)texture_cnt))) {
+      return false;
+    }
+  }
+
+  // 頂点はマッピングのまま使い直せないので, 範囲外のボーンを指していたらキャッシュごと捨てる.
+  const pmx_model_vertex *vertex_array = (const pmx_model_vertex*)(file->data() + h.vertex_offset);
+  for (size_t i=0; i<(size_t)h.vertex_count; ++i) {
+    for (int k=0; k<4; ++k) {
+      if ((vertex_array[i].weight[k] != 0.f) && ((size_t)vertex_array[i].bone[k] >= bone_array.size())) {
+        return false;
+      }
+    }
+  }
+
+  // 範囲外の頂点を指すインデックスは描く時に未定義の読み出しになるので, これもキャッシュごと捨てる.
+  const uint8_t *index_array = file->data() + h.index_offset;
+  if ((h.sizeof_index == 2) ?
+      !is_index_in_range((const uint16_t*)index_array, (size_t)h.index_count, h.vertex_count) :
+      !is_index_in_range((const uint32_t*)index_array, (size_t)h.index_count, h.vertex_count)) {
+    return false;
+  }
+
+  out->vertex_array = vertex_array;
+  out->vertex_count = (size_t)h.vertex_count;
+  out->index_type = index_type;
+  out->index_array = index_array;
+  out->index_count = (size_t)h.index_count;
+  out->section_array = std::move(section_array);
+  out->texture_path_array = std::move(texture_path_array);
+  out->sdef_array = std::move(sdef_array);
+  out->bone_array = std::move(bone_array);
+  out->morph_array = std::move(morph_array);
+  out->base_dir = std::filesystem::path(source_filename).remove_filename();
+  out->holder = file;
+
+  return true;
+}
+
+
+bool write_pmx_cache(const char *cache_filename, const pmx_model_data& data, const pmx_source_key& key,
+                     uint32_t flags)
+{
+  cache_header h;
+  std::memcpy(h.sig, cache_signature, 4);
+  h.version = cache_version;
+  h.sizeof_vertex = sizeof(pmx_model_vertex);
+  h.sizeof_index = (uint32_t)index_type_size(data.index_type);
+  h.flags = flags;
+  h.source = key;
+  h.vertex_offset = align_up(header_size, cache_alignment);
+  h.vertex_count = data.vertex_count;
+  h.index_offset = h.vertex_offset + sizeof(pmx_model_vertex) * data.vertex_count;
+  h.index_count = data.index_count;
+  h.meta_offset = h.index_offset + h.sizeof_index * data.index_count;
+
+  // 書きかけのファイルが残らないよう, 一時ファイルに書いてから置き換える.
+  std::string tmp_filename = std::string(cache_filename) + ".tmp";
+  std::ofstream f;
+  f.open(tmp_filename, std::ios_base::binary | std::ios_base::trunc);
+  if (f.fail()) {
+    return false;
+  }
+  write_header(f, h);
+  const uint8_t padding[cache_alignment] = {};
+  f.write((const char*)padding, h.vertex_offset - header_size);
+  f.write((const char*)data.vertex_array, sizeof(pmx_model_vertex) * data.vertex_count);
+  f.write((const char*)data.index_array, h.sizeof_index * data.index_count);
+
+  uint32_t section_cnt = (uint32_t)data.section_array.size();
+  write_uint32(f, &section_cnt);
+  for (const auto& sec : data.section_array) {
+    write_uint32(f, &sec.index_offset);
+    write_uint32(f, &sec.index_count);
+    write_float(f, as_array(sec.diffuse), 4);
+    write_float(f, as_array(sec.specular), 4);
+    write_float(f, as_array(sec.ambient), 4);
+    write_float(f, as_array(sec.edge_color), 4);
+    write_float(f, &sec.edge_size);
+    write_uint8(f, &sec.flags);
+    write_uint8(f, &sec.sphere_mode);
+    uint8_t is_common_toon_tex = sec.is_common_toon_tex ? 1 : 0;
+    write_uint8(f, &is_common_toon_tex);
+    write_int32(f, &sec.texid);
+    write_int32(f, &sec.sphere_texid);
+    write_int32(f, &sec.toon_texid);
+  }
+  uint32_t texture_cnt = (uint32_t)data.texture_path_array.size();
+  write_uint32(f, &texture_cnt);
+  for (const auto& path : data.texture_path_array) {
+    write_cache_string(f, path);
+  }
+  uint32_t sdef_cnt = (uint32_t)data.sdef_array.size();
+  write_uint32(f, &sdef_cnt);
+  for (const auto& sdef : data.sdef_array) {
+    write_uint32(f, &sdef.vertex);
+    write_float(f, as_array(sdef.c), 3);
+    write_float(f, as_array(sdef.r0), 3);
+    write_float(f, as_array(sdef.r1), 3);
+  }
+  uint32_t bone_cnt = (uint32_t)data.bone_array.size();
+  write_uint32(f, &bone_cnt);
+  for (const auto& bone : data.bone_array) {
+    write_cache_string(f, bone.name);
+    write_float(f, as_array(bone.pos), 3);
+    write_int32(f, &bone.parent);
+    write_int32(f, &bone.level);
+    write_uint16(f, &bone.flags);
+    write_int32(f, &bone.assign_bone);
+    write_float(f, &bone.assign_rate);
+    write_int32(f, &bone.ik_target_bone);
+    write_int32(f, &bone.ik_loop_count);
+    write_float(f, &bone.ik_loop_limit);
+    uint32_t link_cnt = (uint32_t)bone.ik_link_array.size();
+    write_uint32(f, &link_cnt);
+    for (const auto& link : bone.ik_link_array) {
+      write_int32(f, &link.bone);
+      write_uint8(f, &link.angle_limit);
+      write_float(f, as_array(link.min_angle), 3);
+      write_float(f, as_array(link.max_angle), 3);
+    }
+  }
+  write_cache_array_size(f, data.morph_array);
+  for (const auto& morph : data.morph_array) {
+    write_cache_morph(f, morph);
+  }
+  f.close();
+  if (f.fail()) {
+    std::filesystem::remove(tmp_filename);
+    return false;
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_filename, cache_filename, ec);
+  if (ec) {
+    std::filesystem::remove(tmp_filename, ec);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,31 @@
+﻿
+#pragma once
+
+#include "pmx_model.h"
+
+
+// キャッシュの元になった PMX ファイルを識別する値.
+struct pmx_source_key
+{
+  uint64_t size;
+  int64_t mtime;
+  uint64_t hash;
+};
+int64_t pmx_source_mtime(const char *filename);
+pmx_source_key make_pmx_source_key(const char *filename, const void *data, size_t size);
+
+enum PMXCacheFlag
+{
+  // 頂点キャッシュ向けに並べ替えてある.
+  PMXCache_OptimizedMesh = 0x01,
+};
+
+// filename.pmx に対するキャッシュのファイル名 (filename.pmx.cutbin).
+std::string pmx_cache_filename(const char *filename);
+
+// キャッシュをメモリマップで開く.
+// source_filename や flags (PMXCacheFlag) と合わない (古い, 壊れている) 場合は false.
+bool read_pmx_cache(pmx_model_data *out, const char *cache_filename, const char *source_filename,
+                    uint32_t flags);
+bool write_pmx_cache(const char *cache_filename, const pmx_model_data&, const pmx_source_key&,
+                     uint32_t flags);
@@ -4,40 +4,86 @@
 #include "pmx_loader.h"
 
 #include "util.h"
+#include "mapped_file.h"
+#include "byte_reader.h"
+#include "pmx_cache.h"
+#include "utf.h"
+#include "mesh_optimizer.h"
 
 
 namespace {
 
+vertex_decl pmx_model_vertex_decl[] = {
+  { Semantics_Position, GL_FLOAT, 3, offsetof(pmx_model_vertex, pos), sizeof(pmx_model_vertex) },
+  { Semantics_Normal, GL_FLOAT, 3, offsetof(pmx_model_vertex, nml), sizeof(pmx_model_vertex) },
+  { Semantics_TexCoord_0, GL_FLOAT, 2, offsetof(pmx_model_vertex, uv), sizeof(pmx_model_vertex) },
+  { Semantics_BoneIndex, GL_UNSIGNED_INT, 4, offsetof(pmx_model_vertex, bone), sizeof(pmx_model_vertex) },
+  { Semantics_BoneWeight, GL_FLOAT, 4, offsetof(pmx_model_vertex, weight), sizeof(pmx_model_vertex) },
+};
+
+} // end of anonymus namespace
+
+vertex_decl_array_t get_pmx_model_vertex_decl()
+{
+  return vertex_decl_array_t(std::begin(pmx_model_vertex_decl),
+                             std::end(pmx_model_vertex_decl));
+}
+
+
+namespace {
+
+bool s_trace_enabled = true;
+
+// 非同期読み込みで一回のタスクが転送する頂点データの上限.
+const size_t upload_chunk_size = 1024 * 1024;
 
 template<class... Args>
 void pmx_trace(const char *s, Args... args)
 {
+  if (!s_trace_enabled) {
+    return;
+  }
   char buf[256];
   snprintf(buf, countof(buf), s, args...);
   std::cout << buf;
 }
 
-std::string utf8_from_utf16(const std::wstring& u16str)
+// UTF-16 の文字列を len 文字読む. byte_reader ならコピーせずにそのまま指す.
+const char16_t *read_utf16(std::istream& f, size_t len, std::u16string *buf)
 {
-  size_t size = ::WideCharToMultiByte(CP_UTF8, 0, u16str.c_str(), (int)u16str.size(), 0, 0, 0, 0);
-  std::string r;
-  r.assign(size, '\0');
-  ::WideCharToMultiByte(CP_UTF8, 0, u16str.c_str(), (int)u16str.size(), &r[0], (int)r.size(), 0, 0);
-  return r;
+  buf->resize(len);
+  f.read((char*)&(*buf)[0], len * sizeof(char16_t));
+  return buf->data();
+}
+const char16_t *read_utf16(byte_reader& r, size_t len, std::u16string*)
+{
+  return (const char16_t*)r.advance(len * sizeof(char16_t));
 }
 
-void read_pmx_textbuf(std::ifstream& f, bool utf8, std::string *str)
+template<class StreamT>
+void read_pmx_textbuf(StreamT& f, bool utf8, std::string *str)
 {
-  int32_t len;
+  int32_t len = 0;
   read_int32(f, &len);
+  if (f.fail() || (len <= 0)) {
+    str->clear();
+    return;
+  }
   if (utf8) {
     str->assign(len, '\0');
     f.read(&((*str)[0]), len);
   } else {
-    std::wstring u16str;
-    u16str.assign(len, '\0');
-    f.read((char*)&u16str[0], len);
-    *str = utf8_from_utf16(u16str);
+    // 名前ごとに一時領域を確保しないよう, スレッドごとに使い回す.
+    static thread_local std::u16string u16buf;
+    static thread_local std::string u8buf;
+    const char16_t *p = read_utf16(f, len / 2, &u16buf);
+    skip_bytes(f, len % 2);
+    if (!p || f.fail()) {
+      str->clear();
+      return;
+    }
+    utf8_from_utf16(&u8buf, p, len / 2);
+    str->assign(u8buf);
   }
 }
 
@@ -47,8 +93,14 @@ enum PMX_ByteSize
   PMX_Short = 2,
   PMX_Int = 4,
 };
-void read_pmx_variable(std::ifstream& f, int pmx_bytesize, uint32_t *p, int n = 1)
+template<class StreamT>
+void read_pmx_variable(StreamT& f, int pmx_bytesize, uint32_t *p, int n = 1)
 {
+  if (pmx_bytesize == PMX_Int) {
+    // 幅が同じならまとめて読める.
+    read_uint32(f, p, n);
+    return;
+  }
   for (int i=0; i<n; ++i) {
     switch (pmx_bytesize) {
     case PMX_Byte: {
@@ -70,7 +122,8 @@ void read_pmx_variable(std::ifstream& f, int pmx_bytesize, uint32_t *p, int n =
   }
 }
 
-void read_pmx_variable_signed(std::ifstream& f, int pmx_bytesize, int32_t *p, int n = 1)
+template<class StreamT>
+void read_pmx_variable_signed(StreamT& f, int pmx_bytesize, int32_t *p, int n = 1)
 {
   for (int i=0; i<n; ++i) {
     switch (pmx_bytesize) {
@@ -99,77 +152,7 @@ enum PMXWeightType
   PMX_BDEF2,
   PMX_BDEF4,
   PMX_SDEF,
-};
-
-struct pmx_vertex
-{
-  vec3 pos;
-  vec3 nml;
-  vec2 uv;
-  vec4 additional_uv[4];
-  uint8_t weight_type;
-  union {
-    struct {
-      uint32_t bone;
-    } bdef1;
-    struct {
-      uint32_t bone[2];
-      float weight;
-    } bdef2;
-    struct {
-      uint32_t bone[4];
-      float weight[4];
-    } bdef4;
-    struct {
-      uint32_t bone[2];
-      float weight;
-      vec3 c;
-      vec3 r0;
-      vec3 r1;
-    } sdef;
-  };
-  float edge_scale;
-
-  pmx_vertex() {}
-  pmx_vertex(const pmx_vertex& o)
-  {
-    std::memcpy(this, &o, sizeof(*this));
-  }
-};
-
-struct pmx_model_vertex
-{
-  vec3 pos;
-  vec3 nml;
-  vec2 uv;
-  uint32_t bone[4];
-  float weight[4];
-};
-vertex_decl pmx_model_vertex_decl[] = {
-  { Semantics_Position, GL_FLOAT, 3, offsetof(pmx_model_vertex, pos), sizeof(pmx_model_vertex) },
-  { Semantics_Normal, GL_FLOAT, 3, offsetof(pmx_model_vertex, nml), sizeof(pmx_model_vertex) },
-  { Semantics_TexCoord_0, GL_FLOAT, 2, offsetof(pmx_model_vertex, uv), sizeof(pmx_model_vertex) },
-};
-vertex_decl_array_t get_pmx_model_vertex_decl()
-{
-  return vertex_decl_array_t(std::begin(pmx_model_vertex_decl),
-                             std::end(pmx_model_vertex_decl));
-}
-
-enum PMXMaterialFlag
-{
-  PMX_CullNone = 0x01,
-  PMX_ShadowCasterGround = 0x02,
-  PMX_ShadowCaster = 0x04,
-  PMX_ShadowReceiver = 0x08,
-  PMX_Edge = 0x10,
-};
-enum PMXSphereMode
-{
-  PMX_None,
-  PMX_Mult,
-  PMX_Add,
-  PMC_SubTexture,
+  PMX_QDEF,
 };
 
 struct pmx_material
@@ -238,19 +221,6 @@ struct pmx_bone
   std::vector<ik_link> ik_link_array;
 };
 
-enum PMXMorph
-{
-  PMXMorph_Group,
-  PMXMorph_Vertex,
-  PMXMorph_Bone,
-  PMXMorph_UV,
-  PMXMorph_UV_1,
-  PMXMorph_UV_2,
-  PMXMorph_UV_3,
-  PMXMorph_UV_4,
-  PMXMorph_Material,
-};
-
 struct pmx_morph_base
 {
   virtual ~pmx_morph_base() {}
@@ -314,27 +284,80 @@ struct pmx_morph_material : pmx_morph_base
   std::vector<offset> offset_array;
 };
 
-} // end of anonymus namespace
 
+union pmx_info
+{
+  uint8_t v[8];
+  struct {
+    uint8_t encode;
+    uint8_t additional_uv;
+    uint8_t sizeof_vertex_index;
+    uint8_t sizeof_texture_index;
+    uint8_t sizeof_material_index;
+    uint8_t sizeof_bone_index;
+    uint8_t sizeof_morph_index;
+    uint8_t sizeof_rigid_index;
+  };
+};
 
-bool load_pmx(model *out, const char *filename, resource_repository *rm)
+// 読み込んだ PMX の中身.
+struct pmx_document
 {
-  std::ifstream f;
-  f.open(filename, std::ios_base::binary);
-  if (f.fail()) {
-    return false;
+  float version;
+  pmx_info info;
+  std::string model_name;
+  std::string model_name_eng;
+  std::string comment;
+  std::string comment_eng;
+  std::vector<pmx_model_vertex> vertex_array;
+  std::vector<pmx_sdef> sdef_array;
+  // ファイルのままの幅 (info.sizeof_vertex_index) で並ぶ.
+  std::vector<uint8_t> index_array;
+  std::vector<std::string> texture_path_array;
+  std::vector<pmx_material> material_array;
+  std::vector<pmx_bone> bone_array;
+  std::vector<std::shared_ptr<pmx_morph_base>> morph_array;
+};
+
+// ボーンの数を超える番号を指す枠は 0 番・重み 0 にし, 残りの重みで合計 1 に直す.
+// 全ての枠が外れていたら 0 番に全部載せる. 使われていない枠 (-1) も 0 番にしておく.
+void clamp_vertex_bone(pmx_model_vertex *vtx, size_t bone_count)
+{
+  float sum = 0.f;
+  bool clamped = false;
+  for (int k=0; k<4; ++k) {
+    if ((size_t)vtx->bone[k] >= bone_count) {
+      clamped = clamped || (vtx->weight[k] != 0.f);
+      vtx->bone[k] = 0;
+      vtx->weight[k] = 0.f;
+    }
+    sum += vtx->weight[k];
+  }
+  if (!clamped) {
+    return;
   }
+  if (sum > 0.f) {
+    for (int k=0; k<4; ++k) {
+      vtx->weight[k] /= sum;
+    }
+  } else if (bone_count > 0) {
+    vtx->weight[0] = 1.f;
+  }
+}
 
-  pmx_trace("pmx file:%s\n", filename);
-  
+
+// StreamT は std::istream か byte_reader.
+template<class StreamT>
+bool parse_pmx(StreamT& f, pmx_document *doc)
+{
   // ヘッダ.
   uint8_t sig[4];
   read_uint8(f, sig, 4);
-  if ((sig[0] != 'P') || (sig[1] != 'M') || (sig[2] != 'X') || (sig[3] != ' ')) {
+  if (f.fail() || (sig[0] != 'P') || (sig[1] != 'M') || (sig[2] != 'X') || (sig[3] != ' ')) {
     return false;
   }
   pmx_trace("%c%c%c%c\n", sig[0], sig[1], sig[2], sig[3]);
-  float version;
+  float& version = doc->version;
   read_float(f, &version);
   pmx_trace("Ver:%f\n", version);
   if ((version != 2.0f) && (version != 2.1f)) {
@@ -346,89 +369,106 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
   if (info_num != 8) {
     return false;
   }
-  union {
-    uint8_t v[8];
-    struct {
-      uint8_t encode;
-      uint8_t additional_uv;
-      uint8_t sizeof_vertex_index;
-      uint8_t sizeof_texture_index;
-      uint8_t sizeof_material_index;
-      uint8_t sizeof_bone_index;
-      uint8_t sizeof_morph_index;
-      uint8_t sizeof_rigid_index;
-    };
-  } info;
+  pmx_info& info = doc->info;
   read_uint8(f, info.v, info_num);
   pmx_trace("info:(%d)[%d,%d,%d,%d,%d,%d,%d,%d]\n",
             info_num, info.v[0], info.v[1], info.v[2], info.v[3], info.v[4], info.v[5], info.v[6], info.v[7]);
 
   // コメント.
-  std::string model_name, model_name_eng, comment, comment_eng;
-  read_pmx_textbuf(f, info.encode, &model_name);
-  read_pmx_textbuf(f, info.encode, &model_name_eng);
-  read_pmx_textbuf(f, info.encode, &comment);
-  read_pmx_textbuf(f, info.encode, &comment_eng);
-  pmx_trace("ModelName:%s\n", model_name.c_str());
-  pmx_trace("ModelName(eng):%s\n", model_name_eng.c_str());
-  pmx_trace("Comment:%s\n", comment.c_str());
-  pmx_trace("Comment(eng):%s\n", comment.c_str());
+  read_pmx_textbuf(f, info.encode, &doc->model_name);
+  read_pmx_textbuf(f, info.encode, &doc->model_name_eng);
+  read_pmx_textbuf(f, info.encode, &doc->comment);
+  read_pmx_textbuf(f, info.encode, &doc->comment_eng);
+  pmx_trace("ModelName:%s\n", doc->model_name.c_str());
+  pmx_trace("ModelName(eng):%s\n", doc->model_name_eng.c_str());
+  pmx_trace("Comment:%s\n", doc->comment.c_str());
+  pmx_trace("Comment(eng):%s\n", doc->comment.c_str());
+  if (f.fail()) {
+    return false;
+  }
 
   // 頂点.
-  std::vector<pmx_vertex> vertex_array;
-  int32_t vertex_cnt;
+  auto& vertex_array = doc->vertex_array;
+  int32_t vertex_cnt = 0;
   read_int32(f, &vertex_cnt);
+  if (f.fail() || (vertex_cnt < 0)) {
+    return false;
+  }
   vertex_array.reserve(vertex_cnt);
   pmx_trace("Vertex:%d\n", vertex_cnt);
+  // 中間の構造体を経由せず, 描画用の頂点形式へ直接デコードする.
+  const size_t additional_uv_size = sizeof(float) * 4 * info.additional_uv;
   for (int i=0; i<vertex_cnt; ++i) {
-    pmx_vertex vtx;
+    pmx_model_vertex& vtx = vertex_array.emplace_back();
     read_float(f, as_array(vtx.pos), 3);
     read_float(f, as_array(vtx.nml), 3);
     read_float(f, as_array(vtx.uv), 2);
-    for (int j=0; j<info.additional_uv; ++j) {
-      read_float(f, as_array(vtx.additional_uv[i]), 2);
-    }
-    read_uint8(f, &vtx.weight_type);
-    switch (vtx.weight_type) {
+    skip_bytes(f, additional_uv_size);
+    uint8_t weight_type;
+    read_uint8(f, &weight_type);
+    switch (weight_type) {
     case PMX_BDEF1:
-      read_pmx_variable(f, info.sizeof_bone_index, &vtx.bdef1.bone);
+      read_pmx_variable(f, info.sizeof_bone_index, vtx.bone);
+      vtx.bone[1] = vtx.bone[2] = vtx.bone[3] = -1;
+      vtx.weight[0] = 1.f;
+      vtx.weight[1] = vtx.weight[2] = vtx.weight[3] = 0.f;
       break;
     case PMX_BDEF2:
-      read_pmx_variable(f, info.sizeof_bone_index, vtx.bdef2.bone, 2);
-      read_float(f, &vtx.bdef2.weight);
+    case PMX_SDEF:
+      read_pmx_variable(f, info.sizeof_bone_index, vtx.bone, 2);
+      read_float(f, vtx.weight);
+      vtx.bone[2] = vtx.bone[3] = -1;
+      vtx.weight[1] = 1.f - vtx.weight[0];
+      vtx.weight[2] = vtx.weight[3] = 0.f;
+      if (weight_type == PMX_SDEF) {
+        pmx_sdef& sdef = doc->sdef_array.emplace_back();
+        sdef.vertex = (uint32_t)i;
+        read_float(f, as_array(sdef.c), 3);
+        read_float(f, as_array(sdef.r0), 3);
+        read_float(f, as_array(sdef.r1), 3);
+      }
       break;
     case PMX_BDEF4:
-      read_pmx_variable(f, info.sizeof_bone_index, vtx.bdef4.bone, 4);
-      read_float(f, vtx.bdef4.weight, 4);
-      break;
-    case PMX_SDEF:
-      read_pmx_variable(f, info.sizeof_bone_index, vtx.sdef.bone, 2);
-      read_float(f, &vtx.sdef.weight);
-      read_float(f, as_array(vtx.sdef.c), 3);
-      read_float(f, as_array(vtx.sdef.r0), 3);
-      read_float(f, as_array(vtx.sdef.r1), 3);
+    case PMX_QDEF:
+      read_pmx_variable(f, info.sizeof_bone_index, vtx.bone, 4);
+      read_float(f, vtx.weight, 4);
       break;
+    default:
+      return false;
+    }
+    // エッジ倍率.
+    skip_bytes(f, sizeof(float));
+    if (f.fail()) {
+      return false;
     }
-    read_float(f, &vtx.edge_scale);
-    vertex_array.push_back(vtx);
   }
 
   // 面
-  std::vector<uint32_t> index_array;
-  int32_t index_cnt;
+  auto& index_array = doc->index_array;
+  int32_t index_cnt = 0;
   read_int32(f, &index_cnt);
-  index_array.reserve(index_cnt);
+  if (f.fail() || (index_cnt < 0)) {
+    return false;
+  }
+  if ((info.sizeof_vertex_index != PMX_Byte) &&
+      (info.sizeof_vertex_index != PMX_Short) &&
+      (info.sizeof_vertex_index != PMX_Int)) {
+    return false;
+  }
+  index_array.resize((size_t)index_cnt * info.sizeof_vertex_index);
   pmx_trace("Face:%d(%d)\n", index_cnt / 3, index_cnt);
-  for (int i=0; i<index_cnt; ++i) {
-    uint32_t vertex_index;
-    read_pmx_variable(f, info.sizeof_vertex_index, &vertex_index);
-    index_array.push_back(vertex_index);
+  read_uint8(f, index_array.data(), (int)index_array.size());
+  if (f.fail()) {
+    return false;
   }
 
   // テクスチャ.
-  std::vector<std::string> texture_path_array;
-  int32_t texture_cnt;
+  auto& texture_path_array = doc->texture_path_array;
+  int32_t texture_cnt = 0;
   read_int32(f, &texture_cnt);
+  if (f.fail() || (texture_cnt < 0)) {
+    return false;
+  }
   texture_path_array.reserve(texture_cnt);
   for (int i=0; i<texture_cnt; ++i) {
     std::string path;
@@ -437,8 +477,8 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
   }
 
   // 材質.
-  std::vector<pmx_material> material_array;
-  int32_t material_cnt;
+  auto& material_array = doc->material_array;
+  int32_t material_cnt = 0;
   read_int32(f, &material_cnt);
   for (int i=0; i<material_cnt; ++i) {
     pmx_material mtrl;
@@ -468,12 +508,15 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
     }
     read_pmx_textbuf(f, info.encode, &mtrl.memo);
     read_int32(f, &mtrl.index_count);
+    if (f.fail()) {
+      return false;
+    }
     material_array.push_back(mtrl);
   }
 
   // ボーン.
-  std::vector<pmx_bone> bone_array;
-  int32_t bone_cnt;
+  auto& bone_array = doc->bone_array;
+  int32_t bone_cnt = 0;
   read_int32(f, &bone_cnt);
   for (int i=0; i<bone_cnt; ++i) {
     pmx_bone bone;
@@ -506,8 +549,11 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
       read_pmx_variable_signed(f, info.sizeof_bone_index, &bone.ik_target_bone);
       read_int32(f, &bone.ik_loop_count);
       read_float(f, &bone.ik_loop_limit);
-      int32_t ik_link_count;
+      int32_t ik_link_count = 0;
       read_int32(f, &ik_link_count);
+      if (f.fail() || (ik_link_count < 0)) {
+        return false;
+      }
       bone.ik_link_array.reserve(ik_link_count);
       for (int i=0; i<ik_link_count; ++i) {
         pmx_bone::ik_link link;
@@ -520,13 +566,23 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
         bone.ik_link_array.push_back(link);
       }
     }
+    if (f.fail()) {
+      return false;
+    }
     bone_array.push_back(bone);
   }
+  // 頂点の読み込み時にはボーンの数が分からないので, ここで範囲外の番号を直す.
+  for (auto& vtx : doc->vertex_array) {
+    clamp_vertex_bone(&vtx, bone_array.size());
+  }
 
   // モーフ.
-  std::vector<std::shared_ptr<pmx_morph_base>> morph_array;
-  int32_t morph_cnt;
+  auto& morph_array = doc->morph_array;
+  int32_t morph_cnt = 0;
   read_int32(f, &morph_cnt);
+  if (f.fail() || (morph_cnt < 0)) {
+    return false;
+  }
   morph_array.reserve(morph_cnt);
   for (int i=0; i<morph_cnt; ++i) {
     std::string name, name_eng;
@@ -535,8 +591,11 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
     uint8_t panel, type;
     read_uint8(f, &panel);
     read_uint8(f, &type);
-    int32_t offset_num;
+    int32_t offset_num = 0;
     read_int32(f, &offset_num);
+    if (f.fail() || (offset_num < 0)) {
+      return false;
+    }
     std::shared_ptr<pmx_morph_base> morph_base;
     switch (type) {
     case PMXMorph_Group: {
@@ -616,68 +675,417 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
       std::cerr << "unknown morph type " << type << "." << std::endl;
       continue;
     }
+    if (f.fail()) {
+      return false;
+    }
     morph_base->name = name;
     morph_base->name_eng = name_eng;
     morph_base->panel = panel;
     morph_base->type = type;
     morph_array.push_back(morph_base);
   }
-  
-  f.close();
-
-  // 出力.
-  // 頂点を変換.
-  std::vector<pmx_model_vertex> pmx_model_vertex_array;
-  for (const auto& pmx_vtx : vertex_array) {
-    pmx_model_vertex vtx;
-    vtx.pos = pmx_vtx.pos;
-    vtx.nml = pmx_vtx.nml;
-    vtx.uv = pmx_vtx.uv;
-    switch (pmx_vtx.weight_type) {
-    case PMX_BDEF1:
-      vtx.bone[0] = pmx_vtx.bdef1.bone;
-      vtx.bone[1] = vtx.bone[2] = vtx.bone[3] = -1;
-      vtx.weight[0] = 1.f;
-      vtx.weight[1] = vtx.weight[2] = vtx.weight[3] = 0.f;
-      break;
-    case PMX_BDEF2:
-      vtx.bone[0] = pmx_vtx.bdef2.bone[0];
-      vtx.bone[1] = pmx_vtx.bdef2.bone[1];
-      vtx.bone[2] = vtx.bone[3] = -1;
-      vtx.weight[0] = pmx_vtx.bdef2.weight;
-      vtx.weight[1] = 1.f - pmx_vtx.bdef2.weight;
-      vtx.weight[2] = vtx.weight[3] = 0.f;
-      break;
-    case PMX_BDEF4:
-      vtx.bone[0] = pmx_vtx.bdef4.bone[0];
-      vtx.bone[1] = pmx_vtx.bdef4.bone[1];
-      vtx.bone[2] = pmx_vtx.bdef4.bone[2];
-      vtx.bone[3] = pmx_vtx.bdef4.bone[3];
-      vtx.weight[0] = pmx_vtx.bdef4.weight[0];
-      vtx.weight[1] = pmx_vtx.bdef4.weight[1];
-      vtx.weight[2] = pmx_vtx.bdef4.weight[2];
-      vtx.weight[3] = pmx_vtx.bdef4.weight[3];
-      break;
-    case PMX_SDEF:
-      vtx.bone[0] = pmx_vtx.sdef.bone[0];
-      vtx.bone[1] = pmx_vtx.sdef.bone[1];
-      vtx.bone[2] = vtx.bone[3] = -1;
-      vtx.weight[0] = pmx_vtx.sdef.weight;
-      vtx.weight[1] = 1.f - pmx_vtx.sdef.weight;
-      vtx.weight[2] = vtx.weight[3] = 0.f;
-      break;
+
+  return !f.fail();
+}
+
+bool parse_pmx_stream(const char *filename, pmx_document *doc)
+{
+  std::ifstream f;
+  f.open(filename, std::ios_base::binary);
+  if (f.fail()) {
+    return false;
+  }
+  return parse_pmx(f, doc);
+}
+
+bool parse_pmx_mapped(const char *filename, pmx_document *doc)
+{
+  mapped_file file;
+  if (!file.open(filename)) {
+    return false;
+  }
+  byte_reader r(file.data(), file.size());
+  return parse_pmx(r, doc);
+}
+
+
+GLenum pmx_index_type(int pmx_bytesize)
+{
+  switch (pmx_bytesize) {
+  case PMX_Byte: return GL_UNSIGNED_BYTE;
+  case PMX_Short: return GL_UNSIGNED_SHORT;
+  default: return GL_UNSIGNED_INT;
+  }
+}
+
+// 材質ごとに三角形を頂点キャッシュに載りやすい順へ並べ替え,
+// 頂点を使われる順へ並べ替える.
+void optimize_pmx_mesh(pmx_document *doc, const std::vector<pmx_section>& section_array,
+                       std::vector<uint32_t> *index_array)
+{
+  typedef std::chrono::steady_clock clock;
+
+  auto start = clock::now();
+  const size_t vertex_count = doc->vertex_array.size();
+  auto before = analyze_vertex_cache(index_array->data(), index_array->size(), vertex_count);
+  for (const auto& sec : section_array) {
+    optimize_vertex_cache(index_array->data() + sec.index_offset, sec.index_count, vertex_count);
+  }
+  std::vector<uint32_t> remap;
+  make_vertex_fetch_remap(&remap, index_array->data(), index_array->size(), vertex_count);
+  remap_index_array(index_array->data(), index_array->size(), remap);
+  remap_vertex_array(&doc->vertex_array, remap);
+
+  // SDEF とモーフは頂点番号で指しているので合わせる.
+  for (auto& sdef : doc->sdef_array) {
+    sdef.vertex = remap[sdef.vertex];
+  }
+  std::sort(doc->sdef_array.begin(), doc->sdef_array.end(),
+            [](const pmx_sdef& a, const pmx_sdef& b) { return a.vertex < b.vertex; });
+
+  for (auto& morph : doc->morph_array) {
+    if (auto m = dynamic_cast<pmx_morph_vertex*>(morph.get())) {
+      for (auto& ofs : m->offset_array) {
+        if (ofs.index < vertex_count) {
+          ofs.index = remap[ofs.index];
+        }
+      }
+    } else if (auto m = dynamic_cast<pmx_morph_uv*>(morph.get())) {
+      for (auto& ofs : m->offset_array) {
+        if (ofs.index < vertex_count) {
+          ofs.index = remap[ofs.index];
+        }
+      }
     }
-    pmx_model_vertex_array.push_back(vtx);
   }
 
+  auto after = analyze_vertex_cache(index_array->data(), index_array->size(), vertex_count);
+  pmx_trace("Mesh: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f (%.1fms)\n",
+            before.acmr, after.acmr, before.atvr, after.atvr,
+            std::chrono::duration<double, std::milli>(clock::now() - start).count());
+}
+
+// 解析結果から描画用のデータを作る.
+// 頂点とインデックスは doc を指したままにする.
+bool make_pmx_model_data(pmx_model_data *out, std::shared_ptr<pmx_document> doc, const char *filename,
+                         const pmx_load_option& option)
+{
+  out->section_array.clear();
+  out->section_array.reserve(doc->material_array.size());
+  uint32_t index_offset = 0;
+  const size_t index_count = doc->index_array.size() / doc->info.sizeof_vertex_index;
+  for (const auto& pmx_mtrl : doc->material_array) {
+    if ((pmx_mtrl.index_count < 0) ||
+        ((uint64_t)index_offset + pmx_mtrl.index_count > index_count)) {
+      return false;
+    }
+    pmx_section sec;
+    sec.index_offset = index_offset;
+    sec.index_count = pmx_mtrl.index_count;
+    sec.diffuse = pmx_mtrl.diffuse;
+    sec.specular = pmx_mtrl.specular;
+    sec.ambient = pmx_mtrl.ambient;
+    sec.edge_color = pmx_mtrl.edge_color;
+    sec.edge_size = pmx_mtrl.edge_size;
+    sec.flags = pmx_mtrl.flags;
+    sec.sphere_mode = (uint8_t)pmx_mtrl.sphere_mode;
+    sec.is_common_toon_tex = pmx_mtrl.is_common_toon_tex;
+    sec.texid = pmx_mtrl.texid;
+    sec.sphere_texid = pmx_mtrl.sphere_texid;
+    sec.toon_texid = pmx_mtrl.toon_texid;
+    out->section_array.push_back(sec);
+    index_offset += pmx_mtrl.index_count;
+  }
+
+  // PMX のパスは '\\' 区切りなので揃えておく.
+  out->texture_path_array = doc->texture_path_array;
+  for (auto& path : out->texture_path_array) {
+    std::replace(path.begin(), path.end(), '\\', '/');
+  }
+  out->base_dir = std::filesystem::path(filename).remove_filename();
+
+  // インデックスは頂点数で足りる幅へ揃える.
+  GLenum file_index_type = pmx_index_type(doc->info.sizeof_vertex_index);
+  GLenum index_type = index_type_for(doc->vertex_array.size());
+  if (option.optimize_mesh) {
+    std::vector<uint32_t> index_array(index_count);
+    convert_index_array(index_array.data(), GL_UNSIGNED_INT,
+                        doc->index_array.data(), file_index_type, index_count);
+    optimize_pmx_mesh(doc.get(), out->section_array, &index_array);
+    doc->index_array.resize(index_count * index_type_size(index_type));
+    convert_index_array(doc->index_array.data(), index_type,
+                        index_array.data(), GL_UNSIGNED_INT, index_count);
+  } else if (index_type != file_index_type) {
+    std::vector<uint8_t> index_array(index_count * index_type_size(index_type));
+    convert_index_array(index_array.data(), index_type,
+                        doc->index_array.data(), file_index_type, index_count);
+    doc->index_array.swap(index_array);
+  }
+  out->vertex_array = doc->vertex_array.data();
+  out->vertex_count = doc->vertex_array.size();
+  out->sdef_array = doc->sdef_array;
+  out->bone_array.clear();
+  out->bone_array.reserve(doc->bone_array.size());
+  for (const auto& pmx_bone : doc->bone_array) {
+    pmx_model_bone bone;
+    bone.name = pmx_bone.name;
+    bone.pos = pmx_bone.pos;
+    bone.parent = pmx_bone.parent;
+    bone.level = pmx_bone.level;
+    bone.flags = pmx_bone.flags.val;
+    bone.assign_bone = (pmx_bone.flags.assign_rotate || pmx_bone.flags.assign_translate) ? pmx_bone.assign_bone : -1;
+    bone.assign_rate = bone.assign_bone >= 0 ? pmx_bone.assign_rate : 0.f;
+    bone.ik_target_bone = pmx_bone.flags.enable_ik ? pmx_bone.ik_target_bone : -1;
+    bone.ik_loop_count = bone.ik_target_bone >= 0 ? pmx_bone.ik_loop_count : 0;
+    bone.ik_loop_limit = bone.ik_target_bone >= 0 ? pmx_bone.ik_loop_limit : 0.f;
+    if (bone.ik_target_bone >= 0) {
+      for (const auto& l : pmx_bone.ik_link_array) {
+        pmx_model_ik_link link;
+        link.bone = l.bone;
+        link.angle_limit = l.angle_limit ? 1 : 0;
+        link.min_angle = l.angle_limit ? l.min_angle : vec3(0.f, 0.f, 0.f);
+        link.max_angle = l.angle_limit ? l.max_angle : vec3(0.f, 0.f, 0.f);
+        bone.ik_link_array.push_back(link);
+      }
+    }
+    out->bone_array.push_back(bone);
+  }
+  // 範囲外の頂点を指すモーフのオフセットは捨てる.
+  const size_t vertex_count = doc->vertex_array.size();
+  out->morph_array.clear();
+  out->morph_array.reserve(doc->morph_array.size());
+  for (const auto& pmx_morph : doc->morph_array) {
+    pmx_model_morph morph;
+    morph.name = pmx_morph->name;
+    morph.panel = (uint8_t)pmx_morph->panel;
+    morph.type = (uint8_t)pmx_morph->type;
+    if (auto m = dynamic_cast<const pmx_morph_group*>(pmx_morph.get())) {
+      for (const auto& ofs : m->offset_array) {
+        morph.group_array.push_back({ ofs.index, ofs.rate });
+      }
+    } else if (auto m = dynamic_cast<const pmx_morph_vertex*>(pmx_morph.get())) {
+      for (const auto& ofs : m->offset_array) {
+        if (ofs.index < vertex_count) {
+          morph.vertex_array.push_back({ ofs.index, ofs.translate });
+        }
+      }
+    } else if (auto m = dynamic_cast<const pmx_morph_uv*>(pmx_morph.get())) {
+      for (const auto& ofs : m->offset_array) {
+        if (ofs.index < vertex_count) {
+          morph.uv_array.push_back({ ofs.index, ofs.translate });
+        }
+      }
+    } else if (auto m = dynamic_cast<const pmx_morph_bone*>(pmx_morph.get())) {
+      for (const auto& ofs : m->offset_array) {
+        const vec4& q = ofs.quaternion;
+        morph.bone_array.push_back({ ofs.index, ofs.translate, quarternion(q.x, q.y, q.z, q.w) });
+      }
+    } else if (auto m = dynamic_cast<const pmx_morph_material*>(pmx_morph.get())) {
+      for (const auto& ofs : m->offset_array) {
+        pmx_model_morph::material_offset mo;
+        mo.material = ofs.index;
+        mo.op = ofs.op;
+        auto to_color = [](const vec4& v) { return color(v.x, v.y, v.z, v.w); };
+        mo.diffuse = to_color(ofs.diffuse);
+        mo.specular = to_color(ofs.specular);
+        mo.ambient = color(ofs.ambient.x, ofs.ambient.y, ofs.ambient.z, 0.f);
+        mo.edge_color = to_color(ofs.edge_color);
+        mo.edge_size = ofs.edge_size;
+        mo.tex_coef = to_color(ofs.tex_coef);
+        mo.sphere_tex_coef = to_color(ofs.spehre_tex_coef);
+        mo.toon_tex_coef = to_color(ofs.toon_tex_coef);
+        morph.material_array.push_back(mo);
+      }
+    }
+    out->morph_array.push_back(std::move(morph));
+  }
+  out->index_type = index_type;
+  out->index_array = doc->index_array.data();
+  out->index_count = index_count;
+  out->holder = doc;
+
+  return true;
+}
+
+
+// 頂点が参照しているボーンの数. 使われていない枠 (重み 0) の番号は数えない.
+size_t pmx_bone_count(const pmx_model_data& data)
+{
+  size_t count = 0;
+  for (size_t i=0; i<data.vertex_count; ++i) {
+    const auto& vtx = data.vertex_array[i];
+    for (int j=0; j<4; ++j) {
+      if (vtx.weight[j] > 0.f) {
+        count = std::max<size_t>(count, (size_t)vtx.bone[j] + 1);
+      }
+    }
+  }
+  return count;
+}
+
+// 材質一つ分のジオメトリとマテリアルを作って out へ積む.
+// インデックスバッファは全材質で共有し, ジオメトリには区間だけを持たせる.
+void push_pmx_section(model *out, const pmx_section& sec,
+                      vertex_stream_base::ptr_t vtxstm, index_stream::ptr_t idxstm,
+                      const std::vector<texture::ptr_t>& texture_array, resource_repository *rm)
+{
+  auto geom = geometry::make(vtxstm, idxstm, sec.index_offset, sec.index_count);
+  auto mtrl = material::make();
+  mtrl->set_parameter("diffuse", sec.diffuse);
+  mtrl->set_parameter("specular", sec.specular);
+  mtrl->set_parameter("ambient", sec.ambient);
+
+  // テクスチャ.
+  // 無い場合はダミーを入れておく.
+  if (sec.texid >= 0) {
+    mtrl->set_texture("color_sampler", texture_array[sec.texid]);
+  } else {
+    mtrl->set_texture("color_sampler", rm->get<texture::ptr_t>("tex_black"));
+  }
+  if (sec.sphere_texid >= 0) {
+    mtrl->set_texture("sphere_sampler", texture_array[sec.sphere_texid]);
+  } else {
+    if (sec.sphere_mode == PMX_Mult) {
+      mtrl->set_texture("sphere_sampler", rm->get<texture::ptr_t>("tex_white"));
+    } else {
+      mtrl->set_texture("sphere_sampler", rm->get<texture::ptr_t>("tex_black"));
+    }
+  }
+  if (sec.is_common_toon_tex) {
+    // ...?
+    mtrl->set_texture("toon_sampler", rm->get<texture::ptr_t>("tex_white"));
+  } else {
+    if (sec.toon_texid >= 0) {
+      mtrl->set_texture("toon_sampler", texture_array[sec.toon_texid]);
+    } else {
+      mtrl->set_texture("toon_sampler", rm->get<texture::ptr_t>("tex_white"));
+    }
+  }
+  out->push(geom, mtrl);
+}
+
+
+typedef std::shared_ptr<std::vector<pmx_model_vertex>> pmx_vertex_copy_t;
+
+// モーフで頂点を書き換えるなら, 元のメモリ (キャッシュのマッピングなど) は書き換えられないのでコピーする.
+// 書き換えなければ 0.
+pmx_vertex_copy_t copy_pmx_vertex_array(const pmx_model_data& data, const morph_set *mrp)
+{
+  if (!mrp || !mrp->has_vertex_morph()) {
+    return 0;
+  }
+  return std::make_shared<std::vector<pmx_model_vertex>>(
+    data.vertex_array, data.vertex_array + data.vertex_count);
+}
+
+// 頂点ストリームを作る. コピーがあればそちらを, 無ければ data の指すメモリを参照する.
+vertex_stream_base::ptr_t make_pmx_vertex_stream(const pmx_model_data& data, pmx_vertex_copy_t copy,
+                                                 bool upload)
+{
+  if (copy) {
+    return vertex_stream_base::make_view(
+      get_pmx_model_vertex_decl(), copy->data(), copy->size(), copy, upload);
+  }
+  return vertex_stream_base::make_view(
+    get_pmx_model_vertex_decl(), data.vertex_array, data.vertex_count, data.holder, upload);
+}
+
+// セクションのマテリアルをモーフに渡す.
+void attach_pmx_morph(model *out, morph_set::ptr_t mrp, vertex_stream_base::ptr_t vtxstm)
+{
+  if (!mrp) {
+    return;
+  }
+  std::vector<material::ptr_t> material_array;
+  for (const auto& sec : out->section_array()) {
+    material_array.push_back(sec.mtrl);
+  }
+  mrp->attach(vtxstm, material_array);
+  out->set_morph(mrp);
+}
+
+// 二つの読み込み結果が同じモデルになるか.
+bool is_same_document(const pmx_document& a, const pmx_document& b)
+{
+  if ((a.vertex_array.size() != b.vertex_array.size()) ||
+      (a.index_array != b.index_array) ||
+      (a.texture_path_array != b.texture_path_array) ||
+      (a.material_array.size() != b.material_array.size()) ||
+      (a.bone_array.size() != b.bone_array.size()) ||
+      (a.sdef_array.size() != b.sdef_array.size()) ||
+      (a.morph_array.size() != b.morph_array.size())) {
+    return false;
+  }
+  if (std::memcmp(a.vertex_array.data(), b.vertex_array.data(),
+                  sizeof(pmx_model_vertex) * a.vertex_array.size()) != 0) {
+    return false;
+  }
+  for (size_t i=0; i<a.material_array.size(); ++i) {
+    const auto& ma = a.material_array[i];
+    const auto& mb = b.material_array[i];
+    if ((ma.name != mb.name) ||
+        (ma.index_count != mb.index_count) ||
+        (ma.texid != mb.texid) ||
+        (ma.sphere_texid != mb.sphere_texid) ||
+        (ma.toon_texid != mb.toon_texid)) {
+      return false;
+    }
+  }
+  for (size_t i=0; i<a.bone_array.size(); ++i) {
+    if ((a.bone_array[i].name != b.bone_array[i].name) ||
+        (a.bone_array[i].parent != b.bone_array[i].parent)) {
+      return false;
+    }
+  }
+  for (size_t i=0; i<a.morph_array.size(); ++i) {
+    if ((a.morph_array[i]->name != b.morph_array[i]->name) ||
+        (a.morph_array[i]->type != b.morph_array[i]->type)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // end of anonymus namespace
+
+
+bool load_pmx_data(pmx_model_data *out, const char *filename, const pmx_load_option& option)
+{
+  std::string cache_filename = pmx_cache_filename(filename);
+  uint32_t cache_flags = option.optimize_mesh ? PMXCache_OptimizedMesh : 0;
+  if (option.use_cache && read_pmx_cache(out, cache_filename.c_str(), filename, cache_flags)) {
+    pmx_trace("cache:%s\n", cache_filename.c_str());
+    return true;
+  }
+
+  mapped_file file;
+  if (!file.open(filename)) {
+    return false;
+  }
+  auto doc = std::make_shared<pmx_document>();
+  byte_reader r(file.data(), file.size());
+  if (!parse_pmx(r, doc.get()) || !make_pmx_model_data(out, doc, filename, option)) {
+    return false;
+  }
+  if (option.use_cache) {
+    auto key = make_pmx_source_key(filename, file.data(), file.size());
+    if (!write_pmx_cache(cache_filename.c_str(), *out, key, cache_flags)) {
+      std::cerr << "cannot write cache. " << cache_filename << std::endl;
+    }
+  }
+
+  return true;
+}
+
+
+void build_pmx_model(model *out, const pmx_model_data& data, resource_repository *rm)
+{
   // テクスチャを作っておく.
-  std::filesystem::path base_dir(filename);
-  base_dir.remove_filename();
   std::vector<texture::ptr_t> texture_array;
-  texture_array.reserve(texture_path_array.size());
-  for (const auto& path : texture_path_array) {
+  texture_array.reserve(data.texture_path_array.size());
+  for (const auto& path : data.texture_path_array) {
     auto tex = texture::make();
-    std::string fullpath = (base_dir / path).string();
+    std::string fullpath = (data.base_dir / path).string();
     if (!texture::load_from_file(tex, fullpath.c_str())) {
       std::cerr << "cannnot load texture. " << fullpath << std::endl;
     }
@@ -685,50 +1093,317 @@ bool load_pmx(model *out, const char *filename, resource_repository *rm)
   }
 
   // 頂点ストリームは一つ.
-  auto vtxstm = vertex_stream_base::make(
-    get_pmx_model_vertex_decl(), pmx_model_vertex_array);
-  int index_array_start_index = 0;
-  for (const auto& pmx_mtrl : material_array) {
-    int index_array_end_index = index_array_start_index + pmx_mtrl.index_count;
-    auto geom = geometry::make(vtxstm,
-                               std::vector<uint32_t>(index_array.begin() + index_array_start_index,
-                                                     index_array.begin() + index_array_end_index));
-    auto mtrl = material::make();
-    mtrl->set_parameter("diffuse", pmx_mtrl.diffuse);
-    mtrl->set_parameter("specular", pmx_mtrl.specular);
-    mtrl->set_parameter("ambient", pmx_mtrl.ambient);
-
-    // テクスチャ.
-    // 無い場合はダミーを入れておく.
-    if (pmx_mtrl.texid >= 0) {
-      mtrl->set_texture("color_sampler", texture_array[pmx_mtrl.texid]);
-    } else {
-      mtrl->set_texture("color_sampler", rm->get<texture::ptr_t>("tex_black"));
+  // モーフで書き換えなければ, 頂点配列はコピーせず data の指すメモリからそのまま転送する.
+  auto mrp = make_pmx_morph(data);
+  auto vtxstm = make_pmx_vertex_stream(data, copy_pmx_vertex_array(data, mrp.get()), true);
+  // インデックスバッファも一つ. 描画時は材質ごとにオフセットをずらすだけ.
+  auto idxstm = index_stream::make(data.index_type, data.index_array, data.index_count);
+  for (const auto& sec : data.section_array) {
+    push_pmx_section(out, sec, vtxstm, idxstm, texture_array, rm);
+  }
+  attach_pmx_morph(out, mrp, vtxstm);
+  out->set_skeleton(make_pmx_skeleton(data));
+  out->set_bone_count(std::max(pmx_bone_count(data), data.bone_array.size()));
+}
+
+skeleton::ptr_t make_pmx_skeleton(const pmx_model_data& data)
+{
+  std::vector<skeleton_bone> bone_array;
+  bone_array.reserve(data.bone_array.size());
+  for (const auto& pmx_bone : data.bone_array) {
+    skeleton_bone bone;
+    bone.name = pmx_bone.name;
+    bone.pos = pmx_bone.pos;
+    bone.parent = pmx_bone.parent;
+    bone.level = pmx_bone.level;
+    bone.after_physics = (pmx_bone.flags & PMXBone_AfterPhysics) != 0;
+    bone.assign_bone = pmx_bone.assign_bone;
+    bone.assign_rate = pmx_bone.assign_rate;
+    bone.assign_rotate = (pmx_bone.flags & PMXBone_AssignRotate) != 0;
+    bone.assign_translate = (pmx_bone.flags & PMXBone_AssignTranslate) != 0;
+    bone.ik_target_bone = pmx_bone.ik_target_bone;
+    bone.ik_loop_count = pmx_bone.ik_loop_count;
+    bone.ik_loop_limit = pmx_bone.ik_loop_limit;
+    for (const auto& l : pmx_bone.ik_link_array) {
+      bone.ik_link_array.push_back({ l.bone, l.angle_limit != 0, l.min_angle, l.max_angle });
     }
-    if (pmx_mtrl.sphere_texid >= 0) {
-      mtrl->set_texture("sphere_sampler", texture_array[pmx_mtrl.sphere_texid]);
-    } else {
-      if (pmx_mtrl.sphere_mode == PMX_Mult) {
-        mtrl->set_texture("sphere_sampler", rm->get<texture::ptr_t>("tex_white"));
-      } else {
-        mtrl->set_texture("sphere_sampler", rm->get<texture::ptr_t>("tex_black"));
-      }
+    bone_array.push_back(bone);
+  }
+  return skeleton::make(bone_array);
+}
+
+morph_set::ptr_t make_pmx_morph(const pmx_model_data& data)
+{
+  if (data.morph_array.empty()) {
+    return 0;
+  }
+  return morph_set::make(data.morph_array, data.section_array, data.vertex_count);
+}
+
+
+bool load_pmx(model *out, const char *filename, resource_repository *rm, const pmx_load_option& option)
+{
+  pmx_trace("pmx file:%s\n", filename);
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, filename, option)) {
+    return false;
+  }
+  build_pmx_model(out, data, rm);
+  pmx_trace("Memory(peak):%.1fMB\n", peak_resident_memory() / (1024.0 * 1024.0));
+
+  return true;
+}
+
+std::shared_future<model::ptr_t> load_pmx_async(const char *filename, resource_repository *rm,
+                                                job_system *jobs, upload_queue::ptr_t uploader,
+                                                const pmx_load_option& option)
+{
+  // ワーカーとメインスレッドのタスクの間で受け渡すもの.
+  struct state
+  {
+    std::string filename;
+    pmx_load_option option;
+    pmx_model_data data;
+    std::vector<texture_image> image_array;
+    std::vector<texture::ptr_t> texture_array;
+    vertex_stream_base::ptr_t vtxstm;
+    index_stream::ptr_t idxstm;
+    morph_set::ptr_t morph;
+    pmx_vertex_copy_t vertex_copy;
+    model::ptr_t out;
+    std::promise<model::ptr_t> promise;
+  };
+  auto st = std::make_shared<state>();
+  st->filename = filename;
+  st->option = option;
+  std::shared_future<model::ptr_t> future = st->promise.get_future().share();
+
+  jobs->push([st, rm, uploader]() {
+    // ファイルの解析と画像のデコードはワーカーで済ませる.
+    pmx_trace("pmx file:%s\n", st->filename.c_str());
+    if (!load_pmx_data(&st->data, st->filename.c_str(), st->option)) {
+      st->promise.set_value(0);
+      return;
     }
-    if (pmx_mtrl.is_common_toon_tex) {
-      // ...?
-      mtrl->set_texture("toon_sampler", rm->get<texture::ptr_t>("tex_white"));
-    } else {
-      if (pmx_mtrl.toon_texid >= 0) {
-        mtrl->set_texture("toon_sampler", texture_array[pmx_mtrl.toon_texid]);
-      } else {
-        mtrl->set_texture("toon_sampler", rm->get<texture::ptr_t>("tex_white"));
+    const auto& path_array = st->data.texture_path_array;
+    st->image_array.resize(path_array.size());
+    for (size_t i=0; i<path_array.size(); ++i) {
+      std::string fullpath = (st->data.base_dir / path_array[i]).string();
+      if (!texture::decode_file(&st->image_array[i], fullpath.c_str())) {
+        std::cerr << "cannnot load texture. " << fullpath << std::endl;
       }
     }
-    out->push(geom, mtrl);
 
-    index_array_start_index = index_array_end_index;
+    // GL オブジェクトはメインスレッドで少しずつ作る.
+    // 積んだ順に実行されるので, 前のタスクの結果を当てにして良い.
+    st->out = std::make_shared<model>();
+    st->out->set_skeleton(make_pmx_skeleton(st->data));
+    st->out->set_bone_count(std::max(pmx_bone_count(st->data), st->data.bone_array.size()));
+    // モーフで書き換える頂点のコピーもワーカーで作っておく.
+    st->morph = make_pmx_morph(st->data);
+    st->vertex_copy = copy_pmx_vertex_array(st->data, st->morph.get());
+    st->texture_array.resize(path_array.size());
+    for (size_t i=0; i<path_array.size(); ++i) {
+      uploader->push([st, i]() {
+        auto tex = texture::make();
+        if (st->image_array[i].data) {
+          tex->set_image(st->image_array[i]);
+          st->image_array[i].data.reset();
+        }
+        st->texture_array[i] = tex;
+      });
+    }
+    // 頂点は大きいので, 一回のタスクが長くならないよう分けて転送する.
+    uploader->push([st]() {
+      st->vtxstm = make_pmx_vertex_stream(st->data, st->vertex_copy, false);
+    });
+    const size_t vertex_buffer_size = sizeof(pmx_model_vertex) * st->data.vertex_count;
+    for (size_t offset=0; offset<vertex_buffer_size; offset+=upload_chunk_size) {
+      size_t size = std::min(upload_chunk_size, vertex_buffer_size - offset);
+      uploader->push([st, offset, size]() {
+        st->vtxstm->upload_range(offset, size);
+      });
+    }
+    uploader->push([st]() {
+      st->idxstm = index_stream::make(st->data.index_type, st->data.index_array, st->data.index_count);
+    });
+    for (size_t i=0; i<st->data.section_array.size(); ++i) {
+      uploader->push([st, i, rm]() {
+        push_pmx_section(st->out.get(), st->data.section_array[i],
+                         st->vtxstm, st->idxstm, st->texture_array, rm);
+      });
+    }
+    uploader->push([st]() {
+      attach_pmx_morph(st->out.get(), st->morph, st->vtxstm);
+      pmx_trace("Memory(peak):%.1fMB\n", peak_resident_memory() / (1024.0 * 1024.0));
+      st->promise.set_value(st->out);
+    });
+  });
+
+  return future;
+}
+
+
+bool bench_pmx_parse(const char *filename, int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  s_trace_enabled = false;
+  pmx_document stream_doc, mapped_doc;
+  // 一回目はファイルキャッシュを温めるだけ.
+  if (!parse_pmx_stream(filename, &stream_doc) || !parse_pmx_mapped(filename, &mapped_doc)) {
+    s_trace_enabled = true;
+    std::cerr << "cannot parse " << filename << std::endl;
+    return false;
   }
-  
-  return true;
+
+  auto measure = [&](bool (*parse)(const char*, pmx_document*)) {
+    auto start = clock::now();
+    for (int i=0; i<iterations; ++i) {
+      pmx_document doc;
+      parse(filename, &doc);
+    }
+    return std::chrono::duration<double, std::milli>(clock::now() - start).count() / iterations;
+  };
+  double stream_ms = measure(parse_pmx_stream);
+  double mapped_ms = measure(parse_pmx_mapped);
+  s_trace_enabled = true;
+
+  double mb = std::filesystem::file_size(filename) / (1024.0 * 1024.0);
+  printf("pmx parse: %s (%.2f MB, %d iterations)\n", filename, mb, iterations);
+  printf("  ifstream : %9.3f ms  %8.1f MB/s\n", stream_ms, mb / (stream_ms / 1000.0));
+  printf("  mmap     : %9.3f ms  %8.1f MB/s\n", mapped_ms, mb / (mapped_ms / 1000.0));
+  printf("  speedup  : x%.2f\n", stream_ms / mapped_ms);
+  printf("  memory   : %.1f MB (peak resident)\n", peak_resident_memory() / (1024.0 * 1024.0));
+
+  bool same = is_same_document(stream_doc, mapped_doc);
+  printf("  result   : %s\n", same ? "identical" : "MISMATCH");
+
+  return same;
+}
+
+
+bool bench_pmx_cache(const char *filename, int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  s_trace_enabled = false;
+  pmx_load_option no_cache;
+  no_cache.use_cache = false;
+  pmx_model_data parsed, cached;
+  // 一回目でキャッシュを作っておく.
+  if (!load_pmx_data(&parsed, filename, no_cache) ||
+      !load_pmx_data(&cached, filename) ||
+      !load_pmx_data(&cached, filename)) {
+    s_trace_enabled = true;
+    std::cerr << "cannot load " << filename << std::endl;
+    return false;
+  }
+
+  auto measure = [&](const pmx_load_option& option) {
+    auto start = clock::now();
+    for (int i=0; i<iterations; ++i) {
+      pmx_model_data data;
+      load_pmx_data(&data, filename, option);
+    }
+    return std::chrono::duration<double, std::milli>(clock::now() - start).count() / iterations;
+  };
+  double parse_ms = measure(no_cache);
+  double cache_ms = measure(pmx_load_option());
+  s_trace_enabled = true;
+
+  std::string cache_filename = pmx_cache_filename(filename);
+  printf("pmx cache: %s (%d iterations)\n", filename, iterations);
+  printf("  parse    : %9.3f ms  (%.2f MB)\n", parse_ms,
+         std::filesystem::file_size(filename) / (1024.0 * 1024.0));
+  printf("  cache    : %9.3f ms  (%.2f MB)\n", cache_ms,
+         std::filesystem::file_size(cache_filename) / (1024.0 * 1024.0));
+  printf("  speedup  : x%.2f\n", parse_ms / cache_ms);
+
+  bool same =
+    (parsed.vertex_count == cached.vertex_count) &&
+    (parsed.index_count == cached.index_count) &&
+    (parsed.index_type == cached.index_type) &&
+    (parsed.section_array.size() == cached.section_array.size()) &&
+    (parsed.texture_path_array == cached.texture_path_array) &&
+    (std::memcmp(parsed.vertex_array, cached.vertex_array,
+                 sizeof(pmx_model_vertex) * parsed.vertex_count) == 0) &&
+    (std::memcmp(parsed.index_array, cached.index_array,
+                 index_type_size(parsed.index_type) * parsed.index_count) == 0);
+  for (size_t i=0; same && (i<parsed.section_array.size()); ++i) {
+    const auto& a = parsed.section_array[i];
+    const auto& b = cached.section_array[i];
+    same = (a.index_offset == b.index_offset) && (a.index_count == b.index_count) &&
+      (std::memcmp(as_array(a.diffuse), as_array(b.diffuse), sizeof(color)) == 0) &&
+      (std::memcmp(as_array(a.specular), as_array(b.specular), sizeof(color)) == 0) &&
+      (std::memcmp(as_array(a.ambient), as_array(b.ambient), sizeof(color)) == 0) &&
+      (a.flags == b.flags) && (a.texid == b.texid) && (a.sphere_texid == b.sphere_texid) &&
+      (a.toon_texid == b.toon_texid) && (a.is_common_toon_tex == b.is_common_toon_tex);
+  }
+  printf("  result   : %s\n", same ? "identical" : "MISMATCH");
+
+  return same;
 }
 
+
+bool bench_pmx_mesh(const char *filename)
+{
+  typedef std::chrono::steady_clock clock;
+
+  s_trace_enabled = false;
+  pmx_load_option option;
+  option.use_cache = false;
+  option.optimize_mesh = false;
+  pmx_model_data original, optimized;
+  auto start = clock::now();
+  bool loaded = load_pmx_data(&original, filename, option);
+  double original_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+  option.optimize_mesh = true;
+  start = clock::now();
+  loaded = loaded && load_pmx_data(&optimized, filename, option);
+  double optimized_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+  s_trace_enabled = true;
+  if (!loaded) {
+    std::cerr << "cannot load " << filename << std::endl;
+    return false;
+  }
+
+  auto to_uint32 = [](const pmx_model_data& data) {
+    std::vector<uint32_t> r(data.index_count);
+    convert_index_array(r.data(), GL_UNSIGNED_INT, data.index_array, data.index_type, data.index_count);
+    return r;
+  };
+  auto original_index = to_uint32(original);
+  auto optimized_index = to_uint32(optimized);
+
+  printf("mesh optimize: %s (%zu vertices, %zu triangles, %zu sections)\n",
+         filename, original.vertex_count, original.index_count / 3, original.section_array.size());
+  printf("  load     : %9.3f ms -> %9.3f ms\n", original_ms, optimized_ms);
+  for (int cache_size : { 16, 32 }) {
+    auto a = analyze_vertex_cache(original_index.data(), original_index.size(), original.vertex_count, cache_size);
+    auto b = analyze_vertex_cache(optimized_index.data(), optimized_index.size(), optimized.vertex_count, cache_size);
+    printf("  fifo%-4d : ACMR %.3f -> %.3f  ATVR %.3f -> %.3f\n", cache_size, a.acmr, b.acmr, a.atvr, b.atvr);
+  }
+
+  // 並べ替えても材質ごとの三角形の集まりは変わらないはず.
+  auto triangle_hashes = [](const pmx_model_data& data, const std::vector<uint32_t>& index, const pmx_section& sec) {
+    std::vector<uint64_t> r;
+    for (size_t i=sec.index_offset; i+2<sec.index_offset+sec.index_count; i+=3) {
+      pmx_model_vertex tri[3] = {
+        data.vertex_array[index[i]], data.vertex_array[index[i + 1]], data.vertex_array[index[i + 2]],
+      };
+      r.push_back(hash64(tri, sizeof(tri)));
+    }
+    std::sort(r.begin(), r.end());
+    return r;
+  };
+  bool same = (original.section_array.size() == optimized.section_array.size());
+  for (size_t i=0; same && (i<original.section_array.size()); ++i) {
+    same = (triangle_hashes(original, original_index, original.section_array[i]) ==
+            triangle_hashes(optimized, optimized_index, optimized.section_array[i]));
+  }
+  printf("  result   : %s\n", same ? "same triangles" : "MISMATCH");
+
+  return same;
+}
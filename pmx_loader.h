@@ -3,6 +3,42 @@
 
 #include "model.h"
 #include "resource_repository.h"
+#include "pmx_model.h"
+#include "job_system.h"
+#include "upload_queue.h"
+#include "skeleton.h"
+#include "morph.h"
 
-bool load_pmx(model*, const char *filename, resource_repository*);
+struct pmx_load_option
+{
+  // filename.cutbin に変換済みのデータを置いて, 次からはそちらを読む.
+  bool use_cache = true;
+  // 材質ごとに頂点キャッシュ向けの並べ替えをする. キャッシュを使う時は作る時だけかかる.
+  bool optimize_mesh = true;
+};
+
+bool load_pmx(model*, const char *filename, resource_repository*,
+              const pmx_load_option& = pmx_load_option());
+
+// GL オブジェクトを作らずに, 描画用のデータまでを読む.
+bool load_pmx_data(pmx_model_data*, const char *filename,
+                   const pmx_load_option& = pmx_load_option());
+void build_pmx_model(model*, const pmx_model_data&, resource_repository*);
+// ボーンからスケルトンを作る. GL は使わない.
+skeleton::ptr_t make_pmx_skeleton(const pmx_model_data&);
+// モーフを作る. GL は使わない. モーフが一つも無ければ 0.
+morph_set::ptr_t make_pmx_morph(const pmx_model_data&);
+
+// 解析と画像のデコードは jobs で, GL オブジェクトの作成は uploader で行う.
+// uploader はメインスレッドで drain() すること. 失敗した時の結果は 0.
+std::shared_future<model::ptr_t> load_pmx_async(const char *filename, resource_repository*,
+                                                job_system *jobs, upload_queue::ptr_t uploader,
+                                                const pmx_load_option& = pmx_load_option());
+
+// std::ifstream 版とメモリマップ版の解析時間を比べる.
+bool bench_pmx_parse(const char *filename, int iterations);
+// PMX の解析とキャッシュからの読み込みの時間を比べる.
+bool bench_pmx_cache(const char *filename, int iterations);
+// 頂点キャッシュ向けの並べ替えの効果を調べる.
+bool bench_pmx_mesh(const char *filename);
 
@@ -0,0 +1,183 @@
+﻿
+#pragma once
+
+#include "model.h"
+
+
+// 描画用の PMX 頂点.
+struct pmx_model_vertex
+{
+  vec3 pos;
+  vec3 nml;
+  vec2 uv;
+  uint32_t bone[4];
+  float weight[4];
+};
+vertex_decl_array_t get_pmx_model_vertex_decl();
+
+// SDEF の頂点の補正用の値. ボーンと重みは頂点の bone[0..1], weight[0..1].
+struct pmx_sdef
+{
+  uint32_t vertex;
+  vec3 c;
+  vec3 r0;
+  vec3 r1;
+};
+
+enum PMXMaterialFlag
+{
+  PMX_CullNone = 0x01,
+  PMX_ShadowCasterGround = 0x02,
+  PMX_ShadowCaster = 0x04,
+  PMX_ShadowReceiver = 0x08,
+  PMX_Edge = 0x10,
+};
+enum PMXSphereMode
+{
+  PMX_None,
+  PMX_Mult,
+  PMX_Add,
+  PMC_SubTexture,
+};
+
+enum PMXBoneFlag
+{
+  PMXBone_Connect = 0x0001,
+  PMXBone_EnableIK = 0x0020,
+  PMXBone_AssignRotate = 0x0100,
+  PMXBone_AssignTranslate = 0x0200,
+  PMXBone_FixAxis = 0x0400,
+  PMXBone_LocalAxis = 0x0800,
+  PMXBone_AfterPhysics = 0x1000,
+};
+
+// IK の鎖のボーン一つ分. 角度の制限はラジアンの XYZ オイラー角.
+struct pmx_model_ik_link
+{
+  int32_t bone;
+  uint8_t angle_limit;
+  vec3 min_angle;
+  vec3 max_angle;
+};
+
+// 姿勢の計算に使うボーン.
+struct pmx_model_bone
+{
+  std::string name;
+  vec3 pos;
+  int32_t parent;
+  int32_t level;
+  uint16_t flags;
+  int32_t assign_bone;
+  float assign_rate;
+  // IK. ik_target_bone を自分の位置へ寄せる. 無ければ -1.
+  int32_t ik_target_bone;
+  int32_t ik_loop_count;
+  float ik_loop_limit;
+  std::vector<pmx_model_ik_link> ik_link_array;
+};
+
+enum PMXMorph
+{
+  PMXMorph_Group,
+  PMXMorph_Vertex,
+  PMXMorph_Bone,
+  PMXMorph_UV,
+  PMXMorph_UV_1,
+  PMXMorph_UV_2,
+  PMXMorph_UV_3,
+  PMXMorph_UV_4,
+  PMXMorph_Material,
+};
+
+// モーフ. type (PMXMorph) に合う配列だけを使う.
+struct pmx_model_morph
+{
+  struct group_offset
+  {
+    int32_t morph;
+    float rate;
+  };
+  struct vertex_offset
+  {
+    uint32_t vertex;
+    vec3 translate;
+  };
+  struct uv_offset
+  {
+    uint32_t vertex;
+    vec4 translate;
+  };
+  struct bone_offset
+  {
+    int32_t bone;
+    vec3 translate;
+    quarternion rotate;
+  };
+  // op が 0 なら掛け, 1 なら足す. material が -1 なら全ての材質.
+  struct material_offset
+  {
+    int32_t material;
+    uint8_t op;
+    color diffuse;
+    color specular;
+    color ambient;
+    color edge_color;
+    float edge_size;
+    color tex_coef;
+    color sphere_tex_coef;
+    color toon_tex_coef;
+  };
+
+  std::string name;
+  uint8_t panel;
+  uint8_t type;
+  std::vector<group_offset> group_array;
+  std::vector<vertex_offset> vertex_array;
+  std::vector<uv_offset> uv_array;
+  std::vector<bone_offset> bone_array;
+  std::vector<material_offset> material_array;
+};
+
+// 材質一つ分の描画区間.
+struct pmx_section
+{
+  uint32_t index_offset;
+  uint32_t index_count;
+  color diffuse;
+  color specular;
+  color ambient;
+  color edge_color;
+  float edge_size;
+  uint8_t flags;
+  uint8_t sphere_mode;
+  bool is_common_toon_tex;
+  int32_t texid;
+  int32_t sphere_texid;
+  int32_t toon_texid;
+};
+
+// GL オブジェクトを作る直前の, 描画用に変換済みのモデル.
+// 頂点とインデックスは holder が持つメモリ (解析結果かキャッシュのマッピング) を指す.
+struct pmx_model_data
+{
+  std::shared_ptr<const void> holder;
+  const pmx_model_vertex *vertex_array;
+  size_t vertex_count;
+  // 頂点数に合わせた幅 (GL_UNSIGNED_SHORT か GL_UNSIGNED_INT) で並ぶ.
+  GLenum index_type;
+  const void *index_array;
+  size_t index_count;
+  std::vector<pmx_section> section_array;
+  // 頂点番号の順に並ぶ.
+  std::vector<pmx_sdef> sdef_array;
+  std::vector<pmx_model_bone> bone_array;
+  std::vector<pmx_model_morph> morph_array;
+  // モデルのディレクトリからの相対パス. 区切りは '/' に揃えてある.
+  std::vector<std::string> texture_path_array;
+  std::filesystem::path base_dir;
+
+  pmx_model_data()
+    : vertex_array(0), vertex_count(0), index_type(GL_UNSIGNED_INT), index_array(0), index_count(0)
+  {}
+};
@@ -54,7 +54,7 @@ bool png_get_gl_format(int bit_depth, int color_type, GLint *internalformat, GLe
 } // end of anonymus namespace
 
 
-bool load_png(texture *tex, const char *filename)
+bool decode_png(texture_image *img, const char *filename)
 {
   // PNG 読み込み.
   std::ifstream f;
@@ -94,12 +94,12 @@ bool load_png(texture *tex, const char *filename)
   png_destroy_read_struct(&psp, &pip, 0);
   f.close();
 
-  // テクスチャへロード.
-  glBindTexture(GL_TEXTURE_2D, tex->texture_globj());
-  glTexImage2D(GL_TEXTURE_2D, 0, internalformat, width, height, 0, format, type, data.get());
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-  glGenerateMipmap(GL_TEXTURE_2D);
+  img->width = width;
+  img->height = height;
+  img->internalformat = internalformat;
+  img->format = format;
+  img->type = type;
+  img->data = std::move(data);
 
   return true;
 }
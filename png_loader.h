@@ -3,5 +3,5 @@
 
 #include "texture.h"
 
-bool load_png(texture*, const char *filename);
+bool decode_png(texture_image*, const char *filename);
 
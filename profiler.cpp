@@ -0,0 +1,31 @@
+﻿
+#include "stdafx.h"
+
+#include "profiler.h"
+
+
+void profiler_impl::add(const char *name, clock::duration d)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = std::find_if(frame_.begin(), frame_.end(),
+                         [name](const entry& e) { return std::strcmp(e.name, name) == 0; });
+  if (it == frame_.end()) {
+    frame_.push_back({ name, clock::duration::zero(), 0 });
+    it = frame_.end() - 1;
+  }
+  it->total += d;
+  ++it->count;
+}
+
+void profiler_impl::begin_frame()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  last_frame_.swap(frame_);
+  frame_.clear();
+}
+
+std::vector<profiler_impl::entry> profiler_impl::last_frame() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return last_frame_;
+}
@@ -0,0 +1,59 @@
+﻿
+#pragma once
+
+#include <mutex>
+
+#include "singleton.h"
+
+
+// 名前ごとの処理時間をフレーム単位で集める.
+// 名前は文字列リテラルなど, ずっと残る文字列を渡すこと.
+class profiler_impl
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  struct entry
+  {
+    const char *name;
+    clock::duration total;
+    // 足した回数.
+    size_t count;
+  };
+
+public:
+  // ワーカースレッドから呼んでも良い.
+  void add(const char *name, clock::duration);
+
+  // フレームの始めに呼ぶ. 前のフレームの分を last_frame() に移す.
+  void begin_frame();
+  // 前のフレームの分. 初めて足された順に並ぶ.
+  std::vector<entry> last_frame() const;
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<entry> frame_;
+  std::vector<entry> last_frame_;
+};
+typedef singleton<profiler_impl> profiler;
+
+
+// 作ってから消えるまでの時間を profiler に足す.
+class profile_scope
+{
+public:
+  profile_scope(const char *name)
+    : name_(name), start_(profiler_impl::clock::now())
+  {}
+  ~profile_scope()
+  {
+    profiler::instance().add(name_, profiler_impl::clock::now() - start_);
+  }
+
+  profile_scope(const profile_scope&) = delete;
+  profile_scope& operator=(const profile_scope&) = delete;
+
+private:
+  const char *name_;
+  profiler_impl::clock::time_point start_;
+};
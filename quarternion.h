@@ -31,6 +31,8 @@ struct quarternion
   
   static quarternion identity();
   static quarternion rotate(const vec3& axis, float rad);
+  // 回転行列 (左上 3x3) から.
+  static quarternion from_matrix(const matrix& m);
 };
 
 inline quarternion quarternion::identity()
@@ -43,6 +45,25 @@ inline quarternion quarternion::rotate(const vec3& axis, float rad)
   return quarternion(axis * std::sinf(rad/2), cos(rad/2));
 }
 
+inline quarternion quarternion::from_matrix(const matrix& m)
+{
+  float trace = m._00 + m._11 + m._22;
+  if (trace > 0.f) {
+    float s = std::sqrt(trace + 1.f) * 2.f;
+    return quarternion((m._21 - m._12) / s, (m._02 - m._20) / s, (m._10 - m._01) / s, 0.25f * s);
+  }
+  if ((m._00 > m._11) && (m._00 > m._22)) {
+    float s = std::sqrt(1.f + m._00 - m._11 - m._22) * 2.f;
+    return quarternion(0.25f * s, (m._01 + m._10) / s, (m._02 + m._20) / s, (m._21 - m._12) / s);
+  }
+  if (m._11 > m._22) {
+    float s = std::sqrt(1.f + m._11 - m._00 - m._22) * 2.f;
+    return quarternion((m._01 + m._10) / s, 0.25f * s, (m._12 + m._21) / s, (m._02 - m._20) / s);
+  }
+  float s = std::sqrt(1.f + m._22 - m._00 - m._11) * 2.f;
+  return quarternion((m._02 + m._20) / s, (m._12 + m._21) / s, 0.25f * s, (m._10 - m._01) / s);
+}
+
 inline quarternion operator*(const quarternion& a, const quarternion& b)
 {
   quarternion r(a); r *= b; return r;
@@ -52,7 +73,28 @@ inline quarternion operator/(const quarternion& a, float b)
   quarternion r(a); r /= b; return r;
 }
 
+inline float dot(const quarternion& a, const quarternion& b) { return dot(a.v, b.v) + a.w * b.w; }
+inline quarternion normalize(const quarternion& q) { return q / std::sqrt(dot(q, q)); }
 inline quarternion conj(const quarternion& q) { return quarternion(-q.v, q.w); }
+// 球面線形補間. 近い方を回る.
+inline quarternion slerp(const quarternion& a, const quarternion& b, float t)
+{
+  float c = dot(a, b);
+  quarternion e = (c < 0.f) ? quarternion(-b.v, -b.w) : b;
+  c = std::abs(c);
+  float ka, kb;
+  if (c > 0.9995f) {
+    // ほぼ同じ向きなら線形で良い.
+    ka = 1.f - t;
+    kb = t;
+  } else {
+    float theta = std::acos(c);
+    float s = std::sin(theta);
+    ka = std::sin((1.f - t) * theta) / s;
+    kb = std::sin(t * theta) / s;
+  }
+  return normalize(quarternion(a.v * ka + e.v * kb, a.w * ka + e.w * kb));
+}
 inline quarternion inverse(const quarternion& q) { return conj(q) / (lenq(q.v) + q.w * q.w); }
 inline vec3 rotate(const quarternion& q, const vec3& v)
 {
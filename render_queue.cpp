@@ -0,0 +1,244 @@
+﻿
+#include "stdafx.h"
+
+#include "render_queue.h"
+
+#include "util.h"
+#include "gl_state.h"
+
+
+render_queue::render_queue()
+  : stats_(),
+    current_program_(0), current_vertex_array_(0), current_uniform_buffer_(0), current_uniform_offset_(0),
+    current_matrix_index_(0)
+{
+}
+
+uint64_t render_queue::make_key(Pass pass, uint32_t shader_id, uint32_t depth, uint32_t model_id, uint32_t section)
+{
+  // セクションは溢れても順が逆にならないよう, 回さずに頭打ちにする.
+  return ((uint64_t)(pass & 0xf) << 60) |
+         ((uint64_t)(shader_id & 0xfff) << 48) |
+         ((uint64_t)(depth & 0xffff) << 32) |
+         ((uint64_t)(model_id & 0xffff) << 16) |
+         (uint64_t)std::min(section, 0xffffu);
+}
+
+uint32_t render_queue::depth_key(float distance, float far_distance)
+{
+  float d = (far_distance > 0.f) ? (distance / far_distance) : 0.f;
+  d = std::min(std::max(d, 0.f), 1.f);
+  return (uint32_t)(d * 0xffff);
+}
+
+uint32_t render_queue::push_matrix(const matrix& m)
+{
+  matrix_array_.push_back(m);
+  return (uint32_t)(matrix_array_.size() - 1);
+}
+
+void render_queue::push(const draw_item& item)
+{
+  item_array_.push_back(item);
+}
+
+void render_queue::push_custom(scene_node *node, const matrix& world)
+{
+  draw_item item = {};
+  // 積んだ順を崩さないよう, model と section に順番を分けて入れておく.
+  uint32_t order = (uint32_t)item_array_.size();
+  item.key = make_key(Pass_Custom, 0, 0, order >> 16, order & 0xffff);
+  item.matrix_index = push_matrix(world);
+  item.custom_node = node;
+  item_array_.push_back(item);
+}
+
+void render_queue::clear()
+{
+  item_array_.clear();
+  matrix_array_.clear();
+}
+
+void render_queue::invalidate_state()
+{
+  current_program_ = 0;
+  current_vertex_array_ = 0;
+  current_uniform_buffer_ = 0;
+  current_uniform_offset_ = 0;
+  current_matrix_index_ = ~0u;
+  std::fill(current_texture_array_.begin(), current_texture_array_.end(), 0);
+  std::fill(current_sampler_array_.begin(), current_sampler_array_.end(), 0);
+  std::fill(current_sampler_unit_array_.begin(), current_sampler_unit_array_.end(), -1);
+}
+
+void render_queue::submit(scene *scn)
+{
+  std::stable_sort(item_array_.begin(), item_array_.end(),
+                   [](const draw_item& a, const draw_item& b) { return a.key < b.key; });
+
+  auto& gl = gl_state::instance();
+  stats_ = stats();
+  stats_.item_count = item_array_.size();
+  invalidate_state();
+  for (const auto& item : item_array_) {
+    if (item.custom_node) {
+      // 中で何を変えるか分からないので, 覚えている状態は捨てる.
+      draw_context ctx;
+      ctx.push_matrix(matrix_array_[item.matrix_index]);
+      item.custom_node->draw(scn, &ctx);
+      invalidate_state();
+      ++stats_.custom_count;
+      continue;
+    }
+
+    ++stats_.program.requested;
+    if (item.shdr->globj() != current_program_) {
+      item.shdr->use();
+      current_program_ = item.shdr->globj();
+      current_matrix_index_ = ~0u;
+      std::fill(current_sampler_unit_array_.begin(), current_sampler_unit_array_.end(), -1);
+      ++stats_.program.issued;
+    }
+
+    ++stats_.vertex_array.requested;
+    if (item.vertex_array != current_vertex_array_) {
+      gl.bind_vertex_array(item.vertex_array);
+      current_vertex_array_ = item.vertex_array;
+      ++stats_.vertex_array.issued;
+    }
+
+    ++stats_.material.requested;
+    GLuint uniform_buffer = item.mtrlbuf->globj_uniform_buffer();
+    GLintptr uniform_offset = item.mtrlbuf->block_offset(item.material_index);
+    if ((uniform_buffer != current_uniform_buffer_) || (uniform_offset != current_uniform_offset_)) {
+      gl.bind_buffer_range(GL_UNIFORM_BUFFER, UniformBlockBinding_Material, uniform_buffer,
+                           uniform_offset, item.mtrlbuf->block_size());
+      current_uniform_buffer_ = uniform_buffer;
+      current_uniform_offset_ = uniform_offset;
+      ++stats_.material.issued;
+    }
+    for (const auto& [name, param] : item.mtrlbuf->loose_parameter_array(item.material_index)) {
+      param->set_to(name->c_str(), item.shdr);
+    }
+
+    const auto& texture_binding_array = item.mtrlbuf->texture_binding_array(item.material_index);
+    if (current_texture_array_.size() < texture_binding_array.size()) {
+      current_texture_array_.resize(texture_binding_array.size(), 0);
+      current_sampler_array_.resize(texture_binding_array.size(), 0);
+    }
+    for (size_t unit=0; unit<texture_binding_array.size(); ++unit) {
+      const auto& binding = texture_binding_array[unit];
+      ++stats_.texture.requested;
+      if (binding.texture != current_texture_array_[unit]) {
+        gl.bind_texture((GLuint)unit, GL_TEXTURE_2D, binding.texture);
+        current_texture_array_[unit] = binding.texture;
+        ++stats_.texture.issued;
+      }
+      if (binding.sampler != current_sampler_array_[unit]) {
+        gl.bind_sampler((GLuint)unit, binding.sampler);
+        current_sampler_array_[unit] = binding.sampler;
+      }
+      // サンプラの uniform はプログラムが覚えているので, 違う時だけ設定する.
+      if (binding.location >= (GLint)current_sampler_unit_array_.size()) {
+        current_sampler_unit_array_.resize(binding.location + 1, -1);
+      }
+      if (current_sampler_unit_array_[binding.location] != (GLint)unit) {
+        item.shdr->set_uniform(binding.location, (int)unit);
+        current_sampler_unit_array_[binding.location] = (GLint)unit;
+      }
+    }
+
+    if (item.bone_palette) {
+      gl.bind_texture(ReservedTextureUnit_BonePalette, GL_TEXTURE_BUFFER, item.bone_palette);
+    }
+    // 前の項目の表が残らないよう, 無い時も 0 を束縛する. 同じなら gl_state が省く.
+    gl.bind_texture(ReservedTextureUnit_MorphTable, GL_TEXTURE_BUFFER, item.morph_table);
+
+    ++stats_.matrix.requested;
+    if (item.matrix_index != current_matrix_index_) {
+      item.shdr->set_uniform(item.mvp_location, matrix_array_[item.matrix_index]);
+      current_matrix_index_ = item.matrix_index;
+      ++stats_.matrix.issued;
+    }
+
+    if (item.instance_count > 1) {
+      glDrawElementsInstanced(GL_TRIANGLES, item.index_count, item.index_type, (const void*)item.index_byte_offset,
+                              item.instance_count);
+    } else {
+      glDrawElements(GL_TRIANGLES, item.index_count, item.index_type, (const void*)item.index_byte_offset);
+    }
+  }
+
+  clear();
+}
+
+
+bool bench_render_queue(model::ptr_t mdl, shader::ptr_t shdr, int models, int frames)
+{
+  typedef std::chrono::steady_clock clock;
+
+  scene scn;
+  scn.root_camera() =
+    camera(vec3(0.f, 10.f, -30.f),
+           vec3(0.f, 10.f, 0.f),
+           vec3(0.f, 1.f, 0.f),
+           deg2rad(45.f), 1.f, 0.1f, 100.f);
+  // 格子状に並べる.
+  int columns = (int)std::ceil(std::sqrt((float)models));
+  std::vector<std::shared_ptr<model_node>> node_array;
+  for (int i=0; i<models; ++i) {
+    auto node = std::make_shared<model_node>(mdl, shdr);
+    float x = (float)(i % columns - columns / 2) * 10.f;
+    float z = (float)(i / columns) * 10.f;
+    node->set_world_matrix(matrix(1.f, 0.f, 0.f, x,
+                                  0.f, 1.f, 0.f, 0.f,
+                                  0.f, 0.f, 1.f, z,
+                                  0.f, 0.f, 0.f, 1.f));
+    scn.add_node(node);
+    node_array.push_back(node);
+  }
+
+  // GPU の完了は待つが, 待ち時間は計らない.
+  // 最初の一回で gl_state が一フレームに呼んだ数と省いた数を数える.
+  auto& gl = gl_state::instance();
+  gl_state_impl::stats direct_gl_stats, queue_gl_stats;
+  auto measure = [&](auto draw, gl_state_impl::stats *gl_stats) {
+    gl.begin_frame();
+    draw();
+    *gl_stats = gl.frame_stats();
+    glFinish();
+    clock::duration total(0);
+    for (int i=0; i<frames; ++i) {
+      auto start = clock::now();
+      draw();
+      total += clock::now() - start;
+      glFinish();
+    }
+    return std::chrono::duration<double, std::milli>(total).count() / frames;
+  };
+  double direct_ms = measure([&]() {
+    scn.root_camera().makeup_matrix();
+    draw_context ctx;
+    for (auto& node : node_array) {
+      node->draw(&scn, &ctx);
+    }
+  }, &direct_gl_stats);
+  double queue_ms = measure([&]() { scn.draw(); }, &queue_gl_stats);
+
+  const auto& st = scn.queue()->last_stats();
+  printf("render queue: %d models, %zu sections each, %d frames\n", models, mdl->section_array().size(), frames);
+  printf("  direct       : %9.3f ms/frame, gl %zu issued %zu skipped\n",
+         direct_ms, direct_gl_stats.issued, direct_gl_stats.skipped);
+  printf("  render queue : %9.3f ms/frame, gl %zu issued %zu skipped (%zu items)\n",
+         queue_ms, queue_gl_stats.issued, queue_gl_stats.skipped, st.item_count);
+  auto print_count = [](const char *name, const render_queue::state_count& c) {
+    printf("  %-12s : %7zu requested %7zu issued %7zu eliminated\n", name, c.requested, c.issued, c.eliminated());
+  };
+  print_count("program", st.program);
+  print_count("vertex array", st.vertex_array);
+  print_count("material", st.material);
+  print_count("texture", st.texture);
+  print_count("matrix", st.matrix);
+
+  return glGetError() == GL_NO_ERROR;
+}
@@ -0,0 +1,112 @@
+﻿
+#pragma once
+
+#include "model.h"
+
+
+// 描画の待ち行列.
+// シーンをたどる間は描画項目を積むだけにして, 最後にソートキーで並べ替えてから
+// 同じ状態の設定を省きながら GL を呼ぶ.
+class render_queue
+{
+public:
+  // ソートキーの一番上に入る描画の段階.
+  enum Pass
+  {
+    Pass_Opaque,
+    // 待ち行列に対応していないノード. draw() をそのまま呼ぶ.
+    Pass_Custom,
+
+    Pass_Num
+  };
+
+  struct draw_item
+  {
+    uint64_t key;
+    shader *shdr;
+    GLint mvp_location;
+    uint32_t matrix_index;
+    GLuint vertex_array;
+    material_buffer *mtrlbuf;
+    uint32_t material_index;
+    GLenum index_type;
+    GLsizei index_count;
+    size_t index_byte_offset;
+    // スキニングするならボーン行列のテクスチャバッファ.
+    GLuint bone_palette;
+    // モーフをシェーダで足すなら, その表のテクスチャバッファ.
+    GLuint morph_table;
+    // 1 より大きければ glDrawElementsInstanced で描く.
+    GLsizei instance_count;
+    // Pass_Custom の時だけ.
+    scene_node *custom_node;
+  };
+
+  // 状態ごとの設定の回数.
+  // requested は項目ごとに素直に設定した場合の回数, issued は実際に GL を呼んだ回数.
+  struct state_count
+  {
+    size_t requested;
+    size_t issued;
+
+    size_t eliminated() const { return requested - issued; }
+  };
+
+  struct stats
+  {
+    size_t item_count;
+    size_t custom_count;
+    state_count program;
+    state_count vertex_array;
+    state_count material;
+    state_count texture;
+    state_count matrix;
+  };
+
+public:
+  render_queue();
+
+  // キーは上から pass:4, shader:12, depth:16, model:16, section:16 ビット.
+  // 同じシェーダの中では depth の小さい (手前の) モデルから描き, モデルの中はセクションの順に描く.
+  // PMX は半透明の材質もファイルの順に描く前提なので, セクションの順は崩さない.
+  // テクスチャでは並べないが, 続くセクションが同じテクスチャなら設定は省かれる.
+  static uint64_t make_key(Pass, uint32_t shader_id, uint32_t depth, uint32_t model_id, uint32_t section);
+  // カメラからの距離をキーの depth に詰める.
+  static uint32_t depth_key(float distance, float far_distance);
+
+  // 項目から参照する行列を積んで, その番号を返す.
+  uint32_t push_matrix(const matrix&);
+  void push(const draw_item&);
+  void push_custom(scene_node*, const matrix& world);
+
+  // 並べ替えて描く. 描き終わったら空になる.
+  void submit(scene*);
+
+  void clear();
+
+  size_t size() const { return item_array_.size(); }
+  // 直前の submit() の統計.
+  const stats& last_stats() const { return stats_; }
+
+private:
+  void invalidate_state();
+
+private:
+  std::vector<draw_item> item_array_;
+  std::vector<matrix> matrix_array_;
+  stats stats_;
+
+  // submit() の間だけ使う, 今の GL の状態.
+  GLuint current_program_;
+  GLuint current_vertex_array_;
+  GLuint current_uniform_buffer_;
+  GLintptr current_uniform_offset_;
+  uint32_t current_matrix_index_;
+  std::vector<GLuint> current_texture_array_;
+  std::vector<GLuint> current_sampler_array_;
+  // サンプラの uniform の位置ごとに設定したユニット.
+  std::vector<GLint> current_sampler_unit_array_;
+};
+
+// 同じモデルを models 個並べたシーンを, 待ち行列を通した時と木の順に直接描いた時とで比べる.
+bool bench_render_queue(model::ptr_t, shader::ptr_t, int models, int frames);
@@ -4,6 +4,7 @@
 #include "scene.h"
 #include "shader.h"
 #include "model.h"
+#include "render_queue.h"
 
 
 scene_node::scene_node()
@@ -21,6 +22,11 @@ void scene_node::append_child(ptr_t p)
   child_array_.push_back(p);
 }
 
+void scene_node::enqueue(scene*, draw_context *ctx, render_queue *queue)
+{
+  queue->push_custom(this, ctx->current_matrix());
+}
+
 
 draw_context::draw_context()
   : current_matrix_(matrix::identity())
@@ -49,7 +55,12 @@ void draw_context::update_current_matrix()
 
 
 scene::scene()
-  : root_node_(std::make_shared<scene_node>("root"))
+  : root_node_(std::make_shared<scene_node>("root")),
+    queue_(std::make_unique<render_queue>())
+{
+}
+
+scene::~scene()
 {
 }
 
@@ -74,22 +85,26 @@ void scene::draw()
 {
   camera_.makeup_matrix();
 
+  // たどる間は積むだけで, GL はまとめて呼ぶ.
   draw_context ctx;
-  draw_impl(root_node_, &ctx);
+  enqueue_impl(root_node_, &ctx);
+  queue_->submit(this);
 }
 
-void scene::draw_impl(scene_node::ptr_t n, draw_context* ctx)
+void scene::enqueue_impl(scene_node::ptr_t n, draw_context* ctx)
 {
   auto& child_array = n->child_array();
   if (child_array.empty()) {
-    n->draw(this, ctx);
+    n->enqueue(this, ctx, queue_.get());
   } else {
     ctx->push_matrix(n->child_matrix());
     for (auto& c : child_array) {
-      draw_impl(c, ctx);
+      enqueue_impl(c, ctx);
     }
     ctx->pop_matrix();
-    n->draw(this, ctx);
+    if (n != root_node_) {
+      n->enqueue(this, ctx, queue_.get());
+    }
   }
 }
 
@@ -6,6 +6,7 @@
 
 class scene;
 class draw_context;
+class render_queue;
 
 class scene_node
 {
@@ -24,6 +25,8 @@ public:
   void set_child_matrix(const matrix& m) { child_matrix_ = m; }
 
   virtual void draw(scene*, draw_context*) {}
+  // 描画項目を待ち行列に積む. 対応していないノードは draw() をそのまま呼ぶ項目になる.
+  virtual void enqueue(scene*, draw_context*, render_queue*);
 
   template<class NodeT, class... Args>
   static typename NodeT::ptr_t make(Args... args)
@@ -66,6 +69,7 @@ public:
 
 public:
   scene();
+  ~scene();
   
   scene_node::ptr_t add_node(scene_node::ptr_t p);
   scene_node::ptr_t add_node(scene_node::ptr_t parent, scene_node::ptr_t p);
@@ -76,13 +80,16 @@ public:
 
   void draw();
 
+  // draw() で使った待ち行列. 統計を見る時に.
+  render_queue *queue() { return queue_.get(); }
+
   template<class FuncT>
   void traverse_depth_first(FuncT);
   template<class FuncT>
   void traverse_breadth_first(FuncT);
 
 private:
-  void draw_impl(scene_node::ptr_t, draw_context*);
+  void enqueue_impl(scene_node::ptr_t, draw_context*);
 
   template<class FuncT>
   void traverse_depth_first_impl(scene_node::ptr_t, FuncT);
@@ -92,6 +99,7 @@ private:
 private:
   scene_node::ptr_t root_node_;
   camera camera_;
+  std::unique_ptr<render_queue> queue_;
 };
 
 
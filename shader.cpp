@@ -3,6 +3,7 @@
 
 #include "shader.h"
 #include "util.h"
+#include "gl_state.h"
 
 
 namespace {
@@ -48,9 +49,33 @@ bool get_shader_error(GLuint shader, std::string *s) {
   return false;
 }
 
-bool compile_shader_from_source_file(GLuint shader, const char *filename)
+// #version 行の直後に #define を差し込む.
+void insert_defines(std::string *source, const shader_define_array_t& defines)
+{
+  if (defines.empty()) {
+    return;
+  }
+  std::string lines;
+  for (auto& d : defines) {
+    lines += "#define " + d + "\n";
+  }
+  size_t pos = source->find("#version");
+  if (pos == std::string::npos) {
+    source->insert(0, lines);
+    return;
+  }
+  pos = source->find('\n', pos);
+  if (pos == std::string::npos) {
+    source->append("\n" + lines);
+  } else {
+    source->insert(pos + 1, lines);
+  }
+}
+
+bool compile_shader_from_source_file(GLuint shader, const char *filename, const shader_define_array_t& defines)
 {
   std::string source = read_file_all(filename);
+  insert_defines(&source, defines);
   const char *s = source.c_str();
   glShaderSource(shader, 1, &s, 0);
   glCompileShader(shader);
@@ -79,12 +104,33 @@ const char *get_semantics_attrib_name(Semantics semantics)
     "vTexCoord_5",
     "vTexCoord_6",
     "vTexCoord_7",
+    "vBoneIndex",
+    "vBoneWeight",
   };
   static_assert(countof(semantics_attrib_name) == Semantics_Num);
 
   return semantics_attrib_name[semantics];
 }
 
+// 名前で並んだ表から引く.
+template<class TableT>
+const typename TableT::value_type *find_entry(const TableT& table, const char *name)
+{
+  auto it = std::lower_bound(table.begin(), table.end(), name,
+                             [](const auto& e, const char *n) { return strcmp(e.name.c_str(), n) < 0; });
+  if ((it != table.end()) && (it->name == name)) {
+    return &*it;
+  }
+  return 0;
+}
+
+template<class TableT>
+GLint find_location(const TableT& table, const char *name)
+{
+  auto e = find_entry(table, name);
+  return e ? e->location : -1;
+}
+
 }	// end of anonymus namespace
 
 
@@ -101,9 +147,9 @@ vertex_shader::~vertex_shader()
   }
 }
 
-bool vertex_shader::compile_from_source_file(const char *filename)
+bool vertex_shader::compile_from_source_file(const char *filename, const shader_define_array_t& defines)
 {
-  return compile_shader_from_source_file(shader_, filename);
+  return compile_shader_from_source_file(shader_, filename, defines);
 }
 
 
@@ -120,9 +166,9 @@ fragment_shader::~fragment_shader()
   }
 }
 
-bool fragment_shader::compile_from_source_file(const char *filename)
+bool fragment_shader::compile_from_source_file(const char *filename, const shader_define_array_t& defines)
 {
-  return compile_shader_from_source_file(shader_, filename);
+  return compile_shader_from_source_file(shader_, filename, defines);
 }
 
 
@@ -130,12 +176,13 @@ shader_program::shader_program()
   : program_(0)
 {
   program_ = glCreateProgram();
+  std::fill(std::begin(semantics_location_), std::end(semantics_location_), -1);
 }
 
 shader_program::~shader_program()
 {
   if (program_) {
-    glDeleteProgram(program_);
+    gl_state::instance().delete_program(program_);
   }
 }
 
@@ -161,27 +208,142 @@ void shader_program::link()
       std::cout << info_log << std::endl;
     }
   }
+  reflect();
+}
+
+void shader_program::reflect()
+{
+  uniform_table_.clear();
+  attrib_table_.clear();
+  uniform_block_table_.clear();
+  uniform_block_size_.clear();
+  uniform_block_member_table_.clear();
+  std::fill(std::begin(semantics_location_), std::end(semantics_location_), -1);
+
+  GLint uniform_count = 0, uniform_name_length = 0;
+  glGetProgramiv(program_, GL_ACTIVE_UNIFORMS, &uniform_count);
+  glGetProgramiv(program_, GL_ACTIVE_UNIFORM_MAX_LENGTH, &uniform_name_length);
+  std::vector<char> name(std::max(uniform_name_length, 1));
+  for (GLint i=0; i<uniform_count; ++i) {
+    GLsizei length = 0;
+    GLint size = 0;
+    GLenum type;
+    glGetActiveUniform(program_, i, (GLsizei)name.size(), &length, &size, &type, name.data());
+    std::string n(name.data(), length);
+    // ブロックの中の変数は位置を持たないので, 配置を覚えておく.
+    GLuint index = (GLuint)i;
+    GLint block_index = -1;
+    glGetActiveUniformsiv(program_, 1, &index, GL_UNIFORM_BLOCK_INDEX, &block_index);
+    if (block_index >= 0) {
+      uniform_block_member m = { n, block_index, 0, 0, 0 };
+      glGetActiveUniformsiv(program_, 1, &index, GL_UNIFORM_OFFSET, &m.offset);
+      glGetActiveUniformsiv(program_, 1, &index, GL_UNIFORM_ARRAY_STRIDE, &m.array_stride);
+      glGetActiveUniformsiv(program_, 1, &index, GL_UNIFORM_MATRIX_STRIDE, &m.matrix_stride);
+      if ((n.size() > 3) && (n.compare(n.size() - 3, 3, "[0]") == 0)) {
+        m.name = n.substr(0, n.size() - 3);
+      }
+      uniform_block_member_table_.push_back(m);
+      continue;
+    }
+    GLint loc = glGetUniformLocation(program_, n.c_str());
+    if (loc < 0) {
+      continue;
+    }
+    uniform_table_.push_back({n, loc});
+    // 配列は "a[0]" で返ってくるので, "a" と各要素でも引けるようにする.
+    if ((n.size() > 3) && (n.compare(n.size() - 3, 3, "[0]") == 0)) {
+      std::string base = n.substr(0, n.size() - 3);
+      uniform_table_.push_back({base, loc});
+      for (GLint j=1; j<size; ++j) {
+        std::string element = base + "[" + std::to_string(j) + "]";
+        GLint element_loc = glGetUniformLocation(program_, element.c_str());
+        if (element_loc >= 0) {
+          uniform_table_.push_back({element, element_loc});
+        }
+      }
+    }
+  }
+
+  GLint block_count = 0, block_name_length = 0;
+  glGetProgramiv(program_, GL_ACTIVE_UNIFORM_BLOCKS, &block_count);
+  glGetProgramiv(program_, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &block_name_length);
+  name.resize(std::max(block_name_length, 1));
+  uniform_block_size_.resize(block_count);
+  for (GLint i=0; i<block_count; ++i) {
+    GLsizei length = 0;
+    glGetActiveUniformBlockName(program_, i, (GLsizei)name.size(), &length, name.data());
+    glGetActiveUniformBlockiv(program_, i, GL_UNIFORM_BLOCK_DATA_SIZE, &uniform_block_size_[i]);
+    uniform_block_table_.push_back({std::string(name.data(), length), i});
+  }
+
+  GLint attrib_count = 0, attrib_name_length = 0;
+  glGetProgramiv(program_, GL_ACTIVE_ATTRIBUTES, &attrib_count);
+  glGetProgramiv(program_, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &attrib_name_length);
+  name.resize(std::max(attrib_name_length, 1));
+  for (GLint i=0; i<attrib_count; ++i) {
+    GLsizei length = 0;
+    GLint size = 0;
+    GLenum type;
+    glGetActiveAttrib(program_, i, (GLsizei)name.size(), &length, &size, &type, name.data());
+    std::string n(name.data(), length);
+    GLint loc = glGetAttribLocation(program_, n.c_str());
+    if (loc >= 0) {
+      attrib_table_.push_back({n, loc});
+    }
+  }
+
+  auto by_name = [](const location_entry& a, const location_entry& b) { return a.name < b.name; };
+  std::sort(uniform_table_.begin(), uniform_table_.end(), by_name);
+  std::sort(attrib_table_.begin(), attrib_table_.end(), by_name);
+  std::sort(uniform_block_table_.begin(), uniform_block_table_.end(), by_name);
+  std::sort(uniform_block_member_table_.begin(), uniform_block_member_table_.end(),
+            [](const uniform_block_member& a, const uniform_block_member& b) { return a.name < b.name; });
+
+  for (int i=0; i<Semantics_Num; ++i) {
+    semantics_location_[i] = find_location(attrib_table_, get_semantics_attrib_name((Semantics)i));
+  }
 }
 
-GLint shader_program::uniform_location(const char *name)
+GLint shader_program::uniform_location(const char *name) const
 {
-  return glGetUniformLocation(program_, name);
+  return find_location(uniform_table_, name);
 }
 
-GLint shader_program::attrib_location(const char *name)
+GLint shader_program::attrib_location(const char *name) const
 {
-  return glGetAttribLocation(program_, name);
+  return find_location(attrib_table_, name);
 }
 
-GLint shader_program::attrib_location(Semantics semantics)
+GLint shader_program::uniform_block_index(const char *name) const
 {
-  return attrib_location(get_semantics_attrib_name(semantics));
+  return find_location(uniform_block_table_, name);
+}
+
+GLint shader_program::uniform_block_size(GLint block_index) const
+{
+  if ((block_index < 0) || (block_index >= (GLint)uniform_block_size_.size())) {
+    return 0;
+  }
+  return uniform_block_size_[block_index];
+}
+
+const shader_program::uniform_block_member *
+shader_program::find_uniform_block_member(const char *name) const
+{
+  return find_entry(uniform_block_member_table_, name);
+}
+
+void shader_program::set_uniform_block_binding(GLint block_index, GLuint binding)
+{
+  if (block_index >= 0) {
+    glUniformBlockBinding(program_, block_index, binding);
+  }
 }
 
 
 void shader_program::use()
 {
-  glUseProgram(program_);
+  gl_state::instance().use_program(program_);
 }
 
 void shader::use()
@@ -189,12 +351,12 @@ void shader::use()
   get_shader_program()->use();
 }
 
-bool shader::compile_from_source_file(const char *vs, const char *fs)
+bool shader::compile_from_source_file(const char *vs, const char *fs, const shader_define_array_t& defines)
 {
-  if (!vertex_shader_.compile_from_source_file(vs)) {
+  if (!vertex_shader_.compile_from_source_file(vs, defines)) {
     return false;
   }
-  if (!fragment_shader_.compile_from_source_file(fs)) {
+  if (!fragment_shader_.compile_from_source_file(fs, defines)) {
     return false;
   }
   shader_program_.attach(&vertex_shader_);
@@ -207,11 +369,24 @@ bool shader::compile_from_source_file(const char *vs, const char *fs)
 
 void shader::set_attrib(const vertex_decl& decl)
 {
-  set_attrib(get_semantics_attrib_name(decl.semantics),
-             decl.size,
-             decl.type,
-             decl.stride,
-             decl.offset);
+  GLint loc = get_shader_program()->attrib_location(decl.semantics);
+  if (loc < 0) {
+    return;
+  }
+  switch (decl.type) {
+  case GL_BYTE:
+  case GL_UNSIGNED_BYTE:
+  case GL_SHORT:
+  case GL_UNSIGNED_SHORT:
+  case GL_INT:
+  case GL_UNSIGNED_INT:
+    glEnableVertexAttribArray(loc);
+    glVertexAttribIPointer(loc, decl.size, decl.type, decl.stride, (void*)decl.offset);
+    break;
+  default:
+    set_attrib(loc, decl.size, decl.type, decl.stride, decl.offset);
+    break;
+  }
 }
 
 void shader::set_attrib(const char *name,
@@ -220,7 +395,15 @@ void shader::set_attrib(const char *name,
                         GLsizei stride,
                         size_t offset)
 {
-  int loc = get_shader_program()->attrib_location(name);
+  set_attrib(get_shader_program()->attrib_location(name), size, type, stride, offset);
+}
+
+void shader::set_attrib(GLint loc,
+                        GLint size,
+                        GLenum type,
+                        GLsizei stride,
+                        size_t offset)
+{
   if (loc < 0) {
     return;
   }
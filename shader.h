@@ -15,12 +15,32 @@ enum Semantics
   Semantics_TexCoord_5,
   Semantics_TexCoord_6,
   Semantics_TexCoord_7,
+  Semantics_BoneIndex,
+  Semantics_BoneWeight,
 
   Semantics_Num
 };
 
 
+// uniform ブロックの結合先.
+enum UniformBlockBinding
+{
+  UniformBlockBinding_Material,
+
+  UniformBlockBinding_Num
+};
+
+// 材質のテクスチャはユニットを前から使うので, それ以外は後ろから使う.
+enum ReservedTextureUnit
+{
+  ReservedTextureUnit_BonePalette = 15,
+  ReservedTextureUnit_MorphTable = 14,
+  ReservedTextureUnit_VertexAnimation = 13,
+};
+
+
 // 頂点宣言.
+// type が整数型なら整数のまま (glVertexAttribIPointer で) 渡す.
 struct vertex_decl
 {
   Semantics semantics;
@@ -31,6 +51,9 @@ struct vertex_decl
 };
 typedef std::vector<vertex_decl> vertex_decl_array_t;
 
+// コンパイル時に #version の直後へ差し込む #define 名.
+typedef std::vector<std::string> shader_define_array_t;
+
 
 class vertex_shader
 {
@@ -38,7 +61,8 @@ public:
   vertex_shader();
   ~vertex_shader();
 
-  bool compile_from_source_file(const char *filename);
+  bool compile_from_source_file(const char *filename,
+                                const shader_define_array_t& defines = shader_define_array_t());
 
   GLuint globj() { return shader_; }
   
@@ -54,7 +78,8 @@ public:
   fragment_shader();
   ~fragment_shader();
 
-  bool compile_from_source_file(const char *filename);
+  bool compile_from_source_file(const char *filename,
+                                const shader_define_array_t& defines = shader_define_array_t());
 
   GLuint globj() { return shader_; }
 
@@ -67,6 +92,17 @@ class model;
 
 class shader_program
 {
+public:
+  // uniform ブロックの中の変数の配置.
+  struct uniform_block_member
+  {
+    std::string name;
+    GLint block_index;
+    GLint offset;
+    GLint array_stride;
+    GLint matrix_stride;
+  };
+
 public:
   shader_program();
   ~shader_program();
@@ -76,16 +112,43 @@ public:
 
   void link();
 
-  GLint uniform_location(const char*);
-  GLint attrib_location(const char*);
-  GLint attrib_location(Semantics);
+  // 位置はリンクした時に表にしておくので, ここではドライバに問い合わせない.
+  // 使われていない名前は -1.
+  GLint uniform_location(const char*) const;
+  GLint attrib_location(const char*) const;
+  GLint attrib_location(Semantics semantics) const { return semantics_location_[semantics]; }
+
+  // uniform ブロック. 無ければ -1.
+  GLint uniform_block_index(const char*) const;
+  GLint uniform_block_size(GLint block_index) const;
+  // ブロックの中の変数. 無ければ 0.
+  const uniform_block_member *find_uniform_block_member(const char*) const;
+  void set_uniform_block_binding(GLint block_index, GLuint binding);
   
   void use();
 
   GLuint globj() { return program_; }
 
+private:
+  struct location_entry
+  {
+    std::string name;
+    GLint location;
+  };
+  typedef std::vector<location_entry> location_table_t;
+  typedef std::vector<uniform_block_member> uniform_block_member_table_t;
+
+  void reflect();
+
 private:
   GLuint program_;
+  // 名前で並べておく.
+  location_table_t uniform_table_;
+  location_table_t attrib_table_;
+  location_table_t uniform_block_table_;
+  std::vector<GLint> uniform_block_size_;
+  uniform_block_member_table_t uniform_block_member_table_;
+  GLint semantics_location_[Semantics_Num];
 };
 
 
@@ -100,7 +163,8 @@ public:
 
   virtual void use();
 
-  bool compile_from_source_file(const char *vs, const char *fs);
+  bool compile_from_source_file(const char *vs, const char *fs,
+                                const shader_define_array_t& defines = shader_define_array_t());
 
   void set_attrib(const vertex_decl&);
   void set_attrib(const char *name,
@@ -108,6 +172,14 @@ public:
                   GLenum type,
                   GLsizei stride,
                   size_t offset);
+  void set_attrib(GLint loc,
+                  GLint size,
+                  GLenum type,
+                  GLsizei stride,
+                  size_t offset);
+
+  // 毎回名前で引かずに済むよう, 位置を先に取っておいて set_uniform(GLint, ...) に渡す.
+  GLint uniform_location(const char *name) const { return shader_program_.uniform_location(name); }
 
   void validate();
 
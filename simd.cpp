@@ -0,0 +1,62 @@
+﻿
+#include "stdafx.h"
+
+#include "simd.h"
+
+#if defined(_MSC_VER) && defined(CUT_SIMD_X86)
+#include <intrin.h>
+#endif
+
+
+namespace {
+
+simd_level detect_simd_level()
+{
+#if !defined(CUT_SIMD_X86)
+  return SIMD_None;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int max_id = info[0];
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  bool avx2 = false;
+  if ((max_id >= 7) && osxsave && avx) {
+    // OS が YMM レジスタを保存するか.
+    if ((_xgetbv(0) & 0x6) == 0x6) {
+      __cpuidex(info, 7, 0);
+      avx2 = (info[1] & (1 << 5)) != 0;
+    }
+  }
+  return avx2 ? SIMD_AVX2 : (sse2 ? SIMD_SSE2 : SIMD_None);
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SIMD_SSE2;
+  }
+  return SIMD_None;
+#endif
+}
+
+} // end of anonymus namespace
+
+
+simd_level simd_support()
+{
+  static const simd_level level = detect_simd_level();
+  return level;
+}
+
+const char *simd_level_name(simd_level level)
+{
+  switch (level) {
+  case SIMD_SSE2: return "sse2";
+  case SIMD_AVX2: return "avx2";
+  default: return "scalar";
+  }
+}
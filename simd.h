@@ -0,0 +1,30 @@
+﻿
+#pragma once
+
+
+// x86 の SIMD 命令を使えるか.
+// 使えない環境ではスカラー版だけになる.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CUT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// コンパイラの既定より新しい命令を使う関数に付ける.
+// MSVC は指定が無くても組み込み関数を使える.
+#if defined(_MSC_VER)
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+enum simd_level
+{
+  SIMD_None,
+  SIMD_SSE2,
+  SIMD_AVX2,
+};
+
+// 実行中の CPU で使える一番上のもの.
+simd_level simd_support();
+const char *simd_level_name(simd_level);
@@ -0,0 +1,575 @@
+﻿
+#include "stdafx.h"
+
+#include "skeleton.h"
+#include "pmx_loader.h"
+#include "profiler.h"
+
+
+namespace {
+
+enum SlotFlag
+{
+  Slot_AssignRotate = 0x01,
+  Slot_AssignTranslate = 0x02,
+  Slot_IKLink = 0x04,
+};
+
+const vec3 unit_axis[3] = { vec3(1.f, 0.f, 0.f), vec3(0.f, 1.f, 0.f), vec3(0.f, 0.f, 1.f) };
+
+vec3 position(const matrix& m)
+{
+  return vec3(m._03, m._13, m._23);
+}
+
+// 回転だけの行列 m の逆で向きを変える.
+vec3 inverse_rotate(const matrix& m, const vec3& v)
+{
+  return vec3(m._00 * v.x + m._10 * v.y + m._20 * v.z,
+              m._01 * v.x + m._11 * v.y + m._21 * v.z,
+              m._02 * v.x + m._12 * v.y + m._22 * v.z);
+}
+
+// 回転を XYZ オイラー角に分ける. R = Rx * Ry * Rz.
+vec3 to_euler_xyz(const quarternion& q)
+{
+  matrix m = to_matrix(q);
+  float y = std::asin(std::clamp(m._02, -1.f, 1.f));
+  if (std::abs(m._02) > 0.9999f) {
+    // 真横を向いていると x と z が分けられないので, z を 0 にする.
+    return vec3(std::atan2(m._21, m._11), y, 0.f);
+  }
+  return vec3(std::atan2(-m._12, m._22), y, std::atan2(-m._01, m._00));
+}
+
+quarternion from_euler_xyz(const vec3& e)
+{
+  return quarternion::rotate(unit_axis[0], e.x) *
+    quarternion::rotate(unit_axis[1], e.y) *
+    quarternion::rotate(unit_axis[2], e.z);
+}
+
+} // end of anonymus namespace
+
+
+skeleton::skeleton(const std::vector<skeleton_bone>& bone_array)
+  : bone_array_(bone_array)
+{
+  const size_t count = bone_array_.size();
+  auto valid = [count](int32_t i) { return (i >= 0) && ((size_t)i < count); };
+
+  name_index_.resize(count);
+  std::iota(name_index_.begin(), name_index_.end(), 0);
+  std::stable_sort(name_index_.begin(), name_index_.end(),
+                   [this](uint32_t a, uint32_t b) { return bone_array_[a].name < bone_array_[b].name; });
+
+  // 物理後, 変形階層, ファイルでの順で並べてから, 親と付与親より前に来てしまうボーンを後ろへずらす.
+  std::vector<uint32_t> sorted(count);
+  std::iota(sorted.begin(), sorted.end(), 0);
+  std::stable_sort(sorted.begin(), sorted.end(), [this](uint32_t a, uint32_t b) {
+    const auto& ba = bone_array_[a];
+    const auto& bb = bone_array_[b];
+    return std::make_pair(ba.after_physics, ba.level) < std::make_pair(bb.after_physics, bb.level);
+  });
+  std::vector<uint8_t> emitted(count, 0);
+  slot_bone_.reserve(count);
+  while (slot_bone_.size() < count) {
+    size_t before = slot_bone_.size();
+    for (uint32_t b : sorted) {
+      if (emitted[b]) {
+        continue;
+      }
+      const auto& bone = bone_array_[b];
+      if ((valid(bone.parent) && !emitted[bone.parent]) ||
+          (valid(bone.assign_bone) && !emitted[bone.assign_bone])) {
+        continue;
+      }
+      slot_bone_.push_back(b);
+      emitted[b] = 1;
+    }
+    if (slot_bone_.size() == before) {
+      // 循環している. 残りはそのまま並べ, 先に来ない親は無いことにする.
+      for (uint32_t b : sorted) {
+        if (!emitted[b]) {
+          slot_bone_.push_back(b);
+          emitted[b] = 1;
+        }
+      }
+    }
+  }
+
+  bone_slot_.resize(count);
+  for (size_t s=0; s<count; ++s) {
+    bone_slot_[slot_bone_[s]] = (uint32_t)s;
+  }
+  parent_slot_.resize(count);
+  assign_slot_.resize(count);
+  assign_rate_.resize(count);
+  slot_flags_.resize(count);
+  offset_.resize(count);
+  bind_pos_.resize(count);
+  for (size_t s=0; s<count; ++s) {
+    const auto& bone = bone_array_[slot_bone_[s]];
+    auto earlier_slot = [&](int32_t b) {
+      return (valid(b) && (bone_slot_[b] < s)) ? (int32_t)bone_slot_[b] : -1;
+    };
+    parent_slot_[s] = earlier_slot(bone.parent);
+    assign_slot_[s] = earlier_slot(bone.assign_bone);
+    assign_rate_[s] = bone.assign_rate;
+    slot_flags_[s] = (bone.assign_rotate ? Slot_AssignRotate : 0) | (bone.assign_translate ? Slot_AssignTranslate : 0);
+    bind_pos_[s] = bone.pos;
+    offset_[s] = (parent_slot_[s] >= 0) ? bone.pos - bone_array_[bone.parent].pos : bone.pos;
+  }
+
+  // IK の鎖. 目標の親をたどって届かないボーンは回しても目標が動かないので外す.
+  for (size_t s=0; s<count; ++s) {
+    const auto& bone = bone_array_[slot_bone_[s]];
+    if (!valid(bone.ik_target_bone) || (bone.ik_loop_count <= 0)) {
+      continue;
+    }
+    ik_chain chain;
+    chain.ik_slot = (uint32_t)s;
+    chain.target_slot = bone_slot_[bone.ik_target_bone];
+    chain.loop_count = bone.ik_loop_count;
+    chain.loop_limit = (bone.ik_loop_limit > 0.f) ? bone.ik_loop_limit : 3.14159265f;
+    std::vector<uint32_t> ancestor;
+    for (int32_t p = parent_slot_[chain.target_slot]; p >= 0; p = parent_slot_[p]) {
+      ancestor.push_back((uint32_t)p);
+    }
+    for (const auto& l : bone.ik_link_array) {
+      if (!valid(l.bone) ||
+          (std::find(ancestor.begin(), ancestor.end(), bone_slot_[l.bone]) == ancestor.end())) {
+        continue;
+      }
+      ik_link link;
+      link.slot = bone_slot_[l.bone];
+      link.angle_limit = l.angle_limit;
+      link.axis = -1;
+      link.min_angle = l.min_angle;
+      link.max_angle = l.max_angle;
+      if (l.angle_limit) {
+        int free_axis = 0;
+        for (int i=0; i<3; ++i) {
+          if (l.min_angle[i] != l.max_angle[i]) {
+            link.axis = i;
+            ++free_axis;
+          }
+        }
+        if (free_axis != 1) {
+          link.axis = -1;
+        }
+      }
+      chain.link_array.push_back(link);
+      slot_flags_[link.slot] |= Slot_IKLink;
+    }
+    if (chain.link_array.empty()) {
+      continue;
+    }
+    uint32_t root_slot = chain.target_slot;
+    for (const auto& link : chain.link_array) {
+      root_slot = std::min(root_slot, link.slot);
+    }
+    chain.path_slot_array.push_back(chain.target_slot);
+    for (uint32_t a : ancestor) {
+      if (a < root_slot) {
+        break;
+      }
+      chain.path_slot_array.push_back(a);
+    }
+    std::reverse(chain.path_slot_array.begin(), chain.path_slot_array.end());
+    ik_chain_array_.push_back(std::move(chain));
+  }
+}
+
+int32_t skeleton::find_bone(std::string_view name) const
+{
+  auto it = std::lower_bound(name_index_.begin(), name_index_.end(), name,
+                             [this](uint32_t b, std::string_view n) { return bone_array_[b].name < n; });
+  if ((it != name_index_.end()) && (bone_array_[*it].name == name)) {
+    return (int32_t)*it;
+  }
+  return -1;
+}
+
+void skeleton::evaluate(skeleton_pose *pose) const
+{
+  pose->ik_iteration_count_ = 0;
+  if (!pose->ik_enabled_ || ik_chain_array_.empty()) {
+    evaluate_range(pose, 0);
+    return;
+  }
+
+  // IK の回転は毎回, 解く前の姿勢から解き直す.
+  std::fill(pose->ik_rotation_.begin(), pose->ik_rotation_.end(), quarternion::identity());
+  evaluate_range(pose, 0);
+  // ワーカーから姿勢ごとに呼ばれるので, profiler のロックは取らずに姿勢へ貯める.
+  auto start = std::chrono::steady_clock::now();
+  for (const auto& chain : ik_chain_array_) {
+    pose->ik_iteration_count_ += solve_ik_chain(pose, chain);
+    evaluate_range(pose, chain.path_slot_array.front());
+  }
+  pose->ik_time_ += std::chrono::steady_clock::now() - start;
+}
+
+void skeleton::evaluate_physics(skeleton_pose *pose) const
+{
+  evaluate_range(pose, pose->physics_slot_);
+}
+
+void skeleton::evaluate_range(skeleton_pose *pose, size_t begin) const
+{
+  const size_t count = slot_bone_.size();
+  for (size_t s=begin; s<count; ++s) {
+    evaluate_slot(pose, s);
+  }
+}
+
+void skeleton::evaluate_slot(skeleton_pose *pose, size_t s) const
+{
+  quarternion r = pose->rotation_[s];
+  vec3 t = pose->translation_[s];
+  if (pose->has_morph_) {
+    r = r * pose->morph_rotation_[s];
+    t += pose->morph_translation_[s];
+  }
+  uint8_t flags = slot_flags_[s];
+  if (flags & Slot_IKLink) {
+    r = r * pose->ik_rotation_[s];
+  }
+  if (pose->has_physics_) {
+    r = r * pose->physics_rotation_[s];
+  }
+  int32_t a = assign_slot_[s];
+  if (a >= 0) {
+    if (flags & Slot_AssignRotate) {
+      r = slerp(quarternion::identity(), pose->assigned_rotation_[a], assign_rate_[s]) * r;
+    }
+    if (flags & Slot_AssignTranslate) {
+      t += pose->assigned_translation_[a] * assign_rate_[s];
+    }
+  }
+  pose->assigned_rotation_[s] = r;
+  pose->assigned_translation_[s] = t;
+
+  matrix local = to_matrix(r);
+  local._03 = offset_[s].x + t.x;
+  local._13 = offset_[s].y + t.y;
+  local._23 = offset_[s].z + t.z;
+  int32_t p = parent_slot_[s];
+  matrix& world = pose->world_[s];
+  world = (p >= 0) ? concat(pose->world_[p], local) : local;
+
+  // 初期位置へ戻してから今の姿勢へ動かす.
+  matrix& skin = pose->skinning_[slot_bone_[s]];
+  skin = world;
+  vec3 o = transform_direction(world, bind_pos_[s]);
+  skin._03 -= o.x;
+  skin._13 -= o.y;
+  skin._23 -= o.z;
+}
+
+int skeleton::solve_ik_chain(skeleton_pose *pose, const ik_chain& chain) const
+{
+  const float tolerance2 = pose->ik_tolerance_ * pose->ik_tolerance_;
+  const vec3 goal = position(pose->world_[chain.ik_slot]);
+  int iteration = 0;
+  for (; iteration < chain.loop_count; ++iteration) {
+    if (lenq(position(pose->world_[chain.target_slot]) - goal) <= tolerance2) {
+      break;
+    }
+    // CCD. 目標に近いボーンから順に, 目標の先が IK ボーンの方を向くように回す.
+    for (const auto& link : chain.link_array) {
+      const matrix& world = pose->world_[link.slot];
+      vec3 origin = position(world);
+      vec3 to_target = inverse_rotate(world, position(pose->world_[chain.target_slot]) - origin);
+      vec3 to_goal = inverse_rotate(world, goal - origin);
+      if (link.axis >= 0) {
+        // 一つの軸しか回せないなら, その軸に垂直な面で角度を測る.
+        const vec3& axis = unit_axis[link.axis];
+        to_target -= axis * dot(axis, to_target);
+        to_goal -= axis * dot(axis, to_goal);
+      }
+      vec3 c = cross(to_target, to_goal);
+      float angle = std::min(std::atan2(len(c), dot(to_target, to_goal)), chain.loop_limit);
+      bool rotate = (angle >= 1e-5f) && (lenq(to_target) > 1e-12f) && (lenq(to_goal) > 1e-12f);
+      // 制限のあるボーンは回さなくても制限を掛ける.
+      // 膝のように伸び切った所が制限の外なら, 少し曲がって一直線から抜け出せる.
+      if (!rotate && !link.angle_limit) {
+        continue;
+      }
+
+      quarternion& ik = pose->ik_rotation_[link.slot];
+      if (rotate) {
+        vec3 axis;
+        if (link.axis >= 0) {
+          axis = unit_axis[link.axis];
+          if (dot(axis, c) < 0.f) {
+            angle = -angle;
+          }
+        } else {
+          axis = normalize(c);
+        }
+        ik = normalize(ik * quarternion::rotate(axis, angle));
+      }
+      if (link.angle_limit) {
+        // 制限は元の回転と合わせた, 親の空間での回転に掛ける.
+        quarternion base = pose->rotation_[link.slot];
+        if (pose->has_morph_) {
+          base = base * pose->morph_rotation_[link.slot];
+        }
+        vec3 e = to_euler_xyz(base * ik);
+        for (int i=0; i<3; ++i) {
+          e[i] = std::clamp(e[i], link.min_angle[i], link.max_angle[i]);
+        }
+        ik = normalize(inverse(base) * from_euler_xyz(e));
+      }
+
+      // 目標までの道のうち, このボーンから先を計算し直す.
+      auto it = std::lower_bound(chain.path_slot_array.begin(), chain.path_slot_array.end(), link.slot);
+      for (; it != chain.path_slot_array.end(); ++it) {
+        evaluate_slot(pose, *it);
+      }
+    }
+  }
+  return iteration;
+}
+
+
+skeleton_pose::skeleton_pose(skeleton::ptr_t skel)
+  : skeleton_(skel), physics_slot_(0), physics_dirty_(false), has_morph_(false), has_physics_(false),
+    ik_enabled_(true), ik_tolerance_(1e-3f), ik_iteration_count_(0), ik_time_(0)
+{
+  const size_t count = skeleton_->bone_count();
+  translation_.resize(count);
+  rotation_.resize(count);
+  morph_translation_.resize(count);
+  morph_rotation_.resize(count);
+  assigned_translation_.resize(count);
+  assigned_rotation_.resize(count);
+  ik_rotation_.resize(count, quarternion::identity());
+  physics_rotation_.resize(count, quarternion::identity());
+  world_.resize(count);
+  skinning_.resize(count);
+  reset();
+}
+
+void skeleton_pose::reset()
+{
+  std::fill(translation_.begin(), translation_.end(), vec3(0.f, 0.f, 0.f));
+  std::fill(rotation_.begin(), rotation_.end(), quarternion::identity());
+  dirty_ = true;
+}
+
+void skeleton_pose::set_translation(size_t bone, const vec3& t)
+{
+  translation_[skeleton_->bone_slot(bone)] = t;
+  dirty_ = true;
+}
+
+void skeleton_pose::set_rotation(size_t bone, const quarternion& r)
+{
+  rotation_[skeleton_->bone_slot(bone)] = r;
+  dirty_ = true;
+}
+
+void skeleton_pose::set_morph(size_t bone, const vec3& translate, const quarternion& rotate)
+{
+  if (!has_morph_) {
+    clear_morph();
+    has_morph_ = true;
+  }
+  morph_translation_[skeleton_->bone_slot(bone)] = translate;
+  morph_rotation_[skeleton_->bone_slot(bone)] = rotate;
+  dirty_ = true;
+}
+
+void skeleton_pose::clear_morph()
+{
+  std::fill(morph_translation_.begin(), morph_translation_.end(), vec3(0.f, 0.f, 0.f));
+  std::fill(morph_rotation_.begin(), morph_rotation_.end(), quarternion::identity());
+  if (has_morph_) {
+    has_morph_ = false;
+    dirty_ = true;
+  }
+}
+
+void skeleton_pose::set_physics_rotation(size_t bone, const quarternion& r)
+{
+  size_t s = skeleton_->bone_slot(bone);
+  if (!has_physics_) {
+    has_physics_ = true;
+    physics_slot_ = s;
+  }
+  physics_rotation_[s] = r;
+  physics_slot_ = std::min(physics_slot_, s);
+  physics_dirty_ = true;
+}
+
+void skeleton_pose::clear_physics_rotation()
+{
+  if (has_physics_) {
+    // 外した分は次の evaluate() で同じ所から計算し直す.
+    std::fill(physics_rotation_.begin(), physics_rotation_.end(), quarternion::identity());
+    has_physics_ = false;
+    physics_dirty_ = true;
+  }
+}
+
+void skeleton_pose::set_ik_enabled(bool enabled)
+{
+  if (ik_enabled_ != enabled) {
+    ik_enabled_ = enabled;
+    std::fill(ik_rotation_.begin(), ik_rotation_.end(), quarternion::identity());
+    dirty_ = true;
+  }
+}
+
+void skeleton_pose::set_ik_tolerance(float tolerance)
+{
+  ik_tolerance_ = std::max(tolerance, 0.f);
+  dirty_ = true;
+}
+
+std::chrono::steady_clock::duration skeleton_pose::take_ik_time()
+{
+  auto t = ik_time_;
+  ik_time_ = std::chrono::steady_clock::duration(0);
+  return t;
+}
+
+void skeleton_pose::evaluate()
+{
+  if (dirty_) {
+    skeleton_->evaluate(this);
+  } else if (physics_dirty_) {
+    skeleton_->evaluate_physics(this);
+  } else {
+    return;
+  }
+  dirty_ = false;
+  physics_dirty_ = false;
+}
+
+
+void evaluate_pose_array(job_system *jobs, skeleton_pose *const *pose_array, size_t count)
+{
+  profile_scope scope("pose");
+  std::atomic<int64_t> ik_time(0);
+  parallel_for(jobs, count, 4, [pose_array, &ik_time](size_t begin, size_t end) {
+    std::chrono::steady_clock::duration t(0);
+    for (size_t i=begin; i<end; ++i) {
+      pose_array[i]->evaluate();
+      t += pose_array[i]->take_ik_time();
+    }
+    ik_time += t.count();
+  });
+  if (ik_time > 0) {
+    profiler::instance().add("ik", std::chrono::steady_clock::duration(ik_time.load()));
+  }
+}
+
+
+bool bench_skeleton_pose(const char *filename, int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, filename)) {
+    return false;
+  }
+  auto skel = make_pmx_skeleton(data);
+  skeleton_pose pose(skel);
+  for (size_t i=0; i<pose.bone_count(); ++i) {
+    pose.set_rotation(i, quarternion::rotate(normalize(vec3(1.f, (float)(i % 3), 0.5f)), 0.1f));
+  }
+
+  auto start = clock::now();
+  for (int i=0; i<iterations; ++i) {
+    // 毎回計算し直させる.
+    pose.set_translation(0, vec3(0.f, 0.001f * i, 0.f));
+    pose.evaluate();
+  }
+  double us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / iterations;
+
+  size_t assign_count = 0;
+  for (size_t i=0; i<skel->bone_count(); ++i) {
+    assign_count += (skel->bone(i).assign_bone >= 0) ? 1 : 0;
+  }
+  printf("skeleton pose: %zu bones (%zu assigned), %d iterations\n", skel->bone_count(), assign_count, iterations);
+  printf("  evaluate : %9.3f us/pose, %7.2f ns/bone\n", us, us * 1000.0 / std::max<size_t>(skel->bone_count(), 1));
+
+  return true;
+}
+
+bool bench_skeleton_ik(const char *filename, int instances, int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, filename)) {
+    return false;
+  }
+  auto skel = make_pmx_skeleton(data);
+  // IK ボーンを目標の初期位置から鎖の根の方へ寄せる. 届く所なので収束する.
+  std::vector<std::pair<uint32_t, vec3>> ik_bone_array;
+  for (size_t i=0; i<skel->bone_count(); ++i) {
+    const auto& bone = skel->bone(i);
+    if ((bone.ik_target_bone >= 0) && !bone.ik_link_array.empty() &&
+        (bone.ik_link_array.back().bone >= 0) && ((size_t)bone.ik_link_array.back().bone < skel->bone_count())) {
+      const vec3& target = skel->bone(bone.ik_target_bone).pos;
+      const vec3& root = skel->bone(bone.ik_link_array.back().bone).pos;
+      ik_bone_array.push_back({ (uint32_t)i, root - target });
+    }
+  }
+  std::vector<skeleton_pose::ptr_t> pose_array;
+  std::vector<skeleton_pose*> pose_ptr_array;
+  for (int i=0; i<instances; ++i) {
+    pose_array.push_back(skeleton_pose::make(skel));
+    pose_ptr_array.push_back(pose_array.back().get());
+  }
+
+  job_system jobs;
+  printf("skeleton ik: %zu bones, %zu chains, %d instances, %d iterations, %d threads + caller\n",
+         skel->bone_count(), skel->ik_chain_count(), instances, iterations, jobs.thread_count());
+
+  // インスタンスごとにずらして動かしながら解く.
+  auto run = [&](const char *label, job_system *j, float tolerance) {
+    for (auto& pose : pose_array) {
+      pose->set_ik_tolerance(tolerance);
+    }
+    clock::duration ik_time = clock::duration::zero();
+    size_t ik_iterations = 0;
+    auto start = clock::now();
+    for (int f=0; f<iterations; ++f) {
+      profiler::instance().begin_frame();
+      for (int i=0; i<instances; ++i) {
+        float phase = 0.05f * f + 0.3f * i;
+        for (const auto& [b, to_root] : ik_bone_array) {
+          vec3 target = skel->bone(skel->bone(b).ik_target_bone).pos;
+          vec3 side = vec3(0.1f, 0.f, 0.1f) * len(to_root) * std::cos(phase);
+          pose_array[i]->set_translation(b, target - skel->bone(b).pos + to_root * (0.3f + 0.1f * std::sin(phase)) + side);
+        }
+      }
+      evaluate_pose_array(j, pose_ptr_array.data(), pose_ptr_array.size());
+      profiler::instance().begin_frame();
+      for (const auto& e : profiler::instance().last_frame()) {
+        if (std::strcmp(e.name, "ik") == 0) {
+          ik_time += e.total;
+        }
+      }
+      for (const auto& pose : pose_array) {
+        ik_iterations += pose->ik_iteration_count();
+      }
+    }
+    double frame_us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / iterations;
+    double ik_us = std::chrono::duration<double, std::micro>(ik_time).count() / iterations;
+    double chain_count = (double)std::max<size_t>(skel->ik_chain_count(), 1) * instances * iterations;
+    printf("  %-22s: %9.1f us/frame, ik %9.1f us/frame (threads total), %5.2f loops/chain\n",
+           label, frame_us, ik_us, ik_iterations / chain_count);
+  };
+  run("serial, no early-out", nullptr, 0.f);
+  run("serial", nullptr, 1e-3f);
+  run("jobs", &jobs, 1e-3f);
+
+  return true;
+}
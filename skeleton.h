@@ -0,0 +1,217 @@
+﻿
+#pragma once
+
+#include "job_system.h"
+
+
+// IK の鎖のボーン一つ分. 角度の制限はラジアンの XYZ オイラー角で, 親の空間での回転に掛ける.
+struct skeleton_ik_link
+{
+  int32_t bone;
+  bool angle_limit;
+  vec3 min_angle;
+  vec3 max_angle;
+};
+
+// スケルトンのボーン一つ分. 番号はファイルでの並び.
+struct skeleton_bone
+{
+  std::string name;
+  // モデル空間での初期位置.
+  vec3 pos;
+  // 無ければ -1.
+  int32_t parent;
+  // 変形階層. 小さい方から先に計算する.
+  int32_t level;
+  bool after_physics;
+  // 付与親. 付与親の回転や移動を assign_rate 倍して足す. 無ければ -1.
+  int32_t assign_bone;
+  float assign_rate;
+  bool assign_rotate;
+  bool assign_translate;
+  // IK. ik_target_bone を自分の位置へ寄せるように ik_link_array のボーンを回す. 無ければ -1.
+  // ik_loop_limit は一回の繰り返しで一つのボーンを回す角度の上限.
+  int32_t ik_target_bone;
+  int32_t ik_loop_count;
+  float ik_loop_limit;
+  std::vector<skeleton_ik_link> ik_link_array;
+};
+
+class skeleton_pose;
+
+// ボーンの階層.
+// ボーンは親と付与親が必ず先に来る順 (計算順) に並べ替えて持ち,
+// 姿勢はその順に並んだ配列を前から一度なめるだけで計算する.
+// IK があれば, その後で IK ボーンの計算順に CCD で解き, 鎖の根から後ろを計算し直す.
+class skeleton
+{
+public:
+  typedef std::shared_ptr<skeleton> ptr_t;
+
+public:
+  skeleton(const std::vector<skeleton_bone>&);
+
+  size_t bone_count() const { return bone_array_.size(); }
+  const skeleton_bone& bone(size_t i) const { return bone_array_[i]; }
+  // 名前から番号を引く. 無ければ -1.
+  int32_t find_bone(std::string_view name) const;
+
+  // 計算順の i 番目のボーンの番号と, ボーンの計算順での位置.
+  uint32_t slot_bone(size_t slot) const { return slot_bone_[slot]; }
+  uint32_t bone_slot(size_t bone) const { return bone_slot_[bone]; }
+
+  size_t ik_chain_count() const { return ik_chain_array_.size(); }
+
+  // 姿勢のボーンごとの回転と移動から, モデル空間の行列とスキニングの行列を作る.
+  void evaluate(skeleton_pose*) const;
+  // 物理の回転だけを変えた時に, 物理の回転のある一番前のボーンから後ろだけを計算し直す. IK は解き直さない.
+  void evaluate_physics(skeleton_pose*) const;
+
+private:
+  struct ik_link
+  {
+    uint32_t slot;
+    bool angle_limit;
+    // 一つの軸しか回せない制限なら, その軸 (0..2). でなければ -1.
+    int32_t axis;
+    vec3 min_angle;
+    vec3 max_angle;
+  };
+  struct ik_chain
+  {
+    uint32_t ik_slot;
+    uint32_t target_slot;
+    int32_t loop_count;
+    float loop_limit;
+    // 目標に近い方から.
+    std::vector<ik_link> link_array;
+    // 鎖の根から目標までの親をたどる道. 計算順に並ぶ.
+    std::vector<uint32_t> path_slot_array;
+  };
+
+  // 計算順で begin から後ろのボーンの行列を作る.
+  void evaluate_range(skeleton_pose*, size_t begin) const;
+  // s 番目のボーンの回転と移動を決めて, モデル空間の行列を作る.
+  void evaluate_slot(skeleton_pose*, size_t s) const;
+  // 繰り返した数を返す.
+  int solve_ik_chain(skeleton_pose*, const ik_chain&) const;
+
+private:
+  std::vector<skeleton_bone> bone_array_;
+  // 名前で並べたボーン番号.
+  std::vector<uint32_t> name_index_;
+
+  // ここから下は計算順に並ぶ. 親と付与親も計算順での位置で持つ.
+  std::vector<uint32_t> slot_bone_;
+  std::vector<uint32_t> bone_slot_;
+  std::vector<int32_t> parent_slot_;
+  std::vector<int32_t> assign_slot_;
+  std::vector<float> assign_rate_;
+  std::vector<uint8_t> slot_flags_;
+  // 親からの初期位置の差と, 初期位置.
+  std::vector<vec3> offset_;
+  std::vector<vec3> bind_pos_;
+  std::vector<ik_chain> ik_chain_array_;
+
+public:
+  static auto make(const std::vector<skeleton_bone>& bone_array)
+  {
+    return std::make_shared<skeleton>(bone_array);
+  }
+};
+
+
+// スケルトンの姿勢. 同じスケルトンを使うインスタンスごとに持つ.
+// 回転と移動は親の空間での, 初期姿勢からの変化.
+class skeleton_pose
+{
+public:
+  typedef std::shared_ptr<skeleton_pose> ptr_t;
+
+public:
+  skeleton_pose(skeleton::ptr_t);
+
+  skeleton::ptr_t get_skeleton() { return skeleton_; }
+  size_t bone_count() const { return skeleton_->bone_count(); }
+
+  // 回転と移動を全て初期姿勢に戻す. モーフの分は残す.
+  void reset();
+
+  const vec3& translation(size_t bone) const { return translation_[skeleton_->bone_slot(bone)]; }
+  const quarternion& rotation(size_t bone) const { return rotation_[skeleton_->bone_slot(bone)]; }
+  void set_translation(size_t bone, const vec3&);
+  void set_rotation(size_t bone, const quarternion&);
+
+  // ボーンモーフの分. 移動は足し, 回転は rotation の後に掛ける.
+  void set_morph(size_t bone, const vec3& translate, const quarternion& rotate);
+  void clear_morph();
+
+  // IK を解くかどうか. 既定は解く.
+  void set_ik_enabled(bool);
+  bool ik_enabled() const { return ik_enabled_; }
+  // 目標との距離がこれより近くなったら, 繰り返し数を残していても止める.
+  void set_ik_tolerance(float);
+  float ik_tolerance() const { return ik_tolerance_; }
+  // 前の evaluate() で IK を繰り返した数. 全ての鎖の合計.
+  int ik_iteration_count() const { return ik_iteration_count_; }
+  // evaluate() で IK を解くのにかかった時間の合計を返して 0 に戻す.
+  // ワーカーで回す側がジョブごとに集め, profiler へは一度に足す.
+  std::chrono::steady_clock::duration take_ik_time();
+
+  // 物理で足す回転. 自分の空間での回転で, IK の後に掛ける.
+  void set_physics_rotation(size_t bone, const quarternion&);
+  void clear_physics_rotation();
+
+  // 回転や移動を変えていたら計算し直す. 物理の回転だけなら, それで動くボーンだけを計算し直す.
+  void evaluate();
+  bool is_dirty() const { return dirty_ || physics_dirty_; }
+
+  // evaluate() の結果. ボーンのモデル空間での行列.
+  const matrix& world_matrix(size_t bone) const { return world_[skeleton_->bone_slot(bone)]; }
+  // 初期姿勢から今の姿勢への行列. ボーン番号の順で, bone_palette にそのまま渡せる.
+  const matrix *skinning_matrix_array() const { return skinning_.data(); }
+
+private:
+  friend class skeleton;
+
+  skeleton::ptr_t skeleton_;
+  // 計算順に並ぶ.
+  std::vector<vec3> translation_;
+  std::vector<quarternion> rotation_;
+  std::vector<vec3> morph_translation_;
+  std::vector<quarternion> morph_rotation_;
+  // 付与を足した後の回転と移動. 付与先が参照する.
+  std::vector<vec3> assigned_translation_;
+  std::vector<quarternion> assigned_rotation_;
+  // IK で足した回転. 自分の空間での回転で, rotation_ の後に掛ける.
+  std::vector<quarternion> ik_rotation_;
+  std::vector<quarternion> physics_rotation_;
+  // 物理の回転を入れた一番前の計算順での位置.
+  size_t physics_slot_;
+  std::vector<matrix> world_;
+  // ボーン番号の順に並ぶ.
+  std::vector<matrix> skinning_;
+  bool dirty_;
+  bool physics_dirty_;
+  bool has_morph_;
+  bool has_physics_;
+  bool ik_enabled_;
+  float ik_tolerance_;
+  int ik_iteration_count_;
+  std::chrono::steady_clock::duration ik_time_;
+
+public:
+  static auto make(skeleton::ptr_t skel)
+  {
+    return std::make_shared<skeleton_pose>(skel);
+  }
+};
+
+// 多数のインスタンスの姿勢を jobs のワーカーに分けてまとめて計算する. IK もそれぞれ解く.
+// 全部終わるまで戻らない. かかった時間は profiler に "pose" として, そのうち IK の分を "ik" として足す.
+void evaluate_pose_array(job_system *jobs, skeleton_pose *const *pose_array, size_t count);
+
+// 姿勢の計算にかかる時間を計る.
+bool bench_skeleton_pose(const char *filename, int iterations);
+// instances 体の IK をまとめて解く時間を計る.
+bool bench_skeleton_ik(const char *filename, int instances, int iterations);
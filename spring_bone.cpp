@@ -0,0 +1,616 @@
+﻿
+#include "stdafx.h"
+
+#include "spring_bone.h"
+#include "pmx_loader.h"
+
+
+namespace {
+
+// 一回の update() で進める時間の上限.
+const float max_delta = 1.f / 15.f;
+
+// 点を動かすのに使う配列と値. 全て点の番号で引く.
+struct particle_stream
+{
+  float *pos[3];
+  float *prev_pos[3];
+  const float *goal[3];
+  const float *prev_goal[3];
+  const float *mobile;
+  const float *stiffness;
+  const float *drag;
+  const float *radius;
+};
+
+struct step_param
+{
+  float dt;
+  float dt2;
+  float dt_ratio;
+  // 目標を prev_goal から goal へ補間する位置.
+  float t;
+  vec3 gravity;
+};
+
+// カプセルの当たり判定. 全て当たり判定の番号で引く.
+struct collider_stream
+{
+  const float *a[3];
+  const float *ab[3];
+  const float *inv;
+  const float *radius;
+  size_t count;
+};
+
+// x' = x + (x - x_prev) * 減衰 + ((目標 - x) * 強さ + 重力) * dt^2
+void integrate_range_scalar(const particle_stream& s, size_t begin, size_t end, const step_param& p)
+{
+  for (size_t i=begin; i<end; ++i) {
+    float damp = std::max(1.f - s.drag[i] * p.dt, 0.f) * p.dt_ratio;
+    for (int j=0; j<3; ++j) {
+      float x = s.pos[j][i];
+      float g = s.prev_goal[j][i] + (s.goal[j][i] - s.prev_goal[j][i]) * p.t;
+      float a = (g - x) * s.stiffness[i] + p.gravity[j];
+      s.pos[j][i] = x + ((x - s.prev_pos[j][i]) * damp + a * p.dt2) * s.mobile[i];
+      s.prev_pos[j][i] = x;
+    }
+  }
+}
+
+// カプセルの軸で一番近い点から, 点の半径と合わせた距離まで押し出す.
+void collide_range_scalar(const particle_stream& s, size_t begin, size_t end, const collider_stream& c)
+{
+  for (size_t i=begin; i<end; ++i) {
+    float x = s.pos[0][i], y = s.pos[1][i], z = s.pos[2][i];
+    for (size_t k=0; k<c.count; ++k) {
+      float dx = x - c.a[0][k], dy = y - c.a[1][k], dz = z - c.a[2][k];
+      float t = std::clamp((dx * c.ab[0][k] + dy * c.ab[1][k] + dz * c.ab[2][k]) * c.inv[k], 0.f, 1.f);
+      float ex = dx - c.ab[0][k] * t, ey = dy - c.ab[1][k] * t, ez = dz - c.ab[2][k] * t;
+      float d2 = ex * ex + ey * ey + ez * ez;
+      float r = c.radius[k] + s.radius[i];
+      if ((d2 >= r * r) || (d2 <= 1e-12f)) {
+        continue;
+      }
+      float scale = (r / std::sqrt(d2) - 1.f) * s.mobile[i];
+      x += ex * scale;
+      y += ey * scale;
+      z += ez * scale;
+    }
+    s.pos[0][i] = x;
+    s.pos[1][i] = y;
+    s.pos[2][i] = z;
+  }
+}
+
+#if defined(CUT_SIMD_X86)
+
+void integrate_range_sse2(const particle_stream& s, size_t begin, size_t end, const step_param& p)
+{
+  const __m128 dt = _mm_set1_ps(p.dt);
+  const __m128 dt2 = _mm_set1_ps(p.dt2);
+  const __m128 ratio = _mm_set1_ps(p.dt_ratio);
+  const __m128 t = _mm_set1_ps(p.t);
+  const __m128 one = _mm_set1_ps(1.f);
+  for (size_t i=begin; i<end; i+=4) {
+    __m128 damp = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(_mm_loadu_ps(s.drag + i), dt)), _mm_setzero_ps()), ratio);
+    __m128 k = _mm_loadu_ps(s.stiffness + i);
+    __m128 w = _mm_loadu_ps(s.mobile + i);
+    for (int j=0; j<3; ++j) {
+      __m128 x = _mm_loadu_ps(s.pos[j] + i);
+      __m128 pg = _mm_loadu_ps(s.prev_goal[j] + i);
+      __m128 g = _mm_add_ps(pg, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(s.goal[j] + i), pg), t));
+      __m128 a = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(g, x), k), _mm_set1_ps(p.gravity[j]));
+      __m128 v = _mm_mul_ps(_mm_sub_ps(x, _mm_loadu_ps(s.prev_pos[j] + i)), damp);
+      _mm_storeu_ps(s.pos[j] + i, _mm_add_ps(x, _mm_mul_ps(_mm_add_ps(v, _mm_mul_ps(a, dt2)), w)));
+      _mm_storeu_ps(s.prev_pos[j] + i, x);
+    }
+  }
+}
+
+// 点 4 個ごとに, 当たり判定を一つずつ試す. 当たらなかった所は押し出す量を 0 にする.
+void collide_range_sse2(const particle_stream& s, size_t begin, size_t end, const collider_stream& c)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 eps = _mm_set1_ps(1e-12f);
+  for (size_t i=begin; i<end; i+=4) {
+    __m128 x = _mm_loadu_ps(s.pos[0] + i);
+    __m128 y = _mm_loadu_ps(s.pos[1] + i);
+    __m128 z = _mm_loadu_ps(s.pos[2] + i);
+    __m128 rp = _mm_loadu_ps(s.radius + i);
+    __m128 w = _mm_loadu_ps(s.mobile + i);
+    for (size_t k=0; k<c.count; ++k) {
+      __m128 abx = _mm_set1_ps(c.ab[0][k]), aby = _mm_set1_ps(c.ab[1][k]), abz = _mm_set1_ps(c.ab[2][k]);
+      __m128 dx = _mm_sub_ps(x, _mm_set1_ps(c.a[0][k]));
+      __m128 dy = _mm_sub_ps(y, _mm_set1_ps(c.a[1][k]));
+      __m128 dz = _mm_sub_ps(z, _mm_set1_ps(c.a[2][k]));
+      __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, abx), _mm_mul_ps(dy, aby)), _mm_mul_ps(dz, abz)),
+                            _mm_set1_ps(c.inv[k]));
+      t = _mm_min_ps(_mm_max_ps(t, zero), one);
+      __m128 ex = _mm_sub_ps(dx, _mm_mul_ps(abx, t));
+      __m128 ey = _mm_sub_ps(dy, _mm_mul_ps(aby, t));
+      __m128 ez = _mm_sub_ps(dz, _mm_mul_ps(abz, t));
+      __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)), _mm_mul_ps(ez, ez));
+      __m128 r = _mm_add_ps(_mm_set1_ps(c.radius[k]), rp);
+      __m128 hit = _mm_and_ps(_mm_cmplt_ps(d2, _mm_mul_ps(r, r)), _mm_cmpgt_ps(d2, eps));
+      __m128 scale = _mm_and_ps(_mm_sub_ps(_mm_div_ps(r, _mm_sqrt_ps(d2)), one), hit);
+      scale = _mm_mul_ps(scale, w);
+      x = _mm_add_ps(x, _mm_mul_ps(ex, scale));
+      y = _mm_add_ps(y, _mm_mul_ps(ey, scale));
+      z = _mm_add_ps(z, _mm_mul_ps(ez, scale));
+    }
+    _mm_storeu_ps(s.pos[0] + i, x);
+    _mm_storeu_ps(s.pos[1] + i, y);
+    _mm_storeu_ps(s.pos[2] + i, z);
+  }
+}
+
+SIMD_TARGET_AVX2
+void integrate_range_avx2(const particle_stream& s, size_t begin, size_t end, const step_param& p)
+{
+  const __m256 dt = _mm256_set1_ps(p.dt);
+  const __m256 dt2 = _mm256_set1_ps(p.dt2);
+  const __m256 ratio = _mm256_set1_ps(p.dt_ratio);
+  const __m256 t = _mm256_set1_ps(p.t);
+  const __m256 one = _mm256_set1_ps(1.f);
+  for (size_t i=begin; i<end; i+=8) {
+    __m256 damp = _mm256_mul_ps(_mm256_max_ps(_mm256_sub_ps(one, _mm256_mul_ps(_mm256_loadu_ps(s.drag + i), dt)),
+                                              _mm256_setzero_ps()), ratio);
+    __m256 k = _mm256_loadu_ps(s.stiffness + i);
+    __m256 w = _mm256_loadu_ps(s.mobile + i);
+    for (int j=0; j<3; ++j) {
+      __m256 x = _mm256_loadu_ps(s.pos[j] + i);
+      __m256 pg = _mm256_loadu_ps(s.prev_goal[j] + i);
+      __m256 g = _mm256_add_ps(pg, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(s.goal[j] + i), pg), t));
+      __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(g, x), k), _mm256_set1_ps(p.gravity[j]));
+      __m256 v = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_loadu_ps(s.prev_pos[j] + i)), damp);
+      _mm256_storeu_ps(s.pos[j] + i, _mm256_add_ps(x, _mm256_mul_ps(_mm256_add_ps(v, _mm256_mul_ps(a, dt2)), w)));
+      _mm256_storeu_ps(s.prev_pos[j] + i, x);
+    }
+  }
+}
+
+SIMD_TARGET_AVX2
+void collide_range_avx2(const particle_stream& s, size_t begin, size_t end, const collider_stream& c)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 eps = _mm256_set1_ps(1e-12f);
+  for (size_t i=begin; i<end; i+=8) {
+    __m256 x = _mm256_loadu_ps(s.pos[0] + i);
+    __m256 y = _mm256_loadu_ps(s.pos[1] + i);
+    __m256 z = _mm256_loadu_ps(s.pos[2] + i);
+    __m256 rp = _mm256_loadu_ps(s.radius + i);
+    __m256 w = _mm256_loadu_ps(s.mobile + i);
+    for (size_t k=0; k<c.count; ++k) {
+      __m256 abx = _mm256_set1_ps(c.ab[0][k]), aby = _mm256_set1_ps(c.ab[1][k]), abz = _mm256_set1_ps(c.ab[2][k]);
+      __m256 dx = _mm256_sub_ps(x, _mm256_set1_ps(c.a[0][k]));
+      __m256 dy = _mm256_sub_ps(y, _mm256_set1_ps(c.a[1][k]));
+      __m256 dz = _mm256_sub_ps(z, _mm256_set1_ps(c.a[2][k]));
+      __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, abx), _mm256_mul_ps(dy, aby)),
+                                             _mm256_mul_ps(dz, abz)), _mm256_set1_ps(c.inv[k]));
+      t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+      __m256 ex = _mm256_sub_ps(dx, _mm256_mul_ps(abx, t));
+      __m256 ey = _mm256_sub_ps(dy, _mm256_mul_ps(aby, t));
+      __m256 ez = _mm256_sub_ps(dz, _mm256_mul_ps(abz, t));
+      __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey)), _mm256_mul_ps(ez, ez));
+      __m256 r = _mm256_add_ps(_mm256_set1_ps(c.radius[k]), rp);
+      __m256 hit = _mm256_and_ps(_mm256_cmp_ps(d2, _mm256_mul_ps(r, r), _CMP_LT_OQ), _mm256_cmp_ps(d2, eps, _CMP_GT_OQ));
+      __m256 scale = _mm256_and_ps(_mm256_sub_ps(_mm256_div_ps(r, _mm256_sqrt_ps(d2)), one), hit);
+      scale = _mm256_mul_ps(scale, w);
+      x = _mm256_add_ps(x, _mm256_mul_ps(ex, scale));
+      y = _mm256_add_ps(y, _mm256_mul_ps(ey, scale));
+      z = _mm256_add_ps(z, _mm256_mul_ps(ez, scale));
+    }
+    _mm256_storeu_ps(s.pos[0] + i, x);
+    _mm256_storeu_ps(s.pos[1] + i, y);
+    _mm256_storeu_ps(s.pos[2] + i, z);
+  }
+}
+
+#endif
+
+vec3 position(const matrix& m)
+{
+  return vec3(m._03, m._13, m._23);
+}
+
+// 向き a を向き b へ回す一番小さな回転.
+quarternion rotation_between(const vec3& a, const vec3& b)
+{
+  float la = len(a), lb = len(b);
+  if ((la <= 1e-6f) || (lb <= 1e-6f)) {
+    return quarternion::identity();
+  }
+  vec3 na = a / la, nb = b / lb;
+  float c = dot(na, nb);
+  if (c < -0.9999f) {
+    // 真逆なら, a に垂直な軸のどれかで半周回す.
+    vec3 axis = cross(na, (std::abs(na.x) < 0.9f) ? vec3(1.f, 0.f, 0.f) : vec3(0.f, 1.f, 0.f));
+    return quarternion::rotate(normalize(axis), 3.14159265f);
+  }
+  return normalize(quarternion(cross(na, nb), 1.f + c));
+}
+
+} // end of anonymus namespace
+
+
+spring_bone_set::spring_bone_set(skeleton::ptr_t skel, const spring_bone_param& param)
+  : skeleton_(skel), particle_count_(0), gravity_(0.f, -98.f, 0.f),
+    substep_count_(3), last_dt_(0.f), reset_(true), last_update_time_(0)
+{
+  const size_t count = skeleton_->bone_count();
+  for (size_t s=0; s<count; ++s) {
+    uint32_t b = skeleton_->slot_bone(s);
+    const auto& bone = skeleton_->bone(b);
+    if (!bone.after_physics) {
+      continue;
+    }
+    if ((bone.parent >= 0) && ((size_t)bone.parent < count) && skeleton_->bone(bone.parent).after_physics) {
+      continue;
+    }
+    add_chain(b, param);
+  }
+}
+
+int32_t spring_bone_set::add_chain(uint32_t head, const spring_bone_param& param)
+{
+  const size_t count = skeleton_->bone_count();
+  if (head >= count) {
+    return -1;
+  }
+  // 根と同じく物理後かどうかの子をたどり, 無くなったら他の子を一つだけ先端にする.
+  const bool physics = skeleton_->bone(head).after_physics;
+  std::vector<uint32_t> bone_array{ head };
+  while (bone_array.size() < count) {
+    int32_t next = -1, tip = -1;
+    for (size_t b=0; b<count; ++b) {
+      if (skeleton_->bone(b).parent != (int32_t)bone_array.back()) {
+        continue;
+      }
+      if (skeleton_->bone(b).after_physics == physics) {
+        next = (int32_t)b;
+        break;
+      }
+      if (tip < 0) {
+        tip = (int32_t)b;
+      }
+    }
+    if (next < 0) {
+      if (tip >= 0) {
+        bone_array.push_back((uint32_t)tip);
+      }
+      break;
+    }
+    bone_array.push_back((uint32_t)next);
+  }
+  if (bone_array.size() < 2) {
+    return -1;
+  }
+
+  chain c;
+  c.begin = (uint32_t)particle_count_;
+  c.count = (uint32_t)bone_array.size();
+  c.parent = skeleton_->bone(head).parent;
+  if ((c.parent >= 0) && ((size_t)c.parent >= count)) {
+    c.parent = -1;
+  }
+  resize_particle(particle_count_ + c.count);
+  for (uint32_t i=0; i<c.count; ++i) {
+    size_t p = c.begin + i;
+    bone_[p] = bone_array[i];
+    mobile_[p] = (i > 0) ? 1.f : 0.f;
+    length_[p] = (i > 0) ? len(skeleton_->bone(bone_array[i]).pos - skeleton_->bone(bone_array[i - 1]).pos) : 0.f;
+  }
+  chain_array_.push_back(c);
+  parent_rotation_.resize(chain_array_.size(), quarternion::identity());
+  set_param(chain_array_.size() - 1, param);
+  reset_ = true;
+  return (int32_t)chain_array_.size() - 1;
+}
+
+void spring_bone_set::set_param(size_t i, const spring_bone_param& param)
+{
+  const chain& c = chain_array_[i];
+  for (size_t p=c.begin; p<c.begin+c.count; ++p) {
+    stiffness_[p] = std::max(param.stiffness, 0.f);
+    drag_[p] = std::max(param.drag, 0.f);
+    radius_[p] = std::max(param.radius, 0.f);
+  }
+}
+
+void spring_bone_set::resize_particle(size_t count)
+{
+  particle_count_ = count;
+  size_t padded = (count + 7) & ~(size_t)7;
+  bone_.resize(padded, 0);
+  mobile_.resize(padded, 0.f);
+  stiffness_.resize(padded, 0.f);
+  drag_.resize(padded, 0.f);
+  radius_.resize(padded, 0.f);
+  length_.resize(padded, 0.f);
+  for (int j=0; j<3; ++j) {
+    pos_[j].resize(padded, 0.f);
+    prev_pos_[j].resize(padded, 0.f);
+    goal_[j].resize(padded, 0.f);
+    prev_goal_[j].resize(padded, 0.f);
+  }
+  anim_rotation_.resize(padded, quarternion::identity());
+}
+
+void spring_bone_set::add_sphere_collider(uint32_t bone, const vec3& center, float radius)
+{
+  add_capsule_collider(bone, center, center, radius);
+}
+
+void spring_bone_set::add_capsule_collider(uint32_t bone, const vec3& a, const vec3& b, float radius)
+{
+  if (bone >= skeleton_->bone_count()) {
+    return;
+  }
+  collider_array_.push_back(collider{ bone, a, b, std::max(radius, 0.f) });
+  for (int j=0; j<3; ++j) {
+    collider_a_[j].resize(collider_array_.size());
+    collider_ab_[j].resize(collider_array_.size());
+  }
+  collider_inv_.resize(collider_array_.size());
+  collider_radius_.resize(collider_array_.size());
+}
+
+size_t spring_bone_set::add_body_colliders()
+{
+  // 付けるボーン, 両端の位置のボーン, 半径, 両端をずらす量. 頭は頭ボーンの上に球を置く.
+  struct body_part
+  {
+    const char *bone;
+    const char *a;
+    const char *b;
+    float radius;
+    vec3 shift;
+  };
+  static const body_part part_array[] = {
+    { u8"頭", u8"頭", u8"頭", 1.1f, vec3(0.f, 1.2f, 0.f) },
+    { u8"首", u8"首", u8"頭", 0.5f, vec3(0.f, 0.f, 0.f) },
+    { u8"上半身", u8"上半身", u8"首", 1.1f, vec3(0.f, 0.f, 0.f) },
+    { u8"下半身", u8"左足", u8"右足", 1.3f, vec3(0.f, 0.f, 0.f) },
+    { u8"左足", u8"左足", u8"左ひざ", 0.8f, vec3(0.f, 0.f, 0.f) },
+    { u8"右足", u8"右足", u8"右ひざ", 0.8f, vec3(0.f, 0.f, 0.f) },
+    { u8"左ひざ", u8"左ひざ", u8"左足首", 0.6f, vec3(0.f, 0.f, 0.f) },
+    { u8"右ひざ", u8"右ひざ", u8"右足首", 0.6f, vec3(0.f, 0.f, 0.f) },
+  };
+  size_t added = 0;
+  for (const auto& part : part_array) {
+    int32_t bone = skeleton_->find_bone(part.bone);
+    int32_t a = skeleton_->find_bone(part.a);
+    int32_t b = skeleton_->find_bone(part.b);
+    if ((bone < 0) || (a < 0) || (b < 0)) {
+      continue;
+    }
+    const vec3& origin = skeleton_->bone(bone).pos;
+    add_capsule_collider(bone, skeleton_->bone(a).pos - origin + part.shift,
+                         skeleton_->bone(b).pos - origin + part.shift, part.radius);
+    ++added;
+  }
+  return added;
+}
+
+void spring_bone_set::update(skeleton_pose *pose, float delta)
+{
+  update(pose, delta, simd_support());
+}
+
+void spring_bone_set::update(skeleton_pose *pose, float delta, simd_level level)
+{
+  // 揺らす前の, アニメーションだけの姿勢を目標にする.
+  pose->clear_physics_rotation();
+  pose->evaluate();
+  if (chain_array_.empty()) {
+    last_update_time_ = std::chrono::steady_clock::duration(0);
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  for (int j=0; j<3; ++j) {
+    std::swap(goal_[j], prev_goal_[j]);
+  }
+  capture(*pose);
+  if (reset_) {
+    for (int j=0; j<3; ++j) {
+      prev_goal_[j] = goal_[j];
+      pos_[j] = goal_[j];
+      prev_pos_[j] = goal_[j];
+    }
+    last_dt_ = 0.f;
+    reset_ = false;
+  }
+
+  delta = std::min(delta, max_delta);
+  if (delta > 0.f) {
+    const float dt = delta / substep_count_;
+    for (int i=0; i<substep_count_; ++i) {
+      float ratio = ((i == 0) && (last_dt_ > 0.f)) ? dt / last_dt_ : 1.f;
+      step(dt, ratio, (float)(i + 1) / substep_count_, level);
+    }
+    last_dt_ = dt;
+  }
+
+  apply(pose);
+  pose->evaluate();
+  last_update_time_ = std::chrono::steady_clock::now() - start;
+}
+
+void spring_bone_set::capture(const skeleton_pose& pose)
+{
+  for (size_t i=0; i<particle_count_; ++i) {
+    const matrix& m = pose.world_matrix(bone_[i]);
+    goal_[0][i] = m._03;
+    goal_[1][i] = m._13;
+    goal_[2][i] = m._23;
+    anim_rotation_[i] = quarternion::from_matrix(m);
+  }
+  for (size_t i=0; i<chain_array_.size(); ++i) {
+    int32_t parent = chain_array_[i].parent;
+    parent_rotation_[i] = (parent >= 0) ? quarternion::from_matrix(pose.world_matrix(parent)) : quarternion::identity();
+  }
+  for (size_t k=0; k<collider_array_.size(); ++k) {
+    const collider& c = collider_array_[k];
+    const matrix& m = pose.world_matrix(c.bone);
+    vec3 a = transform_point(m, c.a);
+    vec3 ab = transform_point(m, c.b) - a;
+    float ab2 = lenq(ab);
+    for (int j=0; j<3; ++j) {
+      collider_a_[j][k] = a[j];
+      collider_ab_[j][k] = ab[j];
+    }
+    collider_inv_[k] = (ab2 > 1e-12f) ? 1.f / ab2 : 0.f;
+    collider_radius_[k] = c.radius;
+  }
+}
+
+void spring_bone_set::step(float dt, float dt_ratio, float t, simd_level level)
+{
+  particle_stream s;
+  for (int j=0; j<3; ++j) {
+    s.pos[j] = pos_[j].data();
+    s.prev_pos[j] = prev_pos_[j].data();
+    s.goal[j] = goal_[j].data();
+    s.prev_goal[j] = prev_goal_[j].data();
+  }
+  s.mobile = mobile_.data();
+  s.stiffness = stiffness_.data();
+  s.drag = drag_.data();
+  s.radius = radius_.data();
+
+  step_param p;
+  p.dt = dt;
+  p.dt2 = dt * dt;
+  p.dt_ratio = dt_ratio;
+  p.t = t;
+  p.gravity = gravity_;
+
+  collider_stream c;
+  for (int j=0; j<3; ++j) {
+    c.a[j] = collider_a_[j].data();
+    c.ab[j] = collider_ab_[j].data();
+  }
+  c.inv = collider_inv_.data();
+  c.radius = collider_radius_.data();
+  c.count = collider_array_.size();
+
+  const size_t end = mobile_.size();
+  switch (level) {
+#if defined(CUT_SIMD_X86)
+  case SIMD_AVX2:
+    integrate_range_avx2(s, 0, end, p);
+    constrain_length(t);
+    collide_range_avx2(s, 0, end, c);
+    break;
+  case SIMD_SSE2:
+    integrate_range_sse2(s, 0, end, p);
+    constrain_length(t);
+    collide_range_sse2(s, 0, end, c);
+    break;
+#endif
+  default:
+    integrate_range_scalar(s, 0, end, p);
+    constrain_length(t);
+    collide_range_scalar(s, 0, end, c);
+    break;
+  }
+}
+
+// 根をアニメーションの位置へ置き, 一つ前の点からの距離を初期姿勢の長さに戻す.
+void spring_bone_set::constrain_length(float t)
+{
+  for (const auto& c : chain_array_) {
+    for (int j=0; j<3; ++j) {
+      pos_[j][c.begin] = prev_goal_[j][c.begin] + (goal_[j][c.begin] - prev_goal_[j][c.begin]) * t;
+    }
+    for (size_t i=c.begin+1; i<c.begin+c.count; ++i) {
+      vec3 d(pos_[0][i] - pos_[0][i - 1], pos_[1][i] - pos_[1][i - 1], pos_[2][i] - pos_[2][i - 1]);
+      float l = len(d);
+      if (l <= 1e-6f) {
+        continue;
+      }
+      d *= length_[i] / l;
+      for (int j=0; j<3; ++j) {
+        pos_[j][i] = pos_[j][i - 1] + d[j];
+      }
+    }
+  }
+}
+
+// 鎖の根から順に, 親を回した後のボーンの空間で, アニメーションでの子への向きを点の子への向きへ回す.
+void spring_bone_set::apply(skeleton_pose *pose) const
+{
+  auto goal = [this](size_t i) { return vec3(goal_[0][i], goal_[1][i], goal_[2][i]); };
+  auto pos = [this](size_t i) { return vec3(pos_[0][i], pos_[1][i], pos_[2][i]); };
+  for (size_t ci=0; ci<chain_array_.size(); ++ci) {
+    const chain& c = chain_array_[ci];
+    quarternion anim_parent = parent_rotation_[ci];
+    quarternion parent = anim_parent;
+    for (size_t i=c.begin; i+1<c.begin+c.count; ++i) {
+      const quarternion& anim = anim_rotation_[i];
+      quarternion current = parent * (conj(anim_parent) * anim);
+      vec3 from = rotate(conj(anim), goal(i + 1) - goal(i));
+      vec3 to = rotate(conj(current), pos(i + 1) - pos(i));
+      quarternion r = rotation_between(from, to);
+      pose->set_physics_rotation(bone_[i], r);
+      anim_parent = anim;
+      parent = normalize(current * r);
+    }
+  }
+}
+
+
+bool bench_spring_bone(const char *filename, int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  pmx_model_data data;
+  if (!load_pmx_data(&data, filename)) {
+    std::cerr << "cannot load " << filename << std::endl;
+    return false;
+  }
+  auto skel = make_pmx_skeleton(data);
+  auto pose = skeleton_pose::make(skel);
+  auto probe = spring_bone_set::make(skel);
+  size_t colliders = probe->add_body_colliders();
+  printf("spring bone: %zu bones, %zu chains, %zu particles, %zu colliders, %d iterations\n",
+         skel->bone_count(), probe->chain_count(), probe->particle_count(), colliders, iterations);
+  if (probe->chain_count() == 0) {
+    printf("  no after-physics chains.\n");
+    return true;
+  }
+
+  // 全体を左右に振って揺らす. 60fps で進める.
+  auto animate = [&](int i) {
+    float t = i / 60.f;
+    pose->set_rotation(0, quarternion::rotate(vec3(0.f, 1.f, 0.f), 0.6f * std::sin(t * 4.f)));
+    pose->set_translation(0, vec3(2.f * std::sin(t * 3.f), 0.f, 0.f));
+  };
+  auto measure = [&](auto body) {
+    clock::duration total(0);
+    for (int i=0; i<iterations; ++i) {
+      animate(i);
+      auto start = clock::now();
+      body();
+      total += clock::now() - start;
+    }
+    return std::chrono::duration<double, std::micro>(total).count() / iterations;
+  };
+
+  // 揺らさずに姿勢を計算するだけの時間を引く.
+  double pose_us = measure([&]() { pose->evaluate(); });
+  printf("  %-6s : %9.2f us/update\n", "pose", pose_us);
+  for (int level=SIMD_None; level<=simd_support(); ++level) {
+    auto spring = spring_bone_set::make(skel);
+    spring->add_body_colliders();
+    double us = measure([&]() { spring->update(pose.get(), 1.f / 60.f, (simd_level)level); });
+    printf("  %-6s : %9.2f us/update, %9.2f us without pose\n",
+           simd_level_name((simd_level)level), us, us - pose_us);
+  }
+
+  return true;
+}
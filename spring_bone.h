@@ -0,0 +1,140 @@
+﻿
+#pragma once
+
+#include "skeleton.h"
+#include "simd.h"
+
+
+// 揺れ物の鎖一本の設定. 長さは MMD の単位 (1 が 8cm ほど), 時間は秒.
+struct spring_bone_param
+{
+  // アニメーションの位置へ引き戻す強さ (1/s^2).
+  float stiffness = 150.f;
+  // 速さを落とす割合 (1/s).
+  float drag = 5.f;
+  // 点の当たり判定の半径.
+  float radius = 0.2f;
+};
+
+// 髪やスカートのような鎖を, 剛体の代わりにボーンの位置に置いた点のベルレ積分で揺らす.
+// 一回の update() を決まった数の小さなステップに分け, 点を動かす → 長さを保つ → 当たり判定から押し出す を繰り返す.
+// 点は全ての鎖を鎖ごとに続けて SoA に並べ, 動かすのと押し出すのは全ての点を SIMD でまとめて回す.
+// 長さを保つのだけは鎖の根から順に直す. 鎖の根はアニメーションの位置に留める.
+// 結果は鎖のボーンの向きを点の向きへ回す回転にして, skeleton_pose の物理の回転へ入れる.
+//
+// 点と速さはインスタンスごとに持つので, 姿勢一つに一つ作る.
+class spring_bone_set
+{
+public:
+  typedef std::shared_ptr<spring_bone_set> ptr_t;
+
+public:
+  // スケルトンの物理後のボーンの鎖を全て揺らす.
+  // 鎖は物理後でない親を持つ物理後のボーンから, 物理後の子をたどる. 子が無くなったら, 物理後でない子を先端にする.
+  spring_bone_set(skeleton::ptr_t, const spring_bone_param& = spring_bone_param());
+
+  // head から一つ目の子をたどった鎖を足す. 物理後でないボーンでも良い. 点が二つ無ければ足さずに -1.
+  int32_t add_chain(uint32_t head, const spring_bone_param& = spring_bone_param());
+  size_t chain_count() const { return chain_array_.size(); }
+  uint32_t chain_head(size_t chain) const { return bone_[chain_array_[chain].begin]; }
+  void set_param(size_t chain, const spring_bone_param&);
+  // 全ての鎖の点の数.
+  size_t particle_count() const { return particle_count_; }
+
+  // 当たり判定. 位置は bone の空間で, 初期姿勢ならモデル空間の位置から bone の初期位置を引いたもの.
+  // 球は両端が同じカプセルとして扱う.
+  void add_sphere_collider(uint32_t bone, const vec3& center, float radius);
+  void add_capsule_collider(uint32_t bone, const vec3& a, const vec3& b, float radius);
+  // 標準的な名前のボーン (頭, 上半身, 下半身, 足, ひざ) の間にカプセルを置く. 置いた数を返す.
+  size_t add_body_colliders();
+  size_t collider_count() const { return collider_array_.size(); }
+
+  // 既定は MMD と同じく 9.8 m/s^2 を単位を合わせて -98.
+  void set_gravity(const vec3& g) { gravity_ = g; }
+  // 一回の update() を分ける数. 既定は 3.
+  void set_substep_count(int n) { substep_count_ = std::max(n, 1); }
+
+  // 次の update() で点をアニメーションの位置へ置き直す. 瞬間移動やモーションを変えた後に呼ぶ.
+  void reset() { reset_ = true; }
+
+  // pose を計算して delta 秒進め, 鎖のボーンの回転を pose へ入れて計算し直す.
+  // 止まった時に跳ねないよう, delta は 1/15 秒までにする.
+  void update(skeleton_pose*, float delta);
+  void update(skeleton_pose*, float delta, simd_level);
+  // 前の update() で揺らすのにかかった時間. 揺らした後の姿勢の計算を含む.
+  // ワーカーから呼ばれるので profiler へは足さない. 回す側が集めて足す.
+  std::chrono::steady_clock::duration last_update_time() const { return last_update_time_; }
+
+private:
+  struct chain
+  {
+    // 点の並びでの範囲. begin が根.
+    uint32_t begin;
+    uint32_t count;
+    // 根の親. 無ければ -1.
+    int32_t parent;
+  };
+  struct collider
+  {
+    uint32_t bone;
+    vec3 a;
+    vec3 b;
+    float radius;
+  };
+
+  // 点を足す場所を 8 の倍数まで伸ばす.
+  void resize_particle(size_t count);
+  // アニメーションの姿勢から点の目標と当たり判定の位置を取る.
+  void capture(const skeleton_pose&);
+  // dt 秒進める. dt_ratio は一つ前のステップとの長さの比, t は目標を補間する位置.
+  void step(float dt, float dt_ratio, float t, simd_level);
+  void constrain_length(float t);
+  // 点の向きから鎖の回転を決める.
+  void apply(skeleton_pose*) const;
+
+private:
+  skeleton::ptr_t skeleton_;
+  std::vector<chain> chain_array_;
+  std::vector<collider> collider_array_;
+  size_t particle_count_;
+  vec3 gravity_;
+  int substep_count_;
+  float last_dt_;
+  bool reset_;
+  std::chrono::steady_clock::duration last_update_time_;
+
+  // ここから下は点ごと. 最後は 8 の倍数まで伸ばし, 伸ばした分と鎖の根は動かさない.
+  std::vector<uint32_t> bone_;
+  // 動かすなら 1, 留めるなら 0.
+  std::vector<float> mobile_;
+  std::vector<float> stiffness_;
+  std::vector<float> drag_;
+  std::vector<float> radius_;
+  // 一つ前の点との初期姿勢での距離.
+  std::vector<float> length_;
+  std::vector<float> pos_[3];
+  std::vector<float> prev_pos_[3];
+  // 今と一つ前の update() でのアニメーションの位置. ステップの間は線形に補間する.
+  std::vector<float> goal_[3];
+  std::vector<float> prev_goal_[3];
+  // アニメーションでのボーンの回転.
+  std::vector<quarternion> anim_rotation_;
+  // 鎖ごとの, 根の親のアニメーションでの回転.
+  std::vector<quarternion> parent_rotation_;
+
+  // 当たり判定ごと. update() のたびにモデル空間へ置き直す.
+  // カプセルは端 a と a から b への向き, その長さの二乗の逆数 (球なら 0) で持つ.
+  std::vector<float> collider_a_[3];
+  std::vector<float> collider_ab_[3];
+  std::vector<float> collider_inv_;
+  std::vector<float> collider_radius_;
+
+public:
+  static auto make(skeleton::ptr_t skel, const spring_bone_param& param = spring_bone_param())
+  {
+    return std::make_shared<spring_bone_set>(skel, param);
+  }
+};
+
+// モデルの揺れ物を, 胴体の当たり判定を付けて一体分 SIMD の種類ごとに動かし, 一回の update() にかかる時間を計る.
+bool bench_spring_bone(const char *filename, int iterations);
@@ -10,14 +10,19 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <numeric>
 #include <functional>
 #include <memory>
 #include <filesystem>
 #include <initializer_list>
 #include <any>
+#include <tuple>
 #include <functional>
+#include <chrono>
+#include <future>
 
 #include <cstdint>
+#include <cstring>
 #include <cmath>
 #include <cassert>
 
@@ -5,6 +5,7 @@
 
 #include "bmp_loader.h"
 #include "png_loader.h"
+#include "gl_state.h"
 
 
 texture::texture()
@@ -15,20 +16,41 @@ texture::texture()
 
 texture::~texture()
 {
-  glDeleteTextures(1, &texture_);
-  glDeleteTextures(1, &sampler_);
+  gl_state::instance().delete_texture(texture_);
+  gl_state::instance().delete_sampler(sampler_);
+}
+
+
+void texture::set_image(const texture_image& img)
+{
+  gl_state::instance().bind_texture(GL_TEXTURE_2D, texture_);
+  glTexImage2D(GL_TEXTURE_2D, 0, img.internalformat, img.width, img.height, 0, img.format, img.type, img.data.get());
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glGenerateMipmap(GL_TEXTURE_2D);
 }
 
 
 bool texture::load_from_file(texture::ptr_t tex, const char *filename)
+{
+  texture_image img;
+  if (!decode_file(&img, filename)) {
+    return false;
+  }
+  tex->set_image(img);
+
+  return true;
+}
+
+bool texture::decode_file(texture_image *img, const char *filename)
 {
   std::filesystem::path path(filename);
   std::filesystem::path ext = path.extension();
 
   if (ext == ".bmp") {
-    return load_bmp(tex.get(), filename);
+    return decode_bmp(img, filename);
   } else if (ext == ".png") {
-    return load_png(tex.get(), filename);
+    return decode_png(img, filename);
   }
 
   return false;
@@ -2,6 +2,17 @@
 #pragma once
 
 
+// GL へ転送する前の画像.
+struct texture_image
+{
+  int width;
+  int height;
+  GLint internalformat;
+  GLenum format;
+  GLenum type;
+  std::unique_ptr<uint8_t[]> data;
+};
+
 class texture
 {
 public:
@@ -15,6 +26,8 @@ public:
   GLuint texture_globj() { return texture_; }
   GLuint sampler_globj() { return sampler_; }
 
+  void set_image(const texture_image&);
+
 private:
   GLuint texture_;
   GLuint sampler_;
@@ -26,5 +39,7 @@ public:
     return std::make_shared<texture>();
   }
   static bool load_from_file(texture::ptr_t, const char *filename);
+  // GL を使わないので, 別スレッドから呼んでも良い.
+  static bool decode_file(texture_image*, const char *filename);
 };
 
@@ -0,0 +1,43 @@
+﻿
+#include "stdafx.h"
+
+#include "upload_queue.h"
+
+
+void upload_queue::push(task_t task)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  task_queue_.push_back(std::move(task));
+}
+
+int upload_queue::drain(std::chrono::steady_clock::duration budget)
+{
+  typedef std::chrono::steady_clock clock;
+
+  auto start = clock::now();
+  int count = 0;
+  for (;;) {
+    task_t task;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (task_queue_.empty()) {
+        break;
+      }
+      task = std::move(task_queue_.front());
+      task_queue_.pop_front();
+    }
+    // 実行中に積まれたタスクは次の周回で拾う.
+    task();
+    ++count;
+    if (clock::now() - start >= budget) {
+      break;
+    }
+  }
+  return count;
+}
+
+bool upload_queue::empty()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return task_queue_.empty();
+}
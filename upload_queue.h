@@ -0,0 +1,30 @@
+﻿
+#pragma once
+
+#include <mutex>
+#include <deque>
+
+
+// メインスレッドで実行する GL オブジェクト作成の待ち行列.
+// どのスレッドから積んでも良いが, 実行は drain() を呼んだスレッドで積んだ順に行う.
+class upload_queue
+{
+public:
+  typedef std::shared_ptr<upload_queue> ptr_t;
+  typedef std::function<void()> task_t;
+
+public:
+  upload_queue() {}
+
+  void push(task_t);
+
+  // budget を使い切るまで実行する. 止まらないよう少なくとも一つは実行する.
+  // 実行した数を返す.
+  int drain(std::chrono::steady_clock::duration budget);
+
+  bool empty();
+
+private:
+  std::deque<task_t> task_queue_;
+  std::mutex mutex_;
+};
@@ -0,0 +1,395 @@
+﻿
+#include "stdafx.h"
+
+#include "utf.h"
+
+#include "util.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <iconv.h>
+#include <cerrno>
+#endif
+
+
+namespace {
+
+inline char16_t load_utf16(const char16_t *p)
+{
+  char16_t c;
+  std::memcpy(&c, p, sizeof(c));
+  return c;
+}
+
+// src[i] から一文字変換して, 次の位置を返す.
+// サロゲートペアは src[len - 1] まで見る.
+inline size_t encode_one(const char16_t *src, size_t i, size_t len, char **dst)
+{
+  char *d = *dst;
+  uint32_t c = load_utf16(src + i++);
+  if (c < 0x80) {
+    *d++ = (char)c;
+  } else if (c < 0x800) {
+    *d++ = (char)(0xC0 | (c >> 6));
+    *d++ = (char)(0x80 | (c & 0x3F));
+  } else if ((c & 0xF800) != 0xD800) {
+    *d++ = (char)(0xE0 | (c >> 12));
+    *d++ = (char)(0x80 | ((c >> 6) & 0x3F));
+    *d++ = (char)(0x80 | (c & 0x3F));
+  } else {
+    uint32_t c2 = ((c < 0xDC00) && (i < len)) ? load_utf16(src + i) : 0;
+    if ((c2 & 0xFC00) == 0xDC00) {
+      uint32_t cp = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+      *d++ = (char)(0xF0 | (cp >> 18));
+      *d++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+      *d++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+      *d++ = (char)(0x80 | (cp & 0x3F));
+      ++i;
+    } else {
+      // 対になっていないサロゲート.
+      *d++ = (char)0xEF;
+      *d++ = (char)0xBF;
+      *d++ = (char)0xBD;
+    }
+  }
+  *dst = d;
+  return i;
+}
+
+// 混ざったブロックの後にスカラーで変換する文字数の上限.
+// 名前のように ASCII と日本語が数文字ごとに入れ替わる所では, SIMD で試すだけ無駄になる.
+const size_t max_scalar_run = 1024;
+
+// 混ざったブロックの後は run 文字をスカラーで変換し, 続けて混ざるほど run を延ばす.
+inline size_t encode_scalar_run(const char16_t *src, size_t i, size_t len, char **dst, size_t *run)
+{
+  for (size_t end = std::min(i + *run, len); i < end; ) {
+    i = encode_one(src, i, len, dst);
+  }
+  *run = std::min(*run * 2, max_scalar_run);
+  return i;
+}
+
+size_t encode_scalar(char *dst, const char16_t *src, size_t len)
+{
+  char *d = dst;
+  size_t i = 0;
+  while (i < len) {
+    i = encode_one(src, i, len, &d);
+  }
+  return d - dst;
+}
+
+#if defined(CUT_SIMD_X86)
+
+// 8 文字ずつ見て, すべて ASCII なら詰めて書く.
+size_t encode_sse2(char *dst, const char16_t *src, size_t len)
+{
+  const __m128i not_ascii = _mm_set1_epi16((short)0xFF80);
+  const __m128i zero = _mm_setzero_si128();
+  char *d = dst;
+  size_t i = 0;
+  size_t run = 8;
+  while (i + 8 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, not_ascii), zero)) == 0xFFFF) {
+      _mm_storel_epi64((__m128i*)d, _mm_packus_epi16(v, v));
+      d += 8;
+      i += 8;
+      run = 8;
+      continue;
+    }
+    i = encode_scalar_run(src, i, len, &d, &run);
+  }
+  while (i < len) {
+    i = encode_one(src, i, len, &d);
+  }
+  return d - dst;
+}
+
+// 8 文字がすべて 3 バイトになる (U+0800 以上でサロゲートでない) 時の変換.
+SIMD_TARGET_AVX2
+inline void encode_bmp3_x8(__m128i v, char *d)
+{
+  const __m128i mask_3f = _mm_set1_epi16(0x3F);
+  const __m128i lead = _mm_set1_epi16(0xE0);
+  const __m128i cont = _mm_set1_epi16(0x80);
+  __m128i t0 = _mm_or_si128(_mm_srli_epi16(v, 12), lead);
+  __m128i t1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 6), mask_3f), cont);
+  __m128i t2 = _mm_or_si128(_mm_and_si128(v, mask_3f), cont);
+  // lo = [t0 x8, t1 x8], hi = [t2 x8, ...] を t0 t1 t2 の順に並べ替える.
+  __m128i lo = _mm_packus_epi16(t0, t1);
+  __m128i hi = _mm_packus_epi16(t2, t2);
+  const __m128i shuf_lo0 = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+  const __m128i shuf_hi0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i shuf_lo1 = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i shuf_hi1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+  __m128i out0 = _mm_or_si128(_mm_shuffle_epi8(lo, shuf_lo0), _mm_shuffle_epi8(hi, shuf_hi0));
+  __m128i out1 = _mm_or_si128(_mm_shuffle_epi8(lo, shuf_lo1), _mm_shuffle_epi8(hi, shuf_hi1));
+  _mm_storeu_si128((__m128i*)d, out0);
+  _mm_storel_epi64((__m128i*)(d + 16), out1);
+}
+
+// 16 文字ずつ見て, すべて ASCII かすべて 3 バイトならまとめて変換する.
+// 混ざっている時はしばらくスカラーで変換してから試し直す.
+SIMD_TARGET_AVX2
+size_t encode_avx2(char *dst, const char16_t *src, size_t len)
+{
+  const __m256i not_ascii = _mm256_set1_epi16((short)0xFF80);
+  const __m256i mask_f800 = _mm256_set1_epi16((short)0xF800);
+  const __m256i surrogate = _mm256_set1_epi16((short)0xD800);
+  const __m256i zero = _mm256_setzero_si256();
+  char *d = dst;
+  size_t i = 0;
+  size_t run = 16;
+  while (i + 16 <= len) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+    if (_mm256_testz_si256(v, not_ascii)) {
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xD8);
+      _mm_storeu_si128((__m128i*)d, _mm256_castsi256_si128(packed));
+      d += 16;
+      i += 16;
+      run = 16;
+      continue;
+    }
+    __m256i top = _mm256_and_si256(v, mask_f800);
+    __m256i not_bmp3 = _mm256_or_si256(_mm256_cmpeq_epi16(top, zero), _mm256_cmpeq_epi16(top, surrogate));
+    if (_mm256_testz_si256(not_bmp3, not_bmp3)) {
+      encode_bmp3_x8(_mm256_castsi256_si128(v), d);
+      encode_bmp3_x8(_mm256_extracti128_si256(v, 1), d + 24);
+      d += 48;
+      i += 16;
+      run = 16;
+      continue;
+    }
+    i = encode_scalar_run(src, i, len, &d, &run);
+  }
+  while (i < len) {
+    i = encode_one(src, i, len, &d);
+  }
+  return d - dst;
+}
+
+#endif
+
+} // end of anonymus namespace
+
+
+size_t utf8_from_utf16(char *dst, const char16_t *src, size_t len)
+{
+  return utf8_from_utf16(dst, src, len, simd_support());
+}
+
+size_t utf8_from_utf16(char *dst, const char16_t *src, size_t len, simd_level level)
+{
+#if defined(CUT_SIMD_X86)
+  switch (std::min(level, simd_support())) {
+  case SIMD_AVX2: return encode_avx2(dst, src, len);
+  case SIMD_SSE2: return encode_sse2(dst, src, len);
+  default: break;
+  }
+#endif
+  return encode_scalar(dst, src, len);
+}
+
+void utf8_from_utf16(std::string *out, const char16_t *src, size_t len)
+{
+  out->resize(utf8_max_size_from_utf16(len));
+  size_t size = len ? utf8_from_utf16(&(*out)[0], src, len) : 0;
+  out->resize(size);
+}
+
+void utf16_from_utf8(std::u16string *out, const char *src, size_t len)
+{
+  // 続くバイトの数ごとの, 正しい表現での最小の値.
+  static const uint32_t min_code[] = { 0, 0x80, 0x800, 0x10000 };
+  const uint8_t *s = (const uint8_t*)src;
+  out->clear();
+  out->reserve(len);
+  size_t i = 0;
+  while (i < len) {
+    uint8_t c = s[i];
+    uint32_t code;
+    size_t n;
+    if (c < 0x80) {
+      code = c;
+      n = 0;
+    } else if ((c & 0xe0) == 0xc0) {
+      code = c & 0x1f;
+      n = 1;
+    } else if ((c & 0xf0) == 0xe0) {
+      code = c & 0x0f;
+      n = 2;
+    } else if ((c & 0xf8) == 0xf0) {
+      code = c & 0x07;
+      n = 3;
+    } else {
+      out->push_back(u'\uFFFD');
+      ++i;
+      continue;
+    }
+    size_t k = 1;
+    for (; (k <= n) && (i + k < len) && ((s[i + k] & 0xc0) == 0x80); ++k) {
+      code = (code << 6) | (s[i + k] & 0x3f);
+    }
+    i += k;
+    if ((k <= n) || (code < min_code[n]) || ((code >= 0xd800) && (code < 0xe000)) || (code > 0x10ffff)) {
+      out->push_back(u'\uFFFD');
+    } else if (code >= 0x10000) {
+      code -= 0x10000;
+      out->push_back((char16_t)(0xd800 + (code >> 10)));
+      out->push_back((char16_t)(0xdc00 + (code & 0x3ff)));
+    } else {
+      out->push_back((char16_t)code);
+    }
+  }
+}
+
+void utf8_from_sjis(std::string *out, const char *src, size_t len)
+{
+  // 名前はほとんど ASCII か短い日本語なので, ASCII だけならそのまま.
+  if (std::all_of(src, src + len, [](char c) { return (uint8_t)c < 0x80; })) {
+    out->assign(src, len);
+    return;
+  }
+#ifdef _WIN32
+  int count = ::MultiByteToWideChar(932, 0, src, (int)len, 0, 0);
+  std::u16string wide(count, u'\0');
+  if (count > 0) {
+    ::MultiByteToWideChar(932, 0, src, (int)len, (wchar_t*)&wide[0], count);
+  }
+  utf8_from_utf16(out, wide.data(), wide.size());
+#else
+  iconv_t cd = ::iconv_open("UTF-8", "CP932");
+  if (cd == (iconv_t)-1) {
+    out->assign(src, len);
+    return;
+  }
+  // 一バイトが UTF-8 で三バイトになるのが一番長い.
+  out->resize(len * 3);
+  char *in = const_cast<char*>(src);
+  size_t in_left = len;
+  char *dst = &(*out)[0];
+  size_t out_left = out->size();
+  while (in_left > 0) {
+    if (::iconv(cd, &in, &in_left, &dst, &out_left) != (size_t)-1) {
+      break;
+    }
+    if ((errno != EILSEQ) && (errno != EINVAL)) {
+      break;
+    }
+    // 変換できないバイトや途中で切れた文字は飛ばして U+FFFD にする.
+    ++in;
+    --in_left;
+    *dst++ = (char)0xEF;
+    *dst++ = (char)0xBF;
+    *dst++ = (char)0xBD;
+    out_left -= 3;
+  }
+  out->resize(dst - &(*out)[0]);
+  ::iconv_close(cd);
+#endif
+}
+
+
+bool bench_utf_transcode(int iterations)
+{
+  typedef std::chrono::steady_clock clock;
+
+  // 決まった入力の確認.
+  struct sample
+  {
+    std::u16string src;
+    std::string expect;
+  };
+  const sample sample_array[] = {
+    { u"Aa0", "Aa0" },
+    { u"\u00e9\u07ff", "\xc3\xa9\xdf\xbf" },
+    { u"あ左腕ＩＫ", "\xe3\x81\x82\xe5\xb7\xa6\xe8\x85\x95\xef\xbc\xa9\xef\xbc\xab" },
+    { u"\U0001F600x", "\xf0\x9f\x98\x80x" },
+    { std::u16string(1, (char16_t)0xD800) + u"a" + std::u16string(1, (char16_t)0xDC00),
+      "\xef\xbf\xbd" "a" "\xef\xbf\xbd" },
+  };
+  bool ok = true;
+  const simd_level level_array[] = { SIMD_None, SIMD_SSE2, SIMD_AVX2 };
+  for (const auto& s : sample_array) {
+    for (auto level : level_array) {
+      // SIMD の経路を通るよう長くして確かめる.
+      std::u16string src;
+      std::string expect;
+      for (int i=0; i<20; ++i) {
+        src += s.src;
+        expect += s.expect;
+      }
+      std::string out(utf8_max_size_from_utf16(src.size()), '\0');
+      out.resize(utf8_from_utf16(&out[0], src.data(), src.size(), level));
+      ok = ok && (out == expect);
+    }
+    // 壊れたサロゲートの無いものは戻しても同じになる.
+    std::u16string back;
+    utf16_from_utf8(&back, s.expect.data(), s.expect.size());
+    ok = ok && ((back == s.src) || (s.expect.find("\xef\xbf\xbd") != std::string::npos));
+  }
+
+  // PMX の名前らしい文字列を並べたもの.
+  const char16_t *name_array[] = {
+    u"center", u"upper body", u"センター", u"上半身2",
+    u"左腕", u"右ひじ", u"左足ＩＫ", u"右腕IK",
+    u"まばたき", u"笑い", u"あ", u"\U0001F600 smile",
+  };
+  struct corpus
+  {
+    const char *name;
+    std::u16string text;
+  };
+  corpus corpus_array[] = {
+    { "ascii", u"" },
+    { "japanese", u"" },
+    { "names", u"" },
+  };
+  const size_t corpus_len = 1 << 20;
+  while (corpus_array[0].text.size() < corpus_len) {
+    corpus_array[0].text += u"skirt_bone_0123 ";
+  }
+  while (corpus_array[1].text.size() < corpus_len) {
+    corpus_array[1].text += u"左腕右足上半身センター";
+  }
+  for (size_t i=0; corpus_array[2].text.size() < corpus_len; ++i) {
+    corpus_array[2].text += name_array[i % countof(name_array)];
+  }
+
+  printf("utf16 -> utf8 (%d iterations, cpu: %s)\n", iterations, simd_level_name(simd_support()));
+  std::string out(utf8_max_size_from_utf16(corpus_len * 2), '\0');
+  for (const auto& c : corpus_array) {
+    std::string expect(utf8_max_size_from_utf16(c.text.size()), '\0');
+    expect.resize(utf8_from_utf16(&expect[0], c.text.data(), c.text.size(), SIMD_None));
+    double mb = c.text.size() * sizeof(char16_t) / (1024.0 * 1024.0);
+    double scalar_ms = 0.0;
+    for (auto level : level_array) {
+      if (level > simd_support()) {
+        continue;
+      }
+      // 他のスレッドに邪魔された回を除くよう, 一番速かった回で比べる.
+      size_t size = 0;
+      double ms = 0.0;
+      for (int i=0; i<iterations; ++i) {
+        auto start = clock::now();
+        size = utf8_from_utf16(&out[0], c.text.data(), c.text.size(), level);
+        double t = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        ms = (i == 0) ? t : std::min(ms, t);
+      }
+      bool same = (size == expect.size()) && (std::memcmp(out.data(), expect.data(), size) == 0);
+      ok = ok && same;
+      if (level == SIMD_None) {
+        scalar_ms = ms;
+      }
+      // 混ざった名前で SIMD が遅くならないかを scalar との比で見る.
+      printf("  %-9s %-6s : %8.3f ms  %8.1f MB/s  %5.2fx%s\n",
+             c.name, simd_level_name(level), ms, mb / (ms / 1000.0), scalar_ms / ms, same ? "" : "  MISMATCH");
+    }
+  }
+  printf("  result   : %s\n", ok ? "ok" : "MISMATCH");
+
+  return ok;
+}
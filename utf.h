@@ -0,0 +1,30 @@
+﻿
+#pragma once
+
+#include "simd.h"
+
+
+// UTF-16 (ホストのバイト順) から UTF-8 への変換.
+// 対になっていないサロゲートは U+FFFD にする.
+
+// 書き込みに必要な最大バイト数.
+inline size_t utf8_max_size_from_utf16(size_t len) { return len * 3; }
+
+// dst には utf8_max_size_from_utf16(len) バイト必要. 書いたバイト数を返す.
+// src の揃えは問わない.
+size_t utf8_from_utf16(char *dst, const char16_t *src, size_t len);
+size_t utf8_from_utf16(char *dst, const char16_t *src, size_t len, simd_level);
+
+// out を作業領域として使い回す. out の中身は変換結果で置き換わる.
+void utf8_from_utf16(std::string *out, const char16_t *src, size_t len);
+
+// UTF-8 から UTF-16 への変換. GUI に名前を出すのに使う.
+// 壊れた列, 冗長な表現, サロゲートの範囲は U+FFFD にする.
+void utf16_from_utf8(std::u16string *out, const char *src, size_t len);
+
+// Shift_JIS (CP932) から UTF-8 への変換. VMD の名前に使う.
+// 変換できないバイトは U+FFFD にする.
+void utf8_from_sjis(std::string *out, const char *src, size_t len);
+
+// 変換速度を実装ごとに比べる.
+bool bench_utf_transcode(int iterations);
@@ -4,6 +4,14 @@
 #include "stdafx.h"
 
 #include <filesystem>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 std::string read_file_all(const char *filename)
 {
@@ -52,7 +60,122 @@ void read_int32(std::istream& f, int32_t *p, int n)
 {
   read(f, p, n);
 }
+void read_uint64(std::istream& f, uint64_t *p, int n)
+{
+  read(f, p, n);
+}
+void read_int64(std::istream& f, int64_t *p, int n)
+{
+  read(f, p, n);
+}
 void read_float(std::istream& f, float *p, int n)
 {
   read(f, p, n);
 }
+void skip_bytes(std::istream& f, size_t size)
+{
+  f.ignore(size);
+}
+
+template<class T>
+void write(std::ostream& out, const T *p, int n)
+{
+  out.write((const char*)p, sizeof(T) * n);
+}
+
+void write_uint8(std::ostream& f, const uint8_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_int8(std::ostream& f, const int8_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_uint16(std::ostream& f, const uint16_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_int16(std::ostream& f, const int16_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_uint32(std::ostream& f, const uint32_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_int32(std::ostream& f, const int32_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_uint64(std::ostream& f, const uint64_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_int64(std::ostream& f, const int64_t *p, int n)
+{
+  write(f, p, n);
+}
+void write_float(std::ostream& f, const float *p, int n)
+{
+  write(f, p, n);
+}
+
+
+uint64_t hash64(const void *p, size_t size, uint64_t seed)
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ull;
+  const int r = 47;
+
+  uint64_t h = seed ^ (size * m);
+
+  const uint8_t *data = (const uint8_t*)p;
+  const uint8_t *end = data + (size & ~(size_t)7);
+  for (; data != end; data += 8) {
+    uint64_t k;
+    std::memcpy(&k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (size & 7) {
+  case 7: h ^= uint64_t(data[6]) << 48;
+  case 6: h ^= uint64_t(data[5]) << 40;
+  case 5: h ^= uint64_t(data[4]) << 32;
+  case 4: h ^= uint64_t(data[3]) << 24;
+  case 3: h ^= uint64_t(data[2]) << 16;
+  case 2: h ^= uint64_t(data[1]) << 8;
+  case 1: h ^= uint64_t(data[0]);
+    h *= m;
+  };
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  return h;
+}
+
+
+size_t peak_resident_memory()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    return 0;
+  }
+  return pmc.PeakWorkingSetSize;
+#else
+  struct rusage ru;
+  if (::getrusage(RUSAGE_SELF, &ru) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return (size_t)ru.ru_maxrss;
+#else
+  return (size_t)ru.ru_maxrss * 1024;
+#endif
+#endif
+}
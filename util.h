@@ -10,7 +10,26 @@ void read_uint16(std::istream&, uint16_t*, int n = 1);
 void read_int16(std::istream&, int16_t*, int n = 1);
 void read_uint32(std::istream&, uint32_t*, int n = 1);
 void read_int32(std::istream&, int32_t*, int n = 1);
+void read_uint64(std::istream&, uint64_t*, int n = 1);
+void read_int64(std::istream&, int64_t*, int n = 1);
 void read_float(std::istream&, float*, int n = 1);
+void skip_bytes(std::istream&, size_t);
+
+void write_uint8(std::ostream&, const uint8_t*, int n = 1);
+void write_int8(std::ostream&, const int8_t*, int n = 1);
+void write_uint16(std::ostream&, const uint16_t*, int n = 1);
+void write_int16(std::ostream&, const int16_t*, int n = 1);
+void write_uint32(std::ostream&, const uint32_t*, int n = 1);
+void write_int32(std::ostream&, const int32_t*, int n = 1);
+void write_uint64(std::ostream&, const uint64_t*, int n = 1);
+void write_int64(std::ostream&, const int64_t*, int n = 1);
+void write_float(std::ostream&, const float*, int n = 1);
+
+// 64bit ハッシュ (MurmurHash64A).
+uint64_t hash64(const void*, size_t, uint64_t seed = 0);
+
+// プロセスの最大常駐メモリ量 (バイト).
+size_t peak_resident_memory();
 
 #define countof(array) (sizeof(array)/sizeof(array[0]))
 
@@ -0,0 +1,226 @@
+﻿
+#include "stdafx.h"
+
+#include "vertex_animation.h"
+
+#include "util.h"
+#include "pmx_loader.h"
+#include "cpu_skinning.h"
+#include "animation.h"
+#include "gl_state.h"
+
+
+namespace {
+
+// 法線を八面体に写して, snorm16 二つ (下位が x) に詰める. シェーダは unpackSnorm2x16 で戻す.
+uint32_t pack_octahedral_normal(const vec3& n)
+{
+  float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  if (l1 <= 0.f) {
+    return 0;
+  }
+  float x = n.x / l1, y = n.y / l1;
+  if (n.z < 0.f) {
+    float fx = (1.f - std::abs(y)) * ((x >= 0.f) ? 1.f : -1.f);
+    float fy = (1.f - std::abs(x)) * ((y >= 0.f) ? 1.f : -1.f);
+    x = fx;
+    y = fy;
+  }
+  auto snorm16 = [](float f) {
+    return (uint32_t)(uint16_t)(int16_t)std::lround(std::clamp(f, -1.f, 1.f) * 32767.f);
+  };
+  return snorm16(x) | (snorm16(y) << 16);
+}
+
+inline uint32_t float_bits(float f)
+{
+  uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+} // end of anonymus namespace
+
+
+bool bake_vertex_animation(vertex_animation_data *out, const pmx_model_data& data, motion::ptr_t mot,
+                           const vertex_animation_option& opt, job_system *jobs)
+{
+  auto skel = make_pmx_skeleton(data);
+  auto morph = make_pmx_morph(data);
+  auto pose = skeleton_pose::make(skel);
+  motion_sampler sampler(mot, skel, morph);
+  cpu_skinning skin(data);
+  if (pose->bone_count() < skin.bone_count()) {
+    return false;
+  }
+
+  // VMD は 30fps.
+  const float step = std::max(opt.frame_step, 1e-3f);
+  const float end = (opt.end_frame < 0.f) ? mot->frame_count() : opt.end_frame;
+  const double frame_span = std::max(std::floor((double)(end - opt.begin_frame) / step), 0.0) + 1.0;
+  const uint64_t vertex_count64 = (uint64_t)skin.vertex_count();
+  // 確保する前に, 上限とシェーダの int, size_t のバイト数に収まるかを確かめる.
+  const uint64_t max_texel_count = std::min<uint64_t>(opt.max_texel_count, INT32_MAX);
+  if ((vertex_count64 == 0) || (frame_span * (double)vertex_count64 > (double)max_texel_count) ||
+      ((frame_span * (double)vertex_count64) > (double)(SIZE_MAX / (sizeof(uint32_t) * 4)))) {
+    return false;
+  }
+  const uint32_t frame_count = (uint32_t)frame_span;
+  const uint32_t vertex_count = (uint32_t)vertex_count64;
+  out->vertex_count = vertex_count;
+  out->frame_count = frame_count;
+  out->frame_rate = 30.f / step;
+  out->texel_array.resize((size_t)frame_count * vertex_count * 4);
+  out->lo = out->hi = vec3(0.f, 0.f, 0.f);
+
+  // モーフの重みはモデルの morph_set に入れず, ボーンモーフだけを姿勢へ入れる.
+  std::vector<float> weight(morph ? morph->morph_count() : 0, 0.f);
+  morph_set::bone_offset_array_t bone_offset;
+  for (uint32_t f=0; f<frame_count; ++f) {
+    float frame = opt.begin_frame + f * step;
+    sampler.apply_pose(frame, pose.get());
+    if (morph) {
+      sampler.sample_morph(frame, weight.data());
+      morph->evaluate_bone_offset(weight.data(), &bone_offset);
+      pose->clear_morph();
+      for (const auto& ofs : bone_offset) {
+        if (ofs.bone < pose->bone_count()) {
+          pose->set_morph(ofs.bone, ofs.translate, ofs.rotate);
+        }
+      }
+    }
+    pose->evaluate();
+    if (!skin.skin(pose->skinning_matrix_array(), pose->bone_count(), jobs)) {
+      return false;
+    }
+
+    uint32_t *texel = &out->texel_array[(size_t)f * vertex_count * 4];
+    for (uint32_t v=0; v<vertex_count; ++v) {
+      vec3 p = skin.position(v);
+      texel[v * 4 + 0] = float_bits(p.x);
+      texel[v * 4 + 1] = float_bits(p.y);
+      texel[v * 4 + 2] = float_bits(p.z);
+      texel[v * 4 + 3] = pack_octahedral_normal(skin.normal(v));
+    }
+    vec3 lo, hi;
+    skin.bounds(&lo, &hi);
+    if (f == 0) {
+      out->lo = lo;
+      out->hi = hi;
+    } else {
+      out->lo = vec3(std::min(out->lo.x, lo.x), std::min(out->lo.y, lo.y), std::min(out->lo.z, lo.z));
+      out->hi = vec3(std::max(out->hi.x, hi.x), std::max(out->hi.y, hi.y), std::max(out->hi.z, hi.z));
+    }
+  }
+  return true;
+}
+
+
+vertex_animation::vertex_animation(const vertex_animation_data& data)
+  : vertex_count_(data.vertex_count), frame_count_(std::max(data.frame_count, 1u)),
+    frame_rate_(data.frame_rate), buffer_(0), texture_(0)
+{
+  GLint max_texels = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+  if (data.texel_array.empty() || ((uint64_t)data.texel_array.size() / 4 > (uint64_t)std::max(max_texels, 0))) {
+    return;
+  }
+  auto& gl = gl_state::instance();
+  glGenBuffers(1, &buffer_);
+  gl.bind_buffer(GL_TEXTURE_BUFFER, buffer_);
+  glBufferData(GL_TEXTURE_BUFFER, data.size(), data.texel_array.data(), GL_STATIC_DRAW);
+  glGenTextures(1, &texture_);
+  gl.bind_texture(GL_TEXTURE_BUFFER, texture_);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, buffer_);
+}
+
+vertex_animation::~vertex_animation()
+{
+  auto& gl = gl_state::instance();
+  if (texture_) {
+    gl.delete_texture(texture_);
+  }
+  if (buffer_) {
+    gl.delete_buffer(buffer_);
+  }
+}
+
+
+bool bench_vertex_animation(model::ptr_t mdl, const pmx_model_data& data, motion::ptr_t mot,
+                            shader::ptr_t skinning_shdr, shader::ptr_t vat_shdr,
+                            int instances, int frames)
+{
+  typedef std::chrono::steady_clock clock;
+
+  job_system jobs;
+  auto start = clock::now();
+  GLint max_texels = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+  vertex_animation_option opt;
+  opt.max_texel_count = (uint64_t)std::max(max_texels, 0);
+  vertex_animation_data baked;
+  if (!bake_vertex_animation(&baked, data, mot, opt, &jobs)) {
+    std::cerr << "cannot bake vertex animation (too large for a texture buffer?)." << std::endl;
+    return false;
+  }
+  double bake_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+  auto anim = vertex_animation::make(baked);
+  if (!anim->is_valid()) {
+    std::cerr << "vertex animation is too large for a texture buffer." << std::endl;
+    return false;
+  }
+
+  // bench_model_instancing と同じに並べ, 再生位置をずらす.
+  scene scn;
+  std::vector<matrix> world_array = setup_instancing_bench(&scn, instances);
+  animation_stage stage;
+  std::vector<std::shared_ptr<model_node>> node_array;
+  vertex_animation_node vat_node(mdl, anim, vat_shdr);
+  for (int i=0; i<instances; ++i) {
+    const matrix& world = world_array[i];
+    float offset = i * 7.f / 30.f;
+    auto node = std::make_shared<model_node>(mdl, skinning_shdr);
+    node->set_world_matrix(world);
+    if (node->pose()) {
+      auto sampler = motion_sampler::make(mot, node->pose()->get_skeleton(), mdl->get_morph());
+      node->set_palette_buffer(stage.add(node->pose(), sampler, offset * 30.f));
+    }
+    node_array.push_back(node);
+    vat_node.add_instance(world, offset);
+  }
+
+  // GPU の完了は待つが, 待ち時間は計らない.
+  auto measure = [&](auto draw) {
+    draw(0);
+    glFinish();
+    clock::duration total(0);
+    for (int f=0; f<frames; ++f) {
+      auto start = clock::now();
+      draw(f + 1);
+      total += clock::now() - start;
+      glFinish();
+    }
+    return std::chrono::duration<double, std::milli>(total).count() / frames;
+  };
+  // 60fps で進める.
+  double nodes_ms = measure([&](int) {
+    stage.update(&jobs, 0.5f);
+    draw_context ctx;
+    for (auto& node : node_array) {
+      node->draw(&scn, &ctx);
+    }
+  });
+  double vat_ms = measure([&](int f) {
+    vat_node.set_time(f / 60.f);
+    draw_context ctx;
+    vat_node.draw(&scn, &ctx);
+  });
+
+  printf("vertex animation: %u vertices, %u frames at %.0f fps, %.1f MB, bake %.1f ms\n",
+         baked.vertex_count, baked.frame_count, baked.frame_rate, baked.size() / (1024.0 * 1024.0), bake_ms);
+  printf("  %d instances, %d frames, %d threads + caller\n", instances, frames, jobs.thread_count());
+  printf("  stage + model_node : %9.3f ms/frame\n", nodes_ms);
+  printf("  vertex_animation   : %9.3f ms/frame\n", vat_ms);
+
+  return glGetError() == GL_NO_ERROR;
+}
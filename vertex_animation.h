@@ -0,0 +1,86 @@
+﻿
+#pragma once
+
+#include "model.h"
+#include "motion.h"
+#include "pmx_model.h"
+#include "job_system.h"
+
+
+struct vertex_animation_option
+{
+  // モーションの [begin_frame, end_frame] を frame_step フレームごとに焼く. end_frame が負なら最後まで.
+  float begin_frame = 0.f;
+  float end_frame = -1.f;
+  float frame_step = 1.f;
+  // 焼くテクセルの数 (フレーム数 × 頂点数) の上限. 超えるなら焼かずに false を返す.
+  // GL へ渡すなら GL_MAX_TEXTURE_BUFFER_SIZE を入れる. シェーダが int で数えるので 2^31 - 1 は超えない.
+  uint64_t max_texel_count = INT32_MAX;
+};
+
+// 焼いた頂点アニメーション. GL を使わない.
+// フレームごとに全ての頂点を並べ, 一つの頂点は 4 つの uint32 (1 テクセル) で,
+// 位置の xyz を float のビットのまま, w に八面体に写した法線を snorm16 二つで持つ.
+struct vertex_animation_data
+{
+  uint32_t vertex_count;
+  uint32_t frame_count;
+  // 焼いたフレームの秒あたりの数.
+  float frame_rate;
+  std::vector<uint32_t> texel_array;
+  // 全てのフレームの位置を囲む箱.
+  vec3 lo;
+  vec3 hi;
+
+  size_t size() const { return texel_array.size() * sizeof(uint32_t); }
+};
+
+// モデルにモーションを流し, CPU でスキニングした位置と法線をフレームごとに焼く.
+// ボーンモーフは姿勢へ入れるが, 頂点と UV のモーフは焼かない. jobs があればスキニングを分けて回す.
+bool bake_vertex_animation(vertex_animation_data*, const pmx_model_data&, motion::ptr_t,
+                           const vertex_animation_option& = vertex_animation_option(), job_system *jobs = 0);
+
+
+// 焼いた頂点アニメーションのテクスチャバッファ (RGBA32UI).
+// GL_MAX_TEXTURE_BUFFER_SIZE に収まらなければ作らず, is_valid() が false になる.
+class vertex_animation
+{
+public:
+  typedef std::shared_ptr<vertex_animation> ptr_t;
+
+public:
+  vertex_animation(const vertex_animation_data&);
+  ~vertex_animation();
+
+  vertex_animation(const vertex_animation&) = delete;
+  vertex_animation& operator=(const vertex_animation&) = delete;
+
+  uint32_t vertex_count() const { return vertex_count_; }
+  uint32_t frame_count() const { return frame_count_; }
+  float frame_rate() const { return frame_rate_; }
+  // 一周の秒数.
+  float duration() const { return frame_count_ / frame_rate_; }
+  bool is_valid() const { return texture_ != 0; }
+
+  GLuint globj_texture() { return texture_; }
+
+private:
+  uint32_t vertex_count_;
+  uint32_t frame_count_;
+  float frame_rate_;
+  GLuint buffer_;
+  GLuint texture_;
+
+public:
+  static auto make(const vertex_animation_data& data)
+  {
+    return std::make_shared<vertex_animation>(data);
+  }
+};
+
+
+// instances 体を animation_stage と model_node で動かした時と, 焼いて vertex_animation_node で
+// 描いた時の一フレームの CPU 時間を比べる. vat_shdr は VERTEX_ANIMATION と INSTANCING 付き.
+bool bench_vertex_animation(model::ptr_t, const pmx_model_data&, motion::ptr_t,
+                            shader::ptr_t skinning_shdr, shader::ptr_t vat_shdr,
+                            int instances, int frames);
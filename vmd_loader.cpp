@@ -0,0 +1,113 @@
+﻿
+#include "stdafx.h"
+
+#include "vmd_loader.h"
+
+#include "mapped_file.h"
+#include "byte_reader.h"
+#include "utf.h"
+
+
+namespace {
+
+const size_t vmd_header_size = 30;
+const size_t vmd_name_size = 15;
+
+// 名前は Shift_JIS で, 固定長の領域に 0 で終わって入っている.
+// 同じ名前のキーがたくさん並ぶので, 変換した結果を使い回す.
+class vmd_name_reader
+{
+public:
+  bool read(byte_reader& r, size_t size, std::string *out)
+  {
+    const char *p = (const char*)r.advance(size);
+    if (!p) {
+      return false;
+    }
+    std::string_view raw(p, std::find(p, p + size, '\0') - p);
+    auto it = cache_.find(raw);
+    if (it == cache_.end()) {
+      std::string name;
+      utf8_from_sjis(&name, raw.data(), raw.size());
+      it = cache_.emplace(std::string(raw), std::move(name)).first;
+    }
+    *out = it->second;
+    return true;
+  }
+
+private:
+  std::map<std::string, std::string, std::less<>> cache_;
+};
+
+} // end of anonymus namespace
+
+
+bool load_vmd(vmd_motion_data *out, const char *filename)
+{
+  mapped_file file;
+  if (!file.open(filename)) {
+    return false;
+  }
+  byte_reader r(file.data(), file.size());
+
+  // 古い形式はモデル名が 10 バイト.
+  const char *header = (const char*)r.advance(vmd_header_size);
+  if (!header) {
+    return false;
+  }
+  size_t model_name_size = 0;
+  if (std::strncmp(header, "Vocaloid Motion Data 0002", 25) == 0) {
+    model_name_size = 20;
+  } else if (std::strncmp(header, "Vocaloid Motion Data file", 25) == 0) {
+    model_name_size = 10;
+  } else {
+    return false;
+  }
+  vmd_name_reader name_reader;
+  if (!name_reader.read(r, model_name_size, &out->model_name)) {
+    return false;
+  }
+
+  uint32_t bone_key_count = 0;
+  read_uint32(r, &bone_key_count);
+  // 一つのキーは 111 バイト. 壊れた数で大きく確保しないよう, 残りから上限を決める.
+  out->bone_key_array.clear();
+  out->bone_key_array.reserve(std::min<size_t>(bone_key_count, r.remain() / 111));
+  for (uint32_t i=0; (i<bone_key_count) && !r.fail(); ++i) {
+    vmd_bone_key key;
+    name_reader.read(r, vmd_name_size, &key.name);
+    read_uint32(r, &key.frame);
+    read_float(r, as_array(key.translate), 3);
+    float q[4];
+    read_float(r, q, 4);
+    key.rotate = quarternion(q[0], q[1], q[2], q[3]);
+    // 補間は 4 x 16 バイト. 先頭の 16 バイトに x1[XYZR], y1[XYZR], x2[XYZR], y2[XYZR] の順で並ぶ.
+    uint8_t interpolation[64];
+    r.read(interpolation, 64);
+    for (int c=0; c<4; ++c) {
+      for (int k=0; k<4; ++k) {
+        key.curve[c][k] = interpolation[k * 4 + c];
+      }
+    }
+    out->bone_key_array.push_back(std::move(key));
+  }
+
+  // ボーンのキーだけで終わっているファイルもある.
+  uint32_t morph_key_count = 0;
+  if (r.remain() >= sizeof(morph_key_count)) {
+    read_uint32(r, &morph_key_count);
+  }
+  out->morph_key_array.clear();
+  out->morph_key_array.reserve(std::min<size_t>(morph_key_count, r.remain() / 23));
+  for (uint32_t i=0; (i<morph_key_count) && !r.fail(); ++i) {
+    vmd_morph_key key;
+    name_reader.read(r, vmd_name_size, &key.name);
+    read_uint32(r, &key.frame);
+    read_float(r, &key.weight);
+    out->morph_key_array.push_back(std::move(key));
+  }
+  if (r.fail()) {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,34 @@
+﻿
+#pragma once
+
+
+// VMD (MMD のモーション) のボーンのキー. 名前は UTF-8 に変換してある.
+struct vmd_bone_key
+{
+  std::string name;
+  uint32_t frame;
+  // 親の空間での初期姿勢からの移動と回転.
+  vec3 translate;
+  quarternion rotate;
+  // 前のキーからこのキーまでの補間曲線. X, Y, Z の移動と回転の順に,
+  // ベジェの制御点 (x1, y1, x2, y2) を 0..127 で持つ.
+  uint8_t curve[4][4];
+};
+
+struct vmd_morph_key
+{
+  std::string name;
+  uint32_t frame;
+  float weight;
+};
+
+struct vmd_motion_data
+{
+  std::string model_name;
+  // ファイルの並び. フレーム順とは限らない.
+  std::vector<vmd_bone_key> bone_key_array;
+  std::vector<vmd_morph_key> morph_key_array;
+};
+
+// カメラ, 照明, セルフ影, 表示と IK のキーは読まない.
+bool load_vmd(vmd_motion_data*, const char *filename);